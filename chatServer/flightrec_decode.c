@@ -0,0 +1,26 @@
+/*
+ * Print a flight recorder dump (see src/flightrec.h) as text, events from
+ * every thread merged in time order.
+ */
+#include "../src/flightrec.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s dump_file\n", argv[0]);
+    exit(1);
+  }
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror("fopen: ");
+    exit(1);
+  }
+  if (flightrec_decode(in, stdout) == -1) {
+    fprintf(stderr, "%s is not a flight recorder dump\n", argv[1]);
+    fclose(in);
+    exit(1);
+  }
+  fclose(in);
+  return 0;
+}
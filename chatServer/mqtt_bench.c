@@ -0,0 +1,580 @@
+/*
+ * mqtt-bench: multi-threaded MQTT load generator.
+ *
+ * Opens many connections spread over a few threads, each thread running its
+ * own epoll loop. Publishers send PUBLISH packets at a fixed aggregate rate
+ * to one of a set of topics; subscribers subscribe to one topic each, so
+ * publishers / topics is the fan-in and subscribers / topics the fan-out of
+ * every topic. Packets are encoded with the broker's own codec.
+ *
+ * Every payload starts with the monotonic send time, so the receiving
+ * thread can time the trip through the broker. The stamp is only compared
+ * against the bench's own clock, never the broker's.
+ */
+#include "../src/histogram.h"
+#include "../src/mqtt.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_EVENTS 256
+#define BENCH_READ_SIZE (64 * 1024)
+// Send time and sequence number, at the start of every payload
+#define BENCH_STAMP_SIZE 16
+
+struct bench_config {
+  const char *host;
+  const char *port;
+  int connections;
+  int publishers;
+  int threads;
+  unsigned rate; // messages per second across all publishers, 0 = flat out
+  int qos;
+  size_t payload;
+  unsigned topics;
+  unsigned duration;
+};
+
+struct bench_conn {
+  int fd;
+  int publisher;
+  int connected;
+  unsigned topic;
+  uint16_t next_id;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_cap;
+  unsigned char *out;
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+  uint32_t events; // interest registered with epoll
+};
+
+struct bench_thread {
+  int id;
+  pthread_t thread;
+  int epfd;
+  struct bench_conn *conns;
+  int nconns;
+  int npublishers;
+  unsigned char *payload; // scratch, stamped per message
+  struct histogram latency;
+  uint64_t sent;
+  uint64_t completed; // QoS 1 and 2 publishes the broker finished
+  uint64_t received;
+  uint64_t bytes_received;
+  uint64_t blocked; // publish slots skipped while a socket was full
+  uint64_t errors;
+};
+
+static struct bench_config config = {
+    .host = "localhost",
+    .port = "3490",
+    .connections = 1000,
+    .publishers = 0,
+    .threads = 4,
+    .rate = 10000,
+    .qos = 0,
+    .payload = 64,
+    .topics = 100,
+    .duration = 10,
+};
+
+static struct addrinfo *broker_addr;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_u64(unsigned char *p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = v >> (56 - 8 * i);
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++)
+    v = v << 8 | p[i];
+  return v;
+}
+
+static int reserve(unsigned char **buf, size_t *cap, size_t need) {
+  if (need <= *cap)
+    return 0;
+  size_t new_cap = *cap ? *cap : 256;
+  while (new_cap < need)
+    new_cap *= 2;
+  unsigned char *grown = realloc(*buf, new_cap);
+  if (grown == NULL)
+    return -1;
+  *buf = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+// A flush after every publish must not cost a syscall when nothing changes
+static void watch(struct bench_thread *t, struct bench_conn *c, int op,
+                  uint32_t events) {
+  if (op == EPOLL_CTL_MOD && c->events == events)
+    return;
+  struct epoll_event ev = {.events = events, .data.ptr = c};
+  epoll_ctl(t->epfd, op, c->fd, &ev);
+  c->events = events;
+}
+
+/*
+ * Write as much of the connection's pending output as the socket takes.
+ * Returns -1 on a socket error.
+ */
+static int conn_flush(struct bench_thread *t, struct bench_conn *c) {
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                     MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watch(t, c, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+        return 0;
+      }
+      return -1;
+    }
+    c->out_off += n;
+  }
+  c->out_off = c->out_len = 0;
+  watch(t, c, EPOLL_CTL_MOD, EPOLLIN);
+  return 0;
+}
+
+// Space for one more packet at the end of the output buffer
+static unsigned char *conn_append(struct bench_conn *c, size_t len) {
+  if (reserve(&c->out, &c->out_cap, c->out_len + len) == -1)
+    return NULL;
+  unsigned char *at = c->out + c->out_len;
+  c->out_len += len;
+  return at;
+}
+
+static void topic_name(char *buf, size_t size, unsigned topic) {
+  snprintf(buf, size, "bench/%u", topic);
+}
+
+static int conn_start(struct bench_thread *t, struct bench_conn *c, int index) {
+  char client_id[32];
+  snprintf(client_id, sizeof(client_id), "bench-%d-%d", t->id, index);
+  struct mqtt_connect connect = {0};
+  connect.bits.clean_session = 1;
+  connect.payload.keepalive = 60;
+  connect.payload.client_id = (unsigned char *)client_id;
+
+  unsigned char *at = conn_append(c, mqtt_connect_size(&connect));
+  if (at == NULL)
+    return -1;
+  pack_mqtt_connect(at, &connect);
+
+  if (!c->publisher) {
+    char name[32];
+    topic_name(name, sizeof(name), c->topic);
+    struct mqtt_subscribe sub = {.pkt_id = 1, .tuples_len = 1};
+    __typeof__(*sub.tuples) tuple = {strlen(name), (unsigned char *)name,
+                                     config.qos};
+    sub.tuples = &tuple;
+    at = conn_append(c, mqtt_subscribe_size(&sub));
+    if (at == NULL)
+      return -1;
+    pack_mqtt_subscribe(at, &sub);
+  }
+  c->connected = 1;
+  return conn_flush(t, c);
+}
+
+static int conn_open(struct bench_thread *t, struct bench_conn *c) {
+  c->fd = socket(broker_addr->ai_family,
+                 broker_addr->ai_socktype | SOCK_NONBLOCK,
+                 broker_addr->ai_protocol);
+  if (c->fd == -1)
+    return -1;
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(c->fd, broker_addr->ai_addr, broker_addr->ai_addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  watch(t, c, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT);
+  return 0;
+}
+
+static void conn_close(struct bench_thread *t, struct bench_conn *c) {
+  if (c->fd != -1) {
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+  }
+  c->fd = -1;
+  c->connected = 0;
+  t->errors++;
+}
+
+static int send_ack(struct bench_conn *c, unsigned char type_byte,
+                    uint16_t pkt_id) {
+  unsigned char *at = conn_append(c, 4);
+  if (at == NULL)
+    return -1;
+  at[0] = type_byte;
+  at[1] = 2;
+  at[2] = pkt_id >> 8;
+  at[3] = pkt_id & 0xff;
+  return 0;
+}
+
+/*
+ * Handle one complete packet from the broker. Only PUBLISH carries data;
+ * QoS 1 and 2 deliveries are acknowledged so the broker keeps sending. A
+ * QoS 2 publish is released on PUBREC and only complete on PUBCOMP.
+ */
+static int handle_packet(struct bench_thread *t, struct bench_conn *c,
+                         const unsigned char *pkt, size_t hdr_len,
+                         size_t remaining) {
+  union mqtt_header hdr = {.byte = pkt[0]};
+  const unsigned char *body = pkt + hdr_len;
+
+  if (hdr.bits.type == PUBREL && remaining >= 2)
+    return send_ack(c, PUBCOMP_BYTE, body[0] << 8 | body[1]);
+  // PUBREL carries the reserved flags 0010
+  if (hdr.bits.type == PUBREC && remaining >= 2)
+    return send_ack(c, PUBREL_BYTE | 0x02, body[0] << 8 | body[1]);
+  if ((hdr.bits.type == PUBACK && config.qos == AT_LEAST_ONCE) ||
+      (hdr.bits.type == PUBCOMP && config.qos == EXACTLY_ONCE)) {
+    t->completed++;
+    return 0;
+  }
+  if (hdr.bits.type != PUBLISH || remaining < 2)
+    return 0;
+
+  size_t offset = 2 + (body[0] << 8 | body[1]);
+  if (hdr.bits.qos > AT_MOST_ONCE)
+    offset += 2;
+  if (offset > remaining)
+    return 0;
+  uint16_t pkt_id = 0;
+  if (hdr.bits.qos > AT_MOST_ONCE) {
+    pkt_id = body[offset - 2] << 8 | body[offset - 1];
+  }
+  t->received++;
+  if (remaining - offset >= BENCH_STAMP_SIZE) {
+    uint64_t sent_at = get_u64(body + offset);
+    uint64_t now = now_ns();
+    if (now >= sent_at)
+      hist_record(&t->latency, now - sent_at);
+  }
+
+  if (hdr.bits.qos == AT_LEAST_ONCE)
+    return send_ack(c, PUBACK_BYTE, pkt_id);
+  if (hdr.bits.qos == EXACTLY_ONCE)
+    return send_ack(c, PUBREC_BYTE, pkt_id);
+  return 0;
+}
+
+static int conn_read(struct bench_thread *t, struct bench_conn *c) {
+  for (;;) {
+    if (reserve(&c->in, &c->in_cap, c->in_len + BENCH_READ_SIZE) == -1)
+      return -1;
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+    if (n == 0)
+      return -1;
+    if (n == -1)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    c->in_len += n;
+    t->bytes_received += n;
+
+    size_t used = 0;
+    for (;;) {
+      size_t hdr_len, remaining;
+      enum mqtt_frame_status status = mqtt_frame_header(
+          c->in + used, c->in_len - used, &hdr_len, &remaining);
+      if (status == MQTT_FRAME_INCOMPLETE)
+        break;
+      if (status != MQTT_FRAME_OK)
+        return -1;
+      if (c->in_len - used < hdr_len + remaining)
+        break;
+      if (handle_packet(t, c, c->in + used, hdr_len, remaining) == -1)
+        return -1;
+      used += hdr_len + remaining;
+    }
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    if (c->out_len > 0 && conn_flush(t, c) == -1)
+      return -1;
+  }
+}
+
+static int publish(struct bench_thread *t, struct bench_conn *c,
+                   uint64_t seq) {
+  char name[32];
+  topic_name(name, sizeof(name), c->topic);
+  put_u64(t->payload, now_ns());
+  put_u64(t->payload + 8, seq);
+
+  // Packet id 0 is not allowed on QoS 1 and 2
+  if (config.qos > AT_MOST_ONCE && ++c->next_id == 0)
+    c->next_id = 1;
+  struct mqtt_publish pub = {
+      .header = {.byte = PUBLISH_BYTE | config.qos << 1},
+      .pkt_id = c->next_id,
+      .topiclen = strlen(name),
+      .topic = (unsigned char *)name,
+      .payloadlen = config.payload,
+      .payload = t->payload,
+  };
+  unsigned char *at = conn_append(c, mqtt_publish_size(&pub));
+  if (at == NULL)
+    return -1;
+  pack_mqtt_publish(at, &pub);
+  t->sent++;
+  return conn_flush(t, c);
+}
+
+static void *bench_run(void *arg) {
+  struct bench_thread *t = arg;
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  uint64_t thread_rate = config.publishers ? (uint64_t)config.rate *
+                                                 t->npublishers /
+                                                 config.publishers
+                                           : 0;
+  int next_pub = 0;
+  uint64_t seq = 0;
+
+  for (int i = 0; i < t->nconns; i++) {
+    if (conn_open(t, &t->conns[i]) == -1)
+      t->errors++;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)config.duration * 1000000000ULL;
+  for (;;) {
+    uint64_t now = now_ns();
+    if (now >= end)
+      break;
+
+    int n = epoll_wait(t->epfd, events, BENCH_MAX_EVENTS, 1);
+    for (int e = 0; e < n; e++) {
+      struct bench_conn *c = events[e].data.ptr;
+      if (events[e].events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(t, c);
+        continue;
+      }
+      if (events[e].events & EPOLLOUT) {
+        int status = c->connected ? conn_flush(t, c)
+                                  : conn_start(t, c, c - t->conns);
+        if (status == -1) {
+          conn_close(t, c);
+          continue;
+        }
+      }
+      if ((events[e].events & EPOLLIN) && conn_read(t, c) == -1)
+        conn_close(t, c);
+    }
+
+    // Publishers take turns so the thread's share of the rate is met
+    if (t->npublishers == 0)
+      continue;
+    uint64_t due = thread_rate ? (now_ns() - start) * thread_rate / 1000000000ULL
+                               : seq + t->npublishers;
+    for (int tries = 0; seq < due && tries < t->nconns; tries++) {
+      struct bench_conn *c = &t->conns[next_pub];
+      next_pub = (next_pub + 1) % t->nconns;
+      if (!c->publisher || !c->connected)
+        continue;
+      if (c->out_len > 0) {
+        t->blocked++;
+        continue;
+      }
+      if (publish(t, c, seq++) == -1)
+        conn_close(t, c);
+    }
+  }
+
+  for (int i = 0; i < t->nconns; i++) {
+    if (t->conns[i].fd != -1)
+      close(t->conns[i].fd);
+    free(t->conns[i].in);
+    free(t->conns[i].out);
+  }
+  close(t->epfd);
+  return NULL;
+}
+
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void report(struct bench_thread *threads) {
+  struct histogram latency;
+  uint64_t sent = 0, completed = 0, received = 0, bytes = 0, blocked = 0;
+  uint64_t errors = 0;
+  hist_reset(&latency);
+  for (int i = 0; i < config.threads; i++) {
+    sent += threads[i].sent;
+    completed += threads[i].completed;
+    received += threads[i].received;
+    bytes += threads[i].bytes_received;
+    blocked += threads[i].blocked;
+    errors += threads[i].errors;
+    hist_merge(&latency, &threads[i].latency);
+  }
+
+  double secs = config.duration;
+  printf("connections %d (publishers %d, subscribers %d, topics %u)\n",
+         config.connections, config.publishers,
+         config.connections - config.publishers, config.topics);
+  printf("sent        %llu msgs, %.0f msg/s\n", (unsigned long long)sent,
+         sent / secs);
+  if (config.qos > AT_MOST_ONCE)
+    printf("completed   %llu msgs acknowledged by the broker\n",
+           (unsigned long long)completed);
+  printf("received    %llu msgs, %.0f msg/s, %.2f MB/s\n",
+         (unsigned long long)received, received / secs, bytes / secs / 1e6);
+  printf("blocked     %llu publishes skipped on full sockets\n",
+         (unsigned long long)blocked);
+  printf("errors      %llu\n", (unsigned long long)errors);
+  printf("latency     p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+         hist_percentile(&latency, 50.0) / 1e3,
+         hist_percentile(&latency, 99.0) / 1e3,
+         hist_percentile(&latency, 99.9) / 1e3,
+         hist_percentile(&latency, 100.0) / 1e3);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-H host] [-P port] [-c connections] [-p publishers] "
+          "[-t threads]\n"
+          "       [-r msgs_per_sec] [-q qos] [-s payload_bytes] [-T topics] "
+          "[-d seconds]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "H:P:c:p:t:r:q:s:T:d:")) != -1) {
+    switch (opt) {
+    case 'H':
+      config.host = optarg;
+      break;
+    case 'P':
+      config.port = optarg;
+      break;
+    case 'c':
+      config.connections = atoi(optarg);
+      break;
+    case 'p':
+      config.publishers = atoi(optarg);
+      break;
+    case 't':
+      config.threads = atoi(optarg);
+      break;
+    case 'r':
+      config.rate = strtoul(optarg, NULL, 10);
+      break;
+    case 'q':
+      config.qos = atoi(optarg);
+      break;
+    case 's':
+      config.payload = strtoul(optarg, NULL, 10);
+      break;
+    case 'T':
+      config.topics = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      config.duration = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (config.publishers == 0)
+    config.publishers = config.connections / 2;
+  if (config.connections < 1 || config.threads < 1 || config.topics < 1 ||
+      config.qos < 0 || config.qos > 2 || config.duration < 1 ||
+      config.publishers > config.connections)
+    usage(argv[0]);
+  if (config.payload < BENCH_STAMP_SIZE)
+    config.payload = BENCH_STAMP_SIZE;
+
+  struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+  int status = getaddrinfo(config.host, config.port, &hints, &broker_addr);
+  if (status != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+    exit(1);
+  }
+  raise_fd_limit();
+
+  struct bench_thread *threads = calloc(config.threads, sizeof(*threads));
+  if (threads == NULL) {
+    perror("calloc: ");
+    exit(1);
+  }
+  /*
+   * Connection i belongs to thread i % threads. The first `publishers`
+   * connections publish, publisher and subscriber i both use topic
+   * i % topics.
+   */
+  for (int i = 0; i < config.threads; i++) {
+    struct bench_thread *t = &threads[i];
+    t->id = i;
+    t->nconns = config.connections / config.threads +
+                (i < config.connections % config.threads);
+    t->conns = calloc(t->nconns, sizeof(*t->conns));
+    t->payload = calloc(1, config.payload);
+    t->epfd = epoll_create1(0);
+    if (t->conns == NULL || t->payload == NULL || t->epfd == -1) {
+      perror("thread setup: ");
+      exit(1);
+    }
+    hist_reset(&t->latency);
+    for (int j = 0; j < t->nconns; j++) {
+      int index = j * config.threads + i;
+      t->conns[j].fd = -1;
+      t->conns[j].publisher = index < config.publishers;
+      t->conns[j].topic = index % config.topics;
+      t->npublishers += t->conns[j].publisher;
+    }
+  }
+
+  for (int i = 0; i < config.threads; i++) {
+    if (pthread_create(&threads[i].thread, NULL, bench_run, &threads[i]) != 0) {
+      perror("pthread_create: ");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < config.threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+  }
+
+  report(threads);
+  for (int i = 0; i < config.threads; i++) {
+    free(threads[i].conns);
+    free(threads[i].payload);
+  }
+  free(threads);
+  freeaddrinfo(broker_addr);
+  return 0;
+}
@@ -0,0 +1,450 @@
+/*
+ * mqtt-replay: feed a capture (see src/capture.h) back into the broker.
+ *
+ * In-process mode (default) runs every captured byte through the same
+ * framer, decoder and router the broker uses, as fast as possible, and
+ * reports throughput and per-packet cost. Batch envelopes (see batch.h) are
+ * routed intact and then unbatched into one routed message per entry.
+ * Subscriptions for the router are given with -s, one synthetic subscriber
+ * per filter, and captured SUBSCRIBE and UNSUBSCRIBE packets are applied
+ * too: queued across packets and applied as one batch before the next
+ * PUBLISH is routed.
+ *
+ * Loopback mode (-H) opens one connection per captured connection and
+ * resends the bytes at the captured pace, divided by the -x speedup (0 for
+ * no pacing at all). Whatever the broker sends back is read and dropped.
+ */
+#include "../src/batch.h"
+#include "../src/capture.h"
+#include "../src/histogram.h"
+#include "../src/message.h"
+#include "../src/mqtt.h"
+#include "../src/subs.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per captured connection state, indexed by the captured conn id
+struct replay_conn {
+  int fd; // loopback mode
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+};
+
+struct replay_stats {
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t publishes;
+  uint64_t deliveries;
+  uint64_t filters; // subscribed and unsubscribed
+  uint64_t errors;
+  struct histogram cost; // ns per packet, framing excluded
+};
+
+static struct replay_conn *conns;
+static size_t nconns;
+static struct sub_batch pending; // captured (UN)SUBSCRIBEs not applied yet
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct replay_conn *conn_get(uint32_t id) {
+  if (id >= nconns) {
+    size_t n = nconns ? nconns : 64;
+    while (n <= id)
+      n *= 2;
+    struct replay_conn *grown = realloc(conns, sizeof(*conns) * n);
+    if (grown == NULL)
+      return NULL;
+    memset(grown + nconns, 0, sizeof(*conns) * (n - nconns));
+    for (size_t i = nconns; i < n; i++)
+      grown[i].fd = -1;
+    conns = grown;
+    nconns = n;
+  }
+  return &conns[id];
+}
+
+static void count_delivery(const struct subscriber *sub,
+                           const struct topic *filter, void *arg) {
+  (*(uint64_t *)arg)++;
+}
+
+struct unbatch_ctx {
+  struct sub_index *idx;
+  struct replay_stats *st;
+  unsigned char header;
+};
+
+static int route_entry(struct topic *topic, const void *payload, size_t len,
+                       uint64_t timestamp, void *arg) {
+  struct unbatch_ctx *ctx = arg;
+  struct mqtt_message *msg =
+      mqtt_message_publish(topic, payload, len, ctx->header, 0);
+  if (msg == NULL)
+    return 1;
+  ctx->st->publishes++;
+  subs_match(ctx->idx, topic, count_delivery, &ctx->st->deliveries);
+  mqtt_message_release(msg);
+  return 0;
+}
+
+// Captured connections count down from the top, clear of the -s clients
+static void *conn_client(uint32_t id) { return (void *)(UINTPTR_MAX - id); }
+
+static void queue_subscriptions(const union mqtt_packet *p, void *client,
+                                struct replay_stats *st) {
+  int subscribe = p->header.bits.type == SUBSCRIBE;
+  unsigned n = subscribe ? p->subscribe.tuples_len : p->unsubscribe.tuples_len;
+  for (unsigned i = 0; i < n; i++) {
+    const unsigned char *name = subscribe ? p->subscribe.tuples[i].topic
+                                          : p->unsubscribe.tuples[i].topic;
+    size_t len = subscribe ? p->subscribe.tuples[i].topic_len
+                           : p->unsubscribe.tuples[i].topic_len;
+    uint8_t flags;
+    const char *proper = subs_filter_options((const char *)name, &len, &flags);
+    struct topic *filter = topic_intern(proper, len);
+    int status = filter == NULL ? -1
+                 : subscribe
+                     ? subs_batch_add(&pending, filter, client,
+                                      p->subscribe.tuples[i].qos, flags, NULL)
+                     : subs_batch_remove(&pending, filter, client);
+    topic_release(filter);
+    if (status == -1)
+      st->errors++;
+    else
+      st->filters++;
+  }
+}
+
+static void apply_pending(struct sub_index *idx, struct replay_stats *st) {
+  if (pending.nops > 0 && subs_apply(idx, &pending) == -1)
+    st->errors++;
+}
+
+static void free_connect(struct mqtt_connect *c) {
+  free(c->payload.client_id);
+  free(c->payload.username);
+  free(c->payload.password);
+  free(c->payload.will_topic);
+  free(c->payload.will_message);
+}
+
+/*
+ * Decode one framed packet and, for a PUBLISH, serialize it once and match
+ * it against the index the way the broker routes it.
+ */
+static void route_packet(const unsigned char *pkt, void *client,
+                         struct sub_index *idx, struct replay_stats *st) {
+  union mqtt_packet p;
+  uint64_t start = now_ns();
+
+  st->packets++;
+  if (unpack_mqtt_packet(pkt, &p) == -1) {
+    st->errors++;
+    return;
+  }
+  if (p.header.bits.type == PUBLISH) {
+    apply_pending(idx, st);
+    struct mqtt_message *msg = mqtt_message_publish(
+        p.publish.interned, p.publish.payload, p.publish.payloadlen,
+        p.publish.header.byte, p.publish.pkt_id);
+    if (msg != NULL) {
+      st->publishes++;
+      subs_match(idx, p.publish.interned, count_delivery, &st->deliveries);
+      mqtt_message_release(msg);
+    }
+    if (batch_is_envelope(p.publish.interned)) {
+      // Entries keep the envelope's QoS and retain flags
+      struct unbatch_ctx ctx = {idx, st, p.publish.header.byte};
+      if (batch_unpack(p.publish.interned, p.publish.payload,
+                       p.publish.payloadlen, route_entry, &ctx) == -1)
+        st->errors++;
+    }
+    topic_release(p.publish.interned);
+    free(p.publish.payload);
+  } else if (p.header.bits.type == CONNECT) {
+    free_connect(&p.connect);
+  } else if (p.header.bits.type == SUBSCRIBE) {
+    queue_subscriptions(&p, client, st);
+    free(p.subscribe.tuples);
+  } else if (p.header.bits.type == UNSUBSCRIBE) {
+    queue_subscriptions(&p, client, st);
+    free(p.unsubscribe.tuples);
+  }
+  hist_record(&st->cost, now_ns() - start);
+}
+
+static int feed(struct replay_conn *c, void *client, const unsigned char *data,
+                size_t len, struct sub_index *idx, struct replay_stats *st) {
+  if (c->len + len > c->cap) {
+    size_t cap = c->cap ? c->cap : 4096;
+    while (cap < c->len + len)
+      cap *= 2;
+    unsigned char *grown = realloc(c->buf, cap);
+    if (grown == NULL)
+      return -1;
+    c->buf = grown;
+    c->cap = cap;
+  }
+  memcpy(c->buf + c->len, data, len);
+  c->len += len;
+
+  size_t used = 0;
+  for (;;) {
+    size_t hdr_len, remaining;
+    enum mqtt_frame_status status = mqtt_frame_header(
+        c->buf + used, c->len - used, &hdr_len, &remaining);
+    if (status == MQTT_FRAME_INCOMPLETE ||
+        (status == MQTT_FRAME_OK && c->len - used < hdr_len + remaining))
+      break;
+    if (status != MQTT_FRAME_OK) {
+      // The broker would drop the connection, forget what is buffered
+      st->errors++;
+      used = c->len;
+      break;
+    }
+    route_packet(c->buf + used, client, idx, st);
+    used += hdr_len + remaining;
+  }
+  memmove(c->buf, c->buf + used, c->len - used);
+  c->len -= used;
+  return 0;
+}
+
+static int connect_broker(struct addrinfo *addr) {
+  int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+// Read and discard whatever the broker has sent, so it never blocks on us
+static void drain_one(int fd) {
+  unsigned char sink[16384];
+  while (recv(fd, sink, sizeof(sink), 0) > 0)
+    ;
+}
+
+static void drain(void) {
+  for (size_t i = 0; i < nconns; i++) {
+    if (conns[i].fd != -1)
+      drain_one(conns[i].fd);
+  }
+}
+
+static int send_all(int fd, const unsigned char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+      // The broker may be blocked writing to any of our connections
+      drain();
+      struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+      poll(&pfd, 1, 1);
+      continue;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void pace(uint64_t start, uint64_t ts_ns, double speed) {
+  if (speed <= 0)
+    return;
+  uint64_t due = start + (uint64_t)(ts_ns / speed);
+  uint64_t now = now_ns();
+  if (due > now) {
+    struct timespec wait = {(due - now) / 1000000000ULL,
+                            (due - now) % 1000000000ULL};
+    nanosleep(&wait, NULL);
+  }
+}
+
+static int replay_loopback(struct capture_reader *r, struct addrinfo *addr,
+                           double speed, struct replay_stats *st) {
+  struct capture_record rec;
+  const unsigned char *data;
+  uint64_t start = now_ns();
+  int status;
+
+  while ((status = capture_next(r, &rec, &data)) == 1) {
+    struct replay_conn *c = conn_get(rec.conn);
+    if (c == NULL)
+      return -1;
+    pace(start, rec.ts_ns, speed);
+    st->records++;
+
+    switch (capture_kind(&rec)) {
+    case CAP_OPEN:
+      if (c->fd != -1)
+        close(c->fd);
+      if ((c->fd = connect_broker(addr)) == -1)
+        st->errors++;
+      break;
+    case CAP_DATA:
+      st->bytes += capture_len(&rec);
+      if (c->fd != -1 && send_all(c->fd, data, capture_len(&rec)) == -1) {
+        st->errors++;
+        close(c->fd);
+        c->fd = -1;
+      }
+      break;
+    case CAP_CLOSE:
+      if (c->fd != -1)
+        close(c->fd);
+      c->fd = -1;
+      break;
+    }
+    if (c->fd != -1)
+      drain_one(c->fd);
+  }
+  return status;
+}
+
+static int replay_in_process(struct capture_reader *r, struct sub_index *idx,
+                             struct replay_stats *st) {
+  struct capture_record rec;
+  const unsigned char *data;
+  int status;
+
+  while ((status = capture_next(r, &rec, &data)) == 1) {
+    struct replay_conn *c = conn_get(rec.conn);
+    if (c == NULL)
+      return -1;
+    st->records++;
+    if (capture_kind(&rec) == CAP_DATA) {
+      st->bytes += capture_len(&rec);
+      if (feed(c, conn_client(rec.conn), data, capture_len(&rec), idx, st) ==
+          -1)
+        return -1;
+    } else {
+      // A new or closed connection starts framing from scratch
+      c->len = 0;
+    }
+  }
+  apply_pending(idx, st);
+  return status;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-s filter]... capture_file\n"
+          "       %s -H host [-P port] [-x speedup] capture_file\n",
+          prog, prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *host = NULL;
+  const char *port = "3490";
+  double speed = 1.0;
+  struct sub_index idx;
+  static struct replay_stats st;
+  int opt;
+
+  subs_init(&idx);
+  while ((opt = getopt(argc, argv, "H:P:x:s:")) != -1) {
+    if (opt == 'H') {
+      host = optarg;
+    } else if (opt == 'P') {
+      port = optarg;
+    } else if (opt == 'x') {
+      speed = atof(optarg);
+    } else if (opt == 's') {
+      size_t len = strlen(optarg);
+      uint8_t flags;
+      const char *proper = subs_filter_options(optarg, &len, &flags);
+      struct topic *filter = topic_intern(proper, len);
+      // Every filter gets its own synthetic client
+      if (filter == NULL ||
+          subs_add(&idx, filter, (void *)(uintptr_t)(idx.nsubs + 1), 0,
+                   flags) == -1) {
+        perror("subscribe: ");
+        exit(1);
+      }
+      topic_release(filter);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, argv[optind]) == -1) {
+    fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+    exit(1);
+  }
+
+  hist_reset(&st.cost);
+  uint64_t start = now_ns();
+  int status;
+  if (host != NULL) {
+    struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                             .ai_socktype = SOCK_STREAM};
+    struct addrinfo *addr;
+    int rc = getaddrinfo(host, port, &hints, &addr);
+    if (rc != 0) {
+      fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+      exit(1);
+    }
+    status = replay_loopback(&reader, addr, speed, &st);
+    freeaddrinfo(addr);
+  } else {
+    status = replay_in_process(&reader, &idx, &st);
+  }
+  double secs = (now_ns() - start) / 1e9;
+  if (status == -1)
+    fprintf(stderr, "capture file is truncated or corrupt\n");
+
+  printf("records     %llu, %llu bytes in %.3fs (%.2f MB/s)\n",
+         (unsigned long long)st.records, (unsigned long long)st.bytes, secs,
+         st.bytes / secs / 1e6);
+  if (host == NULL) {
+    printf("packets     %llu (%.0f/s), %llu publishes, %llu deliveries\n",
+           (unsigned long long)st.packets, st.packets / secs,
+           (unsigned long long)st.publishes,
+           (unsigned long long)st.deliveries);
+    printf("filters     %llu subscribed or unsubscribed, %zu subscriptions\n",
+           (unsigned long long)st.filters, idx.nsubs);
+    printf("per packet  p50 %lluns p99 %lluns p999 %lluns\n",
+           (unsigned long long)hist_percentile(&st.cost, 50.0),
+           (unsigned long long)hist_percentile(&st.cost, 99.0),
+           (unsigned long long)hist_percentile(&st.cost, 99.9));
+  }
+  printf("errors      %llu\n", (unsigned long long)st.errors);
+
+  for (size_t i = 0; i < nconns; i++) {
+    if (conns[i].fd != -1)
+      close(conns[i].fd);
+    free(conns[i].buf);
+  }
+  free(conns);
+  capture_reader_close(&reader);
+  subs_batch_destroy(&pending);
+  subs_destroy(&idx);
+  return status == -1;
+}
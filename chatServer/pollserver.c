@@ -1,8 +1,26 @@
+#include "../src/capture.h"
+#include "../src/cluster.h"
+#include "../src/expiry.h"
+#include "../src/flightrec.h"
+#include "../src/memacct.h"
+#include "../src/message.h"
+#include "../src/mqtt.h"
+#include "../src/mqttsn.h"
+#include "../src/outq.h"
+#include "../src/shm.h"
+#include "../src/slowcon.h"
+#include "../src/stats.h"
+#include "../src/tls.h"
+#include "../src/topic.h"
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,10 +29,71 @@
 #include <unistd.h>
 
 #define PORT "3490"
+#define TLS_PORT "8883"
+// Poll slots 0 to 2 hold the plaintext, TLS and local listeners, slot 3
+// the MQTT-SN socket, slot 4 the cluster links and slot 5 the $SYS timer,
+// clients follow
+#define SN_SLOT 3
+#define CLUSTER_SLOT 4
+#define SYS_SLOT 5
+#define LISTENERS 6
+#define MAX_CLUSTER_PEERS 16
 #define MAX_CONNECTIONS 10
 #define MAX_BUFFER_SIZE 256
 
-int create_listener_socket() {
+// Per connection state, indexed by fd
+struct client {
+  struct outq out;
+  struct mem_account mem;
+  struct slow_consumer health;
+  struct topic *topic; // conflation key for the chat lines it sends
+  struct tls_conn *tls; // NULL for plaintext clients
+  struct shm_conn *shm; // shared memory rings of a local client, or NULL
+  unsigned char *in;    // start of an MQTT packet longer than one read
+  size_t in_len;
+  size_t in_cap;
+};
+
+// Slow consumer detection, off unless -w was given
+static struct slow_policy slow_policy = {0, 5000000000ULL, SLOW_CONFLATE};
+
+// TLS listener context, only used if -C and -K were given
+static struct tls_server tls_server;
+
+// MQTT-SN gateway, only used if -n was given
+static struct sn_gateway sn_gateway;
+static int sn_enabled;
+
+// Links to the other brokers, only used if -N was given
+static struct cluster cluster;
+static int cluster_enabled;
+// Stream clients are sent everything, so each one counts as interest in "#"
+static struct topic *everything;
+
+// Client table as seen by the gateway and cluster callbacks
+struct relay {
+  struct client **clients;
+  struct pollfd **pfds;
+  int *fd_count;
+  struct worker_stats *stats;
+};
+
+// Queued message TTL, off unless -e was given. Queues are keyed by fd.
+static uint64_t queue_ttl_ns;
+static struct expiry_wheel queue_expiry;
+
+// Inbound traffic recorder, NULL unless -c was given
+static struct capture *capture;
+
+// Latest $SYS values, refreshed every STATS_SYS_INTERVAL_MS
+static struct retain_store sys_store;
+
+// Set by SIGUSR1, the loop prints the stats dump to stderr
+static volatile sig_atomic_t dump_requested;
+
+static void request_dump(int sig) { dump_requested = 1; }
+
+int create_listener_socket(const char *port) {
   int listener_socket, getaddrinfo_status;
   struct addrinfo hints, *server_info, *current_addr;
   int reuse_addr_option = 1;
@@ -25,7 +104,7 @@ int create_listener_socket() {
   hints.ai_flags = AI_PASSIVE;
 
   if ((getaddrinfo_status =
-           getaddrinfo("localhost", PORT, &hints, &server_info)) != 0) {
+           getaddrinfo("localhost", port, &hints, &server_info)) != 0) {
     return -1;
   }
 
@@ -91,22 +170,429 @@ int add_to_poll_fds(struct pollfd **pfds, int new_fd, int *fd_count,
 }
 
 void remove_from_pollfds(struct pollfd **pfds, int index, int *fd_count) {
-  pfds[index] = pfds[*fd_count - 1];
+  (*pfds)[index] = (*pfds)[*fd_count - 1];
   (*fd_count)--;
 }
 
-int main() {
-  int listener_socket = create_listener_socket();
+/*
+ * Clients are indexed by fd, grow the table so fd has a slot.
+ */
+int reserve_client(struct client **clients, int *client_size, int fd) {
+  if (fd < *client_size) {
+    return 0;
+  }
+  int new_size = *client_size ? *client_size : 16;
+  while (new_size <= fd) {
+    new_size *= 2;
+  }
+  struct client *temp = realloc(*clients, sizeof(struct client) * new_size);
+  if (temp == NULL) {
+    return -1;
+  }
+  memset(temp + *client_size, 0,
+         sizeof(struct client) * (new_size - *client_size));
+  *clients = temp;
+  *client_size = new_size;
+  return 0;
+}
+
+/*
+ * The outq keeps a pointer to the client's account, so it has to be set
+ * again whenever the client table moves.
+ */
+void attach_accounts(struct client *clients, struct pollfd *pfds,
+                     int fd_count) {
+  for (int i = LISTENERS; i < fd_count; i++) {
+    clients[pfds[i].fd].out.acct = &clients[pfds[i].fd].mem;
+  }
+}
+
+/*
+ * Stream clients count as "#", which never matches $SYS, so only MQTT-SN
+ * sensors that subscribed to $SYS topics are sent the values.
+ */
+void deliver_sys(struct mqtt_message *msg, void *arg) {
+  if (sn_enabled) {
+    mqttsn_deliver(&sn_gateway, msg);
+  }
+}
+
+/*
+ * $SYS/broker/clients/slow/<fd>/drain_rate is retained while the client is
+ * flagged, so a monitor subscribing later still sees the current offenders.
+ */
+void report_slow(int fd, const struct slow_consumer *health) {
+  char name[64];
+  int len = snprintf(name, sizeof(name),
+                     "$SYS/broker/clients/slow/%d/drain_rate", fd);
+  if (health->flagged) {
+    stats_publish_value(&sys_store, name, health->drain_rate, deliver_sys,
+                        NULL);
+    return;
+  }
+  struct topic *topic = topic_intern(name, len);
+  if (topic != NULL) {
+    retain_set(&sys_store, topic, NULL);
+  }
+}
+
+void close_client(struct pollfd **pfds, int index, int *fd_count,
+                  struct client *clients) {
+  int fd = (*pfds)[index].fd;
+  capture_record(capture, CAP_CLOSE, fd, NULL, 0);
+  if (clients[fd].health.flagged) {
+    stats_add(stats_worker(0), STAT_SLOW_CONSUMERS, -1);
+    clients[fd].health.flagged = 0;
+    report_slow(fd, &clients[fd].health);
+  }
+  topic_release(clients[fd].topic);
+  clients[fd].topic = NULL;
+  outq_destroy(&clients[fd].out);
+  memacct_release(&clients[fd].mem);
+  tls_conn_free(clients[fd].tls);
+  clients[fd].tls = NULL;
+  shm_conn_free(clients[fd].shm);
+  clients[fd].shm = NULL;
+  free(clients[fd].in);
+  clients[fd].in = NULL;
+  clients[fd].in_len = clients[fd].in_cap = 0;
+  if (cluster_enabled) {
+    cluster_interest(&cluster, everything, -1);
+  }
+  close(fd);
+  remove_from_pollfds(pfds, index, fd_count);
+}
+
+int parse_policy(const char *name, enum mem_policy *policy) {
+  if (strcmp(name, "drop") == 0) {
+    *policy = MEM_DROP_OLDEST_QOS0;
+  } else if (strcmp(name, "reject") == 0) {
+    *policy = MEM_REJECT;
+  } else if (strcmp(name, "disconnect") == 0) {
+    *policy = MEM_DISCONNECT;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Topic a demoted consumer conflates msg under: the PUBLISH topic for MQTT
+ * traffic, otherwise the sender, so a slow reader keeps only the latest
+ * line from each peer. Only computed once a conflating consumer needs it.
+ */
+struct topic *message_key(const struct mqtt_message *msg,
+                          struct client *sender) {
+  const unsigned char *name;
+  uint16_t len;
+  union mqtt_header hdr = {.byte = msg->data[0]};
+  if (hdr.bits.type == PUBLISH &&
+      mqtt_peek_publish_topic(msg->data, msg->len, &name, &len) == 0) {
+    return topic_intern((const char *)name, len);
+  }
+  return sender->topic != NULL ? topic_ref(sender->topic) : NULL;
+}
+
+/*
+ * Chat lines are fire and forget like a QoS 0 PUBLISH; only packets that
+ * expect an acknowledgement are kept for a consumer demoted to dropping.
+ */
+int droppable(const struct mqtt_message *msg) {
+  union mqtt_header hdr = {.byte = msg->data[0]};
+  return hdr.bits.type != PUBLISH || hdr.bits.qos == AT_MOST_ONCE;
+}
+
+/*
+ * Queue msg for peer under the slow consumer policy. Returns 1 if queued,
+ * 0 if the policy dropped it and -1 if the queue refused it.
+ */
+int queue_for_peer(struct client *peer, struct mqtt_message *msg,
+                   struct client *sender) {
+  int status;
+  if (!peer->health.flagged) {
+    status = outq_push(&peer->out, mqtt_message_ref(msg));
+  } else if (slow_policy.action == SLOW_CONFLATE) {
+    if (msg->topic == NULL) {
+      msg->topic = message_key(msg, sender);
+    }
+    status = outq_push_conflated(&peer->out, mqtt_message_ref(msg));
+  } else if (droppable(msg)) {
+    return 0;
+  } else {
+    status = outq_push(&peer->out, mqtt_message_ref(msg));
+  }
+  if (status == -1) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * A PUBLISH that didn't come from a stream client goes to every one of
+ * them. The topic is already interned, so conflation never needs the
+ * sender.
+ */
+int relay_to_clients(struct relay *r, struct mqtt_message *msg) {
+  int routed = 0;
+  if (queue_ttl_ns != 0 && msg->expires_ns == 0) {
+    msg->expires_ns = stats_now_ns() + queue_ttl_ns;
+  }
+  for (int output = LISTENERS; output < *r->fd_count; output++) {
+    int status = queue_for_peer(&(*r->clients)[(*r->pfds)[output].fd], msg,
+                                NULL);
+    if (status == 1) {
+      stats_add(r->stats, STAT_MSGS_OUT, 1);
+      routed++;
+    } else {
+      stats_add(r->stats, STAT_MSGS_DROPPED, 1);
+    }
+  }
+  return routed;
+}
+
+// From an MQTT-SN client, also for the peers that want it
+void route_sn_publish(struct mqtt_message *msg, void *arg) {
+  int routed = relay_to_clients(arg, msg);
+  // Other sensors on this gateway subscribe through its own index
+  mqttsn_deliver(&sn_gateway, msg);
+  if (cluster_enabled) {
+    cluster_forward(&cluster, msg);
+  }
+  flightrec_event(FR_PUBLISH_ROUTED, sn_gateway.fd, 0, routed);
+}
+
+// From a peer broker, local subscribers only
+void route_cluster_publish(struct mqtt_message *msg, void *arg) {
+  struct relay *r = arg;
+  stats_add(r->stats, STAT_MSGS_IN, 1);
+  int routed = relay_to_clients(r, msg);
+  if (sn_enabled) {
+    mqttsn_deliver(&sn_gateway, msg);
+  }
+  flightrec_event(FR_PUBLISH_ROUTED, cluster.epfd, 0, routed);
+}
+
+// A complete PUBLISH from a client, for the gateway and the peers
+void forward_frame(struct mqtt_message *msg) {
+  if (sn_enabled) {
+    mqttsn_deliver(&sn_gateway, msg);
+  }
+  if (cluster_enabled) {
+    cluster_forward(&cluster, msg);
+  }
+}
+
+/*
+ * Chat peers get each read as it arrives, but the gateway and the links
+ * need whole packets, so a PUBLISH longer than one read, or two in one
+ * read, must not go out cut at the read boundaries. Buffer the client's
+ * stream and forward every complete packet, reusing msg when the read is
+ * exactly one. Returns -1 when out of memory, over the client's memory
+ * limit or on a packet over the -x limit, and the caller closes the
+ * connection.
+ */
+int route_frames(struct client *c, struct mqtt_message *msg) {
+  size_t header_len, remaining;
+  if (c->in_len == 0 &&
+      mqtt_frame_header(msg->data, msg->len, &header_len, &remaining) ==
+          MQTT_FRAME_OK &&
+      msg->len == header_len + remaining) {
+    forward_frame(msg);
+    return 0;
+  }
+  if (c->in_len + msg->len > c->in_cap) {
+    size_t cap = c->in_cap ? c->in_cap : MAX_BUFFER_SIZE;
+    while (cap < c->in_len + msg->len) {
+      cap *= 2;
+    }
+    // The buffer counts against the client's limit like its queue does
+    if (memacct_over(&c->mem, cap - c->in_cap) > 0) {
+      errno = ENOBUFS;
+      return memacct_refuse(&c->mem);
+    }
+    unsigned char *grown = realloc(c->in, cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    memacct_charge(&c->mem, MEM_RECV, cap - c->in_cap);
+    c->in = grown;
+    c->in_cap = cap;
+  }
+  memcpy(c->in + c->in_len, msg->data, msg->len);
+  c->in_len += msg->len;
+
+  size_t used = 0;
+  int status = 0;
+  for (;;) {
+    enum mqtt_frame_status frame = mqtt_frame_header(
+        c->in + used, c->in_len - used, &header_len, &remaining);
+    if (frame == MQTT_FRAME_INCOMPLETE ||
+        (frame == MQTT_FRAME_OK && c->in_len - used < header_len + remaining)) {
+      break;
+    }
+    if (frame == MQTT_FRAME_TOO_LARGE) {
+      errno = EMSGSIZE;
+      status = -1;
+      break;
+    }
+    if (frame != MQTT_FRAME_OK) {
+      // Not MQTT, forget what is buffered
+      used = c->in_len;
+      break;
+    }
+    struct mqtt_message *packet =
+        mqtt_message_new(c->in + used, header_len + remaining);
+    if (packet == NULL) {
+      status = -1;
+      break;
+    }
+    packet->ingress_ns = msg->ingress_ns;
+    packet->expires_ns = msg->expires_ns;
+    forward_frame(packet);
+    mqtt_message_release(packet);
+    used += header_len + remaining;
+  }
+  memmove(c->in, c->in + used, c->in_len - used);
+  c->in_len -= used;
+  return status;
+}
+
+void sn_interest_changed(struct topic *filter, int delta, void *arg) {
+  cluster_interest(&cluster, filter, delta);
+}
+
+/*
+ * A bucket of queue deadlines passed. The fd may have been closed or
+ * reused since, outq_expire ignores a queue with nothing due.
+ */
+void expire_queue(void *key, uint64_t now_ns, void *arg) {
+  struct relay *r = arg;
+  struct client *c = &(*r->clients)[(intptr_t)key];
+  if (c->out.expiry != NULL) {
+    outq_expire(&c->out, now_ns);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int zerocopy = 0;
+  const char *cert_file = NULL, *key_file = NULL, *local_path = NULL;
+  const char *sn_port = NULL, *port = PORT;
+  const char *cluster_port = NULL, *cluster_peers[MAX_CLUSTER_PEERS];
+  int node_id = 0, ncluster_peers = 0;
+  struct mem_limits limits = {0, 0, MEM_DROP_OLDEST_QOS0};
+  int opt;
+  while ((opt = getopt(argc, argv, "zm:M:p:c:w:g:s:C:K:u:n:N:L:P:l:e:x:")) != -1) {
+    if (opt == 'z') {
+      zerocopy = 1; // MSG_ZEROCOPY for large messages
+    } else if (opt == 'm') {
+      limits.client_bytes = strtoul(optarg, NULL, 10);
+    } else if (opt == 'M') {
+      limits.global_bytes = strtoul(optarg, NULL, 10);
+    } else if (opt == 'p' && parse_policy(optarg, &limits.policy) == 0) {
+      continue;
+    } else if (opt == 'w') {
+      slow_policy.high_watermark = strtoul(optarg, NULL, 10);
+    } else if (opt == 'g') {
+      slow_policy.grace_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+    } else if (opt == 's' &&
+               slow_parse_action(optarg, &slow_policy.action) == 0) {
+      continue;
+    } else if (opt == 'C') {
+      cert_file = optarg; // PEM chain, enables the TLS listener with -K
+    } else if (opt == 'K') {
+      key_file = optarg;
+    } else if (opt == 'u') {
+      local_path = optarg; // Unix socket for shared memory clients
+    } else if (opt == 'n') {
+      sn_port = optarg; // UDP port for MQTT-SN sensors
+    } else if (opt == 'l') {
+      port = optarg; // client port, so several brokers can share a host
+    } else if (opt == 'N') {
+      node_id = atoi(optarg); // enables clustering, unique per broker
+    } else if (opt == 'L') {
+      cluster_port = optarg; // where peer brokers dial this one
+    } else if (opt == 'P' && ncluster_peers < MAX_CLUSTER_PEERS) {
+      cluster_peers[ncluster_peers++] = optarg; // host:port of a peer
+    } else if (opt == 'e') {
+      // Unsent messages older than this are dropped
+      queue_ttl_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+    } else if (opt == 'x') {
+      // Largest packet forwarded to sensors and peers, fixed header included
+      mqtt_set_max_packet_size(strtoul(optarg, NULL, 10));
+    } else if (opt == 'c') {
+      // Record inbound traffic for mqtt-replay
+      if ((capture = capture_open(optarg)) == NULL) {
+        perror("capture: ");
+        exit(1);
+      }
+    } else {
+      fprintf(stderr,
+              "usage: %s [-l port] [-z] [-m client_bytes] [-M global_bytes] "
+              "[-p drop|reject|disconnect] [-c capture_file] "
+              "[-w slow_watermark_bytes] [-g grace_seconds] "
+              "[-s conflate|drop|disconnect] [-e ttl_seconds] "
+              "[-x max_packet_bytes] "
+              "[-C cert.pem -K key.pem] "
+              "[-u local_socket] [-n mqttsn_port] "
+              "[-N node_id [-L cluster_port] [-P host:port]...]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  memacct_configure(&limits);
+
+  // Single threaded, everything is counted as worker 0
+  if (stats_init(1) == -1) {
+    perror("stats: ");
+    exit(1);
+  }
+  struct worker_stats *stats = stats_worker(0);
+  signal(SIGUSR1, request_dump);
+  // SIGUSR2 writes the recent event history for offline decoding
+  if (flightrec_attach(0) == -1 ||
+      flightrec_dump_on_signal(SIGUSR2, "flightrec.bin") == -1) {
+    perror("flight recorder: ");
+  }
+
+  int listener_socket = create_listener_socket(port);
   if (listener_socket == -1) {
     fprintf(stderr, "Error creating listening socket\n");
     exit(1);
   }
+  int tls_listener_socket = -1; // poll skips the slot while it is negative
+  if (cert_file != NULL && key_file != NULL) {
+    if (tls_server_init(&tls_server, cert_file, key_file, 1) == -1) {
+      fprintf(stderr, "Error loading %s and %s\n", cert_file, key_file);
+      exit(1);
+    }
+    tls_listener_socket = create_listener_socket(TLS_PORT);
+    if (tls_listener_socket == -1) {
+      fprintf(stderr, "Error creating TLS listening socket\n");
+      exit(1);
+    }
+  }
+  int local_listener_socket = -1;
+  if (local_path != NULL &&
+      (local_listener_socket = shm_listen(local_path)) == -1) {
+    perror("local listener: ");
+    exit(1);
+  }
+  int sn_socket = -1;
+  if (sn_port != NULL && (sn_socket = mqttsn_listen(sn_port)) == -1) {
+    perror("MQTT-SN listener: ");
+    exit(1);
+  }
+  // TLS writes go through write(2), a closed peer must not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
   struct sockaddr_storage client_addr;
   socklen_t client_addr_len;
   int active_fd_count = 0;
-  int poll_fd_capacity = 5;
+  int poll_fd_capacity = LISTENERS;
   struct pollfd *poll_fds = malloc(sizeof(struct pollfd) * poll_fd_capacity);
+  struct client *clients = NULL;
+  int client_size = 0;
 
   char buffer[MAX_BUFFER_SIZE];
 
@@ -117,45 +603,236 @@ int main() {
 
   poll_fds[0].fd = listener_socket;
   poll_fds[0].events = POLLIN;
-  active_fd_count = 1; // Listener socket added as first file descriptor
+  poll_fds[1].fd = tls_listener_socket;
+  poll_fds[1].events = POLLIN;
+  poll_fds[2].fd = local_listener_socket;
+  poll_fds[2].events = POLLIN;
+  poll_fds[SN_SLOT].fd = sn_socket;
+  poll_fds[SN_SLOT].events = POLLIN;
+  poll_fds[CLUSTER_SLOT].fd = -1;
+  poll_fds[CLUSTER_SLOT].events = POLLIN;
+  poll_fds[SYS_SLOT].fd = -1;
+  poll_fds[SYS_SLOT].events = POLLIN;
+  if (retain_init(&sys_store) == -1 ||
+      (poll_fds[SYS_SLOT].fd = stats_timer_fd(STATS_SYS_INTERVAL_MS)) == -1) {
+    perror("$SYS: ");
+  }
+  active_fd_count = LISTENERS; // Listener sockets come first
+  struct relay relay = {&clients, &poll_fds, &active_fd_count, stats};
+  if (sn_socket != -1) {
+    if (mqttsn_init(&sn_gateway, sn_socket, route_sn_publish, &relay) == -1) {
+      perror("MQTT-SN gateway: ");
+      exit(1);
+    }
+    sn_gateway.stats = stats;
+    sn_enabled = 1;
+  }
+  if (node_id > 0) {
+    if (cluster_init(&cluster, node_id, cluster_port, route_cluster_publish,
+                     &relay) == -1) {
+      perror("cluster: ");
+      exit(1);
+    }
+    cluster.stats = stats;
+    for (int i = 0; i < ncluster_peers; i++) {
+      char host[256];
+      const char *colon = strrchr(cluster_peers[i], ':');
+      if (colon == NULL || colon - cluster_peers[i] >= (long)sizeof(host)) {
+        fprintf(stderr, "Peer %s is not host:port\n", cluster_peers[i]);
+        exit(1);
+      }
+      memcpy(host, cluster_peers[i], colon - cluster_peers[i]);
+      host[colon - cluster_peers[i]] = '\0';
+      if (cluster_add_peer(&cluster, host, colon + 1) == -1) {
+        perror("cluster peer: ");
+        exit(1);
+      }
+    }
+    poll_fds[CLUSTER_SLOT].fd = cluster.epfd;
+    everything = topic_intern("#", 1);
+    sn_gateway.interest = sn_interest_changed;
+    cluster_enabled = 1;
+  }
+  uint64_t sn_expired_ns = stats_now_ns();
+  if (queue_ttl_ns != 0) {
+    expiry_init(&queue_expiry, 1000000000ULL, sn_expired_ns, expire_queue,
+                &relay);
+  }
   printf("Now listening!\n");
 
+  // Set when a TLS client has decrypted input the socket won't poll for
+  int poll_timeout = -1;
   while (1) {
-    int num_events = poll(poll_fds, active_fd_count, -1);
+    int num_events = poll(poll_fds, active_fd_count, poll_timeout);
+    poll_timeout = -1;
+    if (dump_requested) {
+      dump_requested = 0;
+      stats_dump(stderr);
+    }
+    if (num_events == -1 && errno == EINTR) {
+      continue;
+    }
     if (num_events == -1) {
       perror("poll error: ");
       exit(1);
     }
 
-    // Check listener socket, we can just use 0 because of the way that we
-    // delete sockets
-    if (poll_fds[0].revents & POLLIN) {
+    // Check listener sockets, they keep their slots because of the way
+    // that we delete sockets
+    if (poll_fds[CLUSTER_SLOT].revents & POLLIN) {
+      cluster_poll(&cluster);
+    }
+    if (poll_fds[SYS_SLOT].revents & POLLIN) {
+      uint64_t expirations;
+      if (read(poll_fds[SYS_SLOT].fd, &expirations, sizeof(expirations)) > 0) {
+        flightrec_event(FR_TIMER, poll_fds[SYS_SLOT].fd, FR_TIMER_SYS, 0);
+        if (stats_publish_sys(&sys_store, deliver_sys, NULL) == -1) {
+          perror("$SYS: ");
+        }
+      }
+    }
+
+    for (int l = 0; l < SN_SLOT; l++) {
+      if (!(poll_fds[l].revents & POLLIN)) {
+        continue;
+      }
       client_addr_len = sizeof(client_addr);
       int new_client_socket;
       new_client_socket = accept(
-          listener_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+          poll_fds[l].fd, (struct sockaddr *)&client_addr, &client_addr_len);
       if (new_client_socket == -1) {
         perror("Error accepting new connection: ");
+        continue;
       }
-      char addr[INET6_ADDRSTRLEN];
+      char addr[INET6_ADDRSTRLEN] = "local"; // Unix sockets have no address
 
       inet_ntop(client_addr.ss_family,
                 get_addr_name((struct sockaddr *)&client_addr), addr,
                 sizeof(addr));
 
-      int status = add_to_poll_fds(&poll_fds, new_client_socket,
-                                   &active_fd_count, &poll_fd_capacity);
+      // Flushes must never block the loop, a full socket keeps its queue
+      fcntl(new_client_socket, F_SETFL,
+            fcntl(new_client_socket, F_GETFL) | O_NONBLOCK);
+
+      struct client *old_clients = clients;
+      int status = reserve_client(&clients, &client_size, new_client_socket);
+      if (status == 0 && clients != old_clients) {
+        attach_accounts(clients, poll_fds, active_fd_count);
+      }
+      if (status == 0) {
+        status = outq_init(&clients[new_client_socket].out);
+        clients[new_client_socket].out.acct = &clients[new_client_socket].mem;
+        clients[new_client_socket].out.stats = stats;
+        if (queue_ttl_ns != 0) {
+          clients[new_client_socket].out.expiry = &queue_expiry;
+          clients[new_client_socket].out.expiry_key =
+              (void *)(intptr_t)new_client_socket;
+        }
+        slow_init(&clients[new_client_socket].health, stats_now_ns());
+        char key[32];
+        int len = snprintf(key, sizeof(key), "chat/%d", new_client_socket);
+        clients[new_client_socket].topic = topic_intern(key, len);
+      }
+      if (status == 0 && poll_fds[l].fd == tls_listener_socket) {
+        clients[new_client_socket].tls =
+            tls_conn_new(&tls_server, new_client_socket);
+        status = clients[new_client_socket].tls != NULL ? 0 : -1;
+      } else if (status == 0 && poll_fds[l].fd == local_listener_socket) {
+        clients[new_client_socket].shm =
+            shm_conn_new(new_client_socket, SHM_RING_SIZE);
+        status = clients[new_client_socket].shm != NULL ? 0 : -1;
+      }
+      if (status == 0) {
+        status = add_to_poll_fds(&poll_fds, new_client_socket,
+                                 &active_fd_count, &poll_fd_capacity);
+      }
       if (status == -1) {
         fprintf(stderr, "There was a problem with an incoming connection: %s\n",
                 addr);
+        tls_conn_free(clients[new_client_socket].tls);
+        clients[new_client_socket].tls = NULL;
+        shm_conn_free(clients[new_client_socket].shm);
+        clients[new_client_socket].shm = NULL;
+        close(new_client_socket);
       } else {
+        // TLS sockets don't take MSG_ZEROCOPY, even with the kernel encrypting
+        if (zerocopy && clients[new_client_socket].tls == NULL &&
+            clients[new_client_socket].shm == NULL &&
+            outq_enable_zerocopy(&clients[new_client_socket].out,
+                                 new_client_socket,
+                                 OUTQ_ZEROCOPY_THRESHOLD) == -1) {
+          perror("SO_ZEROCOPY: ");
+        }
+        stats_add(stats, STAT_CLIENTS_CONNECTED, 1);
+        if (cluster_enabled) {
+          cluster_interest(&cluster, everything, 1);
+        }
+        flightrec_event(FR_ACCEPT, new_client_socket, 0, 0);
+        if (clients[new_client_socket].tls == NULL) {
+          flightrec_event(FR_CONNECT, new_client_socket, 0, 0);
+        }
+        capture_record(capture, CAP_OPEN, new_client_socket, NULL, 0);
         printf("%s has connected\n", addr);
       }
     }
 
-    for (int i = 1; i < active_fd_count; i++) {
-      if (poll_fds[i].revents & POLLIN) {
-        int bytes_read = recv(poll_fds[i].fd, &buffer, sizeof(buffer), 0);
+    // Sensor datagrams are routed as they are read, in batches
+    if (poll_fds[SN_SLOT].revents & POLLIN) {
+      int handled = mqttsn_poll(&sn_gateway);
+      if (handled == -1) {
+        perror("MQTT-SN: ");
+      } else if (handled == SN_POLL_BATCHES * SN_BATCH) {
+        poll_timeout = 0; // more may be waiting, let clients run first
+      }
+    }
+
+    for (int i = LISTENERS; i < active_fd_count; i++) {
+      struct tls_conn *tls = clients[poll_fds[i].fd].tls;
+      struct shm_conn *shm = clients[poll_fds[i].fd].shm;
+      if (poll_fds[i].revents & POLLERR) {
+        outq_reap_zerocopy(&clients[poll_fds[i].fd].out, poll_fds[i].fd);
+      }
+      if (tls != NULL && tls->state == TLS_HANDSHAKE) {
+        if (!(poll_fds[i].revents & (POLLIN | POLLOUT | POLLHUP))) {
+          continue;
+        }
+        int status = tls_handshake(tls);
+        if (status == 0) {
+          stats_add(stats, STAT_TLS_HANDSHAKES, 1);
+          stats_add(stats, STAT_TLS_RESUMED, tls_resumed(tls));
+          flightrec_event(FR_CONNECT, poll_fds[i].fd, 0, 0);
+          printf("Socket %d finished a %s TLS handshake%s\n", poll_fds[i].fd,
+                 tls_resumed(tls) ? "resumed" : "full",
+                 tls->ktls_send ? ", kernel TLS" : "");
+        } else if (status == -1) {
+          fprintf(stderr, "Socket %d failed its TLS handshake\n",
+                  poll_fds[i].fd);
+          flightrec_event(FR_DISCONNECT, poll_fds[i].fd, FR_REASON_PROTOCOL,
+                          0);
+          close_client(&poll_fds, i, &active_fd_count, clients);
+          stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+          i--;
+        }
+        continue;
+      }
+      if (shm != NULL && (poll_fds[i].revents & (POLLIN | POLLHUP))) {
+        shm_doorbell(shm);
+      }
+      if ((poll_fds[i].revents & (POLLIN | POLLHUP)) ||
+          (tls != NULL && tls_read_pending(tls)) ||
+          (shm != NULL && shm_readable(shm))) {
+        int bytes_read;
+        if (shm != NULL) {
+          bytes_read = shm_read(shm, buffer, sizeof(buffer) - 1);
+        } else if (tls != NULL) {
+          bytes_read = tls_read(tls, buffer, sizeof(buffer) - 1);
+        } else {
+          bytes_read = recv(poll_fds[i].fd, &buffer, sizeof(buffer) - 1, 0);
+        }
+        uint64_t ingress_ns = stats_now_ns();
+        if (bytes_read == -1 && errno == EAGAIN) {
+          continue; // an incomplete TLS record or a spurious doorbell
+        }
         if (bytes_read <= 0) {
           if (bytes_read == 0) {
             printf("Socket exited: %d\n", poll_fds[i].fd);
@@ -163,22 +840,208 @@ int main() {
             perror("recv: ");
           }
 
-          close(poll_fds[i].fd);
-          remove_from_pollfds(&poll_fds, i, &active_fd_count);
+          flightrec_event(FR_DISCONNECT, poll_fds[i].fd,
+                          bytes_read == 0 ? FR_REASON_CLOSED
+                                          : FR_REASON_SOCKET_ERROR,
+                          0);
+          close_client(&poll_fds, i, &active_fd_count, clients);
+          stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+          i--; // the last descriptor was swapped into this slot
         } else {
+          capture_record(capture, CAP_DATA, poll_fds[i].fd, buffer,
+                         bytes_read);
           buffer[bytes_read] = '\0';
           printf("Socket %d said %s\n", poll_fds[i].fd, buffer);
-          for (int output = 1; output < active_fd_count; output++) {
+          stats_add(stats, STAT_MSGS_IN, 1);
+          stats_add(stats, STAT_BYTES_IN, bytes_read);
+
+          // Copy the message once, every peer queues a reference to it
+          struct mqtt_message *msg = mqtt_message_new(
+              (unsigned char *)buffer, bytes_read);
+          if (msg == NULL) {
+            perror("message: ");
+            continue;
+          }
+          // Chat lines need no decoding, the stage covers building the message
+          msg->ingress_ns = ingress_ns;
+          if (queue_ttl_ns != 0) {
+            msg->expires_ns = ingress_ns + queue_ttl_ns;
+          }
+          uint64_t decoded_ns = stats_now_ns();
+          stats_latency(stats, LAT_DECODE, ingress_ns, decoded_ns);
+          int routed = 0;
+          for (int output = LISTENERS; output < active_fd_count; output++) {
             if (output == i) {
               continue;
             }
-            if (send(poll_fds[output].fd, buffer, bytes_read, 0) == -1) {
-              perror("send: ");
+            int status = queue_for_peer(&clients[poll_fds[output].fd], msg,
+                                        &clients[poll_fds[i].fd]);
+            if (status == 0) {
+              stats_add(stats, STAT_MSGS_DROPPED, 1);
+            } else if (status == -1) {
+              stats_add(stats, STAT_MSGS_DROPPED, 1);
+              fprintf(stderr, "Dropped message for socket %d\n",
+                      poll_fds[output].fd);
+            } else {
+              stats_add(stats, STAT_MSGS_OUT, 1);
+              routed++;
             }
           }
+          int framed = sn_enabled || cluster_enabled
+                           ? route_frames(&clients[poll_fds[i].fd], msg)
+                           : 0;
+          if (framed == -1) {
+            perror("framing: ");
+          }
+          flightrec_event(FR_PUBLISH_ROUTED, poll_fds[i].fd, 0, routed);
+          // Queues only read the stamp when flushed, after this pass
+          msg->routed_ns = stats_now_ns();
+          stats_latency(stats, LAT_ROUTE, decoded_ns, msg->routed_ns);
+          mqtt_message_release(msg);
+          if (framed == -1) {
+            // The rest of its stream can't be framed any more
+            flightrec_event(FR_DISCONNECT, poll_fds[i].fd, FR_REASON_PROTOCOL,
+                            0);
+            close_client(&poll_fds, i, &active_fd_count, clients);
+            stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+            i--;
+          }
         }
       }
     }
+
+    /*
+     * Everything queued for a peer in this iteration leaves in one writev;
+     * peers whose socket is full wait for POLLOUT.
+     */
+    uint64_t now_ns = stats_now_ns();
+    if (sn_enabled) {
+      mqttsn_flush(&sn_gateway);
+      // Keep alives are in seconds, a scan per second is plenty
+      if (now_ns - sn_expired_ns >= 1000000000ULL) {
+        size_t expired = mqttsn_expire(&sn_gateway, now_ns);
+        if (expired > 0) {
+          flightrec_event(FR_TIMER, 0, FR_TIMER_MQTTSN, expired);
+        }
+        sn_expired_ns = now_ns;
+      }
+    }
+    // Only the buckets due since the last pass, never every queue
+    size_t fired =
+        queue_ttl_ns != 0 ? expiry_advance(&queue_expiry, now_ns) : 0;
+    // Expired retained values are never replayed, but hold memory until now
+    fired += retain_expire(&sys_store, now_ns);
+    if (fired > 0) {
+      flightrec_event(FR_TIMER, 0, FR_TIMER_EXPIRY, fired);
+    }
+    // A consumer over its watermark is flagged at the end of its grace
+    // period, even if nothing else wakes the loop by then
+    uint64_t slow_deadline = 0;
+    for (int i = LISTENERS; i < active_fd_count; i++) {
+      struct client *c = &clients[poll_fds[i].fd];
+      struct outq *q = &c->out;
+      if (c->mem.disconnect) {
+        printf("Socket %d over its memory limit, disconnecting\n",
+               poll_fds[i].fd);
+        flightrec_event(FR_DISCONNECT, poll_fds[i].fd, FR_REASON_MEMORY, 0);
+        close_client(&poll_fds, i, &active_fd_count, clients);
+        stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+        i--;
+        continue;
+      }
+      int was_blocked = poll_fds[i].events & POLLOUT;
+      size_t queued = q->bytes;
+      int status;
+      if (c->shm != NULL) {
+        status = shm_flush(c->shm, q);
+      } else if (c->tls != NULL) {
+        status = tls_flush(c->tls, q);
+      } else {
+        status = outq_empty(q) ? 0 : outq_flush(q, poll_fds[i].fd);
+      }
+      if (status == -1) {
+        perror("send: ");
+        flightrec_event(FR_DISCONNECT, poll_fds[i].fd, FR_REASON_SOCKET_ERROR,
+                        0);
+        close_client(&poll_fds, i, &active_fd_count, clients);
+        stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+        i--;
+        continue;
+      }
+      if (status && !was_blocked) {
+        flightrec_event(FR_BACKPRESSURE_ON, poll_fds[i].fd, 0, 0);
+      } else if (!status && was_blocked) {
+        flightrec_event(FR_BACKPRESSURE_OFF, poll_fds[i].fd, 0, 0);
+      }
+      // A local client's doorbell wakes us when its ring has room again
+      poll_fds[i].events =
+          status && c->shm == NULL ? POLLIN | POLLOUT : POLLIN;
+      if ((c->tls != NULL && tls_read_pending(c->tls)) ||
+          (c->shm != NULL && !shm_park(c->shm))) {
+        poll_timeout = 0;
+      }
+
+      // A flush only ever removes bytes from the queue
+      uint64_t blocked_ns = c->health.blocked_ns;
+      enum slow_verdict verdict = slow_update(
+          &c->health, &slow_policy, q->bytes, queued - q->bytes, status, now_ns);
+      stats_add(stats, STAT_BACKPRESSURE_US,
+                c->health.blocked_ns / 1000 - blocked_ns / 1000);
+      if (verdict == SLOW_ENGAGE) {
+        fprintf(stderr, "Socket %d is a slow consumer: %zu bytes queued, "
+                        "draining %" PRIu64 " bytes/s\n",
+                poll_fds[i].fd, q->bytes, c->health.drain_rate);
+        stats_add(stats, STAT_SLOW_CONSUMERS, 1);
+        stats_add(stats, STAT_SLOW_ACTIONS, 1);
+        report_slow(poll_fds[i].fd, &c->health);
+      } else if (verdict == SLOW_RELEASE) {
+        printf("Socket %d caught up\n", poll_fds[i].fd);
+        stats_add(stats, STAT_SLOW_CONSUMERS, -1);
+        report_slow(poll_fds[i].fd, &c->health);
+      }
+      if (verdict == SLOW_ENGAGE && slow_policy.action == SLOW_DISCONNECT) {
+        flightrec_event(FR_DISCONNECT, poll_fds[i].fd,
+                        FR_REASON_SLOW_CONSUMER, 0);
+        close_client(&poll_fds, i, &active_fd_count, clients);
+        stats_add(stats, STAT_CLIENTS_CONNECTED, -1);
+        stats_add(stats, STAT_SLOW_DISCONNECTS, 1);
+        i--;
+        continue;
+      }
+      uint64_t deadline_ns = slow_deadline_ns(&c->health, &slow_policy);
+      if (deadline_ns != 0 &&
+          (slow_deadline == 0 || deadline_ns < slow_deadline)) {
+        slow_deadline = deadline_ns;
+      }
+    }
+    if (cluster_enabled) {
+      cluster_flush(&cluster);
+      size_t redialed = cluster_tick(&cluster, now_ns);
+      if (redialed > 0) {
+        flightrec_event(FR_TIMER, 0, FR_TIMER_CLUSTER, redialed);
+      }
+      // Wake up to redial peers that are down even when idle
+      if (poll_timeout == -1) {
+        poll_timeout = CLUSTER_RETRY_NS / 1000000;
+      }
+    }
+    // Queues of idle peers still shed their expired messages
+    uint64_t next_expiry_ns =
+        queue_ttl_ns != 0 ? expiry_next_ns(&queue_expiry) : 0;
+    uint64_t deadlines[] = {next_expiry_ns, slow_deadline};
+    for (size_t d = 0; d < sizeof(deadlines) / sizeof(deadlines[0]); d++) {
+      if (deadlines[d] == 0) {
+        continue;
+      }
+      int wait_ms = deadlines[d] > now_ns
+                        ? (int)((deadlines[d] - now_ns) / 1000000) + 1
+                        : 0;
+      if (poll_timeout == -1 || wait_ms < poll_timeout) {
+        poll_timeout = wait_ms;
+      }
+    }
+    // A crash loses at most the current iteration of the capture
+    capture_flush(capture);
   }
 
   return 0;
@@ -0,0 +1,497 @@
+#include "acl.h"
+#include <stdlib.h>
+#include <string.h>
+
+void acl_init(struct acl *acl, int default_allow) {
+  memset(acl, 0, sizeof(*acl));
+  acl->default_allow = default_allow;
+}
+
+static void node_free(struct acl_node *node) {
+  struct acl_node *slots[] = {node->plus, node->hash, node->user,
+                              node->client};
+  for (size_t i = 0; i < node->nchildren; i++) {
+    node_free(node->children[i]);
+    free(node->children[i]);
+  }
+  for (size_t i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+    if (slots[i] != NULL) {
+      node_free(slots[i]);
+      free(slots[i]);
+    }
+  }
+  free(node->children);
+  free(node->rules);
+  free(node->level);
+}
+
+static void names_free(char **names, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+}
+
+void acl_destroy(struct acl *acl) {
+  node_free(&acl->root);
+  names_free(acl->users, acl->nusers);
+  names_free(acl->groups, acl->ngroups);
+  free(acl->memberships);
+  memset(acl, 0, sizeof(*acl));
+}
+
+static char *copy_name(const char *name, size_t len) {
+  char *copy = malloc(len + 1);
+  if (copy != NULL) {
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+  }
+  return copy;
+}
+
+static int name_find(char *const *names, size_t count, const char *name,
+                     size_t len) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(names[i]) == len && memcmp(names[i], name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Id of name, numbering it if it is new; -1 when out of memory
+static int name_id(char ***names, size_t *count, const char *name) {
+  int id = name_find(*names, *count, name, strlen(name));
+  if (id != -1) {
+    return id;
+  }
+  char **grown = realloc(*names, sizeof(*grown) * (*count + 1));
+  if (grown == NULL) {
+    return -1;
+  }
+  *names = grown;
+  if ((grown[*count] = copy_name(name, strlen(name))) == NULL) {
+    return -1;
+  }
+  return (*count)++;
+}
+
+static int user_id(struct acl *acl, const char *user) {
+  size_t before = acl->nusers;
+  int id = name_id(&acl->users, &acl->nusers, user);
+  if (id == -1 || acl->nusers == before) {
+    return id;
+  }
+  uint64_t *grown = realloc(acl->memberships, sizeof(*grown) * acl->nusers);
+  if (grown == NULL) {
+    // Keep users and memberships the same length
+    free(acl->users[--acl->nusers]);
+    return -1;
+  }
+  acl->memberships = grown;
+  grown[id] = 0;
+  return id;
+}
+
+static int group_id(struct acl *acl, const char *group) {
+  if (acl->ngroups == ACL_MAX_GROUPS &&
+      name_find(acl->groups, acl->ngroups, group, strlen(group)) == -1) {
+    return -1;
+  }
+  return name_id(&acl->groups, &acl->ngroups, group);
+}
+
+int acl_add_member(struct acl *acl, const char *group, const char *user) {
+  int g = group_id(acl, group);
+  int u = g == -1 ? -1 : user_id(acl, user);
+  if (u == -1) {
+    return -1;
+  }
+  acl->memberships[u] |= 1ULL << g;
+  acl->generation++;
+  return 0;
+}
+
+/*
+ * Index of the first child whose hash is >= hash.
+ */
+static size_t child_lower_bound(const struct acl_node *node, uint32_t hash) {
+  size_t lo = 0, hi = node->nchildren;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (node->children[mid]->level_hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static struct acl_node *child_find(const struct acl_node *node,
+                                   const char *level, size_t len,
+                                   uint32_t hash) {
+  for (size_t i = child_lower_bound(node, hash);
+       i < node->nchildren && node->children[i]->level_hash == hash; i++) {
+    struct acl_node *c = node->children[i];
+    if (c->level_len == len && memcmp(c->level, level, len) == 0) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+static struct acl_node *node_new(const char *level, size_t len,
+                                 uint32_t hash) {
+  struct acl_node *node = calloc(1, sizeof(*node));
+  if (node == NULL) {
+    return NULL;
+  }
+  if ((node->level = copy_name(level, len)) == NULL) {
+    free(node);
+    return NULL;
+  }
+  node->level_len = len;
+  node->level_hash = hash;
+  return node;
+}
+
+static int is_level(const char *level, size_t len, const char *what) {
+  return len == strlen(what) && memcmp(level, what, len) == 0;
+}
+
+static struct acl_node *child_get_or_add(struct acl_node *node,
+                                         const char *level, size_t len) {
+  struct acl_node **slot = NULL;
+  if (is_level(level, len, "+")) {
+    slot = &node->plus;
+  } else if (is_level(level, len, "#")) {
+    slot = &node->hash;
+  } else if (is_level(level, len, "%u")) {
+    slot = &node->user;
+  } else if (is_level(level, len, "%c")) {
+    slot = &node->client;
+  }
+  if (slot != NULL) {
+    if (*slot == NULL) {
+      *slot = node_new(level, len, 0);
+    }
+    return *slot;
+  }
+
+  uint32_t hash = topic_hash(level, len);
+  struct acl_node *c = child_find(node, level, len, hash);
+  if (c != NULL) {
+    return c;
+  }
+  if (node->nchildren == node->children_cap) {
+    size_t cap = node->children_cap ? node->children_cap * 2 : 4;
+    struct acl_node **grown = realloc(node->children, sizeof(*grown) * cap);
+    if (grown == NULL) {
+      return NULL;
+    }
+    node->children = grown;
+    node->children_cap = cap;
+  }
+  if ((c = node_new(level, len, hash)) == NULL) {
+    return NULL;
+  }
+  size_t at = child_lower_bound(node, hash);
+  memmove(&node->children[at + 1], &node->children[at],
+          sizeof(*node->children) * (node->nchildren - at));
+  node->children[at] = c;
+  node->nchildren++;
+  return c;
+}
+
+/*
+ * '+' and '#' must fill a whole level and '#' may only come last, the same
+ * as for subscription filters.
+ */
+static int pattern_valid(const char *pattern) {
+  size_t len = strlen(pattern);
+  if (len == 0) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (pattern[i] != '+' && pattern[i] != '#') {
+      continue;
+    }
+    if ((i > 0 && pattern[i - 1] != '/') ||
+        (i + 1 < len && pattern[i + 1] != '/') ||
+        (pattern[i] == '#' && i + 1 != len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Compile one rule into the trie. name is the user or group the rule
+ * applies to and is ignored for ACL_ANYONE. The pattern is a topic filter
+ * whose levels may also be %u or %c.
+ */
+int acl_add_rule(struct acl *acl, enum acl_principal principal,
+                 const char *name, unsigned access, int allow,
+                 const char *pattern) {
+  if (!pattern_valid(pattern) || (access & (ACL_READ | ACL_WRITE)) == 0) {
+    return -1;
+  }
+  int id = 0;
+  if (principal == ACL_USER) {
+    id = user_id(acl, name);
+  } else if (principal == ACL_GROUP) {
+    id = group_id(acl, name);
+  }
+  if (id == -1) {
+    return -1;
+  }
+
+  struct acl_node *node = &acl->root;
+  const char *level = pattern;
+  for (;;) {
+    const char *end = strchr(level, '/');
+    size_t len = end != NULL ? (size_t)(end - level) : strlen(level);
+    if ((node = child_get_or_add(node, level, len)) == NULL) {
+      return -1;
+    }
+    if (end == NULL) {
+      break;
+    }
+    level = end + 1;
+  }
+
+  struct acl_rule *grown =
+      realloc(node->rules, sizeof(*grown) * (node->nrules + 1));
+  if (grown == NULL) {
+    return -1;
+  }
+  node->rules = grown;
+  node->rules[node->nrules++] = (struct acl_rule){
+      .principal = principal, .access = access, .allow = allow != 0, .id = id};
+  acl->generation++;
+  return 0;
+}
+
+static int parse_rule(struct acl *acl, char *line) {
+  char *save;
+  const char *verdict = strtok_r(line, " \t", &save);
+  const char *access = strtok_r(NULL, " \t", &save);
+  const char *who = strtok_r(NULL, " \t", &save);
+  const char *pattern = strtok_r(NULL, " \t", &save);
+  if (pattern == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+    return -1;
+  }
+
+  int allow;
+  if (strcmp(verdict, "allow") == 0) {
+    allow = 1;
+  } else if (strcmp(verdict, "deny") == 0) {
+    allow = 0;
+  } else {
+    return -1;
+  }
+
+  unsigned bits;
+  if (strcmp(access, "read") == 0) {
+    bits = ACL_READ;
+  } else if (strcmp(access, "write") == 0) {
+    bits = ACL_WRITE;
+  } else if (strcmp(access, "readwrite") == 0) {
+    bits = ACL_READ | ACL_WRITE;
+  } else {
+    return -1;
+  }
+
+  if (strcmp(who, "anyone") == 0) {
+    return acl_add_rule(acl, ACL_ANYONE, NULL, bits, allow, pattern);
+  } else if (strncmp(who, "user:", 5) == 0 && who[5] != '\0') {
+    return acl_add_rule(acl, ACL_USER, who + 5, bits, allow, pattern);
+  } else if (strncmp(who, "group:", 6) == 0 && who[6] != '\0') {
+    return acl_add_rule(acl, ACL_GROUP, who + 6, bits, allow, pattern);
+  }
+  return -1;
+}
+
+/*
+ * Load rules from a text file, one per line:
+ *
+ *   group <group> <user>...
+ *   allow|deny read|write|readwrite anyone|user:<name>|group:<name> <pattern>
+ *
+ * Blank lines and lines starting with '#' are ignored. Returns the number of
+ * the first bad line, 0 on success and -1 if reading fails.
+ */
+int acl_load(struct acl *acl, FILE *in) {
+  char line[1024];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    lineno++;
+    line[strcspn(line, "\r\n")] = '\0';
+    char *start = line + strspn(line, " \t");
+    if (*start == '\0' || *start == '#') {
+      continue;
+    }
+
+    if (strncmp(start, "group", 5) == 0 &&
+        (start[5] == ' ' || start[5] == '\t')) {
+      char *save;
+      strtok_r(start, " \t", &save);
+      const char *group = strtok_r(NULL, " \t", &save);
+      const char *user = strtok_r(NULL, " \t", &save);
+      if (user == NULL) {
+        return lineno;
+      }
+      for (; user != NULL; user = strtok_r(NULL, " \t", &save)) {
+        if (acl_add_member(acl, group, user) == -1) {
+          return lineno;
+        }
+      }
+    } else if (parse_rule(acl, start) == -1) {
+      return lineno;
+    }
+  }
+  return ferror(in) ? -1 : 0;
+}
+
+int acl_session_init(struct acl_session *s, const struct acl *acl,
+                     const char *username, size_t username_len,
+                     const char *client_id, size_t client_id_len) {
+  memset(s, 0, sizeof(*s));
+  s->acl = acl;
+  s->user = -1;
+  // Resolved on the first check
+  s->generation = acl->generation - 1;
+  if (username != NULL &&
+      (s->username = copy_name(username, username_len)) == NULL) {
+    return -1;
+  }
+  s->username_len = username_len;
+  if ((s->client_id = copy_name(client_id, client_id_len)) == NULL) {
+    free(s->username);
+    return -1;
+  }
+  s->client_id_len = client_id_len;
+  return 0;
+}
+
+static void cache_clear(struct acl_session *s) {
+  for (size_t i = 0; i < ACL_CACHE_SIZE; i++) {
+    topic_release(s->cache[i].topic);
+    s->cache[i].topic = NULL;
+  }
+}
+
+void acl_session_destroy(struct acl_session *s) {
+  cache_clear(s);
+  free(s->username);
+  free(s->client_id);
+  memset(s, 0, sizeof(*s));
+}
+
+// Rules changed since the last check: look the session up again
+static void session_resolve(struct acl_session *s) {
+  const struct acl *acl = s->acl;
+  s->user = s->username == NULL ? -1
+                                : name_find(acl->users, acl->nusers,
+                                            s->username, s->username_len);
+  s->groups = s->user == -1 ? 0 : acl->memberships[s->user];
+  s->generation = acl->generation;
+  cache_clear(s);
+}
+
+struct acl_walk {
+  const struct acl_session *s;
+  const struct topic *topic;
+  unsigned access;
+  int best; // rank of the winning rule so far, -1 for none
+  int allow;
+};
+
+static void apply(struct acl_walk *w, const struct acl_node *node) {
+  for (size_t i = 0; i < node->nrules; i++) {
+    const struct acl_rule *r = &node->rules[i];
+    if (!(r->access & w->access) ||
+        (r->principal == ACL_USER && r->id != w->s->user) ||
+        (r->principal == ACL_GROUP && !(w->s->groups >> r->id & 1))) {
+      continue;
+    }
+    // Specific principals first, deny before allow within one principal
+    int rank = r->principal * 2 + !r->allow;
+    if (rank > w->best) {
+      w->best = rank;
+      w->allow = r->allow;
+    }
+  }
+}
+
+static void walk(struct acl_walk *w, const struct acl_node *node,
+                 unsigned depth) {
+  const struct topic *t = w->topic;
+  // Wildcards at the first level never match '$' topics
+  int wild = depth > 0 || t->len == 0 || t->name[0] != '$';
+
+  // '#' matches this level and everything below, including nothing
+  if (node->hash != NULL && wild) {
+    apply(w, node->hash);
+  }
+  if (depth == t->nlevels) {
+    apply(w, node);
+    return;
+  }
+
+  size_t len;
+  const char *level = topic_level(t, depth, &len);
+  const struct acl_node *c =
+      child_find(node, level, len, topic_hash(level, len));
+  if (c != NULL) {
+    walk(w, c, depth + 1);
+  }
+  // A subscription's '#' is only covered by a '#' pattern
+  if (node->plus != NULL && wild && !is_level(level, len, "#")) {
+    walk(w, node->plus, depth + 1);
+  }
+  if (node->user != NULL && w->s->username != NULL &&
+      len == w->s->username_len && memcmp(level, w->s->username, len) == 0) {
+    walk(w, node->user, depth + 1);
+  }
+  if (node->client != NULL && len == w->s->client_id_len &&
+      memcmp(level, w->s->client_id, len) == 0) {
+    walk(w, node->client, depth + 1);
+  }
+}
+
+/*
+ * Whether the session may access topic, a topic name for ACL_WRITE and a
+ * topic name or subscription filter for ACL_READ. A filter's wildcards are
+ * taken literally, so "a/+" is only allowed by a pattern that covers every
+ * topic it could match.
+ *
+ * Verdicts are cached per interned topic; a hit costs one pointer compare.
+ */
+int acl_check(struct acl_session *s, struct topic *topic,
+              enum acl_access access) {
+  if (s->generation != s->acl->generation) {
+    session_resolve(s);
+  }
+  struct acl_cache_entry *e = &s->cache[topic->hash & (ACL_CACHE_SIZE - 1)];
+  if (e->topic == topic && (e->known & access)) {
+    return (e->allowed & access) != 0;
+  }
+
+  struct acl_walk w = {s, topic, access, -1, 0};
+  walk(&w, &s->acl->root, 0);
+  int allow = w.best == -1 ? s->acl->default_allow : w.allow;
+
+  if (e->topic != topic) {
+    topic_release(e->topic);
+    e->topic = topic_ref(topic);
+    e->known = 0;
+    e->allowed = 0;
+  }
+  e->known |= access;
+  if (allow) {
+    e->allowed |= access;
+  }
+  return allow;
+}
@@ -0,0 +1,113 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include "topic.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define ACL_MAX_GROUPS 64
+// Direct mapped verdict cache per session, a power of two
+#define ACL_CACHE_SIZE 64
+
+enum acl_access {
+  ACL_READ = 0x01,  // SUBSCRIBE, and receiving a PUBLISH
+  ACL_WRITE = 0x02, // PUBLISH
+};
+
+// Who a rule applies to, from least to most specific
+enum acl_principal {
+  ACL_ANYONE,
+  ACL_GROUP,
+  ACL_USER,
+};
+
+struct acl_rule {
+  uint8_t principal; // ACL_ANYONE, ACL_GROUP or ACL_USER
+  uint8_t access;    // ACL_READ | ACL_WRITE
+  uint8_t allow;
+  uint16_t id; // user or group id
+};
+
+/*
+ * One level of the compiled pattern trie, laid out like the subscription
+ * trie: literal children sorted by hash, plus dedicated slots for '+', '#'
+ * and the %u / %c templates, which match a level equal to the session's
+ * username or client id.
+ */
+struct acl_node {
+  char *level;
+  size_t level_len;
+  uint32_t level_hash;
+
+  struct acl_node **children; // sorted by level_hash
+  size_t nchildren;
+  size_t children_cap;
+  struct acl_node *plus;
+  struct acl_node *hash;
+  struct acl_node *user;
+  struct acl_node *client;
+
+  struct acl_rule *rules; // patterns ending here
+  size_t nrules;
+};
+
+/*
+ * Compiled access control list.
+ *
+ * Every rule pattern is inserted into one trie, so a check walks the topic
+ * once, level by level, and visits every matching pattern on the way
+ * instead of testing the rules one after another. Of the rules that match
+ * and apply to the session, the most specific principal wins (user over
+ * group over anyone) and deny wins within one principal. A topic no rule
+ * matches gets default_allow.
+ *
+ * Users and groups are numbered at load time; a session resolves its own
+ * user id and group mask once, so applying a rule is an integer compare.
+ */
+struct acl {
+  struct acl_node root;
+  char **users; // index is the user id
+  size_t nusers;
+  char **groups; // index is the group id
+  size_t ngroups;
+  uint64_t *memberships; // group mask per user id
+  unsigned generation;   // bumped on every change, invalidates caches
+  int default_allow;
+};
+
+struct acl_cache_entry {
+  struct topic *topic; // referenced while cached
+  uint8_t known;       // ACL_* bits with a cached verdict
+  uint8_t allowed;     // ACL_* bits allowed
+};
+
+// Authorization state of one connection
+struct acl_session {
+  const struct acl *acl;
+  char *username; // NULL when the client sent none
+  size_t username_len;
+  char *client_id;
+  size_t client_id_len;
+  int user;        // -1 when not named in the ACL
+  uint64_t groups; // mask of group ids
+  unsigned generation;
+  struct acl_cache_entry cache[ACL_CACHE_SIZE];
+};
+
+// Function prototypes
+void acl_init(struct acl *acl, int default_allow);
+void acl_destroy(struct acl *acl);
+int acl_add_member(struct acl *acl, const char *group, const char *user);
+int acl_add_rule(struct acl *acl, enum acl_principal principal,
+                 const char *name, unsigned access, int allow,
+                 const char *pattern);
+int acl_load(struct acl *acl, FILE *in);
+int acl_session_init(struct acl_session *s, const struct acl *acl,
+                     const char *username, size_t username_len,
+                     const char *client_id, size_t client_id_len);
+void acl_session_destroy(struct acl_session *s);
+int acl_check(struct acl_session *s, struct topic *topic,
+              enum acl_access access);
+
+#endif // ACL_H
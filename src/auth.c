@@ -0,0 +1,541 @@
+#include "auth.h"
+#include <crypt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Overwrite secrets in a way the compiler can't drop as a dead store
+static void wipe(void *p, size_t len) {
+  volatile unsigned char *b = p;
+  while (len--) {
+    *b++ = 0;
+  }
+}
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND                                                               \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = ROTL(v1, 13);                                                         \
+    v1 ^= v0;                                                                  \
+    v0 = ROTL(v0, 32);                                                         \
+    v2 += v3;                                                                  \
+    v3 = ROTL(v3, 16);                                                         \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = ROTL(v3, 21);                                                         \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = ROTL(v1, 17);                                                         \
+    v1 ^= v2;                                                                  \
+    v2 = ROTL(v2, 32);                                                         \
+  } while (0)
+
+static uint64_t load_le64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) {
+    v = v << 8 | p[i];
+  }
+  return v;
+}
+
+// SipHash-2-4 of in under a 128 bit key
+static uint64_t siphash(const uint64_t key[2], const unsigned char *in,
+                        size_t len) {
+  uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+  uint64_t last = (uint64_t)len << 56;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    uint64_t m = load_le64(in + i);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  for (size_t j = 0; i + j < len; j++) {
+    last |= (uint64_t)in[i + j] << (8 * j);
+  }
+  v3 ^= last;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= last;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static int cache_init(struct auth_cache *c, size_t capacity, unsigned ttl_ms) {
+  memset(c, 0, sizeof(*c));
+  size_t buckets = 16;
+  while (buckets < capacity) {
+    buckets *= 2;
+  }
+  c->entries = calloc(capacity ? capacity : 1, sizeof(*c->entries));
+  c->buckets = malloc(sizeof(*c->buckets) * buckets);
+  if (c->entries == NULL || c->buckets == NULL ||
+      getrandom(c->key, sizeof(c->key), 0) != sizeof(c->key)) {
+    free(c->entries);
+    free(c->buckets);
+    return -1;
+  }
+  for (size_t i = 0; i < buckets; i++) {
+    c->buckets[i] = -1;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    c->entries[i].chain = i + 1 < capacity ? (int32_t)i + 1 : -1;
+  }
+  c->free_list = capacity ? 0 : -1;
+  c->capacity = capacity;
+  c->mask = buckets - 1;
+  c->lru_head = -1;
+  c->lru_tail = -1;
+  c->ttl_ns = (uint64_t)ttl_ms * 1000000ULL;
+  pthread_mutex_init(&c->lock, NULL);
+  return 0;
+}
+
+static void cache_destroy(struct auth_cache *c) {
+  pthread_mutex_destroy(&c->lock);
+  free(c->entries);
+  free(c->buckets);
+  memset(c, 0, sizeof(*c));
+}
+
+static void lru_unlink(struct auth_cache *c, int32_t i) {
+  struct auth_cache_entry *e = &c->entries[i];
+  if (e->prev != -1) {
+    c->entries[e->prev].next = e->next;
+  } else {
+    c->lru_head = e->next;
+  }
+  if (e->next != -1) {
+    c->entries[e->next].prev = e->prev;
+  } else {
+    c->lru_tail = e->prev;
+  }
+}
+
+static void lru_push_front(struct auth_cache *c, int32_t i) {
+  struct auth_cache_entry *e = &c->entries[i];
+  e->prev = -1;
+  e->next = c->lru_head;
+  if (c->lru_head != -1) {
+    c->entries[c->lru_head].prev = i;
+  } else {
+    c->lru_tail = i;
+  }
+  c->lru_head = i;
+}
+
+static void cache_remove(struct auth_cache *c, int32_t i) {
+  int32_t *link = &c->buckets[c->entries[i].digest[0] & c->mask];
+  while (*link != i) {
+    link = &c->entries[*link].chain;
+  }
+  *link = c->entries[i].chain;
+  lru_unlink(c, i);
+  c->entries[i].chain = c->free_list;
+  c->free_list = i;
+  c->count--;
+}
+
+static int32_t cache_find(struct auth_cache *c, const uint64_t digest[2]) {
+  for (int32_t i = c->buckets[digest[0] & c->mask]; i != -1;
+       i = c->entries[i].chain) {
+    if (c->entries[i].digest[0] == digest[0] &&
+        c->entries[i].digest[1] == digest[1]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Whether the credentials were accepted within the last ttl
+static int cache_lookup(struct auth_cache *c, const uint64_t digest[2]) {
+  int hit = 0;
+  pthread_mutex_lock(&c->lock);
+  int32_t i = cache_find(c, digest);
+  if (i != -1 && c->entries[i].expires_ns <= now_ns()) {
+    cache_remove(c, i);
+  } else if (i != -1) {
+    lru_unlink(c, i);
+    lru_push_front(c, i);
+    hit = 1;
+  }
+  if (hit) {
+    c->hits++;
+  } else {
+    c->misses++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return hit;
+}
+
+static void cache_insert(struct auth_cache *c, const uint64_t digest[2]) {
+  if (c->capacity == 0) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  int32_t i = cache_find(c, digest);
+  if (i != -1) {
+    lru_unlink(c, i);
+  } else {
+    if (c->free_list == -1) {
+      cache_remove(c, c->lru_tail); // evict the least recently used
+    }
+    i = c->free_list;
+    c->free_list = c->entries[i].chain;
+    struct auth_cache_entry *e = &c->entries[i];
+    e->digest[0] = digest[0];
+    e->digest[1] = digest[1];
+    int32_t *bucket = &c->buckets[digest[0] & c->mask];
+    e->chain = *bucket;
+    *bucket = i;
+    c->count++;
+  }
+  c->entries[i].expires_ns = now_ns() + c->ttl_ns;
+  lru_push_front(c, i);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void request_free(struct auth_request *req) {
+  wipe(req->data, 2 + req->username_len + req->password_len);
+  free(req);
+}
+
+static void inbox_post(struct auth_inbox *inbox, struct auth_request *req) {
+  req->next = NULL;
+  pthread_mutex_lock(&inbox->lock);
+  int was_empty = inbox->head == NULL;
+  if (inbox->tail != NULL) {
+    inbox->tail->next = req;
+  } else {
+    inbox->head = req;
+  }
+  inbox->tail = req;
+  pthread_mutex_unlock(&inbox->lock);
+
+  uint64_t one = 1;
+  // Only the empty to non-empty transition needs a wakeup
+  if (was_empty && write(inbox->wake_fd, &one, sizeof(one)) == -1) {
+    return;
+  }
+}
+
+static void *auth_thread(void *arg) {
+  struct auth_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->head == NULL && !pool->stopping) {
+      pthread_cond_wait(&pool->ready, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    struct auth_request *req = pool->head;
+    pool->head = req->next;
+    if (pool->head == NULL) {
+      pool->tail = NULL;
+    }
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+
+    const char *username = (const char *)req->data + 2;
+    req->verdict =
+        pool->verify(username, req->username_len,
+                     username + req->username_len, req->password_len,
+                     pool->verify_arg);
+    if (req->verdict == AUTH_ALLOW) {
+      cache_insert(&pool->cache, req->digest);
+    }
+    inbox_post(req->reply, req);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/*
+ * Start nthreads checkers calling verify. Up to cache_capacity accepted
+ * credentials are remembered for ttl_ms; a capacity of 0 disables the cache.
+ */
+int auth_pool_init(struct auth_pool *pool, int nthreads, auth_verify_fn verify,
+                   void *verify_arg, size_t cache_capacity, unsigned ttl_ms) {
+  memset(pool, 0, sizeof(*pool));
+  pool->verify = verify;
+  pool->verify_arg = verify_arg;
+  if (cache_init(&pool->cache, cache_capacity, ttl_ms) == -1) {
+    return -1;
+  }
+  pool->threads = calloc(nthreads, sizeof(*pool->threads));
+  if (pool->threads == NULL) {
+    cache_destroy(&pool->cache);
+    return -1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->ready, NULL);
+  for (; pool->nthreads < nthreads; pool->nthreads++) {
+    if (pthread_create(&pool->threads[pool->nthreads], NULL, auth_thread,
+                       pool) != 0) {
+      auth_pool_destroy(pool);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Stop the checkers once their current request is done. Requests still
+ * queued are dropped without a verdict, so the pool must be destroyed
+ * before the inboxes it posts to.
+ */
+void auth_pool_destroy(struct auth_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  while (pool->head != NULL) {
+    struct auth_request *req = pool->head;
+    pool->head = req->next;
+    request_free(req);
+  }
+  pthread_cond_destroy(&pool->ready);
+  pthread_mutex_destroy(&pool->lock);
+  cache_destroy(&pool->cache);
+  free(pool->threads);
+  memset(pool, 0, sizeof(*pool));
+}
+
+/*
+ * Check CONNECT credentials for session. Credentials found in the cache are
+ * accepted on the spot and 1 is returned. Otherwise the check is queued and
+ * 0 is returned: the verdict arrives through reply, and the CONNACK has to
+ * wait for it. -1 means the pool is saturated or out of memory and the
+ * client should be refused as "server unavailable".
+ */
+int auth_pool_submit(struct auth_pool *pool, struct auth_inbox *reply,
+                     void *session, const char *username, size_t username_len,
+                     const char *password, size_t password_len) {
+  if (username_len > UINT16_MAX || password_len > UINT16_MAX) {
+    return -1;
+  }
+  size_t len = 2 + username_len + password_len;
+  struct auth_request *req = malloc(sizeof(*req) + len);
+  if (req == NULL) {
+    return -1;
+  }
+  req->reply = reply;
+  req->session = session;
+  req->username_len = username_len;
+  req->password_len = password_len;
+  // The length prefix keeps ("ab", "c") and ("a", "bc") apart
+  req->data[0] = username_len >> 8;
+  req->data[1] = username_len & 0xff;
+  memcpy(req->data + 2, username, username_len);
+  memcpy(req->data + 2 + username_len, password, password_len);
+  req->digest[0] = siphash(pool->cache.key, req->data, len);
+  req->digest[1] = siphash(pool->cache.key + 2, req->data, len);
+
+  if (pool->cache.capacity > 0 && cache_lookup(&pool->cache, req->digest)) {
+    request_free(req);
+    return 1;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queued == AUTH_MAX_QUEUED) {
+    pthread_mutex_unlock(&pool->lock);
+    request_free(req);
+    return -1;
+  }
+  req->next = NULL;
+  if (pool->tail != NULL) {
+    pool->tail->next = req;
+  } else {
+    pool->head = req;
+  }
+  pool->tail = req;
+  pool->queued++;
+  pthread_cond_signal(&pool->ready);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+int auth_inbox_init(struct auth_inbox *inbox) {
+  memset(inbox, 0, sizeof(*inbox));
+  inbox->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (inbox->wake_fd == -1) {
+    return -1;
+  }
+  pthread_mutex_init(&inbox->lock, NULL);
+  return 0;
+}
+
+void auth_inbox_destroy(struct auth_inbox *inbox) {
+  while (inbox->head != NULL) {
+    struct auth_request *req = inbox->head;
+    inbox->head = req->next;
+    request_free(req);
+  }
+  pthread_mutex_destroy(&inbox->lock);
+  close(inbox->wake_fd);
+  memset(inbox, 0, sizeof(*inbox));
+}
+
+static void clear_wakeup(int fd) {
+  uint64_t value;
+  if (read(fd, &value, sizeof(value)) == -1) {
+    return; // EAGAIN, nothing was signalled
+  }
+}
+
+/*
+ * Called when the wake fd polls readable: hand every verdict that arrived
+ * to done, which sends the held CONNACK. Returns the number handed over.
+ */
+size_t auth_inbox_drain(struct auth_inbox *inbox, auth_done_fn done,
+                        void *arg) {
+  clear_wakeup(inbox->wake_fd);
+  pthread_mutex_lock(&inbox->lock);
+  struct auth_request *req = inbox->head;
+  inbox->head = NULL;
+  inbox->tail = NULL;
+  pthread_mutex_unlock(&inbox->lock);
+
+  size_t n = 0;
+  while (req != NULL) {
+    struct auth_request *next = req->next;
+    done(req->session, req->verdict, arg);
+    request_free(req);
+    req = next;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Read "username:hash" lines, where hash is any crypt(3) string the system
+ * supports (bcrypt, yescrypt, sha512crypt, ...). Blank lines and lines
+ * starting with '#' are skipped.
+ */
+int auth_file_load(struct auth_file *file, const char *path) {
+  memset(file, 0, sizeof(*file));
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    return -1;
+  }
+
+  char line[1024];
+  int status = 0;
+  while (status == 0 && fgets(line, sizeof(line), in) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *sep = strchr(line, ':');
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+    if (sep == NULL || sep == line) {
+      status = -1;
+      break;
+    }
+    struct auth_file_entry *grown =
+        realloc(file->entries, sizeof(*grown) * (file->count + 1));
+    if (grown == NULL) {
+      status = -1;
+      break;
+    }
+    file->entries = grown;
+    *sep = '\0';
+    struct auth_file_entry *e = &file->entries[file->count];
+    e->username = strdup(line);
+    e->hash = strdup(sep + 1);
+    if (e->username == NULL || e->hash == NULL) {
+      free(e->username);
+      free(e->hash);
+      status = -1;
+      break;
+    }
+    file->count++;
+  }
+  fclose(in);
+  if (status == -1) {
+    auth_file_destroy(file);
+  }
+  return status;
+}
+
+void auth_file_destroy(struct auth_file *file) {
+  for (size_t i = 0; i < file->count; i++) {
+    free(file->entries[i].username);
+    free(file->entries[i].hash);
+  }
+  free(file->entries);
+  memset(file, 0, sizeof(*file));
+}
+
+/*
+ * auth_verify_fn for a struct auth_file. Hashing the password is the slow
+ * part and runs on the pool thread.
+ */
+enum auth_verdict auth_file_verify(const char *username, size_t username_len,
+                                   const char *password, size_t password_len,
+                                   void *arg) {
+  const struct auth_file *file = arg;
+  const struct auth_file_entry *e = NULL;
+  for (size_t i = 0; i < file->count; i++) {
+    if (strlen(file->entries[i].username) == username_len &&
+        memcmp(file->entries[i].username, username, username_len) == 0) {
+      e = &file->entries[i];
+      break;
+    }
+  }
+  // An embedded NUL would cut the phrase short and match its prefix
+  if (e == NULL || memchr(password, 0, password_len) != NULL) {
+    return AUTH_DENY;
+  }
+
+  // crypt wants a C string, and its state is too large for the stack
+  char *phrase = malloc(password_len + 1);
+  struct crypt_data *cd = calloc(1, sizeof(*cd));
+  enum auth_verdict verdict = AUTH_ERROR;
+  if (phrase != NULL && cd != NULL) {
+    memcpy(phrase, password, password_len);
+    phrase[password_len] = '\0';
+    const char *hashed = crypt_r(phrase, e->hash, cd);
+    size_t len = strlen(e->hash);
+    if (hashed != NULL && hashed[0] != '*') {
+      // Compare without an early exit
+      unsigned char diff = strlen(hashed) != len;
+      for (size_t i = 0; i < len && hashed[i] != '\0'; i++) {
+        diff |= hashed[i] ^ e->hash[i];
+      }
+      verdict = diff == 0 ? AUTH_ALLOW : AUTH_DENY;
+    }
+    wipe(phrase, password_len);
+    wipe(cd, sizeof(*cd));
+  }
+  free(phrase);
+  free(cd);
+  return verdict;
+}
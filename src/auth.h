@@ -0,0 +1,139 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AUTH_MAX_QUEUED 4096
+
+enum auth_verdict {
+  AUTH_DENY,
+  AUTH_ALLOW,
+  AUTH_ERROR, // backend unavailable, CONNACK with "server unavailable"
+};
+
+// Slow path credential check, run on a pool thread
+typedef enum auth_verdict (*auth_verify_fn)(const char *username,
+                                            size_t username_len,
+                                            const char *password,
+                                            size_t password_len, void *arg);
+
+/*
+ * A CONNECT waiting for its verdict. data holds the username and password
+ * behind a two byte username length, and is wiped before the request is
+ * freed.
+ */
+struct auth_request {
+  struct auth_request *next;
+  struct auth_inbox *reply;
+  void *session; // caller's handle, given back with the verdict
+  enum auth_verdict verdict;
+  uint64_t digest[2]; // cache key
+  uint16_t username_len;
+  uint16_t password_len;
+  unsigned char data[];
+};
+
+/*
+ * Where verdicts for one event loop land. The wake fd goes into that loop's
+ * poll set and becomes readable when the inbox goes non-empty.
+ */
+struct auth_inbox {
+  pthread_mutex_t lock;
+  struct auth_request *head;
+  struct auth_request *tail;
+  int wake_fd;
+};
+
+struct auth_cache_entry {
+  uint64_t digest[2]; // keyed hash of username and password
+  uint64_t expires_ns;
+  int32_t chain; // next entry in the bucket
+  int32_t prev;  // LRU list, most recent first
+  int32_t next;
+};
+
+/*
+ * Bounded LRU of recently accepted credentials. Entries are keyed by a
+ * 128 bit SipHash of username and password under a random per-process key,
+ * so no password is kept, and expire after ttl_ns so a changed password
+ * takes effect.
+ */
+struct auth_cache {
+  pthread_mutex_t lock;
+  struct auth_cache_entry *entries;
+  int32_t *buckets;
+  size_t capacity;
+  size_t mask; // buckets - 1
+  size_t count;
+  int32_t lru_head;
+  int32_t lru_tail;
+  int32_t free_list; // unused entries, linked through chain
+  uint64_t ttl_ns;
+  uint64_t key[4]; // two SipHash keys
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/*
+ * Authentication offload.
+ *
+ * Event loops submit CONNECT credentials and go on serving their other
+ * clients; a small pool of threads runs the slow check (password hashing or
+ * a backend round trip) and posts the verdict to the submitter's inbox,
+ * where the loop picks it up and only then sends the CONNACK. Credentials
+ * accepted recently are answered from the cache without leaving the loop.
+ *
+ * The tree has no CONNECT session layer yet: pollserver relays chat and
+ * never parses CONNECT, so no loop creates a pool or inbox. A caller
+ * submits what unpack_mqtt_connect decoded and holds the CONNACK until its
+ * auth_done_fn runs.
+ */
+struct auth_pool {
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct auth_request *head;
+  struct auth_request *tail;
+  size_t queued;
+  int stopping;
+
+  auth_verify_fn verify;
+  void *verify_arg;
+  struct auth_cache cache;
+};
+
+// Local file backend: one "username:crypt(3) hash" per line
+struct auth_file_entry {
+  char *username;
+  char *hash;
+};
+
+struct auth_file {
+  struct auth_file_entry *entries;
+  size_t count;
+};
+
+typedef void (*auth_done_fn)(void *session, enum auth_verdict verdict,
+                             void *arg);
+
+// Function prototypes
+int auth_pool_init(struct auth_pool *pool, int nthreads, auth_verify_fn verify,
+                   void *verify_arg, size_t cache_capacity, unsigned ttl_ms);
+void auth_pool_destroy(struct auth_pool *pool);
+int auth_pool_submit(struct auth_pool *pool, struct auth_inbox *reply,
+                     void *session, const char *username, size_t username_len,
+                     const char *password, size_t password_len);
+int auth_inbox_init(struct auth_inbox *inbox);
+void auth_inbox_destroy(struct auth_inbox *inbox);
+size_t auth_inbox_drain(struct auth_inbox *inbox, auth_done_fn done,
+                        void *arg);
+int auth_file_load(struct auth_file *file, const char *path);
+void auth_file_destroy(struct auth_file *file);
+enum auth_verdict auth_file_verify(const char *username, size_t username_len,
+                                   const char *password, size_t password_len,
+                                   void *arg);
+
+#endif // AUTH_H
@@ -0,0 +1,136 @@
+#include "batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Longest topic name MQTT can carry
+#define BATCH_MAX_TOPIC 65535
+
+int batch_is_envelope(const struct topic *topic) {
+  return topic->len > BATCH_PREFIX_LEN &&
+         memcmp(topic->name, BATCH_PREFIX, BATCH_PREFIX_LEN) == 0;
+}
+
+/*
+ * Build "<base>/<suffix>" into name and intern it.
+ */
+static struct topic *entry_topic(char *name, const char *base, size_t base_len,
+                                 const msgpack_object_str *suffix) {
+  if (base_len + 1 + suffix->size > BATCH_MAX_TOPIC ||
+      memchr(suffix->ptr, '+', suffix->size) != NULL ||
+      memchr(suffix->ptr, '#', suffix->size) != NULL) {
+    return NULL;
+  }
+  memcpy(name + base_len + 1, suffix->ptr, suffix->size);
+  return topic_intern(name, base_len + 1 + suffix->size);
+}
+
+/*
+ * Split the envelope published to topic and call fn for every entry with
+ * its full topic, payload and timestamp. The topic is only borrowed for the
+ * call; fn takes a reference if it keeps it. A non-zero return from fn stops
+ * the walk.
+ *
+ * Returns the number of entries delivered, or -1 if the envelope is
+ * malformed. Nothing is delivered from a malformed envelope: every entry
+ * is validated before the first call to fn. An entry whose suffix holds a
+ * wildcard is skipped, since it can't name a topic.
+ */
+int batch_unpack(const struct topic *topic, const void *data, size_t len,
+                 batch_entry_fn fn, void *arg) {
+  if (!batch_is_envelope(topic)) {
+    return -1;
+  }
+
+  msgpack_unpacked result;
+  size_t offset = 0;
+  int delivered = -1;
+  msgpack_unpacked_init(&result);
+  if (msgpack_unpack_next(&result, data, len, &offset) !=
+          MSGPACK_UNPACK_SUCCESS ||
+      offset != len || result.data.type != MSGPACK_OBJECT_ARRAY) {
+    goto out;
+  }
+
+  const msgpack_object_array *entries = &result.data.via.array;
+  for (uint32_t i = 0; i < entries->size; i++) {
+    const msgpack_object *e = &entries->ptr[i];
+    if (e->type != MSGPACK_OBJECT_ARRAY || e->via.array.size != 3 ||
+        e->via.array.ptr[0].type != MSGPACK_OBJECT_STR ||
+        (e->via.array.ptr[1].type != MSGPACK_OBJECT_BIN &&
+         e->via.array.ptr[1].type != MSGPACK_OBJECT_STR) ||
+        e->via.array.ptr[2].type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+      goto out;
+    }
+  }
+
+  const char *base = topic->name + BATCH_PREFIX_LEN;
+  size_t base_len = topic->len - BATCH_PREFIX_LEN;
+  char *name = malloc(BATCH_MAX_TOPIC);
+  if (name == NULL) {
+    goto out;
+  }
+  memcpy(name, base, base_len);
+  name[base_len] = '/';
+
+  delivered = 0;
+  for (uint32_t i = 0; i < entries->size; i++) {
+    const msgpack_object *fields = entries->ptr[i].via.array.ptr;
+    struct topic *t = entry_topic(name, base, base_len, &fields[0].via.str);
+    if (t == NULL) {
+      continue;
+    }
+    // bin and str share a layout, either may carry the payload
+    int stop = fn(t, fields[1].via.bin.ptr, fields[1].via.bin.size,
+                  fields[2].via.u64, arg);
+    topic_release(t);
+    delivered++;
+    if (stop) {
+      break;
+    }
+  }
+  free(name);
+
+out:
+  msgpack_unpacked_destroy(&result);
+  return delivered;
+}
+
+void batch_init(struct batch_builder *b) {
+  msgpack_sbuffer_init(&b->entries);
+  msgpack_packer_init(&b->packer, &b->entries, msgpack_sbuffer_write);
+  b->count = 0;
+}
+
+int batch_add(struct batch_builder *b, const char *suffix, size_t suffix_len,
+              const void *payload, size_t len, uint64_t timestamp) {
+  if (msgpack_pack_array(&b->packer, 3) != 0 ||
+      msgpack_pack_str(&b->packer, suffix_len) != 0 ||
+      msgpack_pack_str_body(&b->packer, suffix, suffix_len) != 0 ||
+      msgpack_pack_bin(&b->packer, len) != 0 ||
+      msgpack_pack_bin_body(&b->packer, payload, len) != 0 ||
+      msgpack_pack_uint64(&b->packer, timestamp) != 0) {
+    return -1;
+  }
+  b->count++;
+  return 0;
+}
+
+/*
+ * Write the finished envelope into out, which the caller initialized with
+ * msgpack_sbuffer_init. The array header needs the final count, so the
+ * entries are appended after it here.
+ */
+int batch_finish(struct batch_builder *b, msgpack_sbuffer *out) {
+  msgpack_packer pk;
+  msgpack_packer_init(&pk, out, msgpack_sbuffer_write);
+  if (msgpack_pack_array(&pk, b->count) != 0 ||
+      msgpack_sbuffer_write(out, b->entries.data, b->entries.size) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+void batch_destroy(struct batch_builder *b) {
+  msgpack_sbuffer_destroy(&b->entries);
+  b->count = 0;
+}
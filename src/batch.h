@@ -0,0 +1,47 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "topic.h"
+#include <msgpack.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Batch envelopes: many small messages in a single PUBLISH.
+ *
+ * A client opts in by publishing to BATCH_PREFIX followed by a base topic,
+ * e.g. "$batch/sensors/room1". The payload is a msgpack array with one
+ * entry per message, each itself a 3 element array:
+ *
+ *   [ [suffix (str), payload (bin or str), timestamp (uint)], ... ]
+ *
+ * Entry i is delivered to "<base>/<suffix>" as an ordinary PUBLISH, so
+ * existing subscribers see individual messages. Because the envelope topic
+ * starts with '$', root wildcards never match it: only subscribers that ask
+ * for "$batch/..." explicitly receive the envelope as is, and the per-entry
+ * timestamps with it.
+ */
+#define BATCH_PREFIX "$batch/"
+#define BATCH_PREFIX_LEN (sizeof(BATCH_PREFIX) - 1)
+
+typedef int (*batch_entry_fn)(struct topic *topic, const void *payload,
+                              size_t len, uint64_t timestamp, void *arg);
+
+// Envelope under construction, see batch_add
+struct batch_builder {
+  msgpack_sbuffer entries;
+  msgpack_packer packer;
+  size_t count;
+};
+
+// Function prototypes
+int batch_is_envelope(const struct topic *topic);
+int batch_unpack(const struct topic *topic, const void *data, size_t len,
+                 batch_entry_fn fn, void *arg);
+void batch_init(struct batch_builder *b);
+int batch_add(struct batch_builder *b, const char *suffix, size_t suffix_len,
+              const void *payload, size_t len, uint64_t timestamp);
+int batch_finish(struct batch_builder *b, msgpack_sbuffer *out);
+void batch_destroy(struct batch_builder *b);
+
+#endif // BATCH_H
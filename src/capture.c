@@ -0,0 +1,133 @@
+#include "capture.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct capture_file_header {
+  char magic[4];
+  uint32_t version;
+};
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct capture *capture_open(const char *path) {
+  struct capture *cap = malloc(sizeof(*cap));
+  if (cap == NULL) {
+    return NULL;
+  }
+  cap->file = fopen(path, "wb");
+  if (cap->file == NULL) {
+    free(cap);
+    return NULL;
+  }
+
+  struct capture_file_header hdr = {.version = CAPTURE_VERSION};
+  memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+  if (fwrite(&hdr, sizeof(hdr), 1, cap->file) != 1) {
+    fclose(cap->file);
+    free(cap);
+    return NULL;
+  }
+  cap->start_ns = monotonic_ns();
+  return cap;
+}
+
+/*
+ * Append one record. A NULL cap is a no-op so callers don't need to check
+ * whether capture is enabled.
+ */
+int capture_record(struct capture *cap, enum capture_kind kind, uint32_t conn,
+                   const void *data, size_t len) {
+  if (cap == NULL) {
+    return 0;
+  }
+  if (len > CAPTURE_LEN_MASK) {
+    return -1;
+  }
+  struct capture_record rec = {
+      .ts_ns = monotonic_ns() - cap->start_ns,
+      .conn = conn,
+      .info = (uint32_t)kind << CAPTURE_KIND_SHIFT | len,
+  };
+  if (fwrite(&rec, sizeof(rec), 1, cap->file) != 1 ||
+      (len > 0 && fwrite(data, 1, len, cap->file) != len)) {
+    return -1;
+  }
+  return 0;
+}
+
+int capture_flush(struct capture *cap) {
+  if (cap == NULL) {
+    return 0;
+  }
+  return fflush(cap->file) == 0 ? 0 : -1;
+}
+
+void capture_close(struct capture *cap) {
+  if (cap == NULL) {
+    return;
+  }
+  fclose(cap->file);
+  free(cap);
+}
+
+int capture_reader_open(struct capture_reader *r, const char *path) {
+  memset(r, 0, sizeof(*r));
+  r->file = fopen(path, "rb");
+  if (r->file == NULL) {
+    return -1;
+  }
+  struct capture_file_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, r->file) != 1 ||
+      memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != CAPTURE_VERSION) {
+    fclose(r->file);
+    r->file = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Read the next record. *data points into a buffer owned by the reader and
+ * stays valid until the next call.
+ *
+ * Returns 1 for a record, 0 at the end of the file and -1 for a truncated
+ * or corrupt file.
+ */
+int capture_next(struct capture_reader *r, struct capture_record *rec,
+                 const unsigned char **data) {
+  if (fread(rec, sizeof(*rec), 1, r->file) != 1) {
+    return feof(r->file) ? 0 : -1;
+  }
+  if (capture_kind(rec) > CAP_CLOSE) {
+    return -1;
+  }
+
+  size_t len = capture_len(rec);
+  if (len > r->capacity) {
+    unsigned char *grown = realloc(r->data, len);
+    if (grown == NULL) {
+      return -1;
+    }
+    r->data = grown;
+    r->capacity = len;
+  }
+  if (len > 0 && fread(r->data, 1, len, r->file) != len) {
+    return -1;
+  }
+  *data = r->data;
+  return 1;
+}
+
+void capture_reader_close(struct capture_reader *r) {
+  if (r->file != NULL) {
+    fclose(r->file);
+  }
+  free(r->data);
+  memset(r, 0, sizeof(*r));
+}
@@ -0,0 +1,68 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "MQCP"
+#define CAPTURE_VERSION 1
+
+enum capture_kind {
+  CAP_OPEN,  // connection accepted
+  CAP_DATA,  // bytes read from the connection
+  CAP_CLOSE, // connection closed
+};
+
+/*
+ * Record header in a capture file, followed by len bytes of data. info packs
+ * the kind in the top 4 bits and len in the low 28, which is enough for the
+ * largest MQTT packet.
+ */
+struct capture_record {
+  uint64_t ts_ns; // since the capture started
+  uint32_t conn;
+  uint32_t info;
+};
+
+#define CAPTURE_LEN_MASK 0x0fffffffu
+#define CAPTURE_KIND_SHIFT 28
+
+/*
+ * Inbound traffic recorder. Writes are buffered by stdio and pushed out
+ * with capture_flush, once per event loop iteration; a record is a 16 byte
+ * header plus the bytes exactly as read from the socket, so replay sees the
+ * same segmentation the broker did.
+ */
+struct capture {
+  FILE *file;
+  uint64_t start_ns;
+};
+
+// Sequential reader over a capture file
+struct capture_reader {
+  FILE *file;
+  unsigned char *data;
+  size_t capacity;
+};
+
+// Function prototypes
+struct capture *capture_open(const char *path);
+int capture_record(struct capture *cap, enum capture_kind kind, uint32_t conn,
+                   const void *data, size_t len);
+int capture_flush(struct capture *cap);
+void capture_close(struct capture *cap);
+int capture_reader_open(struct capture_reader *r, const char *path);
+int capture_next(struct capture_reader *r, struct capture_record *rec,
+                 const unsigned char **data);
+void capture_reader_close(struct capture_reader *r);
+
+static inline enum capture_kind capture_kind(const struct capture_record *rec) {
+  return rec->info >> CAPTURE_KIND_SHIFT;
+}
+
+static inline size_t capture_len(const struct capture_record *rec) {
+  return rec->info & CAPTURE_LEN_MASK;
+}
+
+#endif // CAPTURE_H
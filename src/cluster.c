@@ -0,0 +1,829 @@
+#define _GNU_SOURCE // accept4
+#include "cluster.h"
+#include "mqtt.h"
+#include "stats.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t CLUSTER_INITIAL_BUCKETS = 64;
+// Bytes asked of recv at a time, and reads per peer per cluster_poll
+static const size_t CLUSTER_READ_SIZE = 64 * 1024;
+static const int CLUSTER_READ_ROUNDS = 16;
+
+// Client id of the CONNECT opening a link, followed by the node id
+#define CLUSTER_HELLO_PREFIX "$cluster/"
+#define CLUSTER_HELLO_PREFIX_LEN (sizeof(CLUSTER_HELLO_PREFIX) - 1)
+
+static void put16(unsigned char *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static uint16_t get16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+
+static int watch(struct cluster *c, int op, int fd, uint32_t events,
+                 void *ptr) {
+  struct epoll_event ev = {.events = events, .data.ptr = ptr};
+  return epoll_ctl(c->epfd, op, fd, &ev);
+}
+
+/*
+ * Bind a non-blocking listening socket for peer links on every local
+ * address. Returns the socket or -1.
+ */
+static int cluster_listen(const char *port) {
+  struct addrinfo hints, *info, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(NULL, port, &hints, &info) != 0) {
+    return -1;
+  }
+
+  int fd = -1, reuse = 1;
+  for (ai = info; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(info);
+  return fd;
+}
+
+/*
+ * Set up a node. Peers dial port, NULL for a node that only dials out.
+ * PUBLISH packets received from peers go to deliver.
+ */
+int cluster_init(struct cluster *c, int node_id, const char *port,
+                 cluster_deliver_fn deliver, void *arg) {
+  memset(c, 0, sizeof(*c));
+  c->node_id = node_id;
+  c->listen_fd = -1;
+  c->deliver = deliver;
+  c->deliver_arg = arg;
+  c->epfd = epoll_create1(EPOLL_CLOEXEC);
+  c->buckets = calloc(CLUSTER_INITIAL_BUCKETS, sizeof(*c->buckets));
+  c->mask = CLUSTER_INITIAL_BUCKETS - 1;
+  if (node_id <= 0 || c->epfd == -1 || c->buckets == NULL) {
+    cluster_destroy(c);
+    return -1;
+  }
+  if (port != NULL &&
+      ((c->listen_fd = cluster_listen(port)) == -1 ||
+       watch(c, EPOLL_CTL_ADD, c->listen_fd, EPOLLIN, c) == -1)) {
+    cluster_destroy(c);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Tear the link down. The peer stays in the table, marked by fd -1, until
+ * reap_peers, so events already returned by epoll never see freed memory.
+ */
+static void peer_close(struct cluster *c, struct cluster_peer *p) {
+  if (p->fd == -1) {
+    return;
+  }
+  epoll_ctl(c->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+  close(p->fd);
+  p->fd = -1;
+  outq_destroy(&p->out);
+  subs_destroy(&p->interest);
+  free(p->in);
+  p->in = NULL;
+  if (p->node_id != 0 && c->stats != NULL) {
+    stats_add(c->stats, STAT_CLUSTER_PEERS, -1);
+  }
+  if (p->route != NULL) {
+    p->route->link = NULL;
+    p->route->retry_ns = stats_now_ns() + CLUSTER_RETRY_NS;
+    p->route = NULL;
+  }
+}
+
+static void reap_peers(struct cluster *c) {
+  for (size_t i = 0; i < c->npeers; i++) {
+    if (c->peers[i]->fd == -1) {
+      free(c->peers[i]);
+      c->peers[i--] = c->peers[--c->npeers];
+    }
+  }
+}
+
+void cluster_destroy(struct cluster *c) {
+  for (size_t i = 0; i < c->npeers; i++) {
+    peer_close(c, c->peers[i]);
+  }
+  reap_peers(c);
+  free(c->peers);
+  for (size_t i = 0; i < c->nroutes; i++) {
+    free(c->routes[i]->host);
+    free(c->routes[i]->port);
+    free(c->routes[i]);
+  }
+  free(c->routes);
+  for (size_t b = 0; c->buckets != NULL && b <= c->mask; b++) {
+    while (c->buckets[b] != NULL) {
+      struct cluster_interest *e = c->buckets[b];
+      c->buckets[b] = e->next;
+      topic_release(e->filter);
+      free(e);
+    }
+  }
+  free(c->buckets);
+  for (size_t i = 0; i < c->nops; i++) {
+    topic_release(c->ops[i].filter);
+  }
+  free(c->ops);
+  subs_batch_destroy(&c->batch);
+  if (c->listen_fd != -1) {
+    close(c->listen_fd);
+  }
+  if (c->epfd != -1) {
+    close(c->epfd);
+  }
+  memset(c, 0, sizeof(*c));
+  c->listen_fd = -1;
+  c->epfd = -1;
+}
+
+// Port peers dial, for nodes listening on port "0"
+int cluster_port(const struct cluster *c) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (c->listen_fd == -1 ||
+      getsockname(c->listen_fd, (struct sockaddr *)&addr, &len) == -1) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+/*
+ * Queue the changes in ops for the peer, runs of additions as SUBSCRIBE
+ * and runs of removals as UNSUBSCRIBE packets of at most
+ * CLUSTER_MAX_INTEREST_FRAME bytes.
+ */
+static int queue_ops(struct cluster_peer *p, const struct cluster_op *ops,
+                     size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    int add = ops[i].add;
+    size_t remaining = sizeof(uint16_t); // packet id
+    size_t j = i;
+    while (j < n && ops[j].add == add) {
+      size_t entry = sizeof(uint16_t) + ops[j].filter->len + (add ? 1 : 0);
+      if (j > i && remaining + entry > CLUSTER_MAX_INTEREST_FRAME) {
+        break;
+      }
+      remaining += entry;
+      j++;
+    }
+
+    unsigned char length[4];
+    int length_len = mqtt_encode_length(length, remaining);
+    struct mqtt_message *msg =
+        mqtt_message_new(NULL, 1 + length_len + remaining);
+    if (msg == NULL) {
+      return -1;
+    }
+    unsigned char *at = msg->data;
+    *at++ = add ? SUBSCRIBE << 4 | 0x02 : UNSUBSCRIBE << 4 | 0x02;
+    memcpy(at, length, length_len);
+    at += length_len;
+    put16(at, 0);
+    at += 2;
+    for (; i < j; i++) {
+      put16(at, ops[i].filter->len);
+      memcpy(at + 2, ops[i].filter->name, ops[i].filter->len);
+      at += 2 + ops[i].filter->len;
+      if (add) {
+        *at++ = AT_MOST_ONCE;
+      }
+    }
+    if (outq_push(&p->out, msg) == -1) {
+      mqtt_message_release(msg);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// The whole local interest, for a new link
+static int queue_snapshot(struct cluster *c, struct cluster_peer *p) {
+  if (c->nfilters == 0) {
+    return 0;
+  }
+  struct cluster_op *ops = malloc(sizeof(*ops) * c->nfilters);
+  if (ops == NULL) {
+    return -1;
+  }
+  size_t n = 0;
+  for (size_t b = 0; b <= c->mask; b++) {
+    for (struct cluster_interest *e = c->buckets[b]; e != NULL; e = e->next) {
+      ops[n++] = (struct cluster_op){e->filter, 1};
+    }
+  }
+  int status = queue_ops(p, ops, n);
+  free(ops);
+  return status;
+}
+
+// CONNECT with client id "$cluster/<node id>"
+static int queue_hello(struct cluster *c, struct cluster_peer *p) {
+  char id[CLUSTER_HELLO_PREFIX_LEN + 12];
+  int id_len = snprintf(id, sizeof(id), CLUSTER_HELLO_PREFIX "%d", c->node_id);
+  size_t remaining = 10 + 2 + id_len;
+  struct mqtt_message *msg = mqtt_message_new(NULL, 2 + remaining);
+  if (msg == NULL) {
+    return -1;
+  }
+  msg->data[0] = CONNECT << 4;
+  msg->data[1] = remaining;
+  // Protocol name, level 4, clean session, no keep alive
+  memcpy(msg->data + 2, "\0\4MQTT\4\2\0\0", 10);
+  put16(msg->data + 12, id_len);
+  memcpy(msg->data + 14, id, id_len);
+  if (outq_push_control(&p->out, msg) == -1) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  return 0;
+}
+
+static struct cluster_peer *peer_new(struct cluster *c, int fd,
+                                     struct cluster_route *route,
+                                     int connecting) {
+  if (c->npeers == c->peers_cap) {
+    size_t cap = c->peers_cap ? c->peers_cap * 2 : 4;
+    struct cluster_peer **grown = realloc(c->peers, sizeof(*grown) * cap);
+    if (grown == NULL) {
+      close(fd);
+      return NULL;
+    }
+    c->peers = grown;
+    c->peers_cap = cap;
+  }
+  struct cluster_peer *p = calloc(1, sizeof(*p));
+  if (p == NULL) {
+    close(fd);
+    return NULL;
+  }
+  p->fd = fd;
+  p->connecting = connecting;
+  subs_init(&p->interest);
+  c->peers[c->npeers++] = p;
+
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  if (outq_init(&p->out) == -1) {
+    close(fd);
+    p->fd = -1;
+    return NULL;
+  }
+  if (watch(c, EPOLL_CTL_ADD, fd, EPOLLIN | (connecting ? EPOLLOUT : 0), p) ==
+          -1 ||
+      queue_hello(c, p) == -1 || queue_snapshot(c, p) == -1) {
+    peer_close(c, p);
+    return NULL;
+  }
+  if (route != NULL) {
+    p->route = route;
+    route->link = p;
+  }
+  return p;
+}
+
+static void dial(struct cluster *c, struct cluster_route *r) {
+  struct addrinfo hints, *info;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  r->retry_ns = stats_now_ns() + CLUSTER_RETRY_NS;
+  if (getaddrinfo(r->host, r->port, &hints, &info) != 0) {
+    return;
+  }
+  int fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK,
+                  info->ai_protocol);
+  if (fd != -1) {
+    int status = connect(fd, info->ai_addr, info->ai_addrlen);
+    if (status == 0 || errno == EINPROGRESS) {
+      peer_new(c, fd, r, status != 0);
+    } else {
+      close(fd);
+    }
+  }
+  freeaddrinfo(info);
+}
+
+/*
+ * Link to the node at host and port, now and again whenever the link is
+ * down. Configuring each pair of nodes on one side is enough, a link
+ * carries traffic both ways.
+ */
+int cluster_add_peer(struct cluster *c, const char *host, const char *port) {
+  if (c->nroutes == c->routes_cap) {
+    size_t cap = c->routes_cap ? c->routes_cap * 2 : 4;
+    struct cluster_route **grown = realloc(c->routes, sizeof(*grown) * cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    c->routes = grown;
+    c->routes_cap = cap;
+  }
+  struct cluster_route *r = calloc(1, sizeof(*r));
+  if (r == NULL || (r->host = strdup(host)) == NULL ||
+      (r->port = strdup(port)) == NULL) {
+    if (r != NULL) {
+      free(r->host);
+    }
+    free(r);
+    return -1;
+  }
+  c->routes[c->nroutes++] = r;
+  dial(c, r);
+  return 0;
+}
+
+// Redial routes whose link is down. Returns the number redialed.
+size_t cluster_tick(struct cluster *c, uint64_t now_ns) {
+  size_t redialed = 0;
+  for (size_t i = 0; i < c->nroutes; i++) {
+    if (c->routes[i]->link == NULL && now_ns >= c->routes[i]->retry_ns) {
+      dial(c, c->routes[i]);
+      redialed++;
+    }
+  }
+  reap_peers(c);
+  return redialed;
+}
+
+static int interest_grow(struct cluster *c) {
+  size_t size = (c->mask + 1) * 2;
+  struct cluster_interest **buckets = calloc(size, sizeof(*buckets));
+  if (buckets == NULL) {
+    return -1;
+  }
+  for (size_t b = 0; b <= c->mask; b++) {
+    while (c->buckets[b] != NULL) {
+      struct cluster_interest *e = c->buckets[b];
+      c->buckets[b] = e->next;
+      e->next = buckets[e->filter->hash & (size - 1)];
+      buckets[e->filter->hash & (size - 1)] = e;
+    }
+  }
+  free(c->buckets);
+  c->buckets = buckets;
+  c->mask = size - 1;
+  return 0;
+}
+
+static int log_op(struct cluster *c, struct topic *filter, int add) {
+  if (c->nops == c->ops_cap) {
+    size_t cap = c->ops_cap ? c->ops_cap * 2 : 16;
+    struct cluster_op *grown = realloc(c->ops, sizeof(*grown) * cap);
+    if (grown == NULL) {
+      return -1;
+    }
+    c->ops = grown;
+    c->ops_cap = cap;
+  }
+  c->ops[c->nops++] = (struct cluster_op){topic_ref(filter), add};
+  return 0;
+}
+
+/*
+ * Count a local subscription to filter in (delta 1) or out (delta -1).
+ * Peers hear about the first subscription and the last unsubscription at
+ * the next cluster_flush. Returns 1 if the node's interest changed, 0 if
+ * not and -1 if out of memory.
+ */
+int cluster_interest(struct cluster *c, struct topic *filter, int delta) {
+  struct cluster_interest **at = &c->buckets[filter->hash & c->mask];
+  while (*at != NULL && (*at)->filter != filter) {
+    at = &(*at)->next;
+  }
+  struct cluster_interest *e = *at;
+  if (delta < 0) {
+    if (e == NULL || --e->refs > 0) {
+      return 0;
+    }
+    *at = e->next;
+    c->nfilters--;
+    int status = log_op(c, e->filter, 0);
+    topic_release(e->filter);
+    free(e);
+    return status == -1 ? -1 : 1;
+  }
+
+  if (e != NULL) {
+    e->refs++;
+    return 0;
+  }
+  if (c->nfilters > c->mask && interest_grow(c) == -1) {
+    return -1;
+  }
+  if ((e = malloc(sizeof(*e))) == NULL) {
+    return -1;
+  }
+  if (log_op(c, filter, 1) == -1) {
+    free(e);
+    return -1;
+  }
+  e->filter = topic_ref(filter);
+  e->refs = 1;
+  e->next = c->buckets[filter->hash & c->mask];
+  c->buckets[filter->hash & c->mask] = e;
+  c->nfilters++;
+  return 1;
+}
+
+static void count_match(const struct subscriber *sub,
+                        const struct topic *filter, void *arg) {}
+
+/*
+ * Queue a reference to a PUBLISH for every linked peer with a matching
+ * filter. Never call it for a message that came from a peer. Returns the
+ * number of peers it was queued for.
+ *
+ * msg must hold exactly one complete frame. Anything else, such as part of
+ * a packet or two coalesced reads, is refused: peers frame the link by
+ * each packet's Remaining Length, so a short frame would swallow the ones
+ * after it.
+ */
+size_t cluster_forward(struct cluster *c, struct mqtt_message *msg) {
+  union mqtt_header hdr = {.byte = msg->data[0]};
+  size_t header_len, remaining;
+  if (hdr.bits.type != PUBLISH || c->npeers == 0 ||
+      mqtt_frame_header(msg->data, msg->len, &header_len, &remaining) !=
+          MQTT_FRAME_OK ||
+      msg->len != header_len + remaining) {
+    return 0;
+  }
+  struct topic *topic = msg->topic;
+  if (topic == NULL) {
+    const unsigned char *name;
+    uint16_t len;
+    if (mqtt_peek_publish_topic(msg->data, msg->len, &name, &len) != 0 ||
+        (topic = topic_intern((const char *)name, len)) == NULL) {
+      return 0;
+    }
+  }
+
+  size_t forwarded = 0;
+  for (size_t i = 0; i < c->npeers; i++) {
+    struct cluster_peer *p = c->peers[i];
+    if (p->fd == -1 || p->node_id == 0 ||
+        !subs_may_match(&p->interest, topic) ||
+        subs_match(&p->interest, topic, count_match, NULL) == 0) {
+      continue;
+    }
+    if (outq_push(&p->out, mqtt_message_ref(msg)) == -1) {
+      mqtt_message_release(msg);
+      if (c->stats != NULL) {
+        stats_add(c->stats, STAT_MSGS_DROPPED, 1);
+      }
+      continue;
+    }
+    forwarded++;
+  }
+  if (topic != msg->topic) {
+    topic_release(topic);
+  }
+  if (c->stats != NULL) {
+    stats_add(c->stats, STAT_CLUSTER_FORWARDED, forwarded);
+  }
+  return forwarded;
+}
+
+/*
+ * A second link to the same node, from both dialing at once: keep the one
+ * dialed by the lower id, which both ends agree on, and let it take over
+ * the route. Returns 1 if p itself was closed.
+ */
+static int drop_duplicate(struct cluster *c, struct cluster_peer *p,
+                          struct cluster_peer *q) {
+  int p_dialed_by_lower = (p->route != NULL) == (c->node_id < q->node_id);
+  struct cluster_peer *keep = p_dialed_by_lower ? p : q;
+  struct cluster_peer *drop = p_dialed_by_lower ? q : p;
+  if (drop->route != NULL && keep->route == NULL) {
+    keep->route = drop->route;
+    keep->route->link = keep;
+    drop->route = NULL;
+  }
+  peer_close(c, drop);
+  return drop == p;
+}
+
+static int handle_hello(struct cluster *c, struct cluster_peer *p,
+                        const unsigned char *body, size_t len) {
+  if (p->node_id != 0 || len < 12 || memcmp(body, "\0\4MQTT", 6) != 0) {
+    return -1;
+  }
+  size_t id_len = get16(body + 10);
+  char id[16];
+  if (12 + id_len > len || id_len <= CLUSTER_HELLO_PREFIX_LEN ||
+      id_len >= sizeof(id) ||
+      memcmp(body + 12, CLUSTER_HELLO_PREFIX, CLUSTER_HELLO_PREFIX_LEN) != 0) {
+    return -1;
+  }
+  memcpy(id, body + 12, id_len);
+  id[id_len] = '\0';
+  char *end;
+  long node_id = strtol(id + CLUSTER_HELLO_PREFIX_LEN, &end, 10);
+  if (*end != '\0' || node_id <= 0 || node_id > INT32_MAX ||
+      node_id == c->node_id) {
+    return -1;
+  }
+
+  p->node_id = node_id;
+  for (size_t i = 0; i < c->npeers; i++) {
+    struct cluster_peer *q = c->peers[i];
+    if (q != p && q->fd != -1 && q->node_id == node_id) {
+      p->node_id = 0; // not counted yet, see peer_close
+      int closed = drop_duplicate(c, p, q);
+      p->node_id = node_id;
+      if (closed) {
+        return 0;
+      }
+      break;
+    }
+  }
+  if (c->stats != NULL) {
+    stats_add(c->stats, STAT_CLUSTER_PEERS, 1);
+  }
+  return 0;
+}
+
+// Apply a SUBSCRIBE or UNSUBSCRIBE of the peer's interest in one batch
+static int handle_interest(struct cluster *c, struct cluster_peer *p, int add,
+                           const unsigned char *body, size_t len) {
+  if (len < 2) {
+    return -1;
+  }
+  int status = 0;
+  size_t at = 2; // packet id, unused
+  while (status == 0 && at < len) {
+    if (at + 2 > len) {
+      status = -1;
+      break;
+    }
+    size_t filter_len = get16(body + at);
+    at += 2;
+    if (filter_len == 0 || at + filter_len + (add ? 1 : 0) > len) {
+      status = -1;
+      break;
+    }
+    struct topic *filter =
+        topic_intern((const char *)body + at, filter_len);
+    if (filter == NULL) {
+      status = -1;
+      break;
+    }
+    status = add ? subs_batch_add(&c->batch, filter, p, AT_MOST_ONCE, 0, NULL)
+                 : subs_batch_remove(&c->batch, filter, p);
+    topic_release(filter);
+    at += filter_len + (add ? 1 : 0);
+  }
+  // Filters read before a malformed one still apply
+  if (subs_apply(&p->interest, &c->batch) == -1) {
+    status = -1;
+  }
+  return status;
+}
+
+static int handle_publish(struct cluster *c, const unsigned char *frame,
+                          size_t len) {
+  const unsigned char *name;
+  uint16_t name_len;
+  if (mqtt_peek_publish_topic(frame, len, &name, &name_len) != 0) {
+    return -1;
+  }
+  struct mqtt_message *msg = mqtt_message_new(frame, len);
+  if (msg == NULL) {
+    return -1;
+  }
+  msg->ingress_ns = stats_now_ns();
+  msg->topic = topic_intern((const char *)name, name_len);
+  if (msg->topic == NULL) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  c->deliver(msg, c->deliver_arg);
+  mqtt_message_release(msg);
+  return 0;
+}
+
+static int handle_frame(struct cluster *c, struct cluster_peer *p,
+                        const unsigned char *frame, size_t header_len,
+                        size_t len) {
+  union mqtt_header hdr = {.byte = frame[0]};
+  const unsigned char *body = frame + header_len;
+  if (hdr.bits.type == CONNECT) {
+    return handle_hello(c, p, body, len - header_len);
+  }
+  if (p->node_id == 0) {
+    return -1; // nothing before the hello
+  }
+  switch (hdr.bits.type) {
+  case PUBLISH:
+    return handle_publish(c, frame, len);
+  case SUBSCRIBE:
+    return handle_interest(c, p, 1, body, len - header_len);
+  case UNSUBSCRIBE:
+    return handle_interest(c, p, 0, body, len - header_len);
+  default:
+    return -1;
+  }
+}
+
+// Handle every complete frame buffered from the peer
+static int peer_parse(struct cluster *c, struct cluster_peer *p) {
+  size_t off = 0;
+  while (off < p->in_len && p->fd != -1) {
+    size_t header_len, remaining;
+    enum mqtt_frame_status status = mqtt_frame_header(
+        p->in + off, p->in_len - off, &header_len, &remaining);
+    if (status == MQTT_FRAME_INCOMPLETE) {
+      break;
+    }
+    if (status != MQTT_FRAME_OK) {
+      return -1;
+    }
+    if (p->in_len - off < header_len + remaining) {
+      break;
+    }
+    if (handle_frame(c, p, p->in + off, header_len, header_len + remaining) ==
+        -1) {
+      return -1;
+    }
+    off += header_len + remaining;
+  }
+  if (p->fd == -1) {
+    return 0; // dropped as a duplicate
+  }
+  memmove(p->in, p->in + off, p->in_len - off);
+  p->in_len -= off;
+  return 0;
+}
+
+static int peer_read(struct cluster *c, struct cluster_peer *p) {
+  for (int round = 0; round < CLUSTER_READ_ROUNDS && p->fd != -1; round++) {
+    if (p->in_cap - p->in_len < CLUSTER_READ_SIZE) {
+      size_t cap = p->in_cap ? p->in_cap * 2 : CLUSTER_READ_SIZE;
+      while (cap - p->in_len < CLUSTER_READ_SIZE) {
+        cap *= 2;
+      }
+      unsigned char *grown = realloc(p->in, cap);
+      if (grown == NULL) {
+        return -1;
+      }
+      p->in = grown;
+      p->in_cap = cap;
+    }
+    size_t room = p->in_cap - p->in_len;
+    ssize_t n = recv(p->fd, p->in + p->in_len, room, 0);
+    if (n == 0) {
+      return -1;
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    if (c->stats != NULL) {
+      stats_add(c->stats, STAT_BYTES_IN, n);
+    }
+    p->in_len += n;
+    if (peer_parse(c, p) == -1) {
+      return -1;
+    }
+    if ((size_t)n < room) {
+      break;
+    }
+  }
+  return 0;
+}
+
+static void peer_flush(struct cluster *c, struct cluster_peer *p) {
+  if (p->fd == -1 || p->connecting) {
+    return;
+  }
+  int status = outq_empty(&p->out) ? 0 : outq_flush(&p->out, p->fd);
+  if (status == -1) {
+    peer_close(c, p);
+    return;
+  }
+  if (status != p->blocked) {
+    watch(c, EPOLL_CTL_MOD, p->fd, EPOLLIN | (status ? EPOLLOUT : 0), p);
+    p->blocked = status;
+  }
+}
+
+static void peer_connected(struct cluster *c, struct cluster_peer *p) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 ||
+      error != 0) {
+    peer_close(c, p);
+    return;
+  }
+  p->connecting = 0;
+  p->blocked = 1; // the connect asked for EPOLLOUT
+  peer_flush(c, p);
+}
+
+static void accept_peers(struct cluster *c) {
+  int fd;
+  while ((fd = accept4(c->listen_fd, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+    peer_new(c, fd, NULL, 0);
+  }
+}
+
+/*
+ * Handle whatever is ready on the links without waiting, when the epoll fd
+ * polls readable. Returns the number of events handled or -1.
+ */
+int cluster_poll(struct cluster *c) {
+  struct epoll_event events[CLUSTER_EVENTS];
+  int n = epoll_wait(c->epfd, events, CLUSTER_EVENTS, 0);
+  if (n == -1) {
+    return errno == EINTR ? 0 : -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.ptr == c) {
+      accept_peers(c);
+      continue;
+    }
+    struct cluster_peer *p = events[i].data.ptr;
+    uint32_t ev = events[i].events;
+    if (p->fd != -1 && p->connecting) {
+      if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        peer_connected(c, p);
+      }
+      continue;
+    }
+    if (p->fd != -1 && (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+        peer_read(c, p) == -1) {
+      peer_close(c, p);
+    }
+    if (p->fd != -1 && (ev & EPOLLOUT)) {
+      peer_flush(c, p);
+    }
+  }
+  reap_peers(c);
+  return n;
+}
+
+/*
+ * Send the interest changes made since the last call to every peer, then
+ * write what is queued on every link. Call once per loop iteration, after
+ * routing. Returns the number of links still holding data.
+ */
+int cluster_flush(struct cluster *c) {
+  for (size_t i = 0; i < c->npeers && c->nops > 0; i++) {
+    if (c->peers[i]->fd != -1 &&
+        queue_ops(c->peers[i], c->ops, c->nops) == -1) {
+      peer_close(c, c->peers[i]);
+    }
+  }
+  for (size_t i = 0; i < c->nops; i++) {
+    topic_release(c->ops[i].filter);
+  }
+  c->nops = 0;
+
+  int blocked = 0;
+  for (size_t i = 0; i < c->npeers; i++) {
+    peer_flush(c, c->peers[i]);
+    blocked += c->peers[i]->fd != -1 && c->peers[i]->blocked;
+  }
+  reap_peers(c);
+  return blocked;
+}
+
+// Links that finished their hello
+size_t cluster_linked(const struct cluster *c) {
+  size_t n = 0;
+  for (size_t i = 0; i < c->npeers; i++) {
+    n += c->peers[i]->fd != -1 && c->peers[i]->node_id != 0;
+  }
+  return n;
+}
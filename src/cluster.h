@@ -0,0 +1,121 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "message.h"
+#include "outq.h"
+#include "subs.h"
+#include "topic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+struct worker_stats;
+
+// Wait between attempts to dial a configured peer that is down
+#define CLUSTER_RETRY_NS 1000000000ULL
+// Largest interest update frame, more filters go in the next one
+#define CLUSTER_MAX_INTEREST_FRAME (64 * 1024)
+// Events handled per epoll_wait in cluster_poll
+#define CLUSTER_EVENTS 64
+
+// A peer address given with cluster_add_peer, dialed until linked
+struct cluster_route {
+  char *host;
+  char *port;
+  uint64_t retry_ns; // earliest next dial
+  struct cluster_peer *link; // NULL while down
+};
+
+/*
+ * A link to another broker. interest holds the filters the peer has
+ * subscribers for, with the peer itself as the client handle.
+ */
+struct cluster_peer {
+  int fd;
+  int node_id; // 0 until its hello arrives
+  int connecting; // non-blocking connect still in progress
+  int blocked;    // socket full, waiting for EPOLLOUT
+  struct cluster_route *route; // NULL for links the peer dialed
+  struct outq out;
+  struct sub_index interest;
+  unsigned char *in; // partial frame
+  size_t in_len;
+  size_t in_cap;
+};
+
+// One change to the local interest, waiting for cluster_flush
+struct cluster_op {
+  struct topic *filter;
+  int add;
+};
+
+struct cluster_interest {
+  struct cluster_interest *next;
+  struct topic *filter;
+  size_t refs;
+};
+
+// A PUBLISH from a peer, borrowed for the call
+typedef void (*cluster_deliver_fn)(struct mqtt_message *msg, void *arg);
+
+/*
+ * Cluster of brokers in a full mesh.
+ *
+ * Nodes tell each other which filters their local clients subscribe to, and
+ * a PUBLISH is forwarded only to the peers holding a matching filter, each
+ * peer's filters kept in a trie of their own. The local interest is counted
+ * per filter, so only the first subscriber and the last unsubscriber of a
+ * filter produce an update. Updates made during one loop iteration go to
+ * every peer as a single batch, and a new link gets the whole interest.
+ *
+ * Links carry MQTT framed packets. A forwarded PUBLISH is the very message
+ * the publisher's clients receive, queued by reference in the link's outq,
+ * so a link costs one writev per iteration however many messages it
+ * carries. Interest updates are SUBSCRIBE and UNSUBSCRIBE packets with many
+ * filters each, and the first packet on a link is a CONNECT naming the node.
+ *
+ * A PUBLISH received from a peer is delivered locally and never forwarded
+ * again: in a full mesh its origin has already sent it to every node that
+ * wants it. When two nodes dial each other, the link dialed by the lower
+ * node id is kept.
+ *
+ * Every socket sits in one epoll set, so the host polls a single fd and
+ * calls cluster_poll when it is readable.
+ */
+struct cluster {
+  int node_id;
+  int epfd;
+  int listen_fd;
+  cluster_deliver_fn deliver;
+  void *deliver_arg;
+  struct worker_stats *stats;
+
+  struct cluster_peer **peers;
+  size_t npeers;
+  size_t peers_cap;
+  struct cluster_route **routes;
+  size_t nroutes;
+  size_t routes_cap;
+
+  struct cluster_interest **buckets;
+  size_t mask;
+  size_t nfilters;
+  struct cluster_op *ops;
+  size_t nops;
+  size_t ops_cap;
+  struct sub_batch batch; // a peer's interest update being applied
+};
+
+// Function prototypes
+int cluster_init(struct cluster *c, int node_id, const char *port,
+                 cluster_deliver_fn deliver, void *arg);
+void cluster_destroy(struct cluster *c);
+int cluster_port(const struct cluster *c);
+int cluster_add_peer(struct cluster *c, const char *host, const char *port);
+int cluster_interest(struct cluster *c, struct topic *filter, int delta);
+size_t cluster_forward(struct cluster *c, struct mqtt_message *msg);
+int cluster_poll(struct cluster *c);
+int cluster_flush(struct cluster *c);
+size_t cluster_tick(struct cluster *c, uint64_t now_ns);
+size_t cluster_linked(const struct cluster *c);
+
+#endif // CLUSTER_H
@@ -0,0 +1,143 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+// One list of retired entries per epoch still in flight
+#define EPOCH_LISTS 3
+
+struct epoch_reader {
+  _Alignas(EPOCH_CACHE_LINE) atomic_uint_fast64_t epoch; // 0 outside
+  atomic_int taken;
+};
+
+static atomic_uint_fast64_t global_epoch = 1;
+static struct epoch_reader readers[EPOCH_MAX_READERS];
+static atomic_size_t nreaders; // slots ever handed out
+// Readers without a slot, the epoch waits for all of them
+static atomic_size_t shared_readers;
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_entry *limbo[EPOCH_LISTS]; // by epoch retired in
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static _Thread_local struct epoch_reader *self;
+static _Thread_local unsigned depth;
+
+static void reader_release(void *arg) {
+  struct epoch_reader *r = arg;
+  atomic_store(&r->epoch, 0);
+  atomic_store(&r->taken, 0);
+}
+
+static void make_key(void) { pthread_key_create(&reader_key, reader_release); }
+
+// A free slot for this thread, NULL once all are taken
+static struct epoch_reader *reader_claim(void) {
+  pthread_once(&key_once, make_key);
+  size_t n = atomic_load(&nreaders);
+  for (size_t i = 0; i < n; i++) {
+    int free_slot = 0;
+    if (atomic_compare_exchange_strong(&readers[i].taken, &free_slot, 1)) {
+      self = &readers[i];
+      break;
+    }
+  }
+  while (self == NULL && n < EPOCH_MAX_READERS) {
+    if (!atomic_compare_exchange_weak(&nreaders, &n, n + 1))
+      continue;
+    // A thread scanning the slots may have taken it first
+    int free_slot = 0;
+    if (atomic_compare_exchange_strong(&readers[n].taken, &free_slot, 1))
+      self = &readers[n];
+    n++;
+  }
+  if (self != NULL)
+    pthread_setspecific(reader_key, self);
+  return self;
+}
+
+void epoch_enter(void) {
+  if (depth++ > 0)
+    return;
+  struct epoch_reader *r = self != NULL ? self : reader_claim();
+  if (r == NULL) {
+    atomic_fetch_add(&shared_readers, 1);
+    return;
+  }
+  // Sequentially consistent, so a writer that missed this store published
+  // its changes before anything this section reads
+  atomic_store(&r->epoch, atomic_load(&global_epoch));
+}
+
+void epoch_exit(void) {
+  if (--depth > 0)
+    return;
+  if (self == NULL)
+    atomic_fetch_sub_explicit(&shared_readers, 1, memory_order_release);
+  else
+    atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+/*
+ * Move the epoch on if every reader in a section has seen the current one.
+ * Returns the entries that became unreachable, called with retire_lock
+ * held.
+ */
+static struct epoch_entry *try_advance(void) {
+  uint_fast64_t e = atomic_load(&global_epoch);
+  if (atomic_load(&shared_readers) > 0)
+    return NULL;
+  size_t n = atomic_load(&nreaders);
+  for (size_t i = 0; i < n; i++) {
+    uint_fast64_t seen = atomic_load(&readers[i].epoch);
+    if (seen != 0 && seen != e)
+      return NULL;
+  }
+  atomic_store(&global_epoch, e + 1);
+  // Retired in e - 1, two epochs before the new one
+  struct epoch_entry *done = limbo[(e + 2) % EPOCH_LISTS];
+  limbo[(e + 2) % EPOCH_LISTS] = NULL;
+  return done;
+}
+
+static void free_entries(struct epoch_entry *e) {
+  while (e != NULL) {
+    struct epoch_entry *next = e->next;
+    e->fn(e);
+    e = next;
+  }
+}
+
+/*
+ * Free e with fn once no reader can reach it any more. e must already be
+ * unlinked from everything readers start from.
+ */
+void epoch_retire(struct epoch_entry *e, epoch_free_fn fn) {
+  e->fn = fn;
+  pthread_mutex_lock(&retire_lock);
+  uint_fast64_t now = atomic_load(&global_epoch);
+  e->next = limbo[now % EPOCH_LISTS];
+  limbo[now % EPOCH_LISTS] = e;
+  struct epoch_entry *done = try_advance();
+  pthread_mutex_unlock(&retire_lock);
+  free_entries(done);
+}
+
+/*
+ * Wait until everything retired so far has been freed, e.g. before tearing
+ * down state the free functions still use.
+ */
+void epoch_synchronize(void) {
+  uint_fast64_t target = atomic_load(&global_epoch) + 2;
+  while (atomic_load(&global_epoch) < target) {
+    pthread_mutex_lock(&retire_lock);
+    struct epoch_entry *done = try_advance();
+    pthread_mutex_unlock(&retire_lock);
+    if (done != NULL)
+      free_entries(done);
+    else
+      sched_yield();
+  }
+}
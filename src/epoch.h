@@ -0,0 +1,45 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define EPOCH_CACHE_LINE 64
+// Threads with a reader slot of their own, more share one counter
+#define EPOCH_MAX_READERS 256
+
+struct epoch_entry;
+typedef void (*epoch_free_fn)(struct epoch_entry *e);
+
+/*
+ * Header of a retired object, usually its first member so the free function
+ * can cast it back.
+ */
+struct epoch_entry {
+  struct epoch_entry *next;
+  epoch_free_fn fn;
+};
+
+/*
+ * Epoch based reclamation for read-mostly structures.
+ *
+ * Readers bracket every access with epoch_enter and epoch_exit, which store
+ * to a cache line of their own and never wait. A writer never changes what
+ * readers may be looking at: it publishes a new copy with a release store
+ * and hands the old one to epoch_retire. The global epoch only moves on
+ * once every reader inside a section has seen the current one, so memory
+ * retired in epoch e is freed when the epoch reaches e + 2, by when no
+ * reader can still hold it.
+ *
+ * Every thread takes a reader slot on its first epoch_enter and gives it
+ * back when it exits. Sections nest; epoch_retire and epoch_synchronize
+ * must be called outside of one.
+ */
+
+// Function prototypes
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(struct epoch_entry *e, epoch_free_fn fn);
+void epoch_synchronize(void);
+
+#endif // EPOCH_H
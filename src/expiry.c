@@ -0,0 +1,107 @@
+#include "expiry.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t EXPIRY_INITIAL_CAPACITY = 8;
+
+void expiry_init(struct expiry_wheel *w, uint64_t tick_ns, uint64_t now_ns,
+                 expiry_fn fn, void *arg) {
+  memset(w, 0, sizeof(*w));
+  w->tick_ns = tick_ns;
+  w->next_tick = now_ns / tick_ns + 1;
+  w->fn = fn;
+  w->arg = arg;
+}
+
+// Drops the pending keys without calling fn, the owner releases them
+void expiry_destroy(struct expiry_wheel *w) {
+  for (size_t i = 0; i < EXPIRY_SLOTS; i++) {
+    free(w->slots[i].items);
+  }
+  memset(w, 0, sizeof(*w));
+}
+
+/*
+ * Have fn called with key once expires_ns has passed, at the end of the
+ * tick it falls in. A deadline already past fires on the next advance.
+ * Returns -1 when out of memory.
+ */
+int expiry_add(struct expiry_wheel *w, void *key, uint64_t expires_ns) {
+  // Round up, a bucket only fires once all of its tick has passed
+  uint64_t tick = expires_ns / w->tick_ns + (expires_ns % w->tick_ns != 0);
+  if (tick < w->next_tick) {
+    tick = w->next_tick;
+  }
+  struct expiry_bucket *b = &w->slots[tick & (EXPIRY_SLOTS - 1)];
+  if (b->count == b->capacity) {
+    size_t capacity = b->capacity ? b->capacity * 2 : EXPIRY_INITIAL_CAPACITY;
+    struct expiry_item *items = realloc(b->items, sizeof(*items) * capacity);
+    if (items == NULL) {
+      return -1;
+    }
+    b->items = items;
+    b->capacity = capacity;
+  }
+  b->items[b->count++] = (struct expiry_item){key, expires_ns};
+  w->count++;
+  return 0;
+}
+
+/*
+ * Fire one bucket: due keys go to fn, later ones stay. fn may add to the
+ * wheel, even to this bucket, so items are only ever read by index.
+ */
+static size_t fire_bucket(struct expiry_wheel *w, struct expiry_bucket *b,
+                          uint64_t now_ns) {
+  size_t fired = 0;
+  size_t kept = 0;
+  for (size_t i = 0; i < b->count; i++) {
+    struct expiry_item item = b->items[i];
+    if (item.expires_ns > now_ns) {
+      b->items[kept++] = item;
+      continue;
+    }
+    w->count--;
+    w->fn(item.key, now_ns, w->arg);
+    fired++;
+  }
+  b->count = kept;
+  if (kept == 0) {
+    // A burst of deadlines shouldn't pin its memory once it has fired
+    free(b->items);
+    b->items = NULL;
+    b->capacity = 0;
+  }
+  return fired;
+}
+
+/*
+ * Fire every bucket whose tick has passed by now_ns. Returns the number of
+ * keys handed to fn.
+ */
+size_t expiry_advance(struct expiry_wheel *w, uint64_t now_ns) {
+  uint64_t last = now_ns / w->tick_ns;
+  if (last < w->next_tick) {
+    return 0;
+  }
+  uint64_t tick = w->next_tick;
+  // After a long gap one revolution visits every bucket
+  if (last - tick >= EXPIRY_SLOTS) {
+    tick = last - EXPIRY_SLOTS + 1;
+  }
+  size_t fired = 0;
+  for (; tick <= last && w->count > 0; tick++) {
+    w->next_tick = tick + 1;
+    fired += fire_bucket(w, &w->slots[tick & (EXPIRY_SLOTS - 1)], now_ns);
+  }
+  w->next_tick = last + 1;
+  return fired;
+}
+
+/*
+ * When the next bucket is due, for a poll timeout. 0 if nothing is
+ * pending.
+ */
+uint64_t expiry_next_ns(const struct expiry_wheel *w) {
+  return w->count > 0 ? w->next_tick * w->tick_ns : 0;
+}
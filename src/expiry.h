@@ -0,0 +1,58 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Buckets in the wheel, a power of two
+#define EXPIRY_SLOTS 256
+
+// A key whose deadline has passed, for the wheel's owner to act on
+typedef void (*expiry_fn)(void *key, uint64_t now_ns, void *arg);
+
+struct expiry_item {
+  void *key;
+  uint64_t expires_ns;
+};
+
+struct expiry_bucket {
+  struct expiry_item *items;
+  size_t count;
+  size_t capacity;
+};
+
+/*
+ * Coarse deadlines for whatever holds expiring messages.
+ *
+ * A hashed timing wheel of EXPIRY_SLOTS buckets, each covering tick_ns of
+ * time: a deadline goes into the bucket of the tick it falls in, and
+ * expiry_advance only visits the buckets of the ticks that passed since the
+ * last call, handing every due key to fn at once. Nothing scans the
+ * owners, so a queue with nothing due costs nothing. Deadlines more than a
+ * revolution away share a bucket with nearer ones and are kept until their
+ * own turn comes.
+ *
+ * Keys are never removed, the owner checks on fn whether the key still
+ * has anything due and ignores stale ones. An owner that pushes a later
+ * deadline only needs to add it once the earlier one has fired.
+ *
+ * Not thread safe, it belongs to the thread that advances it.
+ */
+struct expiry_wheel {
+  struct expiry_bucket slots[EXPIRY_SLOTS];
+  uint64_t tick_ns;
+  uint64_t next_tick; // first tick not yet fired
+  size_t count;
+  expiry_fn fn;
+  void *arg;
+};
+
+// Function prototypes
+void expiry_init(struct expiry_wheel *w, uint64_t tick_ns, uint64_t now_ns,
+                 expiry_fn fn, void *arg);
+void expiry_destroy(struct expiry_wheel *w);
+int expiry_add(struct expiry_wheel *w, void *key, uint64_t expires_ns);
+size_t expiry_advance(struct expiry_wheel *w, uint64_t now_ns);
+uint64_t expiry_next_ns(const struct expiry_wheel *w);
+
+#endif // EXPIRY_H
@@ -0,0 +1,138 @@
+#include "fanout.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+int fanout_init(struct fanout *f, struct worker *workers, int nworkers,
+                size_t chunk, fanout_owner_fn owner, void *owner_arg) {
+  memset(f, 0, sizeof(*f));
+  f->open = calloc(nworkers, sizeof(*f->open));
+  if (f->open == NULL) {
+    return -1;
+  }
+  f->workers = workers;
+  f->nworkers = nworkers;
+  f->chunk = chunk ? chunk : FANOUT_CHUNK;
+  f->owner = owner;
+  f->owner_arg = owner_arg;
+  return 0;
+}
+
+void fanout_destroy(struct fanout *f) {
+  for (int w = 0; w < f->nworkers; w++) {
+    free(f->open[w]);
+  }
+  free(f->open);
+  memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Hand worker w its open job. A full inbox drops the job, and with it the
+ * message for those subscribers, like any other full inbox.
+ */
+static void dispatch(struct fanout *f, int w) {
+  struct fanout_job *job = f->open[w];
+  if (job == NULL || job->count == 0) {
+    return;
+  }
+  if (worker_route_job(&f->workers[w], f->msg, job) == -1) {
+    f->dropped += job->count;
+    job->count = 0;
+    return;
+  }
+  f->open[w] = NULL;
+}
+
+static void collect(const struct subscriber *sub, const struct topic *filter,
+                    void *arg) {
+  struct fanout *f = arg;
+  int w = f->owner(sub, f->owner_arg);
+  if (w < 0 || w >= f->nworkers) {
+    f->dropped++;
+    return;
+  }
+
+  struct fanout_job *job = f->open[w];
+  if (job == NULL) {
+    job = malloc(sizeof(*job) + sizeof(job->subs[0]) * f->chunk);
+    if (job == NULL) {
+      f->dropped++;
+      return;
+    }
+    job->count = 0;
+    f->open[w] = job;
+  }
+  job->subs[job->count++] = *sub;
+  if (job->count == f->chunk) {
+    dispatch(f, w);
+  }
+}
+
+/*
+ * Match msg's topic against idx and schedule one delivery per matching
+ * subscription on the owning workers. The caller keeps its reference to msg.
+ * A topic the prefilter rules out costs neither a trie walk nor any job.
+ *
+ * Returns the number of subscriptions matched; those that couldn't be
+ * scheduled are counted in dropped.
+ */
+size_t fanout_publish(struct fanout *f, const struct sub_index *idx,
+                      const struct topic *topic, struct mqtt_message *msg,
+                      size_t *dropped) {
+  int possible = subs_may_match(idx, topic);
+  if (f->stats != NULL) {
+    stats_add(f->stats, STAT_PREFILTER_CHECKED, 1);
+    stats_add(f->stats, STAT_PREFILTER_REJECTED, !possible);
+  }
+  if (!possible) {
+    if (dropped != NULL) {
+      *dropped = 0;
+    }
+    return 0;
+  }
+  f->msg = msg;
+  f->dropped = 0;
+  size_t matched = subs_match(idx, topic, collect, f);
+  // Partial jobs go out once the walk is done
+  for (int w = 0; w < f->nworkers; w++) {
+    dispatch(f, w);
+  }
+  f->msg = NULL;
+  if (dropped != NULL) {
+    *dropped = f->dropped;
+  }
+  return matched;
+}
+
+/*
+ * Serve a fan-out delivery popped from the inbox: call deliver for every
+ * subscriber in the job, then release the delivery's reference and job.
+ * deliver takes its own reference to msg if it queues it.
+ */
+void fanout_run(struct worker *self, struct delivery *d,
+                fanout_deliver_fn deliver, void *arg) {
+  for (size_t i = 0; i < d->job->count; i++) {
+    deliver(self, d->msg, &d->job->subs[i], arg);
+  }
+  mqtt_message_release(d->msg);
+  free(d->job);
+  d->msg = NULL;
+  d->job = NULL;
+}
+
+/*
+ * Queue msg on a subscriber's connection under its subscription options,
+ * for a deliver callback. Takes a reference of its own; returns -1 if the
+ * queue refused the message.
+ */
+int fanout_queue(struct outq *q, const struct subscriber *sub,
+                 struct mqtt_message *msg) {
+  int status = sub->flags & SUB_CONFLATE
+                   ? outq_push_conflated(q, mqtt_message_ref(msg))
+                   : outq_push(q, mqtt_message_ref(msg));
+  if (status == -1) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  return 0;
+}
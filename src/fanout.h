@@ -0,0 +1,68 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "outq.h"
+#include "subs.h"
+#include "worker.h"
+#include <stddef.h>
+
+// Subscribers per job, small enough that a worker gets back to its own
+// sockets quickly between jobs
+#define FANOUT_CHUNK 512
+
+// Subscribers of one message that are all owned by the receiving worker
+struct fanout_job {
+  size_t count;
+  struct subscriber subs[];
+};
+
+// Index of the worker owning the subscriber's connection
+typedef int (*fanout_owner_fn)(const struct subscriber *sub, void *arg);
+
+typedef void (*fanout_deliver_fn)(struct worker *self, struct mqtt_message *msg,
+                                  const struct subscriber *sub, void *arg);
+
+/*
+ * Per publishing worker fan-out scheduler.
+ *
+ * A matched subscriber set is split by connection ownership into jobs of at
+ * most chunk subscribers, and each job goes to its owner's inbox as soon as
+ * it fills, so every worker writes its share of a large fan-out in parallel
+ * while the publisher is still walking the set. The publisher only copies
+ * 16 byte entries; reference counting, queueing and the writes happen on
+ * the owners.
+ *
+ * Each subscriber is only ever served by the worker owning its connection,
+ * and that worker drains its inbox in order, so a subscriber sees messages
+ * from one publisher in publish order however they were chunked.
+ *
+ * Subscribers are copied into the jobs, client handles included: the
+ * broker must keep a handle valid until its owner has drained the inbox.
+ */
+struct fanout {
+  struct worker *workers;
+  int nworkers;
+  size_t chunk;
+  fanout_owner_fn owner;
+  void *owner_arg;
+  struct worker_stats *stats; // optional, set after fanout_init
+
+  // Job being filled for every worker during fanout_publish
+  struct fanout_job **open;
+  struct mqtt_message *msg;
+  size_t dropped;
+};
+
+// Function prototypes
+int fanout_init(struct fanout *f, struct worker *workers, int nworkers,
+                size_t chunk, fanout_owner_fn owner, void *owner_arg);
+void fanout_destroy(struct fanout *f);
+size_t fanout_publish(struct fanout *f, const struct sub_index *idx,
+                      const struct topic *topic, struct mqtt_message *msg,
+                      size_t *dropped);
+void fanout_run(struct worker *self, struct delivery *d,
+                fanout_deliver_fn deliver, void *arg);
+int fanout_queue(struct outq *q, const struct subscriber *sub,
+                 struct mqtt_message *msg);
+
+#endif // FANOUT_H
@@ -0,0 +1,243 @@
+#include "flightrec.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Dump file layout, native endianness:
+ *
+ * +-------------+----------------+-----------------------+-----
+ * | file header | ring header 0  | FLIGHTREC_EVENTS x    | ring header 1 ...
+ * |             | thread, head   | struct fr_event       |
+ * +-------------+----------------+-----------------------+-----
+ *
+ * A ring holds min(head, FLIGHTREC_EVENTS) valid events, the oldest at
+ * slot head % FLIGHTREC_EVENTS once it has wrapped.
+ */
+struct fr_file_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t nrings;
+  uint32_t capacity;
+};
+
+struct fr_ring_header {
+  uint32_t thread;
+  uint32_t reserved;
+  uint64_t head;
+};
+
+_Thread_local struct flightrec *flightrec_local;
+
+static struct flightrec *_Atomic rings[FLIGHTREC_MAX_THREADS];
+static atomic_uint nrings;
+static const char *signal_path;
+
+static const char *const type_names[FR_TYPE_COUNT] = {
+    [FR_ACCEPT] = "accept",
+    [FR_PUBLISH_ROUTED] = "publish_routed",
+    [FR_BACKPRESSURE_ON] = "backpressure_on",
+    [FR_BACKPRESSURE_OFF] = "backpressure_off",
+    [FR_DISCONNECT] = "disconnect",
+    [FR_TIMER] = "timer",
+    [FR_CONNECT] = "connect",
+};
+
+static const char *const reason_names[FR_REASON_COUNT] = {
+    [FR_REASON_CLOSED] = "closed",
+    [FR_REASON_SOCKET_ERROR] = "socket_error",
+    [FR_REASON_MEMORY] = "memory_limit",
+    [FR_REASON_PROTOCOL] = "protocol_error",
+    [FR_REASON_SLOW_CONSUMER] = "slow_consumer",
+};
+
+static const char *const timer_names[FR_TIMER_COUNT] = {
+    [FR_TIMER_SYS] = "sys",
+    [FR_TIMER_EXPIRY] = "expiry",
+    [FR_TIMER_CLUSTER] = "cluster",
+    [FR_TIMER_MQTTSN] = "mqttsn",
+};
+
+const char *flightrec_type_name(unsigned type) {
+  return type < FR_TYPE_COUNT ? type_names[type] : "unknown";
+}
+
+const char *flightrec_reason_name(unsigned reason) {
+  return reason < FR_REASON_COUNT ? reason_names[reason] : "unknown";
+}
+
+/*
+ * Give the calling thread its own ring. Rings live until the process exits
+ * so a dump never races with a free.
+ */
+int flightrec_attach(uint32_t thread) {
+  if (flightrec_local != NULL)
+    return 0;
+  unsigned slot = atomic_fetch_add(&nrings, 1);
+  if (slot >= FLIGHTREC_MAX_THREADS) {
+    atomic_fetch_sub(&nrings, 1);
+    return -1;
+  }
+  struct flightrec *fr = calloc(1, sizeof(*fr));
+  if (fr == NULL)
+    return -1;
+  fr->thread = thread;
+  atomic_store_explicit(&rings[slot], fr, memory_order_release);
+  flightrec_local = fr;
+  return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Write every ring to fd. Uses nothing but write(2), so it is safe to call
+ * from a signal handler.
+ */
+int flightrec_dump_fd(int fd) {
+  unsigned count = atomic_load(&nrings);
+  if (count > FLIGHTREC_MAX_THREADS)
+    count = FLIGHTREC_MAX_THREADS;
+
+  struct flightrec *snapshot[FLIGHTREC_MAX_THREADS];
+  unsigned n = 0;
+  for (unsigned i = 0; i < count; i++) {
+    struct flightrec *fr =
+        atomic_load_explicit(&rings[i], memory_order_acquire);
+    if (fr != NULL)
+      snapshot[n++] = fr;
+  }
+
+  struct fr_file_header hdr = {.version = FLIGHTREC_VERSION,
+                               .nrings = n,
+                               .capacity = FLIGHTREC_EVENTS};
+  memcpy(hdr.magic, FLIGHTREC_MAGIC, sizeof(hdr.magic));
+  if (write_all(fd, &hdr, sizeof(hdr)) == -1)
+    return -1;
+
+  for (unsigned i = 0; i < n; i++) {
+    struct flightrec *fr = snapshot[i];
+    struct fr_ring_header rh = {
+        .thread = fr->thread,
+        .head = atomic_load_explicit(&fr->head, memory_order_acquire),
+    };
+    if (write_all(fd, &rh, sizeof(rh)) == -1 ||
+        write_all(fd, fr->events, sizeof(fr->events)) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+int flightrec_dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+  int status = flightrec_dump_fd(fd);
+  close(fd);
+  return status;
+}
+
+static void dump_handler(int sig) {
+  int saved = errno;
+  flightrec_dump(signal_path);
+  errno = saved;
+}
+
+/*
+ * Dump to path whenever sig arrives. The dump runs inside the handler, so
+ * it still works when the event loop itself is stuck.
+ */
+int flightrec_dump_on_signal(int sig, const char *path) {
+  signal_path = path;
+  struct sigaction sa = {.sa_handler = dump_handler, .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  return sigaction(sig, &sa, NULL);
+}
+
+// An event tagged with the thread whose ring it came from
+struct fr_record {
+  struct fr_event event;
+  uint32_t thread;
+};
+
+static int compare_records(const void *a, const void *b) {
+  const struct fr_record *x = a, *y = b;
+  return x->event.ts_ns < y->event.ts_ns ? -1
+                                         : x->event.ts_ns > y->event.ts_ns;
+}
+
+/*
+ * Read a dump and print every event, merged across threads in time order,
+ * one per line: milliseconds before the newest event, thread, type and
+ * fields.
+ */
+int flightrec_decode(FILE *in, FILE *out) {
+  struct fr_file_header hdr;
+  if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+      memcmp(hdr.magic, FLIGHTREC_MAGIC, sizeof(hdr.magic)) != 0 ||
+      hdr.version != FLIGHTREC_VERSION || hdr.capacity == 0 ||
+      (hdr.capacity & (hdr.capacity - 1)) != 0)
+    return -1;
+
+  struct fr_event *ring = malloc(sizeof(*ring) * hdr.capacity);
+  struct fr_record *records = NULL;
+  size_t total = 0;
+  int status = -1;
+  if (ring == NULL)
+    goto out;
+
+  for (uint32_t r = 0; r < hdr.nrings; r++) {
+    struct fr_ring_header rh;
+    if (fread(&rh, sizeof(rh), 1, in) != 1 ||
+        fread(ring, sizeof(*ring), hdr.capacity, in) != hdr.capacity)
+      goto out;
+    uint64_t n = rh.head < hdr.capacity ? rh.head : hdr.capacity;
+    if (n == 0)
+      continue;
+    struct fr_record *grown =
+        realloc(records, sizeof(*records) * (total + n));
+    if (grown == NULL)
+      goto out;
+    records = grown;
+    for (uint64_t i = rh.head - n; i < rh.head; i++) {
+      records[total].event = ring[i & (hdr.capacity - 1)];
+      records[total].thread = rh.thread;
+      total++;
+    }
+  }
+
+  qsort(records, total, sizeof(*records), compare_records);
+  uint64_t last = total ? records[total - 1].event.ts_ns : 0;
+  for (size_t i = 0; i < total; i++) {
+    const struct fr_event *e = &records[i].event;
+    fprintf(out, "%12.3fms thread %-3u %-16s id %-6u",
+            -(double)(last - e->ts_ns) / 1e6, records[i].thread,
+            flightrec_type_name(e->type), e->id);
+    if (e->type == FR_DISCONNECT)
+      fprintf(out, " reason %s", flightrec_reason_name(e->reason));
+    else if (e->type == FR_TIMER)
+      fprintf(out, " %s",
+              e->reason < FR_TIMER_COUNT ? timer_names[e->reason] : "unknown");
+    if (e->type != FR_DISCONNECT && e->aux != 0)
+      fprintf(out, " aux %u", e->aux);
+    fprintf(out, "\n");
+  }
+  status = 0;
+
+out:
+  free(ring);
+  free(records);
+  return status;
+}
@@ -0,0 +1,99 @@
+#ifndef FLIGHTREC_H
+#define FLIGHTREC_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Events kept per thread, a power of two
+#define FLIGHTREC_EVENTS 4096
+#define FLIGHTREC_MAX_THREADS 64
+#define FLIGHTREC_MAGIC "FREC"
+#define FLIGHTREC_VERSION 2
+
+enum fr_type {
+  FR_ACCEPT,          // id: fd
+  FR_PUBLISH_ROUTED,  // id: publisher fd, aux: subscribers queued to
+  FR_BACKPRESSURE_ON, // id: fd whose socket filled up
+  FR_BACKPRESSURE_OFF,
+  FR_DISCONNECT, // id: fd, reason: enum fr_reason
+  FR_TIMER,      // id: timer fd or 0, reason: enum fr_timer, aux: work done
+  FR_CONNECT,    // id: fd, ready for traffic (after its TLS handshake)
+  FR_TYPE_COUNT,
+};
+
+enum fr_reason {
+  FR_REASON_CLOSED, // peer closed the connection
+  FR_REASON_SOCKET_ERROR,
+  FR_REASON_MEMORY, // over the memory limit
+  FR_REASON_PROTOCOL,
+  FR_REASON_SLOW_CONSUMER,
+  FR_REASON_COUNT,
+};
+
+// Periodic passes recorded as FR_TIMER when they did something
+enum fr_timer {
+  FR_TIMER_SYS,     // $SYS refresh
+  FR_TIMER_EXPIRY,  // aux: queue deadlines fired
+  FR_TIMER_CLUSTER, // aux: peers redialed
+  FR_TIMER_MQTTSN,  // aux: sensors expired
+  FR_TIMER_COUNT,
+};
+
+// One recorded event, 16 bytes
+struct fr_event {
+  uint64_t ts_ns; // CLOCK_MONOTONIC
+  uint8_t type;
+  uint8_t reason;
+  uint16_t aux; // saturates at UINT16_MAX
+  uint32_t id;
+};
+
+/*
+ * Fixed-size ring of the most recent events of one thread.
+ *
+ * Only the owning thread writes, so recording is a few plain stores and a
+ * release store of head: wait-free and never blocked by a dump. A dump
+ * taken while the owner is writing may catch the newest slot half written;
+ * everything older is intact.
+ */
+struct flightrec {
+  _Atomic uint64_t head; // events ever recorded
+  uint32_t thread;
+  struct fr_event events[FLIGHTREC_EVENTS];
+};
+
+extern _Thread_local struct flightrec *flightrec_local;
+
+/*
+ * Record an event in the calling thread's ring. A no-op on threads that
+ * never called flightrec_attach.
+ */
+static inline void flightrec_event(enum fr_type type, uint32_t id,
+                                   uint8_t reason, uint32_t aux) {
+  struct flightrec *fr = flightrec_local;
+  if (fr == NULL)
+    return;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t head = atomic_load_explicit(&fr->head, memory_order_relaxed);
+  struct fr_event *e = &fr->events[head & (FLIGHTREC_EVENTS - 1)];
+  e->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e->type = type;
+  e->reason = reason;
+  e->aux = aux > UINT16_MAX ? UINT16_MAX : aux;
+  e->id = id;
+  atomic_store_explicit(&fr->head, head + 1, memory_order_release);
+}
+
+// Function prototypes
+int flightrec_attach(uint32_t thread);
+int flightrec_dump_fd(int fd);
+int flightrec_dump(const char *path);
+int flightrec_dump_on_signal(int sig, const char *path);
+int flightrec_decode(FILE *in, FILE *out);
+const char *flightrec_type_name(unsigned type);
+const char *flightrec_reason_name(unsigned reason);
+
+#endif // FLIGHTREC_H
@@ -0,0 +1,65 @@
+#include "histogram.h"
+#include <string.h>
+
+void hist_reset(struct histogram *h) {
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+  }
+}
+
+/*
+ * Add src into dst. src may be live on another thread; dst must be owned by
+ * the caller.
+ */
+void hist_merge(struct histogram *dst, const struct histogram *src) {
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    uint64_t n = atomic_load_explicit(&src->counts[i], memory_order_relaxed);
+    if (n == 0)
+      continue;
+    atomic_store_explicit(
+        &dst->counts[i],
+        atomic_load_explicit(&dst->counts[i], memory_order_relaxed) + n,
+        memory_order_relaxed);
+  }
+}
+
+uint64_t hist_count(const struct histogram *h) {
+  uint64_t total = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    total += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+  }
+  return total;
+}
+
+/*
+ * Representative value of a bucket: the middle of the range it covers.
+ */
+uint64_t hist_bucket_value(unsigned bucket) {
+  if (bucket < HIST_SUB_BUCKETS)
+    return bucket;
+  unsigned exponent = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+  unsigned sub = bucket % HIST_SUB_BUCKETS;
+  unsigned shift = exponent - HIST_SUB_BITS;
+  uint64_t low = (uint64_t)(HIST_SUB_BUCKETS + sub) << shift;
+  return low + ((1ULL << shift) >> 1);
+}
+
+/*
+ * Value at the given percentile (0-100], or 0 for an empty histogram.
+ */
+uint64_t hist_percentile(const struct histogram *h, double percentile) {
+  uint64_t total = hist_count(h);
+  if (total == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (seen >= rank)
+      return hist_bucket_value(i);
+  }
+  return hist_bucket_value(HIST_BUCKETS - 1);
+}
@@ -0,0 +1,50 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Log-bucketed histogram in the style of HdrHistogram.
+ *
+ * Values below 2^HIST_SUB_BITS get a bucket each. Above that every power of
+ * two is split into 2^HIST_SUB_BITS linear sub-buckets, so any recorded
+ * value is known to within 1/16 (about 6%) across the full 64 bit range in
+ * a fixed 976 counter array: recording never allocates.
+ *
+ * A histogram has a single writer. Counters are atomics written with
+ * relaxed load/store, so another thread can merge a live histogram without
+ * locks at the cost of possibly missing the latest few records.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+  _Atomic uint64_t counts[HIST_BUCKETS];
+};
+
+static inline unsigned hist_bucket(uint64_t value) {
+  if (value < HIST_SUB_BUCKETS)
+    return value;
+  unsigned exponent = 63 - __builtin_clzll(value);
+  unsigned sub = (value >> (exponent - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+  return (exponent - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+// Record one value. Only the owning thread may call this.
+static inline void hist_record(struct histogram *h, uint64_t value) {
+  _Atomic uint64_t *slot = &h->counts[hist_bucket(value)];
+  atomic_store_explicit(
+      slot, atomic_load_explicit(slot, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+// Function prototypes
+void hist_reset(struct histogram *h);
+void hist_merge(struct histogram *dst, const struct histogram *src);
+uint64_t hist_count(const struct histogram *h);
+uint64_t hist_bucket_value(unsigned bucket);
+uint64_t hist_percentile(const struct histogram *h, double percentile);
+
+#endif // HISTOGRAM_H
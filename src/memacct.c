@@ -0,0 +1,82 @@
+#include "memacct.h"
+#include <string.h>
+
+static struct mem_limits limits = {0, 0, MEM_DROP_OLDEST_QOS0};
+
+static atomic_size_t global_bytes;
+static atomic_uint_fast64_t evicted;
+static atomic_uint_fast64_t rejected;
+static atomic_uint_fast64_t disconnected;
+
+// Set the limits once at startup, before any worker runs
+void memacct_configure(const struct mem_limits *new_limits) {
+  limits = *new_limits;
+}
+
+const struct mem_limits *memacct_limits(void) { return &limits; }
+
+/*
+ * How many bytes would have to be freed before bytes more could be charged
+ * to acct without crossing either its own or the global limit. 0 means the
+ * charge fits.
+ */
+size_t memacct_over(const struct mem_account *acct, size_t bytes) {
+  size_t over = 0;
+
+  if (limits.client_bytes && acct->total + bytes > limits.client_bytes) {
+    over = acct->total + bytes - limits.client_bytes;
+  }
+  if (limits.global_bytes) {
+    size_t global = atomic_load_explicit(&global_bytes, memory_order_relaxed);
+    if (global + bytes > limits.global_bytes &&
+        global + bytes - limits.global_bytes > over) {
+      over = global + bytes - limits.global_bytes;
+    }
+  }
+  return over;
+}
+
+void memacct_charge(struct mem_account *acct, enum mem_kind kind,
+                    size_t bytes) {
+  acct->bytes[kind] += bytes;
+  acct->total += bytes;
+  atomic_fetch_add_explicit(&global_bytes, bytes, memory_order_relaxed);
+}
+
+void memacct_uncharge(struct mem_account *acct, enum mem_kind kind,
+                      size_t bytes) {
+  acct->bytes[kind] -= bytes;
+  acct->total -= bytes;
+  atomic_fetch_sub_explicit(&global_bytes, bytes, memory_order_relaxed);
+}
+
+/*
+ * Record a message refused at the limit. Under MEM_DISCONNECT the session is
+ * flagged so its owner closes it. Always returns -1 for the caller to pass on.
+ */
+int memacct_refuse(struct mem_account *acct) {
+  atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+  if (limits.policy == MEM_DISCONNECT && !acct->disconnect) {
+    acct->disconnect = 1;
+    atomic_fetch_add_explicit(&disconnected, 1, memory_order_relaxed);
+  }
+  return -1;
+}
+
+void memacct_count_evicted(uint64_t n) {
+  atomic_fetch_add_explicit(&evicted, n, memory_order_relaxed);
+}
+
+// Return whatever the session still holds to the global budget
+void memacct_release(struct mem_account *acct) {
+  atomic_fetch_sub_explicit(&global_bytes, acct->total, memory_order_relaxed);
+  memset(acct, 0, sizeof(*acct));
+}
+
+void memacct_snapshot(struct mem_stats *stats) {
+  stats->global_bytes = atomic_load_explicit(&global_bytes, memory_order_relaxed);
+  stats->evicted = atomic_load_explicit(&evicted, memory_order_relaxed);
+  stats->rejected = atomic_load_explicit(&rejected, memory_order_relaxed);
+  stats->disconnected =
+      atomic_load_explicit(&disconnected, memory_order_relaxed);
+}
@@ -0,0 +1,56 @@
+#ifndef MEMACCT_H
+#define MEMACCT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// What a client does once it is over its limit or the node is out of budget
+enum mem_policy {
+  MEM_DROP_OLDEST_QOS0, // evict queued QoS 0 PUBLISH, oldest first
+  MEM_REJECT,           // refuse the new message, keep the queue as is
+  MEM_DISCONNECT,       // refuse it and close the connection
+};
+
+enum mem_kind {
+  MEM_QUEUED, // outbound packets waiting to be written
+  MEM_RECV,   // partial inbound packets being reassembled
+  MEM_KIND_COUNT,
+};
+
+struct mem_limits {
+  size_t client_bytes; // 0 means unlimited
+  size_t global_bytes; // 0 means unlimited
+  enum mem_policy policy;
+};
+
+/*
+ * Bytes held on behalf of one session. Only the thread owning the session
+ * touches it; the node-wide total is the atomic in memacct.c.
+ */
+struct mem_account {
+  size_t bytes[MEM_KIND_COUNT];
+  size_t total;
+  int disconnect; // set once MEM_DISCONNECT has fired for this session
+};
+
+struct mem_stats {
+  size_t global_bytes;
+  uint64_t evicted;      // messages dropped by MEM_DROP_OLDEST_QOS0
+  uint64_t rejected;     // messages refused at the limit
+  uint64_t disconnected; // sessions closed by MEM_DISCONNECT
+};
+
+// Function prototypes
+void memacct_configure(const struct mem_limits *limits);
+const struct mem_limits *memacct_limits(void);
+size_t memacct_over(const struct mem_account *acct, size_t bytes);
+void memacct_charge(struct mem_account *acct, enum mem_kind kind, size_t bytes);
+void memacct_uncharge(struct mem_account *acct, enum mem_kind kind,
+                      size_t bytes);
+int memacct_refuse(struct mem_account *acct);
+void memacct_count_evicted(uint64_t n);
+void memacct_release(struct mem_account *acct);
+void memacct_snapshot(struct mem_stats *stats);
+
+#endif // MEMACCT_H
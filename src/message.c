@@ -0,0 +1,69 @@
+#include "message.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Allocate a message holding a copy of an already encoded packet. The caller
+ * owns the single initial reference.
+ */
+struct mqtt_message *mqtt_message_new(const unsigned char *data, size_t len) {
+  struct mqtt_message *msg = malloc(sizeof(*msg) + len);
+  if (msg == NULL) {
+    return NULL;
+  }
+  atomic_init(&msg->refcount, 1);
+  msg->topic = NULL;
+  msg->len = len;
+  msg->ingress_ns = 0;
+  msg->routed_ns = 0;
+  msg->expires_ns = 0;
+  if (data != NULL) {
+    memcpy(msg->data, data, len);
+  }
+  return msg;
+}
+
+struct mqtt_message *mqtt_message_ref(struct mqtt_message *msg) {
+  // Taking a reference only needs atomicity, the holder already keeps the
+  // message alive
+  atomic_fetch_add_explicit(&msg->refcount, 1, memory_order_relaxed);
+  return msg;
+}
+
+void mqtt_message_release(struct mqtt_message *msg) {
+  if (msg == NULL) {
+    return;
+  }
+  // acq_rel so every write made by other holders is visible before the free
+  if (atomic_fetch_sub_explicit(&msg->refcount, 1, memory_order_acq_rel) == 1) {
+    topic_release(msg->topic);
+    free(msg);
+  }
+}
+
+/*
+ * Encode a PUBLISH for topic into a new message. header is the first byte of
+ * the fixed header (PUBLISH_BYTE plus QoS and retain flags). The message
+ * takes its own reference to topic.
+ */
+struct mqtt_message *mqtt_message_publish(struct topic *topic,
+                                          const void *payload, size_t len,
+                                          unsigned char header,
+                                          unsigned short pkt_id) {
+  struct mqtt_publish pub = {
+      .header = {.byte = header},
+      .pkt_id = pkt_id,
+      .topiclen = topic->len,
+      .topic = (unsigned char *)topic->name,
+      .payloadlen = len,
+      .payload = (unsigned char *)payload,
+  };
+
+  struct mqtt_message *msg = mqtt_message_new(NULL, mqtt_publish_size(&pub));
+  if (msg == NULL) {
+    return NULL;
+  }
+  pack_mqtt_publish(msg->data, &pub);
+  msg->topic = topic_ref(topic);
+  return msg;
+}
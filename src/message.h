@@ -0,0 +1,58 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include "mqtt.h"
+#include "topic.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An encoded MQTT packet, serialized once and shared by reference.
+ *
+ * The thread that decodes a PUBLISH encodes the outgoing packet a single
+ * time; every worker queue and connection that delivers it holds one
+ * reference and drops it with mqtt_message_release once the bytes have been
+ * written. The last release frees the buffer.
+ *
+ * A routed PUBLISH also keeps a reference to its interned topic, so queues
+ * can tell messages for the same topic apart by pointer.
+ *
+ * ingress_ns and routed_ns are monotonic stamps (see stats_now_ns) set by
+ * the reader, so whichever queue writes the message last can time it. Zero
+ * means not stamped.
+ *
+ * expires_ns is the monotonic deadline after which nothing may deliver the
+ * message any more (the MQTT 5 Message Expiry Interval, or the broker's
+ * queued message TTL). Zero means it never expires. See expiry.h.
+ *
+ * +----------+-------+-----+--------+---------+---------------------------+
+ * | refcount | topic | len | stamps | expires | data (fixed header first) |
+ * +----------+-------+-----+--------+---------+---------------------------+
+ */
+struct mqtt_message {
+  atomic_uint refcount;
+  struct topic *topic; // NULL unless set by the router
+  size_t len;
+  uint64_t ingress_ns;
+  uint64_t routed_ns;
+  uint64_t expires_ns;
+  unsigned char data[];
+};
+
+// Whether msg is past its deadline at now_ns
+static inline int mqtt_message_expired(const struct mqtt_message *msg,
+                                       uint64_t now_ns) {
+  return msg->expires_ns != 0 && msg->expires_ns <= now_ns;
+}
+
+// Function prototypes
+struct mqtt_message *mqtt_message_new(const unsigned char *data, size_t len);
+struct mqtt_message *mqtt_message_ref(struct mqtt_message *msg);
+void mqtt_message_release(struct mqtt_message *msg);
+struct mqtt_message *mqtt_message_publish(struct topic *topic,
+                                          const void *payload, size_t len,
+                                          unsigned char header,
+                                          unsigned short pkt_id);
+
+#endif // MESSAGE_H
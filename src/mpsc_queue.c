@@ -0,0 +1,164 @@
+#include "mpsc_queue.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static void mpsc_queue_wake(struct mpsc_queue *q) {
+  uint64_t one = 1;
+  // A full eventfd counter still means "readable", nothing to handle here
+  if (write(q->wake_fd, &one, sizeof(one)) == -1) {
+    return;
+  }
+}
+
+/*
+ * Capacity is rounded up to a power of two so slot lookup is a mask instead
+ * of a division.
+ */
+int mpsc_queue_init(struct mpsc_queue *q, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  q->slots = malloc(sizeof(struct mpsc_slot) * size);
+  if (q->slots == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&q->slots[i].seq, i);
+  }
+
+  q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (q->wake_fd == -1) {
+    free(q->slots);
+    return -1;
+  }
+
+  q->mask = size - 1;
+  q->head = 0;
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->count, 0);
+  return 0;
+}
+
+/*
+ * Releases any deliveries still queued. Must only be called once no producer
+ * can push anymore.
+ */
+void mpsc_queue_destroy(struct mpsc_queue *q) {
+  struct delivery batch[64];
+  size_t n;
+  while ((n = mpsc_queue_pop_batch(q, batch, 64)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      mqtt_message_release(batch[i].msg);
+      free(batch[i].job);
+    }
+  }
+  close(q->wake_fd);
+  free(q->slots);
+  q->slots = NULL;
+}
+
+static int mpsc_queue_push_item(struct mpsc_queue *q,
+                                const struct delivery *item) {
+  /*
+   * The count is raised before the slot is claimed so the consumer can never
+   * subtract an item the counter has not seen yet. Whoever moves it off zero
+   * owns the wakeup.
+   */
+  size_t prev = atomic_fetch_add_explicit(&q->count, 1, memory_order_acq_rel);
+
+  size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  struct mpsc_slot *slot;
+  for (;;) {
+    slot = &q->slots[pos & q->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      atomic_fetch_sub_explicit(&q->count, 1, memory_order_acq_rel);
+      /*
+       * Another producer may have seen our transient increment and skipped
+       * its wakeup, so wake unconditionally; a spurious wakeup is harmless.
+       */
+      mpsc_queue_wake(q);
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    }
+  }
+
+  slot->item = *item;
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+  if (prev == 0) {
+    mpsc_queue_wake(q);
+  }
+  return 0;
+}
+
+/*
+ * Push a delivery, taking over the caller's reference to msg on success.
+ *
+ * Returns -1 when the ring is full; the caller keeps its reference and
+ * decides whether to drop the message or apply backpressure.
+ */
+int mpsc_queue_push(struct mpsc_queue *q, struct mqtt_message *msg, int fd) {
+  struct delivery item = {msg, fd, NULL};
+  return mpsc_queue_push_item(q, &item);
+}
+
+// Same as mpsc_queue_push, for a fan-out job the consumer frees
+int mpsc_queue_push_job(struct mpsc_queue *q, struct mqtt_message *msg,
+                        struct fanout_job *job) {
+  struct delivery item = {msg, -1, job};
+  return mpsc_queue_push_item(q, &item);
+}
+
+/*
+ * Pop up to max deliveries in one go. Only the owning worker may call this.
+ * The popped references now belong to the caller.
+ */
+size_t mpsc_queue_pop_batch(struct mpsc_queue *q, struct delivery *out,
+                            size_t max) {
+  size_t n = 0;
+  while (n < max) {
+    struct mpsc_slot *slot = &q->slots[q->head & q->mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != q->head + 1) {
+      break; // empty, or a producer has claimed the slot but not filled it
+    }
+    out[n++] = slot->item;
+    atomic_store_explicit(&slot->seq, q->head + q->mask + 1,
+                          memory_order_release);
+    q->head++;
+  }
+
+  if (n > 0) {
+    atomic_fetch_sub_explicit(&q->count, n, memory_order_acq_rel);
+  }
+  return n;
+}
+
+/*
+ * Non-zero if deliveries are still outstanding after a drain. Producers only
+ * signal the empty to non-empty transition, so a worker that stops draining
+ * early must poll again without sleeping while this holds.
+ */
+int mpsc_queue_pending(struct mpsc_queue *q) {
+  return atomic_load_explicit(&q->count, memory_order_acquire) != 0;
+}
+
+void mpsc_queue_clear_wakeup(struct mpsc_queue *q) {
+  uint64_t value;
+  if (read(q->wake_fd, &value, sizeof(value)) == -1) {
+    return; // EAGAIN, nothing was signalled
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include "message.h"
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MPSC_CACHE_LINE 64
+
+struct fanout_job;
+
+/*
+ * A single delivery handed from one worker to the worker that owns the
+ * target connection: a reference to the shared encoded message plus the
+ * socket it has to be written to. A fan-out delivery instead carries a job
+ * listing many subscribers owned by the receiving worker, with fd set to -1
+ * (see fanout.h).
+ */
+struct delivery {
+  struct mqtt_message *msg;
+  int fd;
+  struct fanout_job *job; // NULL for a single connection
+};
+
+struct mpsc_slot {
+  atomic_size_t seq;
+  struct delivery item;
+};
+
+/*
+ * Bounded lock-free multi-producer single-consumer ring.
+ *
+ * Any worker may push, only the owning worker pops. Every slot carries a
+ * sequence number so producers claim slots with a single CAS on the tail and
+ * the consumer never touches shared state other than the slot it reads.
+ * Head and tail live on separate cache lines to keep producers from bouncing
+ * the consumer's line.
+ *
+ * The queue owns an eventfd that is written only when the queue goes from
+ * empty to non-empty, so a burst of N deliveries costs one wakeup rather
+ * than N syscalls.
+ */
+struct mpsc_queue {
+  _Alignas(MPSC_CACHE_LINE) atomic_size_t tail; // next slot producers claim
+  _Alignas(MPSC_CACHE_LINE) atomic_size_t count; // items pushed, not popped
+  _Alignas(MPSC_CACHE_LINE) size_t head;         // consumer only
+  size_t mask;
+  struct mpsc_slot *slots;
+  int wake_fd;
+};
+
+// Function prototypes
+int mpsc_queue_init(struct mpsc_queue *q, size_t capacity);
+void mpsc_queue_destroy(struct mpsc_queue *q);
+int mpsc_queue_push(struct mpsc_queue *q, struct mqtt_message *msg, int fd);
+int mpsc_queue_push_job(struct mpsc_queue *q, struct mqtt_message *msg,
+                        struct fanout_job *job);
+size_t mpsc_queue_pop_batch(struct mpsc_queue *q, struct delivery *out,
+                            size_t max);
+int mpsc_queue_pending(struct mpsc_queue *q);
+void mpsc_queue_clear_wakeup(struct mpsc_queue *q);
+
+#endif // MPSC_QUEUE_H
@@ -1,10 +1,12 @@
 #include "mqtt.h"
 #include "mqtt_packet_utils.h"
-#include <bits/types/struct_iovec.h>
-#include <msgpack.h>
-#include <msgpack/unpack.h>
+#include "topic.h"
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /*
  * MQTT v3.1.1 standard, Remaining length field on the fixed header can be at
@@ -12,6 +14,12 @@
  */
 static const int MAX_LEN_BYTES = 4;
 
+/*
+ * Largest whole packet (fixed header included) the broker accepts. Checked
+ * from the fixed header alone, before anything is allocated for the packet.
+ */
+static size_t max_packet_size = MQTT_MAX_REMAINING_LENGTH + MQTT_MAX_FIXED_HEADER;
+
 // Reference: 3.1.1
 /*
  * Encode the remaining length field. This is the Variable Header
@@ -65,6 +73,109 @@ int mqtt_decode_length(const unsigned char **buf, unsigned long *length) {
   return 0;
 }
 
+void mqtt_set_max_packet_size(size_t size) {
+  if (size == 0 || size > MQTT_MAX_REMAINING_LENGTH + MQTT_MAX_FIXED_HEADER)
+    size = MQTT_MAX_REMAINING_LENGTH + MQTT_MAX_FIXED_HEADER;
+  max_packet_size = size;
+}
+
+size_t mqtt_get_max_packet_size(void) { return max_packet_size; }
+
+/*
+ * Work out the size of the packet at the front of a receive buffer that may
+ * hold only part of it. Unlike mqtt_decode_length this never reads past len,
+ * so it can run on every recv.
+ *
+ * On MQTT_FRAME_OK and MQTT_FRAME_TOO_LARGE, header_len is set to the size of
+ * the fixed header and remaining_len to the Remaining Length. An oversized
+ * packet is reported as soon as its length bytes are in, so the caller can
+ * drop the connection without buffering any of the body.
+ */
+enum mqtt_frame_status mqtt_frame_header(const unsigned char *buf, size_t len,
+                                         size_t *header_len,
+                                         size_t *remaining_len) {
+  size_t value = 0;
+  size_t multiplier = 1;
+
+  for (int i = 1; i <= MAX_LEN_BYTES; i++) {
+    if ((size_t)i >= len)
+      return MQTT_FRAME_INCOMPLETE;
+
+    value += (buf[i] & 127) * multiplier;
+    multiplier *= 128;
+    if ((buf[i] & 128) == 0) {
+      *header_len = i + 1;
+      *remaining_len = value;
+      if (*header_len + value > max_packet_size)
+        return MQTT_FRAME_TOO_LARGE;
+      return MQTT_FRAME_OK;
+    }
+  }
+
+  // Continuation bit still set on the fourth length byte
+  return MQTT_FRAME_MALFORMED;
+}
+
+/*
+ * Locate the topic of a PUBLISH whose body is still arriving, so a large
+ * message can be routed as soon as its variable header is in.
+ *
+ * Returns 0 and points topic into buf when enough bytes are buffered, 1 if
+ * more are needed and -1 if the frame is not usable.
+ */
+int mqtt_peek_publish_topic(const unsigned char *buf, size_t len,
+                            const unsigned char **topic, uint16_t *topiclen) {
+  size_t header_len, remaining_len;
+  enum mqtt_frame_status status =
+      mqtt_frame_header(buf, len, &header_len, &remaining_len);
+  if (status == MQTT_FRAME_INCOMPLETE)
+    return 1;
+  if (status != MQTT_FRAME_OK)
+    return -1;
+
+  if (len < header_len + sizeof(uint16_t))
+    return 1;
+  const uint8_t *ptr = buf + header_len;
+  uint16_t tlen = mqtt_unpack_u16(&ptr);
+  if (sizeof(uint16_t) + tlen > remaining_len)
+    return -1;
+  if (len < header_len + sizeof(uint16_t) + tlen)
+    return 1;
+
+  *topic = ptr;
+  *topiclen = tlen;
+  return 0;
+}
+
+/*
+ * Copy out a length-prefixed CONNECT field, NUL terminated. Returns -1 if
+ * the field runs past end or out of memory.
+ */
+static int unpack_connect_field(const unsigned char **buf,
+                                const unsigned char *end,
+                                unsigned char **out) {
+  if (end - *buf < (ptrdiff_t)sizeof(uint16_t))
+    return -1;
+  uint16_t len = mqtt_unpack_u16(buf);
+  if (end - *buf < len)
+    return -1;
+  *out = malloc(len + 1);
+  if (*out == NULL)
+    return -1;
+  mqtt_unpack_bytes(buf, len, *out);
+  return 0;
+}
+
+static void free_connect_fields(struct mqtt_connect *c) {
+  free(c->payload.client_id);
+  free(c->payload.will_topic);
+  free(c->payload.will_message);
+  free(c->payload.username);
+  free(c->payload.password);
+  c->payload.client_id = c->payload.will_topic = c->payload.will_message =
+      c->payload.username = c->payload.password = NULL;
+}
+
 static size_t unpack_mqtt_connect(const unsigned char *buf,
                                   union mqtt_header *hdr,
                                   union mqtt_packet *pkt) {
@@ -84,8 +195,17 @@ static size_t unpack_mqtt_connect(const unsigned char *buf,
 
   packet_end = buf + remaining_length;
 
-  /* Skip protocol name and version (8 bytes) */
-  buf += 7;
+  /*
+   * Skip protocol name and level. Every field below is bounded by the
+   * remaining length, a capture replays untrusted bytes through here.
+   */
+  if (packet_end - buf < (ptrdiff_t)sizeof(uint16_t))
+    goto malformed;
+  uint16_t name_len = mqtt_unpack_u16(&buf);
+  // name, level, flags and keepalive
+  if (packet_end - buf < name_len + 4)
+    goto malformed;
+  buf += name_len + 1;
 
   /* Read variable header byte flags */
   pkt->connect.byte = mqtt_unpack_u8((const uint8_t **)&buf);
@@ -93,37 +213,44 @@ static size_t unpack_mqtt_connect(const unsigned char *buf,
   /* Read keepalive */
   pkt->connect.payload.keepalive = mqtt_unpack_u16((const uint8_t **)&buf);
 
-  uint16_t cid_len;
-  cid_len = mqtt_unpack_u16(&buf);
-  if (cid_len > 0) {
-    pkt->connect.payload.client_id = malloc(cid_len + 1);
-    mqtt_unpack_bytes((const uint8_t **)&buf, cid_len,
-                      pkt->connect.payload.client_id);
-    if (pkt->connect.payload.client_id == NULL) {
-      return 0;
-    }
-  } else {
+  if (packet_end - buf < (ptrdiff_t)sizeof(uint16_t))
+    goto malformed;
+  if (buf[0] == 0 && buf[1] == 0) {
     // TODO: create client id
+    buf += sizeof(uint16_t);
+  } else if (unpack_connect_field(&buf, packet_end,
+                                  &pkt->connect.payload.client_id) == -1) {
+    goto malformed;
   }
 
-  if (pkt->connect.bits.will == 1) {
-    pkt->connect.payload.will_topic = mqtt_unpack_string(&buf);
-    pkt->connect.payload.will_message = mqtt_unpack_string(&buf);
-  }
+  if (pkt->connect.bits.will == 1 &&
+      (unpack_connect_field(&buf, packet_end,
+                            &pkt->connect.payload.will_topic) == -1 ||
+       unpack_connect_field(&buf, packet_end,
+                            &pkt->connect.payload.will_message) == -1))
+    goto malformed;
   /* Read the username if username flag is set */
-  if (pkt->connect.bits.username == 1)
-    pkt->connect.payload.username = mqtt_unpack_string(&buf);
+  if (pkt->connect.bits.username == 1 &&
+      unpack_connect_field(&buf, packet_end,
+                           &pkt->connect.payload.username) == -1)
+    goto malformed;
   /* Read the password if password flag is set */
-  if (pkt->connect.bits.password == 1)
-    pkt->connect.payload.password = mqtt_unpack_string(&buf);
+  if (pkt->connect.bits.password == 1 &&
+      unpack_connect_field(&buf, packet_end,
+                           &pkt->connect.payload.password) == -1)
+    goto malformed;
 
   /* Check if we've read exactly the right number of bytes */
   if (buf != packet_end) {
     fprintf(stderr, "Packet length mismatch\n");
-    return 0;
+    goto malformed;
   }
 
   return buf - init;
+
+malformed:
+  free_connect_fields(&pkt->connect);
+  return 0;
 }
 
 static size_t unpack_mqtt_publish(const unsigned char *buf,
@@ -135,32 +262,317 @@ static size_t unpack_mqtt_publish(const unsigned char *buf,
    * Second byte of the fixed header, contains the length of remaining bytes
    * of the connect packet
    */
-  int status;
   size_t len;
-  status = mqtt_decode_length(&buf, &len);
-  if (status == -1) {
-    // handle error
+  if (mqtt_decode_length(&buf, &len) == -1) {
+    fprintf(stderr, "Error decoding remaining length\n");
+    return 0;
   }
 
-  /* Read topic length and topic of the soon-to-be-published message */
+  /*
+   * Read topic length and topic of the soon-to-be-published message. The
+   * topic is interned rather than copied: most messages repeat a topic the
+   * broker already holds, and every later stage shares the same handle.
+   */
+  if (len < sizeof(uint16_t)) {
+    fprintf(stderr, "PUBLISH too short for a topic length\n");
+    return 0;
+  }
   pkt->publish.topiclen = mqtt_unpack_u16(&buf);
-  pkt->publish.topic = malloc(pkt->publish.topiclen + 1);
-  mqtt_unpack_bytes((const uint8_t **)&buf, pkt->publish.topiclen,
-                    pkt->publish.topic);
+  // The topic and packet id must lie inside the frame before anything reads
+  // them, a forged topic length would otherwise read past its end
+  if (sizeof(uint16_t) + pkt->publish.topiclen +
+          (hdr->bits.qos > AT_MOST_ONCE ? sizeof(uint16_t) : 0) >
+      len) {
+    fprintf(stderr, "PUBLISH variable header exceeds remaining length\n");
+    return 0;
+  }
+  pkt->publish.interned =
+      topic_intern((const char *)buf, pkt->publish.topiclen);
+  if (pkt->publish.interned == NULL) {
+    return 0;
+  }
+  pkt->publish.topic = (unsigned char *)pkt->publish.interned->name;
+  buf += pkt->publish.topiclen;
 
-  uint16_t message_len = len;
+  /*
+   * Payloads can be up to 256 MB, so the length is kept in a size_t all the
+   * way through; a 16 bit length silently wrapped anything over 64 KB.
+   */
+  size_t message_len = len;
+  size_t variable_header = sizeof(uint16_t) + pkt->publish.topiclen;
   /* Read packet id */
   if (publish.header.bits.qos > AT_MOST_ONCE) {
     pkt->publish.pkt_id = mqtt_unpack_u16((const uint8_t **)&buf);
-    message_len -= sizeof(uint16_t);
+    variable_header += sizeof(uint16_t);
+  }
+  if (variable_header > message_len) {
+    fprintf(stderr, "PUBLISH variable header exceeds remaining length\n");
+    topic_release(pkt->publish.interned);
+    pkt->publish.interned = NULL;
+    pkt->publish.topic = NULL;
+    return 0;
   }
   /*
    * Message len is calculated subtracting the length of the variable header
    * from the Remaining Length field that is in the Fixed Header
    */
-  message_len -= (sizeof(uint16_t) + pkt->publish.topiclen);
+  message_len -= variable_header;
   pkt->publish.payloadlen = message_len;
   pkt->publish.payload = malloc(message_len + 1);
+  if (pkt->publish.payload == NULL) {
+    topic_release(pkt->publish.interned);
+    pkt->publish.interned = NULL;
+    pkt->publish.topic = NULL;
+    return 0;
+  }
   mqtt_unpack_bytes((const uint8_t **)&buf, message_len, pkt->publish.payload);
   return len;
-}
\ No newline at end of file
+}
+
+static size_t unpack_mqtt_ack(const unsigned char *buf, union mqtt_header *hdr,
+                              union mqtt_packet *pkt) {
+  struct mqtt_ack ack = {.header = *hdr};
+  size_t len;
+  if (mqtt_decode_length(&buf, &len) == -1 || len != sizeof(uint16_t))
+    return 0;
+  ack.pkt_id = mqtt_unpack_u16((const uint8_t **)&buf);
+  pkt->ack = ack;
+  return len;
+}
+
+/*
+ * Number of filters in a SUBSCRIBE (extra = 1, the QoS byte) or UNSUBSCRIBE
+ * payload, 0 if one overruns it or there are none (3.8.3-3, 3.10.3-2).
+ */
+static unsigned short count_filters(const unsigned char *buf,
+                                    const unsigned char *end, size_t extra) {
+  size_t n = 0;
+  while (buf < end && n < USHRT_MAX) {
+    if ((size_t)(end - buf) < sizeof(uint16_t))
+      return 0;
+    size_t len = (size_t)buf[0] << 8 | buf[1];
+    if (len == 0 || (size_t)(end - buf) < sizeof(uint16_t) + len + extra)
+      return 0;
+    buf += sizeof(uint16_t) + len + extra;
+    n++;
+  }
+  return buf == end ? n : 0;
+}
+
+/*
+ * The filters of a SUBSCRIBE or UNSUBSCRIBE point into buf instead of being
+ * copied: a reconnecting client sends dozens at once and they are interned
+ * when applied, see subs_apply. Only the tuples array is allocated, and buf
+ * must outlive the packet.
+ */
+static size_t unpack_mqtt_subscribe(const unsigned char *buf,
+                                    union mqtt_header *hdr,
+                                    union mqtt_packet *pkt) {
+  struct mqtt_subscribe sub = {.header = *hdr};
+  size_t len;
+  if (mqtt_decode_length(&buf, &len) == -1 || len < sizeof(uint16_t))
+    return 0;
+  const unsigned char *end = buf + len;
+  sub.pkt_id = mqtt_unpack_u16((const uint8_t **)&buf);
+  sub.tuples_len = count_filters(buf, end, 1);
+  if (sub.tuples_len == 0)
+    return 0;
+  sub.tuples = malloc(sizeof(*sub.tuples) * sub.tuples_len);
+  if (sub.tuples == NULL)
+    return 0;
+  for (unsigned i = 0; i < sub.tuples_len; i++) {
+    sub.tuples[i].topic_len = mqtt_unpack_u16((const uint8_t **)&buf);
+    sub.tuples[i].topic = (unsigned char *)buf;
+    buf += sub.tuples[i].topic_len;
+    sub.tuples[i].qos = mqtt_unpack_u8((const uint8_t **)&buf);
+  }
+  pkt->subscribe = sub;
+  return len;
+}
+
+static size_t unpack_mqtt_unsubscribe(const unsigned char *buf,
+                                      union mqtt_header *hdr,
+                                      union mqtt_packet *pkt) {
+  struct mqtt_unsubscribe unsub = {.header = *hdr};
+  size_t len;
+  if (mqtt_decode_length(&buf, &len) == -1 || len < sizeof(uint16_t))
+    return 0;
+  const unsigned char *end = buf + len;
+  unsub.pkt_id = mqtt_unpack_u16((const uint8_t **)&buf);
+  unsub.tuples_len = count_filters(buf, end, 0);
+  if (unsub.tuples_len == 0)
+    return 0;
+  unsub.tuples = malloc(sizeof(*unsub.tuples) * unsub.tuples_len);
+  if (unsub.tuples == NULL)
+    return 0;
+  for (unsigned i = 0; i < unsub.tuples_len; i++) {
+    unsub.tuples[i].topic_len = mqtt_unpack_u16((const uint8_t **)&buf);
+    unsub.tuples[i].topic = (unsigned char *)buf;
+    buf += unsub.tuples[i].topic_len;
+  }
+  pkt->unsubscribe = unsub;
+  return len;
+}
+
+/*
+ * Decode the complete packet at buf (fixed header first) into pkt. The
+ * caller frames the packet first, see mqtt_frame_header.
+ *
+ * Returns 0 on success and -1 for malformed or not yet supported packets.
+ */
+int unpack_mqtt_packet(const unsigned char *buf, union mqtt_packet *pkt) {
+  union mqtt_header hdr = {.byte = *buf};
+  size_t rc = 1;
+
+  buf++;
+  switch (hdr.bits.type) {
+  case CONNECT:
+    rc = unpack_mqtt_connect(buf, &hdr, pkt);
+    break;
+  case PUBLISH:
+    rc = unpack_mqtt_publish(buf, &hdr, pkt);
+    break;
+  case PUBACK:
+  case PUBREC:
+  case PUBREL:
+  case PUBCOMP:
+    rc = unpack_mqtt_ack(buf, &hdr, pkt);
+    break;
+  case SUBSCRIBE:
+    rc = unpack_mqtt_subscribe(buf, &hdr, pkt);
+    break;
+  case UNSUBSCRIBE:
+    rc = unpack_mqtt_unsubscribe(buf, &hdr, pkt);
+    break;
+  case PINGREQ:
+  case DISCONNECT:
+    pkt->header = hdr;
+    break;
+  default:
+    return -1;
+  }
+  return rc == 0 ? -1 : 0;
+}
+
+/*
+ * Encoded size of a PUBLISH, fixed header included
+ */
+size_t mqtt_publish_size(const struct mqtt_publish *pub) {
+  unsigned char len_bytes[MAX_LEN_BYTES];
+  size_t remaining = sizeof(uint16_t) + pub->topiclen + pub->payloadlen;
+  if (pub->header.bits.qos > AT_MOST_ONCE)
+    remaining += sizeof(uint16_t);
+  return 1 + mqtt_encode_length(len_bytes, remaining) + remaining;
+}
+
+/*
+ * Serialize a PUBLISH into buf, which must hold mqtt_publish_size bytes.
+ * Returns the number of bytes written.
+ */
+size_t pack_mqtt_publish(unsigned char *buf, const struct mqtt_publish *pub) {
+  unsigned char *ptr = buf;
+  size_t remaining = sizeof(uint16_t) + pub->topiclen + pub->payloadlen;
+  if (pub->header.bits.qos > AT_MOST_ONCE)
+    remaining += sizeof(uint16_t);
+
+  mqtt_pack_u8(&ptr, pub->header.byte);
+  ptr += mqtt_encode_length(ptr, remaining);
+  mqtt_pack_string(&ptr, (const char *)pub->topic, pub->topiclen);
+  if (pub->header.bits.qos > AT_MOST_ONCE)
+    mqtt_pack_u16(&ptr, pub->pkt_id);
+  memcpy(ptr, pub->payload, pub->payloadlen);
+  ptr += pub->payloadlen;
+  return ptr - buf;
+}
+
+static size_t connect_remaining(const struct mqtt_connect *c) {
+  // Protocol name, level, flags and keepalive
+  size_t remaining = 10;
+  remaining += sizeof(uint16_t);
+  if (c->payload.client_id != NULL)
+    remaining += strlen((const char *)c->payload.client_id);
+  if (c->bits.will) {
+    remaining += sizeof(uint16_t) + strlen((const char *)c->payload.will_topic);
+    remaining +=
+        sizeof(uint16_t) + strlen((const char *)c->payload.will_message);
+  }
+  if (c->bits.username)
+    remaining += sizeof(uint16_t) + strlen((const char *)c->payload.username);
+  if (c->bits.password)
+    remaining += sizeof(uint16_t) + strlen((const char *)c->payload.password);
+  return remaining;
+}
+
+static void pack_optional_string(unsigned char **ptr, const unsigned char *s) {
+  size_t len = s != NULL ? strlen((const char *)s) : 0;
+  mqtt_pack_string(ptr, s != NULL ? (const char *)s : "", len);
+}
+
+/*
+ * Encoded size of a CONNECT, fixed header included
+ */
+size_t mqtt_connect_size(const struct mqtt_connect *c) {
+  unsigned char len_bytes[MAX_LEN_BYTES];
+  size_t remaining = connect_remaining(c);
+  return 1 + mqtt_encode_length(len_bytes, remaining) + remaining;
+}
+
+/*
+ * Serialize a MQTT 3.1.1 CONNECT into buf, which must hold mqtt_connect_size
+ * bytes. Optional strings are written when their flag bit is set.
+ */
+size_t pack_mqtt_connect(unsigned char *buf, const struct mqtt_connect *c) {
+  unsigned char *ptr = buf;
+
+  mqtt_pack_u8(&ptr, CONNECT << 4);
+  ptr += mqtt_encode_length(ptr, connect_remaining(c));
+  mqtt_pack_string(&ptr, "MQTT", 4);
+  mqtt_pack_u8(&ptr, 4); // protocol level 3.1.1
+  mqtt_pack_u8(&ptr, c->byte);
+  mqtt_pack_u16(&ptr, c->payload.keepalive);
+  pack_optional_string(&ptr, c->payload.client_id);
+  if (c->bits.will) {
+    pack_optional_string(&ptr, c->payload.will_topic);
+    pack_optional_string(&ptr, c->payload.will_message);
+  }
+  if (c->bits.username)
+    pack_optional_string(&ptr, c->payload.username);
+  if (c->bits.password)
+    pack_optional_string(&ptr, c->payload.password);
+  return ptr - buf;
+}
+
+static size_t subscribe_remaining(const struct mqtt_subscribe *s) {
+  size_t remaining = sizeof(uint16_t);
+  for (unsigned i = 0; i < s->tuples_len; i++)
+    remaining += sizeof(uint16_t) + s->tuples[i].topic_len + 1;
+  return remaining;
+}
+
+/*
+ * Encoded size of a SUBSCRIBE, fixed header included
+ */
+size_t mqtt_subscribe_size(const struct mqtt_subscribe *s) {
+  unsigned char len_bytes[MAX_LEN_BYTES];
+  size_t remaining = subscribe_remaining(s);
+  return 1 + mqtt_encode_length(len_bytes, remaining) + remaining;
+}
+
+/*
+ * Serialize a SUBSCRIBE into buf, which must hold mqtt_subscribe_size bytes.
+ * The fixed header flags are always 0010 as the spec requires.
+ */
+size_t pack_mqtt_subscribe(unsigned char *buf,
+                           const struct mqtt_subscribe *s) {
+  unsigned char *ptr = buf;
+
+  mqtt_pack_u8(&ptr, SUBSCRIBE << 4 | 0x02);
+  ptr += mqtt_encode_length(ptr, subscribe_remaining(s));
+  mqtt_pack_u16(&ptr, s->pkt_id);
+  for (unsigned i = 0; i < s->tuples_len; i++) {
+    mqtt_pack_string(&ptr, (const char *)s->tuples[i].topic,
+                     s->tuples[i].topic_len);
+    mqtt_pack_u8(&ptr, s->tuples[i].qos);
+  }
+  return ptr - buf;
+}
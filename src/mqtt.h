@@ -59,6 +59,23 @@
 #define UNSUBACK_BYTE 0xB0
 #define PINGRESP_BYTE 0xD0
 
+/*
+ * Largest Remaining Length the 4 byte variable length encoding can carry
+ * (256 MB). The broker-wide limit set with mqtt_set_max_packet_size can only
+ * lower this.
+ */
+#define MQTT_MAX_REMAINING_LENGTH 268435455
+// Fixed header is at most 1 type byte plus 4 length bytes
+#define MQTT_MAX_FIXED_HEADER 5
+
+// Result of inspecting the fixed header at the front of a receive buffer
+enum mqtt_frame_status {
+  MQTT_FRAME_INCOMPLETE, // need more bytes to know the packet size
+  MQTT_FRAME_OK,
+  MQTT_FRAME_TOO_LARGE, // exceeds the configured max packet size
+  MQTT_FRAME_MALFORMED,
+};
+
 // Reference: 2.1.2 MQTT Control Packet type
 enum packet_type {
   CONNECT = 1,
@@ -211,12 +228,15 @@ struct mqtt_connack {
   unsigned char rc;
 };
 
+struct topic;
+
 struct mqtt_publish {
   union mqtt_header header;
   unsigned short pkt_id;
   unsigned short topiclen;
-  unsigned char *topic;
-  unsigned short payloadlen;
+  unsigned char *topic;      // name of interned, not a private copy
+  struct topic *interned;    // reference owned by the packet
+  size_t payloadlen; // up to 256 MB, does not fit in 16 bits
   unsigned char *payload;
 };
 
@@ -281,9 +301,21 @@ union mqtt_packet {
 // Function prototypes
 int mqtt_encode_length(unsigned char *, size_t);
 int mqtt_decode_length(const unsigned char **, unsigned long *);
+void mqtt_set_max_packet_size(size_t);
+size_t mqtt_get_max_packet_size(void);
+enum mqtt_frame_status mqtt_frame_header(const unsigned char *, size_t,
+                                         size_t *, size_t *);
+int mqtt_peek_publish_topic(const unsigned char *, size_t,
+                            const unsigned char **, uint16_t *);
 
 int unpack_mqtt_packet(const unsigned char *, union mqtt_packet *);
 unsigned char *pack_mqtt_packet(const union mqtt_packet *, unsigned);
+size_t mqtt_publish_size(const struct mqtt_publish *);
+size_t pack_mqtt_publish(unsigned char *, const struct mqtt_publish *);
+size_t mqtt_connect_size(const struct mqtt_connect *);
+size_t pack_mqtt_connect(unsigned char *, const struct mqtt_connect *);
+size_t mqtt_subscribe_size(const struct mqtt_subscribe *);
+size_t pack_mqtt_subscribe(unsigned char *, const struct mqtt_subscribe *);
 
 union mqtt_header *mqtt_packet_header(unsigned char);
 struct mqtt_ack *mqtt_packet_ack(unsigned char, unsigned short);
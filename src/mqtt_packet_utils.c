@@ -38,7 +38,7 @@ unsigned char *mqtt_unpack_string(const uint8_t **buf) {
   return str;
 }
 
-uint8_t *unpack_bytes(const uint8_t **buf, size_t len, uint8_t *str) {
+uint8_t *mqtt_unpack_bytes(const uint8_t **buf, size_t len, uint8_t *str) {
     memcpy(str, *buf, len);
     str[len] = '\0';
     (*buf) += len;
@@ -0,0 +1,800 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#include "mqttsn.h"
+#include "mqtt.h"
+#include "stats.h"
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const size_t SN_INITIAL_BUCKETS = 64;
+// Receive buffer asked for, so bursts queue in the kernel between polls
+static const int SN_RCVBUF = 8 * 1024 * 1024;
+
+struct sn_io {
+  struct mmsghdr rx[SN_BATCH];
+  struct iovec rx_iov[SN_BATCH];
+  struct sockaddr_storage rx_addr[SN_BATCH];
+  unsigned char rx_buf[SN_BATCH][SN_MAX_DATAGRAM];
+
+  struct mmsghdr tx[SN_BATCH];
+  struct iovec tx_iov[SN_BATCH];
+  struct sockaddr_storage tx_addr[SN_BATCH];
+  unsigned char tx_buf[SN_BATCH][SN_MAX_DATAGRAM];
+  unsigned tx_count;
+};
+
+static void put16(unsigned char *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static uint16_t get16(const unsigned char *p) { return p[0] << 8 | p[1]; }
+
+/*
+ * Bind a non-blocking UDP socket on every local address, sensors are
+ * remote. Returns the socket or -1.
+ */
+int mqttsn_listen(const char *port) {
+  struct addrinfo hints, *info, *ai;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(NULL, port, &hints, &info) != 0) {
+    return -1;
+  }
+
+  int fd = -1;
+  for (ai = info; ai != NULL; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                ai->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(info);
+  if (fd != -1) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &SN_RCVBUF, sizeof(SN_RCVBUF));
+  }
+  return fd;
+}
+
+/*
+ * Set up a gateway on a bound UDP socket, which it takes over. Received
+ * PUBLISH packets go to route.
+ */
+int mqttsn_init(struct sn_gateway *gw, int fd, sn_route_fn route, void *arg) {
+  memset(gw, 0, sizeof(*gw));
+  gw->buckets = calloc(SN_INITIAL_BUCKETS, sizeof(*gw->buckets));
+  gw->io = calloc(1, sizeof(*gw->io));
+  if (gw->buckets == NULL || gw->io == NULL) {
+    free(gw->buckets);
+    free(gw->io);
+    gw->buckets = NULL;
+    gw->io = NULL;
+    return -1;
+  }
+  gw->mask = SN_INITIAL_BUCKETS - 1;
+  gw->fd = fd;
+  gw->route = route;
+  gw->route_arg = arg;
+  subs_init(&gw->subs);
+
+  for (int i = 0; i < SN_BATCH; i++) {
+    gw->io->rx_iov[i].iov_base = gw->io->rx_buf[i];
+    gw->io->rx_iov[i].iov_len = SN_MAX_DATAGRAM;
+    gw->io->rx[i].msg_hdr.msg_iov = &gw->io->rx_iov[i];
+    gw->io->rx[i].msg_hdr.msg_iovlen = 1;
+    gw->io->rx[i].msg_hdr.msg_name = &gw->io->rx_addr[i];
+    gw->io->tx_iov[i].iov_base = gw->io->tx_buf[i];
+    gw->io->tx[i].msg_hdr.msg_iov = &gw->io->tx_iov[i];
+    gw->io->tx[i].msg_hdr.msg_iovlen = 1;
+    gw->io->tx[i].msg_hdr.msg_name = &gw->io->tx_addr[i];
+  }
+  return 0;
+}
+
+// A subscription was added (delta 1) or removed (delta -1)
+static void interest(struct sn_gateway *gw, struct topic *filter, int delta) {
+  if (gw->stats != NULL) {
+    stats_add(gw->stats, STAT_SUBSCRIPTIONS, delta);
+  }
+  if (gw->interest != NULL) {
+    gw->interest(filter, delta, gw->interest_arg);
+  }
+}
+
+// Forget the client's topic ids and subscriptions
+static void client_reset(struct sn_gateway *gw, struct sn_client *c) {
+  for (size_t i = 0; i < c->nfilters; i++) {
+    subs_remove(&gw->subs, c->filters[i], c);
+    interest(gw, c->filters[i], -1);
+    topic_release(c->filters[i]);
+  }
+  c->nfilters = 0;
+  for (uint16_t i = 0; i < c->nids; i++) {
+    topic_release(c->ids[i]);
+  }
+  c->nids = 0;
+}
+
+static void client_free(struct sn_gateway *gw, struct sn_client *c) {
+  client_reset(gw, c);
+  free(c->filters);
+  free(c->ids);
+  free(c);
+}
+
+void mqttsn_destroy(struct sn_gateway *gw) {
+  for (size_t b = 0; gw->buckets != NULL && b <= gw->mask; b++) {
+    while (gw->buckets[b] != NULL) {
+      struct sn_client *c = gw->buckets[b];
+      gw->buckets[b] = c->next;
+      client_free(gw, c);
+    }
+  }
+  free(gw->buckets);
+  gw->buckets = NULL;
+  free(gw->io);
+  gw->io = NULL;
+  for (int i = 0; i < SN_MAX_PREDEFINED; i++) {
+    topic_release(gw->predefined[i]);
+    gw->predefined[i] = NULL;
+  }
+  subs_destroy(&gw->subs);
+  if (gw->fd != -1) {
+    close(gw->fd);
+    gw->fd = -1;
+  }
+}
+
+/*
+ * Configure a topic id every client may publish to without registering,
+ * including with QoS -1.
+ */
+int mqttsn_predefine(struct sn_gateway *gw, uint16_t id, const char *name) {
+  if (id == 0 || id >= SN_MAX_PREDEFINED) {
+    return -1;
+  }
+  struct topic *t = topic_intern(name, strlen(name));
+  if (t == NULL) {
+    return -1;
+  }
+  topic_release(gw->predefined[id]);
+  gw->predefined[id] = t;
+  return 0;
+}
+
+// Port and address, the identity of a client
+static size_t addr_key(const struct sockaddr_storage *addr,
+                       unsigned char key[18]) {
+  if (addr->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+    memcpy(key, &a->sin6_port, 2);
+    memcpy(key + 2, &a->sin6_addr, 16);
+    return 18;
+  }
+  const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+  memcpy(key, &a->sin_port, 2);
+  memcpy(key + 2, &a->sin_addr, 4);
+  return 6;
+}
+
+static uint32_t addr_hash(const struct sockaddr_storage *addr) {
+  unsigned char key[18];
+  size_t len = addr_key(addr, key);
+  return topic_hash((const char *)key, len) ^ addr->ss_family;
+}
+
+static int same_addr(const struct sockaddr_storage *a,
+                     const struct sockaddr_storage *b) {
+  unsigned char ka[18], kb[18];
+  size_t len = addr_key(a, ka);
+  return a->ss_family == b->ss_family && addr_key(b, kb) == len &&
+         memcmp(ka, kb, len) == 0;
+}
+
+static struct sn_client *client_find(struct sn_gateway *gw,
+                                     const struct sockaddr_storage *addr,
+                                     uint32_t hash) {
+  for (struct sn_client *c = gw->buckets[hash & gw->mask]; c != NULL;
+       c = c->next) {
+    if (c->hash == hash && same_addr(&c->addr, addr)) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+// Double the buckets once there are more clients than buckets
+static void client_table_grow(struct sn_gateway *gw) {
+  size_t nbuckets = (gw->mask + 1) * 2;
+  struct sn_client **grown = calloc(nbuckets, sizeof(*grown));
+  if (grown == NULL) {
+    return; // longer chains, still correct
+  }
+  for (size_t b = 0; b <= gw->mask; b++) {
+    while (gw->buckets[b] != NULL) {
+      struct sn_client *c = gw->buckets[b];
+      gw->buckets[b] = c->next;
+      c->next = grown[c->hash & (nbuckets - 1)];
+      grown[c->hash & (nbuckets - 1)] = c;
+    }
+  }
+  free(gw->buckets);
+  gw->buckets = grown;
+  gw->mask = nbuckets - 1;
+}
+
+static struct sn_client *client_add(struct sn_gateway *gw,
+                                    const struct sockaddr_storage *addr,
+                                    socklen_t addr_len, uint32_t hash) {
+  struct sn_client *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  memcpy(&c->addr, addr, addr_len);
+  c->addr_len = addr_len;
+  c->hash = hash;
+  c->next_msg_id = 1;
+  if (gw->nclients >= gw->mask + 1) {
+    client_table_grow(gw);
+  }
+  c->next = gw->buckets[hash & gw->mask];
+  gw->buckets[hash & gw->mask] = c;
+  gw->nclients++;
+  return c;
+}
+
+static void client_remove(struct sn_gateway *gw, struct sn_client *c) {
+  struct sn_client **at = &gw->buckets[c->hash & gw->mask];
+  while (*at != c) {
+    at = &(*at)->next;
+  }
+  *at = c->next;
+  gw->nclients--;
+  client_free(gw, c);
+}
+
+// The id t is registered under for this client, 0 if none
+static uint16_t client_topic_id(const struct sn_client *c,
+                                const struct topic *t) {
+  for (uint16_t i = 0; i < c->nids; i++) {
+    if (c->ids[i] == t) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Register t for the client, returns its id or 0 when out of ids
+static uint16_t client_register(struct sn_client *c, struct topic *t) {
+  uint16_t id = client_topic_id(c, t);
+  if (id != 0) {
+    return id;
+  }
+  if (c->nids == UINT16_MAX - 1) {
+    return 0;
+  }
+  if (c->nids == c->ids_cap) {
+    size_t cap = c->ids_cap ? (size_t)c->ids_cap * 2 : 8;
+    if (cap > UINT16_MAX - 1) {
+      cap = UINT16_MAX - 1;
+    }
+    struct topic **grown = realloc(c->ids, sizeof(*grown) * cap);
+    if (grown == NULL) {
+      return 0;
+    }
+    c->ids = grown;
+    c->ids_cap = cap;
+  }
+  c->ids[c->nids++] = topic_ref(t);
+  return c->nids;
+}
+
+int mqttsn_flush(struct sn_gateway *gw) {
+  unsigned sent = 0;
+  while (sent < gw->io->tx_count) {
+    int n = sendmmsg(gw->fd, gw->io->tx + sent, gw->io->tx_count - sent, 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // Datagrams are best effort, don't hold the loop for a full socket
+      gw->dropped += gw->io->tx_count - sent;
+      break;
+    }
+    if (gw->stats != NULL) {
+      for (int i = 0; i < n; i++) {
+        stats_add(gw->stats, STAT_BYTES_OUT, gw->io->tx[sent + i].msg_len);
+      }
+    }
+    sent += n;
+  }
+  gw->io->tx_count = 0;
+  return sent;
+}
+
+/*
+ * Start a packet of body bytes after the header to addr in the send batch,
+ * sending the batch first if it is full. Returns where the body goes, or
+ * NULL if the packet wouldn't fit in a datagram.
+ */
+static unsigned char *sn_packet(struct sn_gateway *gw,
+                                const struct sockaddr_storage *addr,
+                                socklen_t addr_len, enum sn_type type,
+                                size_t body) {
+  size_t len = body + 2 <= 255 ? body + 2 : body + 4;
+  if (len > SN_MAX_DATAGRAM) {
+    gw->dropped++;
+    return NULL;
+  }
+  if (gw->io->tx_count == SN_BATCH) {
+    mqttsn_flush(gw);
+  }
+
+  unsigned slot = gw->io->tx_count++;
+  memcpy(&gw->io->tx_addr[slot], addr, addr_len);
+  gw->io->tx[slot].msg_hdr.msg_namelen = addr_len;
+  gw->io->tx_iov[slot].iov_len = len;
+  unsigned char *p = gw->io->tx_buf[slot];
+  if (len <= 255) {
+    *p++ = len;
+  } else {
+    *p++ = 0x01;
+    put16(p, len);
+    p += 2;
+  }
+  *p++ = type;
+  return p;
+}
+
+static void sn_ack(struct sn_gateway *gw, const struct sockaddr_storage *addr,
+                   socklen_t addr_len, enum sn_type type, uint16_t topic_id,
+                   uint16_t msg_id, enum sn_return_code rc) {
+  unsigned char *p = sn_packet(gw, addr, addr_len, type, 5);
+  if (p != NULL) {
+    put16(p, topic_id);
+    put16(p + 2, msg_id);
+    p[4] = rc;
+  }
+}
+
+static void sn_empty(struct sn_gateway *gw, const struct sockaddr_storage *addr,
+                     socklen_t addr_len, enum sn_type type) {
+  sn_packet(gw, addr, addr_len, type, 0);
+}
+
+static int has_wildcard(const unsigned char *name, size_t len) {
+  return memchr(name, '+', len) != NULL || memchr(name, '#', len) != NULL;
+}
+
+/*
+ * Topic a PUBLISH, SUBSCRIBE or UNSUBSCRIBE refers to, as a new reference,
+ * or NULL if it names none. With by_name a normal topic type carries the
+ * name itself (SUBSCRIBE) rather than a registered id (PUBLISH).
+ */
+static struct topic *sn_topic(struct sn_gateway *gw, struct sn_client *c,
+                              int type, const unsigned char *field,
+                              size_t len, int by_name) {
+  if (type == SN_TOPIC_SHORT) {
+    return len == 2 ? topic_intern((const char *)field, 2) : NULL;
+  }
+  if (len != 2 && !(type == SN_TOPIC_NORMAL && by_name)) {
+    return NULL;
+  }
+  if (type == SN_TOPIC_PREDEFINED) {
+    uint16_t id = get16(field);
+    return id < SN_MAX_PREDEFINED && gw->predefined[id] != NULL
+               ? topic_ref(gw->predefined[id])
+               : NULL;
+  }
+  if (by_name) {
+    return len > 0 ? topic_intern((const char *)field, len) : NULL;
+  }
+  uint16_t id = get16(field);
+  return c != NULL && id >= 1 && id <= c->nids ? topic_ref(c->ids[id - 1])
+                                                : NULL;
+}
+
+static void sn_connect(struct sn_gateway *gw, struct sn_client *c,
+                       const struct sockaddr_storage *addr, socklen_t addr_len,
+                       uint32_t hash, const unsigned char *body, size_t len,
+                       uint64_t now) {
+  // Flags, protocol id, duration, then the client id
+  size_t id_len = len - 4;
+  if (len < 5 || id_len > SN_MAX_CLIENT_ID || body[1] != 0x01) {
+    gw->dropped++;
+    return;
+  }
+  if (body[0] & SN_FLAG_WILL) {
+    unsigned char *p = sn_packet(gw, addr, addr_len, SN_CONNACK, 1);
+    if (p != NULL) {
+      *p = SN_REJECTED_NOT_SUPPORTED;
+    }
+    return;
+  }
+  if (c == NULL) {
+    c = client_add(gw, addr, addr_len, hash);
+  } else if (body[0] & 0x04) {
+    client_reset(gw, c); // clean session
+  }
+  unsigned char *p = sn_packet(gw, addr, addr_len, SN_CONNACK, 1);
+  if (c == NULL) {
+    if (p != NULL) {
+      *p = SN_REJECTED_CONGESTION;
+    }
+    return;
+  }
+  memcpy(c->client_id, body + 4, id_len);
+  c->client_id[id_len] = '\0';
+  // Silent for one and a half keep alive periods means gone
+  c->keepalive_ns = get16(body + 2) * 1500000000ULL;
+  c->last_seen_ns = now;
+  if (p != NULL) {
+    *p = SN_ACCEPTED;
+  }
+}
+
+static void sn_register(struct sn_gateway *gw, struct sn_client *c,
+                        const unsigned char *body, size_t len) {
+  // Topic id (0 from a client), message id, topic name
+  if (c == NULL || len < 5 || has_wildcard(body + 4, len - 4)) {
+    gw->dropped++;
+    return;
+  }
+  uint16_t id = 0;
+  struct topic *t = topic_intern((const char *)body + 4, len - 4);
+  if (t != NULL) {
+    id = client_register(c, t);
+    topic_release(t);
+  }
+  sn_ack(gw, &c->addr, c->addr_len, SN_REGACK, id, get16(body + 2),
+         id != 0 ? SN_ACCEPTED : SN_REJECTED_CONGESTION);
+}
+
+static void sn_publish(struct sn_gateway *gw, struct sn_client *c,
+                       const struct sockaddr_storage *addr, socklen_t addr_len,
+                       const unsigned char *body, size_t len, uint64_t now) {
+  // Flags, topic id, message id, data
+  if (len < 5) {
+    gw->dropped++;
+    return;
+  }
+  int qos = body[0] & SN_FLAG_QOS_MASK;
+  int type = body[0] & SN_TOPIC_TYPE_MASK;
+  uint16_t topic_id = get16(body + 1);
+  uint16_t msg_id = get16(body + 3);
+  if (qos == SN_FLAG_QOS_MINUS1 ? type == SN_TOPIC_NORMAL : c == NULL) {
+    gw->dropped++; // only QoS -1 may publish unconnected, never by id
+    return;
+  }
+  if (qos > SN_FLAG_QOS1 && qos != SN_FLAG_QOS_MINUS1) {
+    sn_ack(gw, addr, addr_len, SN_PUBACK, topic_id, msg_id,
+           SN_REJECTED_NOT_SUPPORTED);
+    return;
+  }
+
+  struct topic *t = sn_topic(gw, c, type, body + 1, 2, 0);
+  if (t == NULL) {
+    gw->dropped++;
+    if (qos == SN_FLAG_QOS1) {
+      sn_ack(gw, addr, addr_len, SN_PUBACK, topic_id, msg_id,
+             SN_REJECTED_TOPIC_ID);
+    }
+    return;
+  }
+  // Acknowledged here, the routing core gets a plain QoS 0 PUBLISH
+  struct mqtt_message *msg =
+      mqtt_message_publish(t, body + 5, len - 5, PUBLISH_BYTE, 0);
+  topic_release(t);
+  if (msg == NULL) {
+    gw->dropped++;
+    if (qos == SN_FLAG_QOS1) {
+      sn_ack(gw, addr, addr_len, SN_PUBACK, topic_id, msg_id,
+             SN_REJECTED_CONGESTION);
+    }
+    return;
+  }
+  msg->ingress_ns = now;
+  if (gw->stats != NULL) {
+    stats_add(gw->stats, STAT_MSGS_IN, 1);
+  }
+  gw->route(msg, gw->route_arg);
+  mqtt_message_release(msg);
+  if (qos == SN_FLAG_QOS1) {
+    sn_ack(gw, addr, addr_len, SN_PUBACK, topic_id, msg_id, SN_ACCEPTED);
+  }
+}
+
+static void sn_subscribe(struct sn_gateway *gw, struct sn_client *c,
+                         const unsigned char *body, size_t len,
+                         int subscribe) {
+  // Flags, message id, topic name or id
+  if (c == NULL || len < 4) {
+    gw->dropped++;
+    return;
+  }
+  int type = body[0] & SN_TOPIC_TYPE_MASK;
+  uint16_t msg_id = get16(body + 1);
+  const unsigned char *field = body + 3;
+  size_t field_len = len - 3;
+  struct topic *filter = sn_topic(gw, c, type, field, field_len, 1);
+
+  if (!subscribe) {
+    if (filter != NULL && subs_remove(&gw->subs, filter, c) == 0) {
+      for (size_t i = 0; i < c->nfilters; i++) {
+        if (c->filters[i] == filter) {
+          interest(gw, filter, -1);
+          topic_release(c->filters[i]);
+          c->filters[i] = c->filters[--c->nfilters];
+          break;
+        }
+      }
+    }
+    topic_release(filter);
+    unsigned char *p = sn_packet(gw, &c->addr, c->addr_len, SN_UNSUBACK, 2);
+    if (p != NULL) {
+      put16(p, msg_id);
+    }
+    return;
+  }
+
+  enum sn_return_code rc = SN_REJECTED_TOPIC_ID;
+  uint16_t topic_id = 0;
+  if (filter != NULL) {
+    rc = SN_REJECTED_CONGESTION;
+    if (c->nfilters == c->filters_cap) {
+      size_t cap = c->filters_cap ? c->filters_cap * 2 : 4;
+      struct topic **grown = realloc(c->filters, sizeof(*grown) * cap);
+      if (grown != NULL) {
+        c->filters = grown;
+        c->filters_cap = cap;
+      }
+    }
+    int added = c->nfilters < c->filters_cap
+                    ? subs_add(&gw->subs, filter, c, 0, 0)
+                    : -1;
+    if (added == 0) {
+      c->filters[c->nfilters++] = topic_ref(filter);
+      interest(gw, filter, 1);
+    }
+    if (added != -1) {
+      rc = SN_ACCEPTED;
+      // A concrete name gets its id now, wildcard matches are registered
+      // when they are first delivered
+      if (type == SN_TOPIC_PREDEFINED) {
+        topic_id = get16(field);
+      } else if (type == SN_TOPIC_NORMAL &&
+                 !has_wildcard(field, field_len)) {
+        topic_id = client_register(c, filter);
+      }
+    }
+    topic_release(filter);
+  }
+
+  unsigned char *p = sn_packet(gw, &c->addr, c->addr_len, SN_SUBACK, 6);
+  if (p != NULL) {
+    p[0] = 0; // granted QoS 0
+    put16(p + 1, topic_id);
+    put16(p + 3, msg_id);
+    p[5] = rc;
+  }
+}
+
+static void sn_handle(struct sn_gateway *gw,
+                      const struct sockaddr_storage *addr, socklen_t addr_len,
+                      const unsigned char *buf, size_t len, uint64_t now) {
+  size_t header = 1;
+  size_t pkt_len = buf[0];
+  if (len >= 3 && buf[0] == 0x01) {
+    header = 3;
+    pkt_len = get16(buf + 1);
+  }
+  if (len < 2 || pkt_len != len || pkt_len < header + 1) {
+    gw->dropped++;
+    return;
+  }
+  if (gw->stats != NULL) {
+    stats_add(gw->stats, STAT_BYTES_IN, len);
+  }
+  enum sn_type type = buf[header];
+  const unsigned char *body = buf + header + 1;
+  size_t body_len = pkt_len - header - 1;
+  uint32_t hash = addr_hash(addr);
+  struct sn_client *c = client_find(gw, addr, hash);
+  if (c != NULL) {
+    c->last_seen_ns = now;
+  }
+
+  switch (type) {
+  case SN_CONNECT:
+    sn_connect(gw, c, addr, addr_len, hash, body, body_len, now);
+    break;
+  case SN_REGISTER:
+    sn_register(gw, c, body, body_len);
+    break;
+  case SN_PUBLISH:
+    sn_publish(gw, c, addr, addr_len, body, body_len, now);
+    break;
+  case SN_SUBSCRIBE:
+  case SN_UNSUBSCRIBE:
+    sn_subscribe(gw, c, body, body_len, type == SN_SUBSCRIBE);
+    break;
+  case SN_PINGREQ:
+    sn_empty(gw, addr, addr_len, SN_PINGRESP);
+    break;
+  case SN_DISCONNECT:
+    sn_empty(gw, addr, addr_len, SN_DISCONNECT);
+    if (c != NULL) {
+      client_remove(gw, c);
+    }
+    break;
+  case SN_REGACK:
+  case SN_PUBACK:
+    break; // answers to our REGISTER and PUBLISH, nothing to do at QoS 0
+  default:
+    gw->dropped++;
+  }
+}
+
+/*
+ * Read and handle every datagram waiting on the socket, up to
+ * SN_POLL_BATCHES batches, then send the replies. Returns the number of
+ * datagrams read, or -1 on a socket error.
+ */
+int mqttsn_poll(struct sn_gateway *gw) {
+  uint64_t now = stats_now_ns();
+  int handled = 0;
+
+  for (int round = 0; round < SN_POLL_BATCHES; round++) {
+    for (int i = 0; i < SN_BATCH; i++) {
+      gw->io->rx[i].msg_hdr.msg_namelen = sizeof(gw->io->rx_addr[i]);
+    }
+    int n = recvmmsg(gw->fd, gw->io->rx, SN_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      mqttsn_flush(gw);
+      return -1;
+    }
+    for (int i = 0; i < n; i++) {
+      struct msghdr *h = &gw->io->rx[i].msg_hdr;
+      if (h->msg_flags & MSG_TRUNC) {
+        gw->dropped++;
+        continue;
+      }
+      sn_handle(gw, &gw->io->rx_addr[i], h->msg_namelen, gw->io->rx_buf[i],
+                gw->io->rx[i].msg_len, now);
+    }
+    handled += n;
+    if (n < SN_BATCH) {
+      break;
+    }
+  }
+  mqttsn_flush(gw);
+  return handled;
+}
+
+struct sn_delivery {
+  struct sn_gateway *gw;
+  struct topic *topic;
+  const unsigned char *payload;
+  size_t len;
+};
+
+static void deliver_one(const struct subscriber *sub,
+                        const struct topic *filter, void *arg) {
+  struct sn_delivery *d = arg;
+  struct sn_client *c = sub->client;
+  int type = SN_TOPIC_NORMAL;
+  uint16_t id;
+
+  if (d->topic->len == 2) {
+    type = SN_TOPIC_SHORT;
+    id = get16((const unsigned char *)d->topic->name);
+  } else if ((id = client_topic_id(c, d->topic)) == 0) {
+    if ((id = client_register(c, d->topic)) == 0) {
+      d->gw->dropped++;
+      return;
+    }
+    unsigned char *p = sn_packet(d->gw, &c->addr, c->addr_len, SN_REGISTER,
+                                 4 + d->topic->len);
+    if (p == NULL) {
+      return;
+    }
+    put16(p, id);
+    put16(p + 2, c->next_msg_id++);
+    memcpy(p + 4, d->topic->name, d->topic->len);
+  }
+
+  unsigned char *p =
+      sn_packet(d->gw, &c->addr, c->addr_len, SN_PUBLISH, 5 + d->len);
+  if (p == NULL) {
+    return;
+  }
+  p[0] = type; // QoS 0
+  put16(p + 1, id);
+  put16(p + 3, 0);
+  memcpy(p + 5, d->payload, d->len);
+  if (d->gw->stats != NULL) {
+    stats_add(d->gw->stats, STAT_MSGS_OUT, 1);
+  }
+}
+
+/*
+ * Queue an MQTT PUBLISH from the broker for every matching SN subscriber.
+ * The datagrams leave with the next mqttsn_flush or mqttsn_poll. The
+ * payload ends where the frame does; a message holding less than its
+ * whole frame is dropped rather than delivered truncated.
+ */
+void mqttsn_deliver(struct sn_gateway *gw, struct mqtt_message *msg) {
+  const unsigned char *name;
+  uint16_t name_len;
+  size_t header_len, remaining;
+  union mqtt_header hdr = {.byte = msg->data[0]};
+  if (hdr.bits.type != PUBLISH || gw->subs.nsubs == 0 ||
+      mqtt_frame_header(msg->data, msg->len, &header_len, &remaining) !=
+          MQTT_FRAME_OK ||
+      msg->len < header_len + remaining ||
+      mqtt_peek_publish_topic(msg->data, msg->len, &name, &name_len) != 0) {
+    return;
+  }
+
+  const unsigned char *end = msg->data + header_len + remaining;
+  struct sn_delivery d = {gw, msg->topic, NULL, 0};
+  d.payload = name + name_len + (hdr.bits.qos > AT_MOST_ONCE ? 2 : 0);
+  if (d.payload > end) {
+    return;
+  }
+  d.len = end - d.payload;
+  if (d.topic == NULL) {
+    d.topic = topic_intern((const char *)name, name_len);
+  } else {
+    topic_ref(d.topic);
+  }
+  if (d.topic == NULL) {
+    return;
+  }
+  int possible = subs_may_match(&gw->subs, d.topic);
+  if (gw->stats != NULL) {
+    stats_add(gw->stats, STAT_PREFILTER_CHECKED, 1);
+    stats_add(gw->stats, STAT_PREFILTER_REJECTED, !possible);
+  }
+  if (possible) {
+    subs_match(&gw->subs, d.topic, deliver_one, &d);
+  }
+  topic_release(d.topic);
+}
+
+/*
+ * Drop clients silent for longer than their keep alive allows. Returns the
+ * number removed.
+ */
+size_t mqttsn_expire(struct sn_gateway *gw, uint64_t now_ns) {
+  size_t removed = 0;
+  for (size_t b = 0; b <= gw->mask; b++) {
+    struct sn_client **at = &gw->buckets[b];
+    while (*at != NULL) {
+      struct sn_client *c = *at;
+      if (c->keepalive_ns != 0 && now_ns - c->last_seen_ns > c->keepalive_ns) {
+        *at = c->next;
+        gw->nclients--;
+        client_free(gw, c);
+        removed++;
+      } else {
+        at = &c->next;
+      }
+    }
+  }
+  return removed;
+}
@@ -0,0 +1,135 @@
+#ifndef MQTTSN_H
+#define MQTTSN_H
+
+#include "message.h"
+#include "subs.h"
+#include "topic.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct worker_stats;
+struct sn_io;
+
+// Datagrams per recvmmsg or sendmmsg
+#define SN_BATCH 64
+// Batches read per mqttsn_poll, so a flood can't starve the rest of the loop
+#define SN_POLL_BATCHES 16
+// Largest datagram handled, an Ethernet frame's UDP payload
+#define SN_MAX_DATAGRAM 1472
+#define SN_MAX_CLIENT_ID 23
+#define SN_MAX_PREDEFINED 256
+
+// MQTT-SN 1.2 message types
+enum sn_type {
+  SN_CONNECT = 0x04,
+  SN_CONNACK = 0x05,
+  SN_REGISTER = 0x0a,
+  SN_REGACK = 0x0b,
+  SN_PUBLISH = 0x0c,
+  SN_PUBACK = 0x0d,
+  SN_SUBSCRIBE = 0x12,
+  SN_SUBACK = 0x13,
+  SN_UNSUBSCRIBE = 0x14,
+  SN_UNSUBACK = 0x15,
+  SN_PINGREQ = 0x16,
+  SN_PINGRESP = 0x17,
+  SN_DISCONNECT = 0x18,
+};
+
+// Flags byte
+#define SN_FLAG_QOS_MASK 0x60
+#define SN_FLAG_QOS1 0x20
+#define SN_FLAG_QOS_MINUS1 0x60 // publish without connecting
+#define SN_FLAG_WILL 0x08
+#define SN_TOPIC_TYPE_MASK 0x03
+
+enum sn_topic_type {
+  SN_TOPIC_NORMAL,     // id registered by this client
+  SN_TOPIC_PREDEFINED, // id configured on the gateway
+  SN_TOPIC_SHORT,      // two character name carried in the id
+};
+
+enum sn_return_code {
+  SN_ACCEPTED,
+  SN_REJECTED_CONGESTION,
+  SN_REJECTED_TOPIC_ID,
+  SN_REJECTED_NOT_SUPPORTED,
+};
+
+/*
+ * A client known by its address. Topic ids are per client: ids[i] is the
+ * topic registered as id i + 1. Sensors use a handful of topics, so the
+ * reverse lookup when delivering is a scan.
+ */
+struct sn_client {
+  struct sn_client *next; // hash chain
+  uint32_t hash;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  char client_id[SN_MAX_CLIENT_ID + 1];
+  uint64_t last_seen_ns;
+  uint64_t keepalive_ns; // 0 never expires
+
+  struct topic **ids;
+  uint16_t nids;
+  uint16_t ids_cap;
+  struct topic **filters; // subscriptions, to remove on disconnect
+  size_t nfilters;
+  size_t filters_cap;
+  uint16_t next_msg_id;
+};
+
+// A received PUBLISH as an encoded MQTT PUBLISH, borrowed for the call
+typedef void (*sn_route_fn)(struct mqtt_message *msg, void *arg);
+// A filter gained (delta 1) or lost (delta -1) an SN subscriber
+typedef void (*sn_interest_fn)(struct topic *filter, int delta, void *arg);
+
+/*
+ * MQTT-SN gateway on one UDP socket.
+ *
+ * Datagrams are read SN_BATCH at a time with recvmmsg, and every reply or
+ * delivery produced while handling them is queued and sent back in one
+ * sendmmsg, so the socket costs two syscalls per batch rather than one or
+ * two per datagram. All buffers are allocated once in mqttsn_init.
+ *
+ * A PUBLISH is mapped from its topic id to the interned topic and handed
+ * to route as the same encoded MQTT PUBLISH a TCP client would produce.
+ * Broker traffic goes the other way through mqttsn_deliver, which finds
+ * the SN subscribers in the gateway's own subscription index.
+ *
+ * QoS -1 publishes on predefined or short topics need no connection at
+ * all, which suits sensors that wake, send one datagram and sleep.
+ * Deliveries to SN clients go out at QoS 0, and a topic a wildcard
+ * subscriber has not seen yet is registered with a REGISTER sent just
+ * ahead of the PUBLISH rather than after waiting for the REGACK.
+ */
+struct sn_gateway {
+  int fd;
+  sn_route_fn route;
+  void *route_arg;
+  struct worker_stats *stats;
+  sn_interest_fn interest; // optional, set after mqttsn_init
+  void *interest_arg;
+
+  struct sn_client **buckets;
+  size_t mask;
+  size_t nclients;
+  struct topic *predefined[SN_MAX_PREDEFINED];
+  struct sub_index subs;
+  struct sn_io *io; // batch buffers
+
+  uint64_t dropped; // malformed, unknown or unsendable datagrams
+};
+
+// Function prototypes
+int mqttsn_listen(const char *port);
+int mqttsn_init(struct sn_gateway *gw, int fd, sn_route_fn route, void *arg);
+void mqttsn_destroy(struct sn_gateway *gw);
+int mqttsn_predefine(struct sn_gateway *gw, uint16_t id, const char *name);
+int mqttsn_poll(struct sn_gateway *gw);
+void mqttsn_deliver(struct sn_gateway *gw, struct mqtt_message *msg);
+int mqttsn_flush(struct sn_gateway *gw);
+size_t mqttsn_expire(struct sn_gateway *gw, uint64_t now_ns);
+
+#endif // MQTTSN_H
@@ -0,0 +1,770 @@
+#include "outq.h"
+#include "mqtt.h"
+#include "stats.h"
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+// errqueue.h needs struct timespec declared first
+#include <linux/errqueue.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+static const size_t OUTQ_INITIAL_CAPACITY = 16;
+
+int outq_init(struct outq *q) {
+  memset(q, 0, sizeof(*q));
+  q->zc_threshold = OUTQ_ZEROCOPY_THRESHOLD;
+  return 0;
+}
+
+static void ring_release_all(struct outq_ring *r) {
+  for (size_t i = 0; i < r->count; i++) {
+    mqtt_message_release(r->entries[(r->head + i) & (r->capacity - 1)].msg);
+  }
+  free(r->entries);
+  memset(r, 0, sizeof(*r));
+}
+
+void outq_destroy(struct outq *q) {
+  if (q->acct != NULL) {
+    memacct_uncharge(q->acct, MEM_QUEUED, q->bytes);
+  }
+  ring_release_all(&q->ring);
+  ring_release_all(&q->control);
+  ring_release_all(&q->held);
+  free(q->last);
+  for (size_t i = 0; i < q->zc_count; i++) {
+    size_t slot = (q->zc_head + i) & (q->zc_capacity - 1);
+    mqtt_message_release(q->zc_inflight[slot].msg);
+  }
+  free(q->zc_inflight);
+  memset(q, 0, sizeof(*q));
+}
+
+/*
+ * Double a power of two ring, unwrapping it so the live items start at 0.
+ */
+static void *ring_grow(void *ring, size_t item_size, size_t head,
+                       size_t count, size_t *capacity) {
+  size_t new_capacity = *capacity ? *capacity * 2 : OUTQ_INITIAL_CAPACITY;
+  unsigned char *grown = malloc(item_size * new_capacity);
+  if (grown == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t slot = (head + i) & (*capacity - 1);
+    memcpy(grown + i * item_size, (unsigned char *)ring + slot * item_size,
+           item_size);
+  }
+  free(ring);
+  *capacity = new_capacity;
+  return grown;
+}
+
+static int ring_append(struct outq_ring *r, struct mqtt_message *msg,
+                       int chunk) {
+  if (r->count == r->capacity) {
+    struct outq_entry *grown = ring_grow(r->entries, sizeof(*grown), r->head,
+                                         r->count, &r->capacity);
+    if (grown == NULL) {
+      return -1;
+    }
+    r->entries = grown;
+    r->head = 0;
+  }
+
+  struct outq_entry *e = &r->entries[(r->head + r->count) & (r->capacity - 1)];
+  e->msg = msg;
+  e->offset = 0;
+  e->chunk = chunk;
+  e->conflated = 0;
+  r->count++;
+  return 0;
+}
+
+static int is_qos0_publish(const struct mqtt_message *msg) {
+  union mqtt_header hdr = {.byte = msg->data[0]};
+  return hdr.bits.type == PUBLISH && hdr.bits.qos == AT_MOST_ONCE;
+}
+
+/*
+ * Drop unwritten QoS 0 PUBLISH packets, oldest first, until want bytes are
+ * freed. Survivors are compacted in place so their order is kept.
+ */
+static size_t ring_evict_qos0(struct outq_ring *r, size_t want,
+                              uint64_t *evicted) {
+  size_t freed = 0;
+  size_t kept = 0;
+
+  for (size_t i = 0; i < r->count; i++) {
+    struct outq_entry *e = &r->entries[(r->head + i) & (r->capacity - 1)];
+    if (freed < want && e->offset == 0 && !e->chunk &&
+        is_qos0_publish(e->msg)) {
+      freed += e->msg->len;
+      mqtt_message_release(e->msg);
+      (*evicted)++;
+      continue;
+    }
+    r->entries[(r->head + kept) & (r->capacity - 1)] = *e;
+    kept++;
+  }
+  r->count = kept;
+  return freed;
+}
+
+/*
+ * Drop unwritten messages past their deadline, compacting survivors in
+ * place like ring_evict_qos0. next_ns is lowered to the earliest deadline
+ * still to come. Returns the number of messages dropped.
+ */
+static size_t ring_evict_expired(struct outq_ring *r, uint64_t now_ns,
+                                 size_t *freed, uint64_t *next_ns) {
+  size_t dropped = 0;
+  size_t kept = 0;
+
+  for (size_t i = 0; i < r->count; i++) {
+    struct outq_entry *e = &r->entries[(r->head + i) & (r->capacity - 1)];
+    uint64_t expires_ns = e->msg->expires_ns;
+    if (e->offset == 0 && !e->chunk && mqtt_message_expired(e->msg, now_ns)) {
+      *freed += e->msg->len;
+      mqtt_message_release(e->msg);
+      dropped++;
+      continue;
+    }
+    // A partly written message past its deadline goes out regardless
+    if (expires_ns > now_ns && (*next_ns == 0 || expires_ns < *next_ns)) {
+      *next_ns = expires_ns;
+    }
+    r->entries[(r->head + kept) & (r->capacity - 1)] = *e;
+    kept++;
+  }
+  r->count = kept;
+  return dropped;
+}
+
+static struct outq_entry *ring_at(struct outq_ring *r, size_t i) {
+  return &r->entries[(r->head + i) & (r->capacity - 1)];
+}
+
+static struct outq_last *last_slot(struct outq_last *table, size_t capacity,
+                                   const struct topic *topic) {
+  size_t mask = capacity - 1;
+  for (size_t i = topic->hash & mask;; i = (i + 1) & mask) {
+    if (table[i].topic == NULL || table[i].topic == topic) {
+      return &table[i];
+    }
+  }
+}
+
+/*
+ * The unsent conflated entry a slot points at, or NULL if it has been
+ * written, evicted or replaced by an ordinary message since.
+ */
+static struct outq_entry *last_entry(struct outq *q,
+                                     const struct outq_last *slot) {
+  if (slot->topic == NULL || slot->pos < q->removed ||
+      slot->pos - q->removed >= q->ring.count) {
+    return NULL;
+  }
+  struct outq_entry *e = ring_at(&q->ring, slot->pos - q->removed);
+  if (!e->conflated || e->offset != 0 || e->msg->topic != slot->topic) {
+    return NULL;
+  }
+  return e;
+}
+
+/*
+ * Rebuild the conflation index from the ring, dropping stale slots, with
+ * room for at least want entries. Needed whenever entries move within the
+ * ring. Out of memory just empties the index, which only costs conflation
+ * opportunities.
+ */
+static void last_rebuild(struct outq *q, size_t want) {
+  size_t capacity = OUTQ_INITIAL_CAPACITY;
+  while (capacity < want * 2) {
+    capacity *= 2;
+  }
+  struct outq_last *table = calloc(capacity, sizeof(*table));
+  if (table == NULL) {
+    if (q->last != NULL) {
+      memset(q->last, 0, sizeof(*q->last) * q->last_capacity);
+    }
+    q->last_count = 0;
+    return;
+  }
+
+  free(q->last);
+  q->last = table;
+  q->last_capacity = capacity;
+  q->last_count = 0;
+  for (size_t i = 0; i < q->ring.count; i++) {
+    struct outq_entry *e = ring_at(&q->ring, i);
+    if (!e->conflated) {
+      continue;
+    }
+    struct outq_last *slot = last_slot(table, capacity, e->msg->topic);
+    if (slot->topic == NULL) {
+      q->last_count++;
+    }
+    slot->topic = e->msg->topic;
+    slot->pos = q->removed + i;
+  }
+}
+
+/*
+ * Put the queue on the wheel for msg's deadline, unless an earlier one is
+ * there already: that one fires first and puts the queue back for the
+ * rest.
+ */
+static void track_expiry(struct outq *q, const struct mqtt_message *msg) {
+  if (q->expiry == NULL || msg->expires_ns == 0 ||
+      (q->expires_ns != 0 && q->expires_ns <= msg->expires_ns)) {
+    return;
+  }
+  if (expiry_add(q->expiry, q->expiry_key, msg->expires_ns) == 0) {
+    q->expires_ns = msg->expires_ns;
+  }
+}
+
+/*
+ * Make room for len more bytes under the session's memory limits. Returns 0
+ * if the bytes may be queued (and charges them), -1 if the message has to be
+ * refused.
+ */
+static int outq_admit(struct outq *q, size_t len) {
+  if (q->acct == NULL) {
+    return 0;
+  }
+
+  size_t over = memacct_over(q->acct, len);
+  if (over > 0 && memacct_limits()->policy == MEM_DROP_OLDEST_QOS0) {
+    uint64_t evicted = 0;
+    size_t freed = ring_evict_qos0(&q->ring, over, &evicted);
+    if (freed < over) {
+      freed += ring_evict_qos0(&q->held, over - freed, &evicted);
+    }
+    q->bytes -= freed;
+    memacct_uncharge(q->acct, MEM_QUEUED, freed);
+    memacct_count_evicted(evicted);
+    if (evicted > 0 && q->last != NULL) {
+      // Survivors were compacted, positions in the index moved
+      last_rebuild(q, q->last_count);
+    }
+    over = memacct_over(q->acct, len);
+  }
+  if (over > 0) {
+    return memacct_refuse(q->acct);
+  }
+
+  memacct_charge(q->acct, MEM_QUEUED, len);
+  return 0;
+}
+
+/*
+ * Queue a message for this connection, taking over the caller's reference.
+ * While a stream owns the queue the message is held back until it ends.
+ */
+int outq_push(struct outq *q, struct mqtt_message *msg) {
+  struct outq_ring *r = q->stream_owner != NULL ? &q->held : &q->ring;
+  if (outq_admit(q, msg->len) == -1) {
+    return -1;
+  }
+  if (ring_append(r, msg, OUTQ_WHOLE) == -1) {
+    if (q->acct != NULL) {
+      memacct_uncharge(q->acct, MEM_QUEUED, msg->len);
+    }
+    return -1;
+  }
+  q->bytes += msg->len;
+  track_expiry(q, msg);
+  return 0;
+}
+
+/*
+ * Queue a message with last-value semantics, taking over the caller's
+ * reference: if an unsent conflated message for the same topic is still
+ * queued it is replaced in place, keeping its position. Messages without a
+ * topic, or pushed while a stream owns the queue, are queued as usual.
+ *
+ * Returns 1 if a pending message was replaced, 0 if the message was
+ * appended and -1 if it was refused.
+ */
+int outq_push_conflated(struct outq *q, struct mqtt_message *msg) {
+  if (msg->topic == NULL || q->stream_owner != NULL) {
+    return outq_push(q, msg);
+  }
+  // Admission may evict and compact, so look up only afterwards
+  if (outq_admit(q, msg->len) == -1) {
+    return -1;
+  }
+  if ((q->last_count + 1) * 2 > q->last_capacity) {
+    last_rebuild(q, q->last_count + 1);
+  }
+
+  struct outq_last *slot =
+      q->last_capacity == 0 ? NULL
+                            : last_slot(q->last, q->last_capacity, msg->topic);
+  struct outq_entry *e = slot != NULL ? last_entry(q, slot) : NULL;
+  if (e != NULL) {
+    q->bytes = q->bytes - e->msg->len + msg->len;
+    if (q->acct != NULL) {
+      memacct_uncharge(q->acct, MEM_QUEUED, e->msg->len);
+    }
+    mqtt_message_release(e->msg);
+    e->msg = msg;
+    track_expiry(q, msg);
+    return 1;
+  }
+
+  if (ring_append(&q->ring, msg, OUTQ_WHOLE) == -1) {
+    if (q->acct != NULL) {
+      memacct_uncharge(q->acct, MEM_QUEUED, msg->len);
+    }
+    return -1;
+  }
+  q->bytes += msg->len;
+  track_expiry(q, msg);
+  ring_at(&q->ring, q->ring.count - 1)->conflated = 1;
+  if (slot != NULL && q->last_count * 2 < q->last_capacity) {
+    if (slot->topic == NULL) {
+      q->last_count++;
+    }
+    slot->topic = msg->topic;
+    slot->pos = q->removed + q->ring.count - 1;
+  }
+  return 0;
+}
+
+/*
+ * Queue a control packet on the control lane, taking over the caller's
+ * reference. Its bytes are charged but never refused: dropping an ack costs
+ * far more than the few bytes it holds. Returns -1 only when out of memory.
+ */
+int outq_push_control(struct outq *q, struct mqtt_message *msg) {
+  if (ring_append(&q->control, msg, OUTQ_WHOLE) == -1) {
+    return -1;
+  }
+  if (q->acct != NULL) {
+    memacct_charge(q->acct, MEM_QUEUED, msg->len);
+  }
+  q->bytes += msg->len;
+  return 0;
+}
+
+// Nothing is ready to be written
+int outq_empty(const struct outq *q) {
+  return q->ring.count == 0 && q->control.count == 0;
+}
+
+/*
+ * Claim the queue for a PUBLISH forwarded in chunks. Returns -1 if another
+ * stream is still writing to this connection; the caller must then assemble
+ * the packet in full and outq_push it.
+ */
+int outq_stream_begin(struct outq *q, const void *owner) {
+  if (q->stream_owner != NULL && q->stream_owner != owner) {
+    return -1;
+  }
+  if (q->stream_owner == NULL) {
+    q->stream_chunks = 0;
+  }
+  q->stream_owner = owner;
+  return 0;
+}
+
+int outq_stream_push(struct outq *q, const void *owner,
+                     struct mqtt_message *chunk) {
+  if (q->stream_owner != owner || outq_admit(q, chunk->len) == -1) {
+    return -1;
+  }
+  int kind = q->stream_chunks == 0 ? OUTQ_CHUNK_HEAD : OUTQ_CHUNK_NEXT;
+  if (ring_append(&q->ring, chunk, kind) == -1) {
+    if (q->acct != NULL) {
+      memacct_uncharge(q->acct, MEM_QUEUED, chunk->len);
+    }
+    return -1;
+  }
+  q->bytes += chunk->len;
+  q->stream_chunks++;
+  return 0;
+}
+
+/*
+ * Release the queue after the last chunk, or after the stream was aborted,
+ * and move the messages held back meanwhile behind it.
+ */
+int outq_stream_end(struct outq *q, const void *owner) {
+  if (q->stream_owner != owner) {
+    return -1;
+  }
+  q->stream_owner = NULL;
+
+  int status = 0;
+  for (size_t i = 0; i < q->held.count; i++) {
+    struct outq_entry *e =
+        &q->held.entries[(q->held.head + i) & (q->held.capacity - 1)];
+    if (status == 0 && ring_append(&q->ring, e->msg, OUTQ_WHOLE) == 0) {
+      continue;
+    }
+    // Out of memory, drop what can't be moved rather than leak it
+    q->bytes -= e->msg->len;
+    if (q->acct != NULL) {
+      memacct_uncharge(q->acct, MEM_QUEUED, e->msg->len);
+    }
+    mqtt_message_release(e->msg);
+    status = -1;
+  }
+  q->held.head = 0;
+  q->held.count = 0;
+  return status;
+}
+
+static int zc_track(struct outq *q, struct mqtt_message *msg) {
+  if (q->zc_count == q->zc_capacity) {
+    struct outq_zc_entry *grown =
+        ring_grow(q->zc_inflight, sizeof(*grown), q->zc_head, q->zc_count,
+                  &q->zc_capacity);
+    if (grown == NULL) {
+      return -1;
+    }
+    q->zc_inflight = grown;
+    q->zc_head = 0;
+  }
+
+  struct outq_zc_entry *z =
+      &q->zc_inflight[(q->zc_head + q->zc_count) & (q->zc_capacity - 1)];
+  z->msg = mqtt_message_ref(msg);
+  z->seq = q->zc_next_seq++;
+  q->zc_count++;
+  return 0;
+}
+
+static int is_zerocopy_candidate(const struct outq *q,
+                                 const struct outq_entry *e) {
+  return q->zerocopy && e->msg->len - e->offset >= q->zc_threshold;
+}
+
+/*
+ * Advance one lane past n written bytes, releasing fully written messages.
+ * Returns the bytes left over once the lane is empty.
+ */
+static size_t outq_consume(struct outq *q, struct outq_ring *r, size_t n) {
+  uint64_t now = 0;
+  while (n > 0 && r->count > 0) {
+    struct outq_entry *e = &r->entries[r->head];
+    size_t left = e->msg->len - e->offset;
+    if (n < left) {
+      e->offset += n;
+      return 0;
+    }
+    n -= left;
+    if (q->stats != NULL && e->msg->routed_ns != 0) {
+      if (now == 0) {
+        now = stats_now_ns();
+      }
+      stats_latency(q->stats, LAT_WRITE, e->msg->routed_ns, now);
+      stats_latency(q->stats, LAT_END_TO_END, e->msg->ingress_ns, now);
+    }
+    mqtt_message_release(e->msg);
+    r->head = (r->head + 1) & (r->capacity - 1);
+    r->count--;
+    if (r == &q->ring) {
+      q->removed++;
+    }
+  }
+  return n;
+}
+
+/*
+ * Whether the next data byte starts a packet, so a control packet may be
+ * written in between. Mid-stream with every queued chunk written, the rest
+ * of the packet hasn't arrived yet and nothing may interrupt it.
+ */
+static int data_at_boundary(const struct outq *q) {
+  const struct outq_ring *r = &q->ring;
+  if (r->count == 0) {
+    return q->stream_owner == NULL || q->stream_chunks == 0;
+  }
+  const struct outq_entry *e = &r->entries[r->head];
+  return e->offset == 0 && e->chunk != OUTQ_CHUNK_NEXT;
+}
+
+/*
+ * Add the unwritten part of r's entries to iov, stopping at a zero-copy
+ * candidate, a full iov or the byte budget. With stop_at_boundary the data
+ * lane is only gathered up to the end of the packet in progress, so pending
+ * control packets go out in the next writev.
+ */
+static void ring_gather(const struct outq *q, const struct outq_ring *r,
+                        struct iovec *iov, int *iovcnt, size_t *wanted,
+                        size_t budget, int stop_at_boundary) {
+  for (size_t i = 0; i < r->count && *iovcnt < IOV_MAX && *wanted < budget;
+       i++) {
+    struct outq_entry *e = &r->entries[(r->head + i) & (r->capacity - 1)];
+    if (is_zerocopy_candidate(q, e) ||
+        (stop_at_boundary && i > 0 && e->chunk != OUTQ_CHUNK_NEXT)) {
+      break;
+    }
+    size_t len = e->msg->len - e->offset;
+    if (len > budget - *wanted) {
+      len = budget - *wanted;
+    }
+    iov[*iovcnt].iov_base = e->msg->data + e->offset;
+    iov[*iovcnt].iov_len = len;
+    (*iovcnt)++;
+    *wanted += len;
+  }
+}
+
+// Account for n bytes written from the lanes gathered, control first
+static void outq_written(struct outq *q, int control, size_t n) {
+  q->bytes -= n;
+  if (q->stats != NULL) {
+    stats_add(q->stats, STAT_BYTES_OUT, n);
+  }
+  if (q->acct != NULL) {
+    memacct_uncharge(q->acct, MEM_QUEUED, n);
+  }
+  size_t rest = control ? outq_consume(q, &q->control, n) : n;
+  outq_consume(q, &q->ring, rest);
+}
+
+// Whether the next write starts with the control lane
+static int control_first(const struct outq *q) {
+  return q->control.count > 0 && data_at_boundary(q);
+}
+
+static void set_cork(int fd, int on) {
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * Write as much of the queue as the socket accepts, up to OUTQ_BYTE_BUDGET.
+ *
+ * Consecutive small messages are coalesced into one writev. A message at or
+ * above the zero-copy threshold is written on its own with MSG_ZEROCOPY,
+ * in which case the socket is corked for the duration of the flush so the
+ * separate syscalls don't produce runt segments. Queued control packets lead
+ * the first writev that starts at a packet boundary.
+ *
+ * Returns 0 once nothing more can be written until more is queued, 1 if
+ * data is left over (the caller should wait for POLLOUT) and -1 on a socket
+ * error.
+ */
+int outq_flush(struct outq *q, int fd) {
+  struct iovec iov[IOV_MAX];
+  struct outq_ring *r = &q->ring;
+  size_t budget = OUTQ_BYTE_BUDGET;
+  int corked = 0;
+  int status = 0;
+
+  // The wheel fires up to a tick late, don't write what is already due
+  if (q->expires_ns != 0) {
+    outq_expire(q, stats_now_ns());
+  }
+  while (!outq_empty(q)) {
+    int control = control_first(q);
+    if (!control && r->count == 0) {
+      break; // control waits for the rest of a streamed packet
+    }
+    struct outq_entry *front = &r->entries[r->head];
+    ssize_t written;
+    size_t wanted;
+
+    if (!control && is_zerocopy_candidate(q, front)) {
+      if (!corked) {
+        set_cork(fd, 1);
+        corked = 1;
+      }
+      wanted = front->msg->len - front->offset;
+      if (wanted > budget) {
+        wanted = budget;
+      }
+      written = send(fd, front->msg->data + front->offset, wanted,
+                     MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (written == -1 && errno == ENOBUFS) {
+        // Out of optmem for pinned pages, fall back to a copying send
+        written =
+            send(fd, front->msg->data + front->offset, wanted, MSG_NOSIGNAL);
+      } else if (written > 0 && zc_track(q, front->msg) == -1) {
+        status = -1;
+        break;
+      }
+    } else {
+      int iovcnt = 0;
+      wanted = 0;
+      if (control) {
+        ring_gather(q, &q->control, iov, &iovcnt, &wanted, budget, 0);
+      }
+      ring_gather(q, r, iov, &iovcnt, &wanted, budget,
+                  !control && q->control.count > 0);
+      written = writev(fd, iov, iovcnt);
+    }
+
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      status = (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+      break;
+    }
+
+    outq_written(q, control, written);
+    budget -= written;
+    if ((size_t)written < wanted || budget == 0) {
+      status = !outq_empty(q);
+      break;
+    }
+  }
+
+  if (corked) {
+    set_cork(fd, 0);
+  }
+  return status;
+}
+
+/*
+ * Copy up to len of the next bytes to write into buf, in the order
+ * outq_flush would write them, for writers that take a flat buffer rather
+ * than a socket (a TLS record layer). The copied bytes stay queued until
+ * outq_advance, which must follow before anything else is pushed. Zero-copy
+ * is not used on such queues, and expired messages are not skipped: call
+ * outq_expire first. Returns the number of bytes copied.
+ */
+size_t outq_peek(const struct outq *q, void *buf, size_t len) {
+  struct iovec iov[IOV_MAX];
+  int iovcnt = 0;
+  size_t wanted = 0;
+  int control = control_first(q);
+
+  if (control) {
+    ring_gather(q, &q->control, iov, &iovcnt, &wanted, len, 0);
+  }
+  ring_gather(q, &q->ring, iov, &iovcnt, &wanted, len,
+              !control && q->control.count > 0);
+  unsigned char *out = buf;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(out, iov[i].iov_base, iov[i].iov_len);
+    out += iov[i].iov_len;
+  }
+  return wanted;
+}
+
+// Drop the first n bytes returned by outq_peek once they have been written
+void outq_advance(struct outq *q, size_t n) {
+  outq_written(q, control_first(q), n);
+}
+
+/*
+ * Opt the socket into MSG_ZEROCOPY for messages of at least threshold bytes.
+ * Returns -1 if the kernel doesn't support it; the queue keeps copying.
+ */
+int outq_enable_zerocopy(struct outq *q, int fd, size_t threshold) {
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) {
+    return -1;
+  }
+  q->zerocopy = 1;
+  q->zc_threshold = threshold;
+  return 0;
+}
+
+/*
+ * Drain zero-copy completions from the socket error queue and release the
+ * messages the kernel no longer references. Call it when the socket polls
+ * POLLERR.
+ *
+ * Returns the number of messages released, or -1 on a real socket error.
+ */
+int outq_reap_zerocopy(struct outq *q, int fd) {
+  int released = 0;
+
+  for (;;) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg = {.msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return released;
+      }
+      return -1;
+    }
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err *err = (void *)CMSG_DATA(cm);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      // Completions cover the inclusive range [ee_info, ee_data]
+      uint32_t hi = err->ee_data;
+      while (q->zc_count > 0) {
+        struct outq_zc_entry *z = &q->zc_inflight[q->zc_head];
+        if ((int32_t)(z->seq - hi) > 0) {
+          break;
+        }
+        mqtt_message_release(z->msg);
+        q->zc_head = (q->zc_head + 1) & (q->zc_capacity - 1);
+        q->zc_count--;
+        released++;
+      }
+    }
+  }
+}
+
+/*
+ * Drop every unsent message past its deadline, from the data lane and from
+ * the messages held behind a stream, and put the queue back on the wheel
+ * for the earliest deadline left. Call it when the wheel fires the queue's
+ * key; a key left over from an earlier deadline costs one compare. Control
+ * packets, partly written messages and streamed chunks are never dropped.
+ *
+ * Returns the number of messages dropped.
+ */
+size_t outq_expire(struct outq *q, uint64_t now_ns) {
+  if (q->expires_ns == 0 || q->expires_ns > now_ns) {
+    return 0;
+  }
+  size_t freed = 0;
+  uint64_t next_ns = 0;
+  size_t dropped = ring_evict_expired(&q->ring, now_ns, &freed, &next_ns);
+  dropped += ring_evict_expired(&q->held, now_ns, &freed, &next_ns);
+
+  q->bytes -= freed;
+  if (q->acct != NULL) {
+    memacct_uncharge(q->acct, MEM_QUEUED, freed);
+  }
+  if (q->stats != NULL) {
+    stats_add(q->stats, STAT_MSGS_EXPIRED, dropped);
+  }
+  if (dropped > 0 && q->last != NULL) {
+    // Survivors were compacted, positions in the index moved
+    last_rebuild(q, q->last_count);
+  }
+  q->expires_ns = 0;
+  if (next_ns != 0 && q->expiry != NULL &&
+      expiry_add(q->expiry, q->expiry_key, next_ns) == 0) {
+    q->expires_ns = next_ns;
+  }
+  return dropped;
+}
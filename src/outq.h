@@ -0,0 +1,151 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include "expiry.h"
+#include "memacct.h"
+#include "message.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Most bytes written to a single connection per flush, so one fat queue
+// can't starve the rest of the event loop
+#define OUTQ_BYTE_BUDGET (256 * 1024)
+// Payloads at least this large go through MSG_ZEROCOPY when it is enabled
+#define OUTQ_ZEROCOPY_THRESHOLD (16 * 1024)
+
+struct worker_stats;
+
+// Where a streamed chunk sits in its packet
+enum outq_chunk {
+  OUTQ_WHOLE,      // a complete packet, not a chunk
+  OUTQ_CHUNK_HEAD, // first chunk of a streamed packet
+  OUTQ_CHUNK_NEXT, // continues the packet of the chunk before it
+};
+
+struct outq_entry {
+  struct mqtt_message *msg;
+  size_t offset; // bytes of msg already written
+  int chunk;     // OUTQ_CHUNK_*, never evicted on its own
+  int conflated; // latest value for its topic, replaced by the next one
+};
+
+// Power of two ring of queued messages, in write order
+struct outq_ring {
+  struct outq_entry *entries;
+  size_t head;
+  size_t count;
+  size_t capacity;
+};
+
+/*
+ * Where the pending conflated entry of a topic sits, as an absolute ring
+ * position: entries removed from the head so far plus the offset from the
+ * head, so consuming doesn't invalidate it. Stale slots are detected on
+ * lookup and never dereferenced.
+ */
+struct outq_last {
+  const struct topic *topic; // NULL for an empty slot
+  uint64_t pos;
+};
+
+// A zero-copy send the kernel may still be reading from
+struct outq_zc_entry {
+  struct mqtt_message *msg;
+  uint32_t seq;
+};
+
+/*
+ * Outbound packets for one connection.
+ *
+ * Everything queued during one event loop iteration is written by a single
+ * outq_flush, which gathers the queued messages into one writev of up to
+ * IOV_MAX buffers and OUTQ_BYTE_BUDGET bytes. With zero-copy enabled, large
+ * messages are instead sent with MSG_ZEROCOPY under TCP_CORK so they still
+ * leave in full segments alongside the small ones; their references are
+ * held until the kernel reports completion on the socket error queue.
+ *
+ * The queue only ever holds complete packets, except while a stream owns it
+ * (see outq_stream_begin).
+ *
+ * Control packets pushed with outq_push_control (CONNACK, PUBACK and the
+ * rest of the QoS handshake, SUBACK, UNSUBACK, PINGRESP) get a lane of their
+ * own that is written ahead of queued PUBLISH traffic at the next packet
+ * boundary, so acks and ping responses never wait behind a backlog of
+ * fan-out. Control packets are charged to the session but never refused or
+ * evicted.
+ *
+ * pollserver never parses CONNECT or the QoS handshake, so it queues no
+ * acks; in the tree only the cluster link's CONNECT hello uses the lane.
+ * Acks jump the backlog once a session layer pushes them here.
+ *
+ * When acct is set, queued bytes are charged to that session and every push
+ * is checked against the memory limits, applying the configured policy
+ * (see memacct.h) before anything is queued.
+ *
+ * Messages pushed with outq_push_conflated keep at most one pending entry
+ * per topic: a newer message for the topic replaces the unsent one in
+ * place, so a slow last-value consumer costs one message per topic rather
+ * than one per publish.
+ *
+ * When stats is set, the write and end to end latency of every stamped
+ * message is recorded in the owning worker's histograms once its last byte
+ * is written.
+ *
+ * When expiry is set, messages with a deadline are dropped unsent once it
+ * passes. The queue keeps expiry_key on the wheel for its earliest
+ * deadline only; the wheel's owner calls outq_expire when it fires, which
+ * drops everything due in one pass and puts the key back for the next.
+ * outq_flush drops what is due itself, since the wheel may fire a tick late.
+ */
+struct outq {
+  struct outq_ring ring;    // data lane
+  struct outq_ring control; // control lane, written first
+  size_t bytes; // unsent bytes, including held messages
+  struct mem_account *acct;
+  struct worker_stats *stats;
+  struct expiry_wheel *expiry;
+  void *expiry_key;    // what the wheel hands back for this queue
+  uint64_t expires_ns; // earliest deadline on the wheel, 0 for none
+
+  /*
+   * While a large PUBLISH is being cut through chunk by chunk, nothing else
+   * may be written in the middle of it. Messages pushed meanwhile wait in
+   * held and are appended once the stream owning the queue ends.
+   */
+  const void *stream_owner;
+  size_t stream_chunks; // chunks queued by the current stream
+  struct outq_ring held;
+
+  uint64_t removed; // entries ever removed from the ring head
+  struct outq_last *last; // open addressing, keyed by topic pointer
+  size_t last_count;
+  size_t last_capacity;
+
+  int zerocopy;
+  size_t zc_threshold;
+  uint32_t zc_next_seq; // kernel numbers zero-copy sends per socket from 0
+  struct outq_zc_entry *zc_inflight; // FIFO by seq
+  size_t zc_head;
+  size_t zc_count;
+  size_t zc_capacity;
+};
+
+// Function prototypes
+int outq_init(struct outq *q);
+void outq_destroy(struct outq *q);
+int outq_push(struct outq *q, struct mqtt_message *msg);
+int outq_push_conflated(struct outq *q, struct mqtt_message *msg);
+int outq_push_control(struct outq *q, struct mqtt_message *msg);
+int outq_empty(const struct outq *q);
+int outq_stream_begin(struct outq *q, const void *owner);
+int outq_stream_push(struct outq *q, const void *owner,
+                     struct mqtt_message *chunk);
+int outq_stream_end(struct outq *q, const void *owner);
+int outq_flush(struct outq *q, int fd);
+size_t outq_peek(const struct outq *q, void *buf, size_t len);
+void outq_advance(struct outq *q, size_t n);
+int outq_enable_zerocopy(struct outq *q, int fd, size_t threshold);
+int outq_reap_zerocopy(struct outq *q, int fd);
+size_t outq_expire(struct outq *q, uint64_t now_ns);
+
+#endif // OUTQ_H
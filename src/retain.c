@@ -0,0 +1,206 @@
+#include "retain.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t RETAIN_INITIAL_CAPACITY = 64;
+static const uint64_t RETAIN_EXPIRY_TICK_NS = 1000000000ULL;
+
+static void expire_topic(void *key, uint64_t now_ns, void *arg);
+
+int retain_init(struct retain_store *store) {
+  memset(store, 0, sizeof(*store));
+  store->slots = calloc(RETAIN_INITIAL_CAPACITY, sizeof(struct retain_entry));
+  if (store->slots == NULL) {
+    return -1;
+  }
+  store->capacity = RETAIN_INITIAL_CAPACITY;
+  // The first retain_expire catches up in one revolution
+  expiry_init(&store->expiry, RETAIN_EXPIRY_TICK_NS, 0, expire_topic, store);
+  pthread_mutex_init(&store->lock, NULL);
+  return 0;
+}
+
+void retain_destroy(struct retain_store *store) {
+  for (size_t i = 0; i < store->capacity; i++) {
+    if (store->slots[i].topic != NULL) {
+      topic_release(store->slots[i].topic);
+      mqtt_message_release(store->slots[i].msg);
+    }
+  }
+  free(store->slots);
+  for (size_t i = 0; i < EXPIRY_SLOTS; i++) {
+    struct expiry_bucket *b = &store->expiry.slots[i];
+    for (size_t j = 0; j < b->count; j++) {
+      topic_release(b->items[j].key);
+    }
+  }
+  expiry_destroy(&store->expiry);
+  pthread_mutex_destroy(&store->lock);
+  memset(store, 0, sizeof(*store));
+}
+
+static size_t slot_of(const struct retain_store *store,
+                      const struct topic *topic) {
+  size_t i = topic->hash & (store->capacity - 1);
+  while (store->slots[i].topic != NULL && store->slots[i].topic != topic) {
+    i = (i + 1) & (store->capacity - 1);
+  }
+  return i;
+}
+
+static int grow(struct retain_store *store) {
+  struct retain_entry *old = store->slots;
+  size_t old_capacity = store->capacity;
+  struct retain_entry *slots =
+      calloc(old_capacity * 2, sizeof(struct retain_entry));
+  if (slots == NULL) {
+    return -1;
+  }
+  store->slots = slots;
+  store->capacity = old_capacity * 2;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].topic != NULL) {
+      store->slots[slot_of(store, old[i].topic)] = old[i];
+    }
+  }
+  free(old);
+  return 0;
+}
+
+// Remove slot i, shifting back later entries of the same probe run
+static void remove_slot(struct retain_store *store, size_t i) {
+  size_t mask = store->capacity - 1;
+  size_t j = i;
+  store->slots[i].topic = NULL;
+  for (;;) {
+    j = (j + 1) & mask;
+    if (store->slots[j].topic == NULL) {
+      return;
+    }
+    size_t home = store->slots[j].topic->hash & mask;
+    // Move j back to i unless its home lies cyclically in (i, j]
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && (home <= i && home > j))) {
+      store->slots[i] = store->slots[j];
+      store->slots[j].topic = NULL;
+      i = j;
+    }
+  }
+}
+
+/*
+ * Store msg as the retained message for topic, taking over a reference to
+ * each. A NULL msg, or one with an empty payload as the caller decides,
+ * clears the topic (3.3.1.3).
+ */
+int retain_set(struct retain_store *store, struct topic *topic,
+               struct mqtt_message *msg) {
+  pthread_mutex_lock(&store->lock);
+  // Out of memory only means the message lingers until replaced
+  if (msg != NULL && msg->expires_ns != 0 &&
+      expiry_add(&store->expiry, topic_ref(topic), msg->expires_ns) == -1) {
+    topic_release(topic);
+  }
+  size_t i = slot_of(store, topic);
+  struct retain_entry *e = &store->slots[i];
+
+  if (e->topic != NULL) {
+    // Already present: the store keeps its own topic reference
+    mqtt_message_release(e->msg);
+    topic_release(topic);
+    if (msg != NULL) {
+      e->msg = msg;
+    } else {
+      topic_release(e->topic);
+      remove_slot(store, i);
+      store->count--;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+  }
+
+  if (msg == NULL) {
+    topic_release(topic);
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+  }
+
+  // Keep the load factor under 3/4
+  if ((store->count + 1) * 4 > store->capacity * 3) {
+    if (grow(store) == -1) {
+      pthread_mutex_unlock(&store->lock);
+      return -1;
+    }
+    i = slot_of(store, topic);
+  }
+  store->slots[i] = (struct retain_entry){topic, msg};
+  store->count++;
+  pthread_mutex_unlock(&store->lock);
+  return 0;
+}
+
+/*
+ * The retained message for topic with a new reference for the caller, or
+ * NULL if there is none or it has expired.
+ */
+struct mqtt_message *retain_get(struct retain_store *store,
+                                const struct topic *topic) {
+  struct mqtt_message *msg = NULL;
+  pthread_mutex_lock(&store->lock);
+  struct retain_entry *e = &store->slots[slot_of(store, topic)];
+  if (e->topic != NULL && !mqtt_message_expired(e->msg, stats_now_ns())) {
+    msg = mqtt_message_ref(e->msg);
+  }
+  pthread_mutex_unlock(&store->lock);
+  return msg;
+}
+
+/*
+ * Call fn for every retained message matching a new subscription's filter.
+ * The callback runs under the store lock and must not call back into it.
+ */
+size_t retain_match(struct retain_store *store, const struct topic *filter,
+                    retain_match_fn fn, void *arg) {
+  size_t matched = 0;
+  uint64_t now_ns = stats_now_ns();
+  pthread_mutex_lock(&store->lock);
+  for (size_t i = 0; i < store->capacity; i++) {
+    struct retain_entry *e = &store->slots[i];
+    if (e->topic != NULL && topic_matches(filter, e->topic) &&
+        !mqtt_message_expired(e->msg, now_ns)) {
+      fn(e->topic, e->msg, arg);
+      matched++;
+    }
+  }
+  pthread_mutex_unlock(&store->lock);
+  return matched;
+}
+
+// A deadline fired, drop the topic's message if it is still the expired one
+static void expire_topic(void *key, uint64_t now_ns, void *arg) {
+  struct retain_store *store = arg;
+  struct topic *topic = key;
+  size_t i = slot_of(store, topic);
+  struct retain_entry *e = &store->slots[i];
+  if (e->topic != NULL && mqtt_message_expired(e->msg, now_ns)) {
+    mqtt_message_release(e->msg);
+    topic_release(e->topic);
+    remove_slot(store, i);
+    store->count--;
+  }
+  topic_release(topic);
+}
+
+/*
+ * Drop the retained messages whose deadline has passed, visiting only the
+ * buckets due since the last call. Returns the number dropped.
+ */
+size_t retain_expire(struct retain_store *store, uint64_t now_ns) {
+  pthread_mutex_lock(&store->lock);
+  size_t count = store->count;
+  expiry_advance(&store->expiry, now_ns);
+  count -= store->count;
+  pthread_mutex_unlock(&store->lock);
+  return count;
+}
@@ -0,0 +1,50 @@
+#ifndef RETAIN_H
+#define RETAIN_H
+
+#include "expiry.h"
+#include "message.h"
+#include "topic.h"
+#include <pthread.h>
+#include <stddef.h>
+
+struct retain_entry {
+  struct topic *topic; // NULL for an empty slot
+  struct mqtt_message *msg;
+};
+
+/*
+ * Last retained message per topic.
+ *
+ * Keyed by interned topic handle: the precomputed hash picks the slot and
+ * equality is a pointer compare, so no topic string is stored or compared
+ * here. Open addressing with linear probing; deletions use backward shift so
+ * no tombstones build up.
+ *
+ * A retained message with a deadline is never handed out once it has
+ * passed, and is dropped when retain_expire fires the second-long bucket
+ * it falls in. The wheel holds a topic reference per deadline, so entries
+ * can move within the table.
+ */
+struct retain_store {
+  pthread_mutex_t lock;
+  struct retain_entry *slots;
+  size_t capacity; // power of two
+  size_t count;
+  struct expiry_wheel expiry; // keyed by topic
+};
+
+typedef void (*retain_match_fn)(struct topic *topic, struct mqtt_message *msg,
+                                void *arg);
+
+// Function prototypes
+int retain_init(struct retain_store *store);
+void retain_destroy(struct retain_store *store);
+int retain_set(struct retain_store *store, struct topic *topic,
+               struct mqtt_message *msg);
+struct mqtt_message *retain_get(struct retain_store *store,
+                                const struct topic *topic);
+size_t retain_match(struct retain_store *store, const struct topic *filter,
+                    retain_match_fn fn, void *arg);
+size_t retain_expire(struct retain_store *store, uint64_t now_ns);
+
+#endif // RETAIN_H
@@ -0,0 +1,424 @@
+// memfd_create and accept4
+#define _GNU_SOURCE
+#include "shm.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Memfd layout: one page holding both ring headers, then the data of the
+ * client to broker ring, then the data of the broker to client ring.
+ */
+static size_t page_size(void) { return sysconf(_SC_PAGESIZE); }
+
+static size_t shm_file_size(size_t ring_size) {
+  return page_size() + 2 * ring_size;
+}
+
+// Map size bytes of fd at offset twice in a row
+static unsigned char *map_twice(int fd, off_t offset, size_t size) {
+  unsigned char *base =
+      mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (mmap(base + i * size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+      munmap(base, 2 * size);
+      return NULL;
+    }
+  }
+  return base;
+}
+
+static void shm_unmap(struct shm_conn *c) {
+  if (c->headers != NULL) {
+    munmap(c->headers, page_size());
+  }
+  if (c->in.data != NULL) {
+    munmap(c->in.data, 2 * c->in.size);
+  }
+  if (c->out.data != NULL) {
+    munmap(c->out.data, 2 * c->out.size);
+  }
+}
+
+/*
+ * Map the rings of fd. Ring 0 carries client to broker traffic, so the
+ * broker reads it and the client writes it.
+ */
+static struct shm_conn *shm_map(int sock, int fd, size_t ring_size,
+                                int broker) {
+  struct shm_conn *c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->sock = sock;
+  c->headers =
+      mmap(NULL, page_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (c->headers == MAP_FAILED) {
+    free(c);
+    return NULL;
+  }
+  struct shm_ring_header *hdr = c->headers;
+  struct shm_ring *up = broker ? &c->in : &c->out;
+  struct shm_ring *down = broker ? &c->out : &c->in;
+  up->hdr = &hdr[0];
+  down->hdr = &hdr[1];
+  up->size = down->size = ring_size;
+  up->data = map_twice(fd, page_size(), ring_size);
+  down->data = map_twice(fd, page_size() + ring_size, ring_size);
+  if (up->data == NULL || down->data == NULL) {
+    shm_unmap(c);
+    free(c);
+    return NULL;
+  }
+  // Whatever the peer left there, we start where the shared state says
+  c->in.pos = atomic_load_explicit(&c->in.hdr->head, memory_order_acquire);
+  c->out.pos = atomic_load_explicit(&c->out.hdr->tail, memory_order_acquire);
+  return c;
+}
+
+// Listen for local clients on a Unix socket at path, replacing a stale one
+int shm_listen(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+/*
+ * Broker side of the handshake on an accepted socket: create the rings,
+ * send them over with their size and switch the socket to non-blocking
+ * for the doorbell.
+ */
+struct shm_conn *shm_conn_new(int sock, size_t ring_size) {
+  int fd = memfd_create("cz-mqtt-shm", MFD_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct shm_conn *c = NULL;
+  if (ftruncate(fd, shm_file_size(ring_size)) == 0) {
+    c = shm_map(sock, fd, ring_size, 1);
+  }
+  if (c == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  struct shm_hello hello = {SHM_MAGIC, SHM_VERSION, ring_size};
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+  ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  close(fd); // the mappings keep it alive
+  if (sent != sizeof(hello)) {
+    shm_conn_free(c);
+    return NULL;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return c;
+}
+
+/*
+ * Client side: connect to the broker's socket at path and map the rings it
+ * sends. The socket is c->sock, the caller closes it after shm_conn_free.
+ */
+struct shm_conn *shm_connect(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    return NULL;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return NULL;
+  }
+
+  struct shm_hello hello;
+  struct iovec iov = {&hello, sizeof(hello)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  int fd = -1;
+  if (cm != NULL && cm->cmsg_level == SOL_SOCKET &&
+      cm->cmsg_type == SCM_RIGHTS) {
+    memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+  }
+
+  struct stat st;
+  size_t size = hello.ring_size;
+  struct shm_conn *c = NULL;
+  if (got == sizeof(hello) && fd != -1 && hello.magic == SHM_MAGIC &&
+      hello.version == SHM_VERSION && size >= page_size() &&
+      size <= SHM_MAX_RING_SIZE && (size & (size - 1)) == 0 &&
+      fstat(fd, &st) == 0 && (size_t)st.st_size == shm_file_size(size)) {
+    c = shm_map(sock, fd, size, 0);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (c == NULL) {
+    close(sock);
+    errno = EPROTO;
+    return NULL;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  return c;
+}
+
+// Unmap the rings. Doesn't close the socket.
+void shm_conn_free(struct shm_conn *c) {
+  if (c == NULL) {
+    return;
+  }
+  shm_unmap(c);
+  free(c);
+}
+
+static void ring_doorbell(struct shm_conn *c) {
+  char bell = 0;
+  // A full socket already holds a wakeup the peer hasn't read
+  send(c->sock, &bell, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// Bytes the producer may add, -1 if the consumer's position is impossible
+static ssize_t ring_space(const struct shm_ring *r) {
+  uint64_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+  if (r->pos - head > r->size) {
+    return -1;
+  }
+  return r->size - (r->pos - head);
+}
+
+// Bytes the consumer may take, -1 if the producer's position is impossible
+static ssize_t ring_avail(const struct shm_ring *r) {
+  uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+  if (tail - r->pos > r->size) {
+    return -1;
+  }
+  return tail - r->pos;
+}
+
+/*
+ * Make written bytes visible and wake the consumer if it parked. The fence
+ * orders the store before the flag load, pairing with the one in
+ * ring_park, so either the consumer sees the data or we see its flag.
+ */
+static void ring_publish(struct shm_conn *c, struct shm_ring *r) {
+  atomic_store_explicit(&r->hdr->tail, r->pos, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&r->hdr->reader_waiting, memory_order_relaxed) &&
+      atomic_exchange(&r->hdr->reader_waiting, 0)) {
+    ring_doorbell(c);
+  }
+}
+
+static void ring_release(struct shm_conn *c, struct shm_ring *r) {
+  atomic_store_explicit(&r->hdr->head, r->pos, memory_order_release);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&r->hdr->writer_waiting, memory_order_relaxed) &&
+      atomic_exchange(&r->hdr->writer_waiting, 0)) {
+    ring_doorbell(c);
+  }
+}
+
+/*
+ * Ask to be woken when the ring changes, then look again. Returns 1 if
+ * the caller may sleep, 0 if there is already something to do.
+ */
+static int ring_park(struct shm_ring *r, _Atomic uint32_t *flag, int writer) {
+  atomic_store(flag, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  return (writer ? ring_space(r) : ring_avail(r)) == 0;
+}
+
+/*
+ * Write up to len bytes. Returns the bytes written, possibly 0 with the
+ * ring full, in which case the peer rings once it has made room; -1 if the
+ * peer hung up or broke the ring.
+ */
+ssize_t shm_write(struct shm_conn *c, const void *buf, size_t len) {
+  struct shm_ring *r = &c->out;
+  size_t done = 0;
+  if (c->closed) {
+    errno = EPIPE;
+    return -1;
+  }
+
+  while (done < len) {
+    ssize_t space = ring_space(r);
+    if (space == -1) {
+      errno = EPROTO;
+      return -1;
+    }
+    size_t n = len - done < (size_t)space ? len - done : (size_t)space;
+    if (n > 0) {
+      memcpy(r->data + (r->pos & (r->size - 1)), (const char *)buf + done, n);
+      r->pos += n;
+      done += n;
+      ring_publish(c, r);
+    } else if (ring_park(r, &r->hdr->writer_waiting, 1)) {
+      break;
+    }
+  }
+  return done;
+}
+
+/*
+ * Copy out up to len bytes, like recv: returns the count, 0 once the peer
+ * has hung up and everything it wrote was read, and -1 with errno EAGAIN
+ * when the ring is empty.
+ */
+ssize_t shm_read(struct shm_conn *c, void *buf, size_t len) {
+  struct shm_ring *r = &c->in;
+  ssize_t avail = ring_avail(r);
+  if (avail == -1) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (avail == 0) {
+    if (c->closed) {
+      return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+  }
+  size_t n = len < (size_t)avail ? len : (size_t)avail;
+  memcpy(buf, r->data + (r->pos & (r->size - 1)), n);
+  r->pos += n;
+  ring_release(c, r);
+  return n;
+}
+
+// Bytes are waiting to be read, or the ring is broken and shm_read says so
+int shm_readable(const struct shm_conn *c) { return ring_avail(&c->in) != 0; }
+
+/*
+ * Move as much of the queue into the ring as fits, with outq_flush's
+ * return values. Packets are copied straight from the queued messages
+ * into shared memory. 1 means the ring is full and the peer rings once it
+ * has made room, so there is no POLLOUT to wait for.
+ */
+int shm_flush(struct shm_conn *c, struct outq *q) {
+  struct shm_ring *r = &c->out;
+  if (c->closed) {
+    return -1;
+  }
+  if (q->expires_ns != 0) {
+    outq_expire(q, stats_now_ns());
+  }
+
+  while (!outq_empty(q)) {
+    ssize_t space = ring_space(r);
+    if (space == -1) {
+      return -1;
+    }
+    if (space == 0) {
+      if (ring_park(r, &r->hdr->writer_waiting, 1)) {
+        return 1;
+      }
+      continue;
+    }
+    size_t n = outq_peek(q, r->data + (r->pos & (r->size - 1)), space);
+    if (n == 0) {
+      break; // control waits for the rest of a streamed packet
+    }
+    outq_advance(q, n);
+    r->pos += n;
+    ring_publish(c, r);
+  }
+  return 0;
+}
+
+/*
+ * Drain doorbell bytes once the socket polls readable, noting a hang up.
+ */
+void shm_doorbell(struct shm_conn *c) {
+  char bells[64];
+  ssize_t n;
+  while ((n = recv(c->sock, bells, sizeof(bells), MSG_DONTWAIT)) > 0) {
+  }
+  if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    c->closed = 1;
+  }
+}
+
+/*
+ * Before the event loop sleeps: ask for a doorbell when data arrives.
+ * Returns 1 if it may sleep, 0 if input is already waiting.
+ */
+int shm_park(struct shm_conn *c) {
+  return ring_park(&c->in, &c->in.hdr->reader_waiting, 0);
+}
+
+/*
+ * Sleep until the peer writes, makes room after a short shm_write, or
+ * hangs up, for clients without an event loop of their own. Returns 1 when
+ * woken, 0 on timeout and -1 once the peer is gone.
+ */
+int shm_wait(struct shm_conn *c, int timeout_ms) {
+  if (c->closed) {
+    return -1;
+  }
+  if (!shm_park(c)) {
+    return 1;
+  }
+  struct pollfd pfd = {.fd = c->sock, .events = POLLIN};
+  int ready = poll(&pfd, 1, timeout_ms);
+  if (ready == 1) {
+    shm_doorbell(c);
+  }
+  if (c->closed) {
+    return -1;
+  }
+  return ready > 0 ? 1 : ready;
+}
@@ -0,0 +1,83 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "outq.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_MAGIC 0x4d51534dU // "MQSM"
+#define SHM_VERSION 1
+// Bytes per direction, a power of two and a multiple of the page size
+#define SHM_RING_SIZE (1 << 20)
+#define SHM_MAX_RING_SIZE (1 << 28)
+
+// Sent with the ring memfd once the Unix socket is accepted
+struct shm_hello {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+};
+
+/*
+ * The shared part of one direction. Positions are free running byte counts,
+ * each written by one side only and kept on its own cache line together
+ * with the flag the other side raises to be woken.
+ */
+struct shm_ring_header {
+  _Alignas(64) _Atomic uint64_t tail; // producer
+  _Atomic uint32_t writer_waiting;    // producer parked on a full ring
+  _Alignas(64) _Atomic uint64_t head; // consumer
+  _Atomic uint32_t reader_waiting;    // consumer parked on an empty ring
+};
+
+/*
+ * One side's view of a direction. The data is mapped twice back to back,
+ * so any size bytes starting inside the ring are contiguous in memory and
+ * nothing is ever split at the wrap.
+ */
+struct shm_ring {
+  struct shm_ring_header *hdr;
+  unsigned char *data;
+  size_t size;
+  uint64_t pos; // our own position, never read back from shared memory
+};
+
+/*
+ * Local transport for clients on the same host.
+ *
+ * Each connection is a pair of single producer, single consumer byte rings
+ * in a memfd the broker creates and hands over a Unix socket, carrying the
+ * same MQTT frames as a TCP connection. Reading and writing never enter the
+ * kernel: a side only asks to be woken, by raising its flag in the ring
+ * header, when it is about to sleep on an empty or full ring, and the other
+ * side then rings its doorbell with one byte on the socket. The socket also
+ * reports the peer hanging up, so one poll slot covers both.
+ *
+ * The peer can write anything to the shared pages. Our own positions are
+ * kept privately, the peer's are checked before use, and frames are copied
+ * out before they are decoded.
+ */
+struct shm_conn {
+  struct shm_ring in;
+  struct shm_ring out;
+  int sock;
+  int closed; // the peer hung up
+  void *headers;
+};
+
+// Function prototypes
+int shm_listen(const char *path);
+struct shm_conn *shm_conn_new(int sock, size_t ring_size);
+struct shm_conn *shm_connect(const char *path);
+void shm_conn_free(struct shm_conn *c);
+ssize_t shm_write(struct shm_conn *c, const void *buf, size_t len);
+ssize_t shm_read(struct shm_conn *c, void *buf, size_t len);
+int shm_readable(const struct shm_conn *c);
+int shm_flush(struct shm_conn *c, struct outq *q);
+void shm_doorbell(struct shm_conn *c);
+int shm_park(struct shm_conn *c);
+int shm_wait(struct shm_conn *c, int timeout_ms);
+
+#endif // SHM_H
@@ -0,0 +1,84 @@
+#include "slowcon.h"
+#include <string.h>
+
+#define SLOW_WINDOW_NS 1000000000ULL
+
+void slow_init(struct slow_consumer *sc, uint64_t now_ns) {
+  memset(sc, 0, sizeof(*sc));
+  sc->window_start_ns = now_ns;
+}
+
+/*
+ * Account one iteration: queued bytes left after the flush, bytes written by
+ * it and whether the socket refused more (blocked). Returns SLOW_ENGAGE the
+ * first time the consumer qualifies as slow and SLOW_RELEASE once it has
+ * recovered; a flagged consumer stays flagged in between.
+ */
+enum slow_verdict slow_update(struct slow_consumer *sc,
+                              const struct slow_policy *policy,
+                              size_t queued, size_t written, int blocked,
+                              uint64_t now_ns) {
+  sc->window_bytes += written;
+  uint64_t elapsed = now_ns - sc->window_start_ns;
+  if (elapsed >= SLOW_WINDOW_NS) {
+    uint64_t rate = sc->window_bytes * SLOW_WINDOW_NS / elapsed;
+    // Halve the weight of history every window
+    sc->drain_rate = (sc->drain_rate + rate) / 2;
+    sc->window_bytes = 0;
+    sc->window_start_ns = now_ns;
+  }
+
+  if (blocked && sc->blocked_since_ns == 0) {
+    sc->blocked_since_ns = now_ns;
+  } else if (!blocked && sc->blocked_since_ns != 0) {
+    sc->blocked_ns += now_ns - sc->blocked_since_ns;
+    sc->blocked_since_ns = 0;
+  }
+
+  if (policy->high_watermark == 0) {
+    return SLOW_OK;
+  }
+  if (queued > policy->high_watermark) {
+    if (sc->over_since_ns == 0) {
+      sc->over_since_ns = now_ns;
+    }
+    if (!sc->flagged && now_ns - sc->over_since_ns >= policy->grace_ns) {
+      sc->flagged = 1;
+      return SLOW_ENGAGE;
+    }
+    return SLOW_OK;
+  }
+
+  sc->over_since_ns = 0;
+  if (sc->flagged && queued <= policy->high_watermark / 2) {
+    sc->flagged = 0;
+    return SLOW_RELEASE;
+  }
+  return SLOW_OK;
+}
+
+/*
+ * When slow_update would flag the consumer if nothing drains meanwhile,
+ * so an otherwise idle loop can wake up for it. 0 if no deadline is
+ * pending.
+ */
+uint64_t slow_deadline_ns(const struct slow_consumer *sc,
+                          const struct slow_policy *policy) {
+  if (policy->high_watermark == 0 || sc->flagged || sc->over_since_ns == 0) {
+    return 0;
+  }
+  return sc->over_since_ns + policy->grace_ns;
+}
+
+int slow_parse_action(const char *name, enum slow_action *action) {
+  if (strcmp(name, "conflate") == 0) {
+    *action = SLOW_CONFLATE;
+  } else if (strcmp(name, "drop") == 0) {
+    *action = SLOW_DROP_QOS0;
+  } else if (strcmp(name, "disconnect") == 0) {
+    *action = SLOW_DISCONNECT;
+  } else {
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef SLOWCON_H
+#define SLOWCON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What to do with a consumer that stays over the high watermark
+enum slow_action {
+  SLOW_CONFLATE,   // demote to last-value delivery (outq_push_conflated)
+  SLOW_DROP_QOS0,  // stop queueing QoS 0 messages to it
+  SLOW_DISCONNECT, // close the connection
+};
+
+struct slow_policy {
+  size_t high_watermark; // queued bytes; 0 disables detection
+  uint64_t grace_ns;     // time over the watermark before acting
+  enum slow_action action;
+};
+
+// Result of slow_update for the caller to apply
+enum slow_verdict {
+  SLOW_OK,
+  SLOW_ENGAGE,  // apply the policy action now
+  SLOW_RELEASE, // back under the low watermark, undo a demotion
+};
+
+/*
+ * Health of one connection's outbound side.
+ *
+ * Updated once per event loop iteration with the bytes still queued and the
+ * bytes written since the last update. A consumer is flagged once its queue
+ * has stayed above the high watermark for the grace period, and released
+ * when it falls back under half the watermark, so one bad client is
+ * isolated without flapping.
+ */
+struct slow_consumer {
+  uint64_t window_start_ns;
+  uint64_t window_bytes;
+  uint64_t drain_rate;       // bytes/s, smoothed over one second windows
+  uint64_t over_since_ns;    // 0 while under the high watermark
+  uint64_t blocked_since_ns; // 0 while the socket accepts everything
+  uint64_t blocked_ns;       // total time spent in backpressure
+  int flagged;
+};
+
+// Function prototypes
+void slow_init(struct slow_consumer *sc, uint64_t now_ns);
+enum slow_verdict slow_update(struct slow_consumer *sc,
+                              const struct slow_policy *policy,
+                              size_t queued, size_t written, int blocked,
+                              uint64_t now_ns);
+uint64_t slow_deadline_ns(const struct slow_consumer *sc,
+                          const struct slow_policy *policy);
+int slow_parse_action(const char *name, enum slow_action *action);
+
+#endif // SLOWCON_H
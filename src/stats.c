@@ -0,0 +1,212 @@
+#include "stats.h"
+#include "memacct.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static struct worker_stats *workers;
+static int worker_count;
+
+static const char *const sys_topics[STAT_COUNT] = {
+    [STAT_CLIENTS_CONNECTED] = "$SYS/broker/clients/connected",
+    [STAT_SUBSCRIPTIONS] = "$SYS/broker/subscriptions/count",
+    [STAT_MSGS_IN] = "$SYS/broker/messages/received",
+    [STAT_MSGS_OUT] = "$SYS/broker/messages/sent",
+    [STAT_BYTES_IN] = "$SYS/broker/bytes/received",
+    [STAT_BYTES_OUT] = "$SYS/broker/bytes/sent",
+    [STAT_MSGS_DROPPED] = "$SYS/broker/messages/dropped",
+    [STAT_SLOW_CONSUMERS] = "$SYS/broker/clients/slow",
+    [STAT_SLOW_ACTIONS] = "$SYS/broker/clients/slow/actions",
+    [STAT_SLOW_DISCONNECTS] = "$SYS/broker/clients/slow/disconnected",
+    [STAT_BACKPRESSURE_US] = "$SYS/broker/clients/backpressure_us",
+    [STAT_TLS_HANDSHAKES] = "$SYS/broker/tls/handshakes",
+    [STAT_TLS_RESUMED] = "$SYS/broker/tls/resumed",
+    [STAT_CLUSTER_PEERS] = "$SYS/broker/cluster/peers",
+    [STAT_CLUSTER_FORWARDED] = "$SYS/broker/cluster/forwarded",
+    [STAT_PREFILTER_CHECKED] = "$SYS/broker/routing/prefilter/checked",
+    [STAT_PREFILTER_REJECTED] = "$SYS/broker/routing/prefilter/rejected",
+    [STAT_MSGS_EXPIRED] = "$SYS/broker/messages/expired",
+};
+
+/*
+ * Allocate one counter block per worker. Called once before the workers
+ * start.
+ */
+int stats_init(int nworkers) {
+  free(workers);
+  workers = aligned_alloc(STATS_CACHE_LINE,
+                          sizeof(struct worker_stats) * nworkers);
+  if (workers == NULL) {
+    return -1;
+  }
+  memset(workers, 0, sizeof(struct worker_stats) * nworkers);
+  worker_count = nworkers;
+  return 0;
+}
+
+struct worker_stats *stats_worker(int id) { return &workers[id]; }
+
+void stats_snapshot(int64_t totals[STAT_COUNT]) {
+  memset(totals, 0, sizeof(int64_t) * STAT_COUNT);
+  for (int w = 0; w < worker_count; w++) {
+    for (int c = 0; c < STAT_COUNT; c++) {
+      totals[c] += atomic_load_explicit(&workers[w].counters[c],
+                                        memory_order_relaxed);
+    }
+  }
+}
+
+static const char *const lat_names[LAT_STAGE_COUNT] = {
+    [LAT_DECODE] = "decode",
+    [LAT_ROUTE] = "route",
+    [LAT_WRITE] = "write",
+    [LAT_END_TO_END] = "end_to_end",
+};
+
+static const struct {
+  const char *name;
+  double percentile;
+} lat_percentiles[] = {{"p50", 50.0}, {"p99", 99.0}, {"p999", 99.9}};
+
+#define LAT_PERCENTILE_COUNT                                                   \
+  (sizeof(lat_percentiles) / sizeof(lat_percentiles[0]))
+
+/*
+ * Merge one stage's histogram across all workers into merged. Done on demand
+ * by the reader; workers never touch a shared histogram.
+ */
+void stats_latency_snapshot(enum lat_stage stage, struct histogram *merged) {
+  hist_reset(merged);
+  for (int w = 0; w < worker_count; w++) {
+    hist_merge(merged, &workers[w].latency[stage]);
+  }
+}
+
+// Percentage of checked topics the prefilter turned away
+static int64_t prefilter_hit_rate(const int64_t totals[STAT_COUNT]) {
+  int64_t checked = totals[STAT_PREFILTER_CHECKED];
+  return checked > 0 ? totals[STAT_PREFILTER_REJECTED] * 100 / checked : 0;
+}
+
+// Human readable dump of every counter and latency percentile
+void stats_dump(FILE *out) {
+  int64_t totals[STAT_COUNT];
+  struct histogram merged;
+
+  stats_snapshot(totals);
+  for (int c = 0; c < STAT_COUNT; c++) {
+    fprintf(out, "%s %" PRId64 "\n", sys_topics[c], totals[c]);
+  }
+  fprintf(out, "$SYS/broker/routing/prefilter/hit_rate %" PRId64 "%%\n",
+          prefilter_hit_rate(totals));
+  for (int s = 0; s < LAT_STAGE_COUNT; s++) {
+    stats_latency_snapshot(s, &merged);
+    fprintf(out, "latency %-10s n=%" PRIu64, lat_names[s], hist_count(&merged));
+    for (size_t p = 0; p < LAT_PERCENTILE_COUNT; p++) {
+      fprintf(out, " %s=%" PRIu64 "ns", lat_percentiles[p].name,
+              hist_percentile(&merged, lat_percentiles[p].percentile));
+    }
+    fprintf(out, "\n");
+  }
+  fflush(out);
+}
+
+/*
+ * A timerfd that fires every interval_ms, for the $SYS refresh to sit in a
+ * worker's poll set. The owner reads it to clear it, then calls
+ * stats_publish_sys.
+ */
+int stats_timer_fd(unsigned interval_ms) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct itimerspec spec = {
+      .it_interval = {interval_ms / 1000, (interval_ms % 1000) * 1000000L},
+      .it_value = {interval_ms / 1000, (interval_ms % 1000) * 1000000L},
+  };
+  if (timerfd_settime(fd, 0, &spec, NULL) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Publish one value as a retained QoS 0 message, as stats_publish_sys does
+ * for each counter.
+ */
+int stats_publish_value(struct retain_store *store, const char *name,
+                        int64_t value, sys_publish_fn deliver, void *arg) {
+  char payload[32];
+  int len = snprintf(payload, sizeof(payload), "%" PRId64, value);
+
+  struct topic *topic = topic_intern(name, strlen(name));
+  if (topic == NULL) {
+    return -1;
+  }
+  struct mqtt_message *msg =
+      mqtt_message_publish(topic, payload, len, PUBLISH_BYTE | 0x01, 0);
+  if (msg == NULL) {
+    topic_release(topic);
+    return -1;
+  }
+
+  // New subscribers get the latest value from the retained store
+  retain_set(store, topic, mqtt_message_ref(msg));
+  if (deliver != NULL) {
+    deliver(msg, arg);
+  }
+  mqtt_message_release(msg);
+  return 0;
+}
+
+/*
+ * Sum the per-worker counters and publish each one as a retained QoS 0
+ * message under $SYS/broker/. deliver routes the message to current
+ * subscribers and must take its own reference if it keeps it.
+ */
+int stats_publish_sys(struct retain_store *store, sys_publish_fn deliver,
+                      void *arg) {
+  int64_t totals[STAT_COUNT];
+  struct mem_stats mem;
+  int status = 0;
+
+  stats_snapshot(totals);
+  for (int c = 0; c < STAT_COUNT; c++) {
+    status |=
+        stats_publish_value(store, sys_topics[c], totals[c], deliver, arg);
+  }
+
+  memacct_snapshot(&mem);
+  status |= stats_publish_value(store, "$SYS/broker/memory/queued",
+                                mem.global_bytes, deliver, arg);
+  status |= stats_publish_value(store, "$SYS/broker/memory/evicted",
+                                mem.evicted, deliver, arg);
+  status |= stats_publish_value(store, "$SYS/broker/memory/rejected",
+                                mem.rejected, deliver, arg);
+  status |= stats_publish_value(store, "$SYS/broker/memory/disconnected",
+                                mem.disconnected, deliver, arg);
+  status |= stats_publish_value(store, "$SYS/broker/topics/interned",
+                                topic_count(), deliver, arg);
+  status |= stats_publish_value(store, "$SYS/broker/routing/prefilter/hit_rate",
+                                prefilter_hit_rate(totals), deliver, arg);
+
+  // $SYS/broker/latency/<stage>/<percentile>, in nanoseconds
+  struct histogram merged;
+  char name[64];
+  for (int s = 0; s < LAT_STAGE_COUNT; s++) {
+    stats_latency_snapshot(s, &merged);
+    for (size_t p = 0; p < LAT_PERCENTILE_COUNT; p++) {
+      snprintf(name, sizeof(name), "$SYS/broker/latency/%s/%s", lat_names[s],
+               lat_percentiles[p].name);
+      status |= stats_publish_value(
+          store, name, hist_percentile(&merged, lat_percentiles[p].percentile),
+          deliver, arg);
+    }
+  }
+  return status;
+}
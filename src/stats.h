@@ -0,0 +1,106 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "histogram.h"
+#include "message.h"
+#include "retain.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define STATS_CACHE_LINE 64
+// How often the $SYS topics are refreshed
+#define STATS_SYS_INTERVAL_MS 10000
+
+enum stat_counter {
+  STAT_CLIENTS_CONNECTED,
+  STAT_SUBSCRIPTIONS,
+  STAT_MSGS_IN,
+  STAT_MSGS_OUT,
+  STAT_BYTES_IN,
+  STAT_BYTES_OUT,
+  STAT_MSGS_DROPPED,
+  STAT_SLOW_CONSUMERS,
+  STAT_SLOW_ACTIONS,
+  STAT_SLOW_DISCONNECTS,
+  STAT_BACKPRESSURE_US,
+  STAT_TLS_HANDSHAKES,
+  STAT_TLS_RESUMED, // handshakes abbreviated by a ticket or cached session
+  STAT_CLUSTER_PEERS,
+  STAT_CLUSTER_FORWARDED, // PUBLISH copies queued for peer nodes
+  STAT_PREFILTER_CHECKED, // topics checked against the subscription prefilter
+  STAT_PREFILTER_REJECTED, // of those, known to have no subscriber
+  STAT_MSGS_EXPIRED, // dropped unsent once past their deadline
+  STAT_COUNT,
+};
+
+/*
+ * Pipeline stages timed per delivered message, in nanoseconds:
+ * ingress (bytes read) -> decoded -> routed (queued to every subscriber)
+ * -> written to the subscriber's socket.
+ */
+enum lat_stage {
+  LAT_DECODE,
+  LAT_ROUTE,
+  LAT_WRITE,
+  LAT_END_TO_END,
+  LAT_STAGE_COUNT,
+};
+
+/*
+ * Counters and latency histograms owned by one worker.
+ *
+ * Only the owning worker writes them, so an update is a relaxed load and
+ * store with no locked instruction; the aggregator reads every worker's
+ * block with relaxed loads and never blocks a writer. Gauges such as
+ * connected clients may go negative on one worker when a client moves
+ * between workers, only the sum is meaningful.
+ *
+ * Each block is padded to its own cache lines so workers never share one.
+ */
+struct worker_stats {
+  _Alignas(STATS_CACHE_LINE) _Atomic int64_t counters[STAT_COUNT];
+  _Alignas(STATS_CACHE_LINE) struct histogram latency[LAT_STAGE_COUNT];
+};
+
+/*
+ * Add n to one of the calling worker's counters. Inline so the hot path is a
+ * plain load, add and store.
+ */
+static inline void stats_add(struct worker_stats *ws, enum stat_counter c,
+                             int64_t n) {
+  int64_t v = atomic_load_explicit(&ws->counters[c], memory_order_relaxed);
+  atomic_store_explicit(&ws->counters[c], v + n, memory_order_relaxed);
+}
+
+// Monotonic timestamp for latency stamps
+static inline uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Record end - start for one stage; unset (zero) stamps are ignored
+static inline void stats_latency(struct worker_stats *ws, enum lat_stage stage,
+                                 uint64_t start_ns, uint64_t end_ns) {
+  if (start_ns != 0 && end_ns >= start_ns) {
+    hist_record(&ws->latency[stage], end_ns - start_ns);
+  }
+}
+
+typedef void (*sys_publish_fn)(struct mqtt_message *msg, void *arg);
+
+// Function prototypes
+int stats_init(int nworkers);
+struct worker_stats *stats_worker(int id);
+void stats_snapshot(int64_t totals[STAT_COUNT]);
+void stats_latency_snapshot(enum lat_stage stage, struct histogram *merged);
+void stats_dump(FILE *out);
+int stats_timer_fd(unsigned interval_ms);
+int stats_publish_sys(struct retain_store *store, sys_publish_fn deliver,
+                      void *arg);
+int stats_publish_value(struct retain_store *store, const char *name,
+                        int64_t value, sys_publish_fn deliver, void *arg);
+
+#endif // STATS_H
@@ -0,0 +1,172 @@
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void release_assembly(struct stream_target *t) {
+  if (t->q->acct != NULL) {
+    memacct_uncharge(t->q->acct, MEM_QUEUED, t->assembly->len);
+  }
+  mqtt_message_release(t->assembly);
+  t->assembly = NULL;
+}
+
+/*
+ * The whole packet is buffered for a busy connection, so it has to fit the
+ * session's memory limits up front. Under MEM_REJECT or MEM_DISCONNECT the
+ * copy is refused; it is QoS 0, so the subscriber just misses it.
+ */
+static int assemble(struct stream_target *t, size_t packet_len) {
+  if (t->q->acct != NULL && memacct_over(t->q->acct, packet_len) > 0) {
+    return memacct_refuse(t->q->acct);
+  }
+  t->assembly = mqtt_message_new(NULL, packet_len);
+  if (t->assembly == NULL) {
+    return -1;
+  }
+  if (t->q->acct != NULL) {
+    memacct_charge(t->q->acct, MEM_QUEUED, packet_len);
+  }
+  return 0;
+}
+
+/*
+ * A subscriber that has seen part of a packet can't be given anything else
+ * on that connection, so the only way out of a failed stream is to drop it.
+ */
+static void cut_target(struct publish_stream *s, struct stream_target *t) {
+  if (t->q == NULL) {
+    return;
+  }
+  if (t->assembly != NULL) {
+    // Nothing was queued yet, the subscriber simply misses this message
+    release_assembly(t);
+  } else {
+    outq_stream_end(t->q, s);
+    s->cut(t->q, s->cut_arg);
+  }
+  t->q = NULL;
+}
+
+/*
+ * Start forwarding a QoS 0 PUBLISH of packet_len bytes (fixed header
+ * included) to the given output queues. The stream struct itself identifies
+ * the stream to the queues, so it must not move until the stream is done or
+ * aborted.
+ *
+ * cut is called for every subscriber whose copy can't be completed; the
+ * caller should mark that connection for closing.
+ *
+ * Returns -1 for any other packet, which the caller buffers and routes
+ * whole, or when out of memory.
+ */
+int publish_stream_begin(struct publish_stream *s, union mqtt_header header,
+                         size_t packet_len, struct outq **targets,
+                         size_t ntargets, stream_cut_fn cut, void *cut_arg) {
+  if (header.bits.type != PUBLISH || header.bits.qos != AT_MOST_ONCE) {
+    return -1;
+  }
+  s->remaining = packet_len;
+  s->ntargets = ntargets;
+  s->cut = cut;
+  s->cut_arg = cut_arg;
+  s->targets = calloc(ntargets ? ntargets : 1, sizeof(struct stream_target));
+  if (s->targets == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < ntargets; i++) {
+    struct stream_target *t = &s->targets[i];
+    t->q = targets[i];
+    if (outq_stream_begin(t->q, s) == 0) {
+      continue;
+    }
+    // Connection busy with another stream, buffer this one copy in full
+    if (assemble(t, packet_len) == -1) {
+      t->q = NULL;
+    }
+  }
+  return 0;
+}
+
+static void finish(struct publish_stream *s) {
+  for (size_t i = 0; i < s->ntargets; i++) {
+    struct stream_target *t = &s->targets[i];
+    if (t->q == NULL) {
+      continue;
+    }
+    if (t->assembly != NULL) {
+      // outq_push charges the packet again once it is queued
+      struct mqtt_message *packet = mqtt_message_ref(t->assembly);
+      release_assembly(t);
+      if (outq_push(t->q, packet) == -1) {
+        mqtt_message_release(packet);
+      }
+    } else {
+      outq_stream_end(t->q, s);
+    }
+  }
+  free(s->targets);
+  s->targets = NULL;
+  s->ntargets = 0;
+}
+
+/*
+ * Forward the next bytes read from the publisher. Bytes past the end of the
+ * packet are not consumed; they belong to the next packet on the connection.
+ *
+ * Returns the number of bytes consumed.
+ */
+size_t publish_stream_feed(struct publish_stream *s,
+                           const unsigned char *data, size_t len) {
+  size_t n = len < s->remaining ? len : s->remaining;
+  if (n == 0) {
+    return 0;
+  }
+
+  struct mqtt_message *chunk = NULL;
+  for (size_t i = 0; i < s->ntargets; i++) {
+    struct stream_target *t = &s->targets[i];
+    if (t->q == NULL) {
+      continue;
+    }
+    if (t->assembly != NULL) {
+      memcpy(t->assembly->data + t->filled, data, n);
+      t->filled += n;
+      continue;
+    }
+    // One copy of the chunk is shared by every streaming subscriber
+    if (chunk == NULL && (chunk = mqtt_message_new(data, n)) == NULL) {
+      cut_target(s, t);
+      continue;
+    }
+    if (outq_stream_push(t->q, s, mqtt_message_ref(chunk)) == -1) {
+      mqtt_message_release(chunk);
+      cut_target(s, t);
+    }
+  }
+  mqtt_message_release(chunk);
+
+  s->remaining -= n;
+  if (s->remaining == 0) {
+    finish(s);
+  }
+  return n;
+}
+
+int publish_stream_done(const struct publish_stream *s) {
+  return s->remaining == 0;
+}
+
+/*
+ * The publisher went away mid-packet. Subscribers that were buffering just
+ * lose the message, those that already received part of it are cut.
+ */
+void publish_stream_abort(struct publish_stream *s) {
+  for (size_t i = 0; i < s->ntargets; i++) {
+    cut_target(s, &s->targets[i]);
+  }
+  free(s->targets);
+  s->targets = NULL;
+  s->ntargets = 0;
+  s->remaining = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "mqtt.h"
+#include "outq.h"
+#include <stddef.h>
+
+// PUBLISH packets at least this large are cut through instead of buffered
+#define MQTT_STREAM_THRESHOLD (64 * 1024)
+
+typedef void (*stream_cut_fn)(struct outq *q, void *arg);
+
+struct stream_target {
+  struct outq *q; // NULL once the target has been cut
+  /*
+   * Set when another stream was already writing to this connection. The
+   * packet is then assembled here and queued whole once it is complete,
+   * charged to the connection's account all the while.
+   */
+  struct mqtt_message *assembly;
+  size_t filled;
+};
+
+/*
+ * A large PUBLISH forwarded to its subscribers while it is still arriving.
+ *
+ * Once the variable header is in (see mqtt_peek_publish_topic) the receiving
+ * connection routes the message and starts a stream to the matching
+ * connections. Every chunk read from the publisher afterwards is copied once
+ * into a shared message and queued on each subscriber, so memory held for
+ * the packet is bounded by what subscribers have not written yet rather than
+ * by the packet size.
+ *
+ * The publisher's fixed and variable header are forwarded unchanged, which
+ * is only correct for QoS 0: a QoS 1/2 packet needs its QoS capped and a
+ * packet id from each subscriber's session, so it is never streamed.
+ */
+struct publish_stream {
+  size_t remaining; // bytes of the packet still to arrive
+  size_t ntargets;
+  struct stream_target *targets;
+  stream_cut_fn cut;
+  void *cut_arg;
+};
+
+// Function prototypes
+int publish_stream_begin(struct publish_stream *s, union mqtt_header header,
+                         size_t packet_len, struct outq **targets,
+                         size_t ntargets, stream_cut_fn cut, void *cut_arg);
+size_t publish_stream_feed(struct publish_stream *s,
+                           const unsigned char *data, size_t len);
+int publish_stream_done(const struct publish_stream *s);
+void publish_stream_abort(struct publish_stream *s);
+
+#endif // STREAM_H
@@ -0,0 +1,746 @@
+#include "subs.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const size_t PREFILTER_MIN_COUNTERS = 1024;
+#define PREFILTER_HASHES 3
+#define PREFILTER_SATURATED 255
+// Subscribers on a node below which subs_apply scans instead of hashing
+static const size_t BATCH_SCAN_MAX = 16;
+
+void subs_init(struct sub_index *idx) {
+  memset(idx, 0, sizeof(*idx));
+  pthread_mutex_init(&idx->lock, NULL);
+}
+
+static void set_free(struct epoch_entry *e) {
+  struct sub_set *set = (struct sub_set *)e;
+  topic_release(set->filter);
+  free(set);
+}
+
+// Children and prefilter tables hold nothing else
+static void entry_free(struct epoch_entry *e) { free(e); }
+
+static void node_free(struct sub_node *node) {
+  struct sub_children *t = atomic_load(&node->children);
+  for (size_t i = 0; t != NULL && i <= t->mask; i++) {
+    struct sub_node *c = atomic_load(&t->slots[i]);
+    if (c != NULL) {
+      node_free(c);
+      free(c);
+    }
+  }
+  struct sub_node *plus = atomic_load(&node->plus);
+  if (plus != NULL) {
+    node_free(plus);
+    free(plus);
+  }
+  struct sub_node *hash = atomic_load(&node->hash);
+  if (hash != NULL) {
+    node_free(hash);
+    free(hash);
+  }
+  struct sub_set *set = atomic_load(&node->set);
+  if (set != NULL)
+    set_free(&set->retired);
+  free(t);
+  free(node->level);
+}
+
+/*
+ * No reader may be left on the index. What it retired earlier is freed
+ * before returning, so none of its filter references outlive it.
+ */
+void subs_destroy(struct sub_index *idx) {
+  node_free(&idx->root);
+  free(atomic_load(&idx->prefilter.bloom));
+  pthread_mutex_destroy(&idx->lock);
+  memset(idx, 0, sizeof(*idx));
+  epoch_synchronize();
+}
+
+static struct sub_node *child_find(const struct sub_node *node,
+                                   const char *level, size_t len,
+                                   uint32_t hash) {
+  const struct sub_children *t =
+      atomic_load_explicit(&node->children, memory_order_acquire);
+  if (t == NULL)
+    return NULL;
+  // Never full, so an empty slot ends every probe
+  for (size_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+    struct sub_node *c =
+        atomic_load_explicit(&t->slots[i], memory_order_acquire);
+    if (c == NULL)
+      return NULL;
+    if (c->level_hash == hash && c->level_len == len &&
+        memcmp(c->level, level, len) == 0)
+      return c;
+  }
+}
+
+static struct sub_node *node_new(const char *level, size_t len,
+                                 uint32_t hash) {
+  struct sub_node *node = calloc(1, sizeof(*node));
+  if (node == NULL)
+    return NULL;
+  node->level = malloc(len + 1);
+  if (node->level == NULL) {
+    free(node);
+    return NULL;
+  }
+  memcpy(node->level, level, len);
+  node->level[len] = '\0';
+  node->level_len = len;
+  node->level_hash = hash;
+  return node;
+}
+
+static void children_put(struct sub_children *t, struct sub_node *c) {
+  size_t i = c->level_hash & t->mask;
+  while (atomic_load_explicit(&t->slots[i], memory_order_relaxed) != NULL)
+    i = (i + 1) & t->mask;
+  atomic_store_explicit(&t->slots[i], c, memory_order_release);
+  t->count++;
+}
+
+// Replace the children table of node with one twice the size
+static struct sub_children *children_grow(struct sub_node *node) {
+  struct sub_children *old =
+      atomic_load_explicit(&node->children, memory_order_relaxed);
+  size_t size = old != NULL ? (old->mask + 1) * 2 : 4;
+  struct sub_children *t =
+      calloc(1, sizeof(*t) + sizeof(t->slots[0]) * size);
+  if (t == NULL)
+    return NULL;
+  t->mask = size - 1;
+  for (size_t i = 0; old != NULL && i <= old->mask; i++) {
+    struct sub_node *c =
+        atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+    if (c != NULL)
+      children_put(t, c);
+  }
+  atomic_store_explicit(&node->children, t, memory_order_release);
+  if (old != NULL)
+    epoch_retire(&old->retired, entry_free);
+  return t;
+}
+
+static struct sub_node *child_get_or_add(struct sub_node *node,
+                                         const char *level, size_t len) {
+  _Atomic(struct sub_node *) *slot = NULL;
+  if (len == 1 && level[0] == '+')
+    slot = &node->plus;
+  else if (len == 1 && level[0] == '#')
+    slot = &node->hash;
+  if (slot != NULL) {
+    struct sub_node *c = atomic_load_explicit(slot, memory_order_relaxed);
+    if (c == NULL && (c = node_new(level, len, 0)) != NULL)
+      atomic_store_explicit(slot, c, memory_order_release);
+    return c;
+  }
+
+  uint32_t hash = topic_hash(level, len);
+  struct sub_node *c = child_find(node, level, len, hash);
+  if (c != NULL)
+    return c;
+
+  // Kept at most three quarters full
+  struct sub_children *t =
+      atomic_load_explicit(&node->children, memory_order_relaxed);
+  if ((t == NULL || (t->count + 1) * 4 > (t->mask + 1) * 3) &&
+      (t = children_grow(node)) == NULL)
+    return NULL;
+  if ((c = node_new(level, len, hash)) == NULL)
+    return NULL;
+  children_put(t, c);
+  return c;
+}
+
+// FNV-1a carried on over more bytes, see topic_hash
+static uint32_t fnv_extend(uint32_t hash, const char *p, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Number of literal levels at the front of filter, capped at
+ * SUB_PREFIX_LEVELS - 1, and the hash of those levels with the separators
+ * between them.
+ */
+static unsigned filter_prefix(const struct topic *filter, uint32_t *hash) {
+  unsigned k = 0;
+  size_t end = 0;
+  while (k < filter->nlevels && k < SUB_PREFIX_LEVELS - 1) {
+    size_t len;
+    const char *level = topic_level(filter, k, &len);
+    if (len == 1 && (level[0] == '+' || level[0] == '#'))
+      break;
+    end = level + len - filter->name;
+    k++;
+  }
+  *hash = topic_hash(filter->name, end);
+  return k;
+}
+
+// Counter i of the prefix of k levels hashing to hash, by double hashing
+static size_t probe(uint32_t hash, unsigned k, unsigned i, size_t mask) {
+  uint32_t h1 = hash ^ (k * 0x9e3779b9u);
+  uint32_t h2 = ((h1 >> 16 | h1 << 16) * 0x85ebca6bu) | 1;
+  return (h1 + i * h2) & mask;
+}
+
+// Only the writer changes counters, readers see either value
+static void prefilter_insert(struct sub_bloom *bloom, unsigned k,
+                             uint32_t hash) {
+  for (unsigned i = 0; i < PREFILTER_HASHES; i++) {
+    _Atomic uint8_t *c = &bloom->counters[probe(hash, k, i, bloom->mask)];
+    uint8_t v = atomic_load_explicit(c, memory_order_relaxed);
+    if (v < PREFILTER_SATURATED)
+      atomic_store_explicit(c, v + 1, memory_order_relaxed);
+  }
+}
+
+static void prefilter_delete(struct sub_bloom *bloom, unsigned k,
+                             uint32_t hash) {
+  for (unsigned i = 0; i < PREFILTER_HASHES; i++) {
+    _Atomic uint8_t *c = &bloom->counters[probe(hash, k, i, bloom->mask)];
+    uint8_t v = atomic_load_explicit(c, memory_order_relaxed);
+    if (v > 0 && v < PREFILTER_SATURATED)
+      atomic_store_explicit(c, v - 1, memory_order_relaxed);
+  }
+}
+
+static void prefilter_fill(struct sub_bloom *bloom,
+                           const struct sub_node *node) {
+  const struct sub_set *set = atomic_load(&node->set);
+  if (set != NULL) {
+    uint32_t hash;
+    unsigned k = filter_prefix(set->filter, &hash);
+    if (k > 0)
+      prefilter_insert(bloom, k, hash);
+  }
+  const struct sub_children *t = atomic_load(&node->children);
+  for (size_t i = 0; t != NULL && i <= t->mask; i++) {
+    const struct sub_node *c = atomic_load(&t->slots[i]);
+    if (c != NULL)
+      prefilter_fill(bloom, c);
+  }
+  const struct sub_node *plus = atomic_load(&node->plus);
+  if (plus != NULL)
+    prefilter_fill(bloom, plus);
+  const struct sub_node *hash = atomic_load(&node->hash);
+  if (hash != NULL)
+    prefilter_fill(bloom, hash);
+}
+
+// Whether the counters are too few for nfilters filters
+static int prefilter_full(const struct sub_index *idx, size_t nfilters) {
+  const struct sub_bloom *bloom = atomic_load(&idx->prefilter.bloom);
+  return bloom == NULL || nfilters * SUB_PREFILTER_RATIO > bloom->mask + 1;
+}
+
+/*
+ * Count the filters in the trie into new counters sized for them, which
+ * then replace the old ones. Out of memory, they are counted again on top
+ * of the old ones instead: a filter counted twice only means more false
+ * positives.
+ */
+static void prefilter_rebuild(struct sub_index *idx) {
+  struct sub_bloom *old = atomic_load(&idx->prefilter.bloom);
+  size_t size = PREFILTER_MIN_COUNTERS;
+  while (size < idx->nfilters * SUB_PREFILTER_RATIO * 2)
+    size *= 2;
+  struct sub_bloom *bloom = calloc(1, sizeof(*bloom) + size);
+  if (bloom == NULL) {
+    if (old != NULL)
+      prefilter_fill(old, &idx->root);
+    return;
+  }
+  bloom->mask = size - 1;
+  prefilter_fill(bloom, &idx->root);
+  atomic_store_explicit(&idx->prefilter.bloom, bloom, memory_order_release);
+  if (old != NULL)
+    epoch_retire(&old->retired, entry_free);
+}
+
+/*
+ * Count a filter that got its first subscriber in, or one that lost its
+ * last out. The counters are left alone when a rebuild follows.
+ */
+static void prefilter_count(struct sub_prefilter *pf,
+                            const struct topic *filter, int add,
+                            int counters) {
+  uint32_t hash;
+  unsigned k = filter_prefix(filter, &hash);
+  if (add)
+    pf->lengths[k]++;
+  else
+    pf->lengths[k]--;
+  struct sub_bloom *bloom = atomic_load(&pf->bloom);
+  if (!counters || bloom == NULL || k == 0)
+    return;
+  if (add)
+    prefilter_insert(bloom, k, hash);
+  else
+    prefilter_delete(bloom, k, hash);
+}
+
+// Node of filter, created along with its parents if missing
+static struct sub_node *node_get_or_add(struct sub_index *idx,
+                                        const struct topic *filter) {
+  struct sub_node *node = &idx->root;
+  for (unsigned i = 0; i < filter->nlevels && node != NULL; i++) {
+    size_t len;
+    const char *level = topic_level(filter, i, &len);
+    node = child_get_or_add(node, level, len);
+  }
+  return node;
+}
+
+static struct sub_node *node_find(struct sub_index *idx,
+                                  const struct topic *filter) {
+  struct sub_node *node = &idx->root;
+  for (unsigned i = 0; i < filter->nlevels && node != NULL; i++) {
+    size_t len;
+    const char *level = topic_level(filter, i, &len);
+    if (len == 1 && level[0] == '+')
+      node = atomic_load(&node->plus);
+    else if (len == 1 && level[0] == '#')
+      node = atomic_load(&node->hash);
+    else
+      node = child_find(node, level, len, topic_hash(level, len));
+  }
+  return node;
+}
+
+/*
+ * Open addressing map from client to its index in subs, plus one so that
+ * 0 is an empty slot. Built for sets with many subscribers so a batch
+ * touching them costs one probe per op instead of a scan.
+ */
+struct client_map {
+  size_t *slots;
+  size_t mask;
+  const struct subscriber *subs;
+};
+
+static size_t client_home(const struct client_map *m, const void *client) {
+  uint64_t h = (uintptr_t)client * 0x9e3779b97f4a7c15ull;
+  return (h ^ h >> 32) & m->mask;
+}
+
+// Slot holding client, or the empty slot where it would go
+static size_t client_slot(const struct client_map *m, const void *client) {
+  size_t i = client_home(m, client);
+  while (m->slots[i] != 0 && m->subs[m->slots[i] - 1].client != client)
+    i = (i + 1) & m->mask;
+  return i;
+}
+
+// Empty slot i, shifting back the entries probed past it
+static void client_unmap(struct client_map *m, size_t i) {
+  for (size_t j = (i + 1) & m->mask; m->slots[j] != 0;
+       j = (j + 1) & m->mask) {
+    size_t home = client_home(m, m->subs[m->slots[j] - 1].client);
+    if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+      m->slots[i] = m->slots[j];
+      i = j;
+    }
+  }
+  m->slots[i] = 0;
+}
+
+static int client_map_build(struct sub_batch *b, struct client_map *m,
+                            const struct sub_set *set, size_t entries) {
+  size_t size = 16;
+  while (size < entries * 2)
+    size *= 2;
+  if (size > b->map_cap) {
+    size_t *grown = realloc(b->map, sizeof(size_t) * size);
+    if (grown == NULL)
+      return -1;
+    b->map = grown;
+    b->map_cap = size;
+  }
+  memset(b->map, 0, sizeof(size_t) * size);
+  m->slots = b->map;
+  m->mask = size - 1;
+  m->subs = set->subs;
+  for (size_t i = 0; i < set->nsubs; i++)
+    m->slots[client_slot(m, set->subs[i].client)] = i + 1;
+  return 0;
+}
+
+// Index of client in set, set->nsubs if absent
+static size_t set_index(const struct sub_set *set, const struct client_map *m,
+                        const void *client) {
+  if (m == NULL) {
+    size_t i = 0;
+    while (i < set->nsubs && set->subs[i].client != client)
+      i++;
+    return i;
+  }
+  size_t slot = m->slots[client_slot(m, client)];
+  return slot != 0 ? slot - 1 : set->nsubs;
+}
+
+/*
+ * Apply the ops on one filter: copy its subscriber set with room for the
+ * additions, apply them all to the copy and publish it with one store.
+ * Called with the index locked, b is only used for scratch space. Returns
+ * the number of ops that failed for lack of memory.
+ */
+static size_t apply_filter(struct sub_index *idx, struct sub_batch *b,
+                           struct sub_op *ops, size_t n, int counters) {
+  size_t adds = 0;
+  for (size_t i = 0; i < n; i++)
+    adds += !ops[i].remove;
+  struct sub_node *node = adds > 0 ? node_get_or_add(idx, ops[0].filter)
+                                   : node_find(idx, ops[0].filter);
+  // Removals of subscriptions that never were
+  if (node == NULL && adds == 0)
+    return 0;
+
+  struct sub_set *old =
+      node != NULL ? atomic_load_explicit(&node->set, memory_order_relaxed)
+                   : NULL;
+  size_t had = old != NULL ? old->nsubs : 0;
+  struct sub_set *set =
+      node != NULL
+          ? malloc(sizeof(*set) + sizeof(struct subscriber) * (had + adds))
+          : NULL;
+  if (set == NULL) {
+    for (size_t i = 0; i < n; i++)
+      if (ops[i].rc != NULL)
+        *ops[i].rc = SUB_FAILURE;
+    return n;
+  }
+  if (had > 0)
+    memcpy(set->subs, old->subs, sizeof(struct subscriber) * had);
+  set->nsubs = had;
+
+  struct client_map map, *m = NULL;
+  if (b != NULL && n > 1 && had + adds > BATCH_SCAN_MAX &&
+      client_map_build(b, &map, set, had + adds) == 0)
+    m = &map;
+
+  int changed = 0;
+  for (size_t i = 0; i < n; i++) {
+    struct sub_op *op = &ops[i];
+    size_t at = set_index(set, m, op->client);
+    if (op->remove) {
+      if (at == set->nsubs)
+        continue;
+      size_t last = --set->nsubs;
+      if (m != NULL) {
+        client_unmap(m, client_slot(m, op->client));
+        if (at != last)
+          m->slots[client_slot(m, set->subs[last].client)] = at + 1;
+      }
+      set->subs[at] = set->subs[last];
+      changed = 1;
+      continue;
+    }
+    if (at == set->nsubs) {
+      set->nsubs++;
+      if (m != NULL)
+        m->slots[client_slot(m, op->client)] = at + 1;
+    }
+    set->subs[at] = (struct subscriber){op->client, op->qos, op->flags};
+    if (op->rc != NULL)
+      *op->rc = op->qos;
+    changed = 1;
+  }
+  if (!changed) {
+    free(set);
+    return 0;
+  }
+
+  idx->nsubs += set->nsubs;
+  idx->nsubs -= had;
+  if (set->nsubs == 0) {
+    free(set);
+    set = NULL;
+  } else {
+    set->filter = topic_ref(ops[0].filter);
+  }
+  atomic_store_explicit(&node->set, set, memory_order_release);
+  if (old == NULL && set != NULL) {
+    idx->nfilters++;
+    prefilter_count(&idx->prefilter, set->filter, 1, counters);
+  } else if (old != NULL && set == NULL) {
+    idx->nfilters--;
+    prefilter_count(&idx->prefilter, old->filter, 0, counters);
+  }
+  if (old != NULL)
+    epoch_retire(&old->retired, set_free);
+  return 0;
+}
+
+// One op outside of a batch, growing the prefilter when it is due
+static size_t apply_one(struct sub_index *idx, struct sub_op *op) {
+  int grow = !op->remove && prefilter_full(idx, idx->nfilters + 1);
+  size_t failed = apply_filter(idx, NULL, op, 1, !grow);
+  if (grow)
+    prefilter_rebuild(idx); // counts the new filter too
+  return failed;
+}
+
+/*
+ * Subscribe client to filter. A client subscribing again to the same filter
+ * replaces its previous QoS and flags, as required by 3.8.4.
+ *
+ * Returns 1 if the subscription replaced an existing one, 0 if it is new and
+ * -1 if out of memory.
+ */
+int subs_add(struct sub_index *idx, struct topic *filter, void *client,
+             uint8_t qos, uint8_t flags) {
+  struct sub_op op = {.filter = filter, .client = client, .qos = qos,
+                      .flags = flags};
+  pthread_mutex_lock(&idx->lock);
+  size_t before = idx->nsubs;
+  int status = apply_one(idx, &op) > 0 ? -1 : idx->nsubs == before;
+  pthread_mutex_unlock(&idx->lock);
+  return status;
+}
+
+/*
+ * Returns 0 if the subscription existed and was removed, -1 if it did not
+ * or, with the subscription left in place, if out of memory. Emptied nodes
+ * are kept; they are cheap and likely to be reused on resubscribe.
+ */
+int subs_remove(struct sub_index *idx, const struct topic *filter,
+                void *client) {
+  struct sub_op op = {.filter = (struct topic *)filter, .client = client,
+                      .remove = 1};
+  pthread_mutex_lock(&idx->lock);
+  size_t before = idx->nsubs;
+  apply_one(idx, &op);
+  int status = idx->nsubs < before ? 0 : -1;
+  pthread_mutex_unlock(&idx->lock);
+  return status;
+}
+
+static size_t emit(const struct sub_node *node, sub_match_fn fn, void *arg) {
+  const struct sub_set *set =
+      atomic_load_explicit(&node->set, memory_order_acquire);
+  if (set == NULL)
+    return 0;
+  for (size_t i = 0; i < set->nsubs; i++)
+    fn(&set->subs[i], set->filter, arg);
+  return set->nsubs;
+}
+
+static size_t match_level(const struct sub_node *node,
+                          const struct topic *topic, unsigned depth,
+                          sub_match_fn fn, void *arg) {
+  size_t matched = 0;
+
+  // '#' matches this level and everything below, including nothing
+  const struct sub_node *hash =
+      atomic_load_explicit(&node->hash, memory_order_acquire);
+  if (hash != NULL)
+    matched += emit(hash, fn, arg);
+
+  if (depth == topic->nlevels)
+    return matched + emit(node, fn, arg);
+
+  size_t len;
+  const char *level = topic_level(topic, depth, &len);
+  const struct sub_node *c = child_find(node, level, len, topic_hash(level, len));
+  if (c != NULL)
+    matched += match_level(c, topic, depth + 1, fn, arg);
+  const struct sub_node *plus =
+      atomic_load_explicit(&node->plus, memory_order_acquire);
+  if (plus != NULL)
+    matched += match_level(plus, topic, depth + 1, fn, arg);
+  return matched;
+}
+
+/*
+ * Call fn for every subscription matching topic, once per matching filter.
+ * Topics beginning with '$' are not matched by wildcards at the first
+ * level (4.7.2). Returns the number of calls made.
+ *
+ * Never waits for a writer: each filter's subscribers are seen as they were
+ * when the walk reached it. fn must not keep sub or filter past the call.
+ */
+size_t subs_match(const struct sub_index *idx, const struct topic *topic,
+                  sub_match_fn fn, void *arg) {
+  const struct sub_node *root = &idx->root;
+  size_t matched = 0;
+  epoch_enter();
+  if (topic->len > 0 && topic->name[0] == '$') {
+    size_t len;
+    const char *level = topic_level(topic, 0, &len);
+    const struct sub_node *c =
+        child_find(root, level, len, topic_hash(level, len));
+    if (c != NULL)
+      matched = match_level(c, topic, 1, fn, arg);
+  } else {
+    matched = match_level(root, topic, 0, fn, arg);
+  }
+  epoch_exit();
+  return matched;
+}
+
+/*
+ * Whether any filter could match topic, from the prefilter alone. A zero
+ * is certain, so routing paths check this before walking the trie or
+ * setting up a fan-out for a topic nobody subscribes to.
+ */
+int subs_may_match(const struct sub_index *idx, const struct topic *topic) {
+  const struct sub_prefilter *pf = &idx->prefilter;
+  if (idx->nfilters == 0)
+    return 0;
+  // A wildcard first level matches anything but '$' topics (4.7.2)
+  if (atomic_load_explicit(&pf->lengths[0], memory_order_relaxed) > 0 &&
+      !(topic->len > 0 && topic->name[0] == '$'))
+    return 1;
+
+  epoch_enter();
+  const struct sub_bloom *bloom =
+      atomic_load_explicit(&pf->bloom, memory_order_acquire);
+  int possible = bloom == NULL;
+  unsigned max = topic->nlevels < SUB_PREFIX_LEVELS - 1
+                     ? topic->nlevels
+                     : SUB_PREFIX_LEVELS - 1;
+  uint32_t hash = topic_hash(topic->name, 0);
+  size_t hashed = 0;
+  for (unsigned k = 1; k <= max && !possible; k++) {
+    if (atomic_load_explicit(&pf->lengths[k], memory_order_relaxed) == 0)
+      continue;
+    size_t len;
+    const char *level = topic_level(topic, k - 1, &len);
+    size_t end = level + len - topic->name;
+    hash = fnv_extend(hash, topic->name + hashed, end - hashed);
+    hashed = end;
+    unsigned i = 0;
+    while (i < PREFILTER_HASHES &&
+           atomic_load_explicit(
+               &bloom->counters[probe(hash, k, i, bloom->mask)],
+               memory_order_relaxed))
+      i++;
+    possible = i == PREFILTER_HASHES;
+  }
+  epoch_exit();
+  return possible;
+}
+
+void subs_batch_init(struct sub_batch *b) { memset(b, 0, sizeof(*b)); }
+
+void subs_batch_destroy(struct sub_batch *b) {
+  for (size_t i = 0; i < b->nops; i++)
+    topic_release(b->ops[i].filter);
+  free(b->ops);
+  free(b->map);
+  memset(b, 0, sizeof(*b));
+}
+
+static struct sub_op *batch_push(struct sub_batch *b) {
+  if (b->nops == b->cap) {
+    size_t cap = b->cap ? b->cap * 2 : 64;
+    struct sub_op *grown = realloc(b->ops, sizeof(struct sub_op) * cap);
+    if (grown == NULL)
+      return NULL;
+    b->ops = grown;
+    b->cap = cap;
+  }
+  struct sub_op *op = &b->ops[b->nops];
+  op->seq = b->nops++;
+  return op;
+}
+
+/*
+ * Queue a subscription for subs_apply, which sets *rc unless rc is NULL.
+ * Returns -1 if out of memory, with nothing queued.
+ */
+int subs_batch_add(struct sub_batch *b, struct topic *filter, void *client,
+                   uint8_t qos, uint8_t flags, unsigned char *rc) {
+  struct sub_op *op = batch_push(b);
+  if (op == NULL)
+    return -1;
+  op->filter = topic_ref(filter);
+  op->client = client;
+  op->qos = qos;
+  op->flags = flags;
+  op->remove = 0;
+  op->rc = rc;
+  return 0;
+}
+
+int subs_batch_remove(struct sub_batch *b, struct topic *filter,
+                      void *client) {
+  struct sub_op *op = batch_push(b);
+  if (op == NULL)
+    return -1;
+  op->filter = topic_ref(filter);
+  op->client = client;
+  op->remove = 1;
+  op->rc = NULL;
+  return 0;
+}
+
+// Group the ops by filter, in the order they were queued
+static int op_cmp(const void *a, const void *b) {
+  const struct sub_op *x = a, *y = b;
+  if (x->filter != y->filter)
+    return (uintptr_t)x->filter < (uintptr_t)y->filter ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ * Apply and empty the batch, holding the index lock once for all of it.
+ * Every op on a filter is applied in the order queued, with the same
+ * results as subs_add and subs_remove one at a time.
+ *
+ * Returns 0, or -1 if some ops failed for lack of memory; a failed
+ * subscription's rc says SUB_FAILURE and the rest of the batch is applied.
+ */
+int subs_apply(struct sub_index *idx, struct sub_batch *b) {
+  size_t adds = 0, failed = 0;
+  for (size_t i = 0; i < b->nops; i++)
+    adds += !b->ops[i].remove;
+  qsort(b->ops, b->nops, sizeof(struct sub_op), op_cmp);
+
+  pthread_mutex_lock(&idx->lock);
+  // Rebuilt once at the end if the batch could outgrow the counters
+  int rebuild = adds > 0 && prefilter_full(idx, idx->nfilters + adds);
+  for (size_t i = 0, end; i < b->nops; i = end) {
+    end = i + 1;
+    while (end < b->nops && b->ops[end].filter == b->ops[i].filter)
+      end++;
+    failed += apply_filter(idx, b, &b->ops[i], end - i, !rebuild);
+  }
+  if (rebuild)
+    prefilter_rebuild(idx);
+  pthread_mutex_unlock(&idx->lock);
+
+  for (size_t i = 0; i < b->nops; i++)
+    topic_release(b->ops[i].filter);
+  b->nops = 0;
+  return failed > 0 ? -1 : 0;
+}
+
+/*
+ * Split the options a SUBSCRIBE gives in front of a filter from the filter
+ * itself, the way MQTT 5 shared subscriptions use "$share/". A filter
+ * starting with "$conflate/" gets SUB_CONFLATE. Returns the filter proper
+ * and updates len; flags gets the options, 0 for a plain filter. An
+ * UNSUBSCRIBE names the filter the same way.
+ */
+const char *subs_filter_options(const char *name, size_t *len,
+                                uint8_t *flags) {
+  size_t prefix = sizeof(SUB_CONFLATE_PREFIX) - 1;
+  *flags = 0;
+  if (*len > prefix && memcmp(name, SUB_CONFLATE_PREFIX, prefix) == 0) {
+    *flags |= SUB_CONFLATE;
+    name += prefix;
+    *len -= prefix;
+  }
+  return name;
+}
@@ -0,0 +1,175 @@
+#ifndef SUBS_H
+#define SUBS_H
+
+#include "epoch.h"
+#include "topic.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Literal prefix lengths told apart by the prefilter, longer ones share the
+// last slot
+#define SUB_PREFIX_LEVELS 64
+// Counters per filter the prefilter keeps at least, about 3% false positives
+#define SUB_PREFILTER_RATIO 8
+
+// Subscription option flags
+#define SUB_CONFLATE 0x01 // last value only, queue with outq_push_conflated
+
+// Filter prefix a client subscribes with to ask for SUB_CONFLATE
+#define SUB_CONFLATE_PREFIX "$conflate/"
+
+// SUBACK return code of a filter subs_apply could not add
+#define SUB_FAILURE 0x80
+
+struct subscriber {
+  void *client; // session handle owned by the broker
+  uint8_t qos;  // granted QoS
+  uint8_t flags; // SUB_* options
+};
+
+/*
+ * Subscribers of one filter. A published set is never changed: SUBSCRIBE
+ * and UNSUBSCRIBE build a new one and retire the old.
+ */
+struct sub_set {
+  struct epoch_entry retired;
+  struct topic *filter; // reference owned by the set
+  size_t nsubs;
+  struct subscriber subs[];
+};
+
+struct sub_node;
+
+/*
+ * Literal children of a node, open addressed by the hash of their level.
+ * Slots are only ever filled, so a reader probing a table sees each child
+ * either complete or not at all; a full table is replaced by a bigger copy.
+ */
+struct sub_children {
+  struct epoch_entry retired;
+  size_t mask;
+  size_t count;
+  _Atomic(struct sub_node *) slots[];
+};
+
+/*
+ * One level of the subscription trie.
+ *
+ * Literal children are found by hashing their level; '+' and '#' get
+ * dedicated slots. Nodes are kept once created, and what changes under
+ * them (the children table, the subscriber set) is replaced whole, so
+ * matching takes no lock and never waits for a writer. A node where a
+ * filter ends holds its subscribers in a set that keeps a reference to the
+ * interned filter, the same handle as every other stage naming that
+ * filter.
+ */
+struct sub_node {
+  char *level;
+  size_t level_len;
+  uint32_t level_hash;
+
+  _Atomic(struct sub_children *) children; // NULL until the first one
+  _Atomic(struct sub_node *) plus;
+  _Atomic(struct sub_node *) hash;
+  _Atomic(struct sub_set *) set; // NULL without subscribers
+};
+
+struct sub_bloom {
+  struct epoch_entry retired;
+  size_t mask;
+  _Atomic uint8_t counters[];
+};
+
+/*
+ * Counting Bloom filter over the literal prefix of every filter: the levels
+ * before its first wildcard, e.g. "fleet/7" for "fleet/7/+/temp". A topic
+ * can only match a filter whose prefix equals the topic's first levels, so
+ * a topic none of whose prefixes is in the filter is known to have no
+ * subscriber without walking the trie. Only prefix lengths some filter
+ * has are probed, and the FNV-1a hash is carried from one length to the
+ * next.
+ *
+ * Counters saturate at 255 and then stay, so removals never cause a false
+ * negative. The table grows with the number of filters, a grown one
+ * replacing the old like any other part of the index.
+ */
+struct sub_prefilter {
+  _Atomic(struct sub_bloom *) bloom; // NULL until the first filter
+  atomic_uint lengths[SUB_PREFIX_LEVELS]; // filters per prefix length
+};
+
+/*
+ * Subscription index, read lock-free by any number of routing threads.
+ *
+ * Readers run inside an epoch section (see epoch.h), taken by subs_match
+ * and subs_may_match themselves. Writers serialize on lock, once per
+ * subs_add, subs_remove or whole subs_apply batch, and retire what they
+ * replace.
+ */
+struct sub_index {
+  struct sub_node root;
+  atomic_size_t nfilters;
+  atomic_size_t nsubs;
+  struct sub_prefilter prefilter;
+  pthread_mutex_t lock;
+};
+
+// One subscription change queued in a sub_batch
+struct sub_op {
+  struct topic *filter; // reference held by the batch
+  void *client;
+  size_t seq; // order queued, kept per filter
+  uint8_t qos;
+  uint8_t flags;
+  uint8_t remove;
+  unsigned char *rc; // optional, set to the granted QoS or SUB_FAILURE
+};
+
+/*
+ * Subscription changes applied to the index in one pass.
+ *
+ * After a mass reconnect every client resubscribes to many filters at
+ * once. Queuing all the filters of a SUBSCRIBE, or of every SUBSCRIBE read
+ * in one loop iteration, and applying them together sorts them by filter:
+ * each filter's node is then found once, its subscriber set copied once,
+ * and the prefilter counted or rebuilt once for the whole batch, all under
+ * one hold of the index lock. Changes to the same filter keep the order
+ * they were queued in.
+ *
+ * A SUBSCRIBE's return codes are written through rc straight into the
+ * array the SUBACK is built from.
+ */
+struct sub_batch {
+  struct sub_op *ops;
+  size_t nops;
+  size_t cap;
+  size_t *map; // scratch for subs_apply, see client_map
+  size_t map_cap;
+};
+
+typedef void (*sub_match_fn)(const struct subscriber *sub,
+                             const struct topic *filter, void *arg);
+
+// Function prototypes
+void subs_init(struct sub_index *idx);
+void subs_destroy(struct sub_index *idx);
+int subs_add(struct sub_index *idx, struct topic *filter, void *client,
+             uint8_t qos, uint8_t flags);
+int subs_remove(struct sub_index *idx, const struct topic *filter,
+                void *client);
+size_t subs_match(const struct sub_index *idx, const struct topic *topic,
+                  sub_match_fn fn, void *arg);
+int subs_may_match(const struct sub_index *idx, const struct topic *topic);
+void subs_batch_init(struct sub_batch *b);
+void subs_batch_destroy(struct sub_batch *b);
+int subs_batch_add(struct sub_batch *b, struct topic *filter, void *client,
+                   uint8_t qos, uint8_t flags, unsigned char *rc);
+int subs_batch_remove(struct sub_batch *b, struct topic *filter,
+                      void *client);
+int subs_apply(struct sub_index *idx, struct sub_batch *b);
+const char *subs_filter_options(const char *name, size_t *len,
+                                uint8_t *flags);
+
+#endif // SUBS_H
@@ -0,0 +1,205 @@
+#include "tls.h"
+#include "stats.h"
+#include <errno.h>
+#include <openssl/err.h>
+#include <stdlib.h>
+
+// Sessions are only resumed by servers of the same context
+static const unsigned char SESSION_ID_CONTEXT[] = "cz-mqtt";
+
+/*
+ * Load the certificate chain and key and set up resumption. With ktls set
+ * the record layer is offloaded to the kernel where it supports it.
+ * Returns -1 if the files can't be loaded or don't match.
+ */
+int tls_server_init(struct tls_server *srv, const char *cert_file,
+                    const char *key_file, int ktls) {
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    return -1;
+  }
+  if (SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) != 1 ||
+      SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    SSL_CTX_free(ctx);
+    return -1;
+  }
+
+  // Stateless tickets for every version, the cache for TLS 1.2 session ids
+  SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT,
+                                 sizeof(SESSION_ID_CONTEXT) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+  // A peer closing without close_notify is an ordinary disconnect
+  uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF;
+  if (ktls) {
+    options |= SSL_OP_ENABLE_KTLS;
+  }
+  SSL_CTX_set_options(ctx, options);
+  // Idle connections give their record buffers back
+  SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+  srv->ctx = ctx;
+  return 0;
+}
+
+void tls_server_destroy(struct tls_server *srv) {
+  SSL_CTX_free(srv->ctx);
+  srv->ctx = NULL;
+}
+
+// Start the server side of a handshake on an accepted, non-blocking socket
+struct tls_conn *tls_conn_new(struct tls_server *srv, int fd) {
+  struct tls_conn *c = malloc(sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  c->ssl = SSL_new(srv->ctx);
+  if (c->ssl == NULL || SSL_set_fd(c->ssl, fd) != 1) {
+    SSL_free(c->ssl);
+    free(c);
+    return NULL;
+  }
+  SSL_set_accept_state(c->ssl);
+  c->fd = fd;
+  c->state = TLS_HANDSHAKE;
+  c->want_write = 0;
+  c->ktls_send = 0;
+  c->ktls_recv = 0;
+  c->pending = 0;
+  return c;
+}
+
+/*
+ * Free the connection, sending close_notify if it ended cleanly so its
+ * session stays resumable. Doesn't close the socket.
+ */
+void tls_conn_free(struct tls_conn *c) {
+  if (c == NULL) {
+    return;
+  }
+  if (c->state == TLS_OPEN) {
+    ERR_clear_error();
+    SSL_shutdown(c->ssl);
+  }
+  SSL_free(c->ssl);
+  free(c);
+}
+
+/*
+ * Whether the operation that returned ret should be retried once the socket
+ * is ready, noting which way. Anything else is fatal for the connection.
+ */
+static int tls_retry(struct tls_conn *c, int ret) {
+  switch (SSL_get_error(c->ssl, ret)) {
+  case SSL_ERROR_WANT_READ:
+    c->want_write = 0;
+    return 1;
+  case SSL_ERROR_WANT_WRITE:
+    c->want_write = 1;
+    return 1;
+  default:
+    c->state = TLS_CLOSED;
+    return 0;
+  }
+}
+
+/*
+ * Advance the handshake. Returns 0 once it is complete, 1 while it waits
+ * for the socket (POLLOUT if want_write is set) and -1 if it failed.
+ */
+int tls_handshake(struct tls_conn *c) {
+  if (c->state != TLS_HANDSHAKE) {
+    return c->state == TLS_OPEN ? 0 : -1;
+  }
+  ERR_clear_error();
+  int ret = SSL_do_handshake(c->ssl);
+  if (ret != 1) {
+    return tls_retry(c, ret) ? 1 : -1;
+  }
+  c->state = TLS_OPEN;
+  c->want_write = 0;
+  c->ktls_send = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+  c->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(c->ssl));
+  return 0;
+}
+
+// The handshake was abbreviated from a ticket or cached session
+int tls_resumed(const struct tls_conn *c) {
+  return SSL_session_reused(c->ssl);
+}
+
+/*
+ * Read decrypted bytes, like recv: returns the count, 0 once the peer has
+ * closed and -1 with errno set to EAGAIN when nothing is readable yet.
+ */
+ssize_t tls_read(struct tls_conn *c, void *buf, size_t len) {
+  ERR_clear_error();
+  int n = SSL_read(c->ssl, buf, len);
+  if (n > 0) {
+    return n;
+  }
+  if (SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN) {
+    return 0;
+  }
+  if (tls_retry(c, n)) {
+    errno = EAGAIN;
+  } else if (errno == 0 || errno == EAGAIN) {
+    errno = EPROTO;
+  }
+  return -1;
+}
+
+/*
+ * Decrypted bytes are buffered from a record read only in part. The socket
+ * won't poll readable for them, so the caller must read again.
+ */
+int tls_read_pending(const struct tls_conn *c) {
+  return SSL_pending(c->ssl) > 0;
+}
+
+/*
+ * Write as much of the queue as the connection accepts, with outq_flush's
+ * return values. Queued packets are copied into records of up to
+ * TLS_RECORD_SIZE bytes, so a burst of small PUBLISH packets costs one
+ * encryption and one write per record. With kernel TLS the queue is
+ * written to the socket directly.
+ */
+int tls_flush(struct tls_conn *c, struct outq *q) {
+  if (c->state != TLS_OPEN) {
+    // Nothing is written before the handshake, which may wait for POLLOUT
+    return c->state == TLS_CLOSED ? -1 : c->want_write;
+  }
+  size_t budget = OUTQ_BYTE_BUDGET;
+  if (q->expires_ns != 0) {
+    outq_expire(q, stats_now_ns());
+  }
+
+  for (;;) {
+    if (c->pending == 0) {
+      if (c->ktls_send) {
+        return outq_flush(q, c->fd);
+      }
+      if (budget == 0) {
+        return !outq_empty(q);
+      }
+      size_t len = budget < sizeof(c->record) ? budget : sizeof(c->record);
+      c->pending = outq_peek(q, c->record, len);
+      if (c->pending == 0) {
+        return 0;
+      }
+      // Handed to the record layer, a retry must offer the same bytes
+      outq_advance(q, c->pending);
+      budget -= c->pending;
+    }
+
+    ERR_clear_error();
+    int n = SSL_write(c->ssl, c->record, c->pending);
+    if (n <= 0) {
+      return tls_retry(c, n) ? 1 : -1;
+    }
+    c->pending = 0;
+  }
+}
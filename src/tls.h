@@ -0,0 +1,67 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "outq.h"
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Largest TLS record payload, what one SSL_write turns into one record
+#define TLS_RECORD_SIZE 16384
+// Server side sessions kept for resumption by session id
+#define TLS_SESSION_CACHE_SIZE 20480
+
+/*
+ * TLS termination for the listener.
+ *
+ * Reconnect storms are dominated by full handshakes, so the context is set
+ * up for abbreviated ones: TLS 1.3 clients resume with the stateless
+ * session tickets the server issues after each handshake (keys are
+ * generated and rotated by OpenSSL), TLS 1.2 clients with tickets or from
+ * the server side session cache.
+ *
+ * With ktls set, OpenSSL hands the record layer to the kernel after the
+ * handshake when the kernel and cipher allow it. Once a connection's
+ * transmit side is offloaded the socket takes plaintext, and its queue is
+ * written with outq_flush's writev straight from the shared message
+ * buffers as for a plaintext client. Otherwise tls_flush coalesces queued
+ * packets into full records.
+ */
+struct tls_server {
+  SSL_CTX *ctx;
+};
+
+enum tls_state {
+  TLS_HANDSHAKE,
+  TLS_OPEN,
+  TLS_CLOSED,
+};
+
+struct tls_conn {
+  SSL *ssl;
+  int fd;
+  enum tls_state state;
+  int want_write; // blocked until the socket is writable again
+  int ktls_send;  // the kernel encrypts, the fd takes plaintext writes
+  int ktls_recv;
+  /*
+   * A record SSL_write could not finish. Its bytes are already taken off
+   * the queue and must be offered again, unchanged, before anything else.
+   */
+  size_t pending;
+  unsigned char record[TLS_RECORD_SIZE];
+};
+
+// Function prototypes
+int tls_server_init(struct tls_server *srv, const char *cert_file,
+                    const char *key_file, int ktls);
+void tls_server_destroy(struct tls_server *srv);
+struct tls_conn *tls_conn_new(struct tls_server *srv, int fd);
+void tls_conn_free(struct tls_conn *c);
+int tls_handshake(struct tls_conn *c);
+int tls_resumed(const struct tls_conn *c);
+ssize_t tls_read(struct tls_conn *c, void *buf, size_t len);
+int tls_read_pending(const struct tls_conn *c);
+int tls_flush(struct tls_conn *c, struct outq *q);
+
+#endif // TLS_H
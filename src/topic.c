@@ -0,0 +1,220 @@
+#include "topic.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The table is split into independently locked shards so workers interning
+ * different topics rarely contend. A shard lock is only held for the bucket
+ * walk, never while calling out.
+ */
+#define TOPIC_SHARDS 64
+#define TOPIC_INITIAL_BUCKETS 64
+
+struct topic_shard {
+  pthread_mutex_t lock;
+  struct topic **buckets;
+  size_t nbuckets; // power of two
+  size_t count;
+};
+
+static struct topic_shard shards[TOPIC_SHARDS] = {
+    [0 ... TOPIC_SHARDS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+
+static atomic_size_t total_topics;
+
+// FNV-1a, cheap and good enough to spread topic names
+uint32_t topic_hash(const char *name, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static struct topic_shard *shard_of(uint32_t hash) {
+  // Low bits pick the bucket, use the high ones for the shard
+  return &shards[(hash >> 26) % TOPIC_SHARDS];
+}
+
+static struct topic *topic_new(const char *name, size_t len, uint32_t hash) {
+  size_t nlevels = 1;
+  for (size_t i = 0; i < len; i++) {
+    if (name[i] == '/')
+      nlevels++;
+  }
+  if (nlevels > UINT16_MAX) {
+    return NULL;
+  }
+
+  struct topic *t =
+      malloc(sizeof(*t) + sizeof(uint16_t) * nlevels + len + 1);
+  if (t == NULL) {
+    return NULL;
+  }
+
+  atomic_init(&t->refcount, 1);
+  t->hash = hash;
+  t->next = NULL;
+  t->len = len;
+  t->nlevels = nlevels;
+
+  char *copy = (char *)&t->levels[nlevels];
+  memcpy(copy, name, len);
+  copy[len] = '\0';
+  t->name = copy;
+
+  uint16_t level = 0;
+  t->levels[level++] = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (name[i] == '/')
+      t->levels[level++] = i + 1;
+  }
+  return t;
+}
+
+static int shard_grow(struct topic_shard *s) {
+  size_t nbuckets = s->nbuckets ? s->nbuckets * 2 : TOPIC_INITIAL_BUCKETS;
+  struct topic **buckets = calloc(nbuckets, sizeof(struct topic *));
+  if (buckets == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < s->nbuckets; i++) {
+    struct topic *t = s->buckets[i];
+    while (t != NULL) {
+      struct topic *next = t->next;
+      t->next = buckets[t->hash & (nbuckets - 1)];
+      buckets[t->hash & (nbuckets - 1)] = t;
+      t = next;
+    }
+  }
+  free(s->buckets);
+  s->buckets = buckets;
+  s->nbuckets = nbuckets;
+  return 0;
+}
+
+/*
+ * Return the canonical handle for name, creating it on first use. The caller
+ * owns one reference. Topics are limited to 65535 bytes by the protocol.
+ */
+struct topic *topic_intern(const char *name, size_t len) {
+  if (len > UINT16_MAX) {
+    return NULL;
+  }
+  uint32_t hash = topic_hash(name, len);
+  struct topic_shard *s = shard_of(hash);
+  struct topic *t = NULL;
+
+  pthread_mutex_lock(&s->lock);
+  if (s->nbuckets > 0) {
+    for (t = s->buckets[hash & (s->nbuckets - 1)]; t != NULL; t = t->next) {
+      if (t->hash == hash && t->len == len && memcmp(t->name, name, len) == 0) {
+        atomic_fetch_add_explicit(&t->refcount, 1, memory_order_relaxed);
+        break;
+      }
+    }
+  }
+
+  if (t == NULL && (s->count < s->nbuckets || shard_grow(s) == 0) &&
+      (t = topic_new(name, len, hash)) != NULL) {
+    struct topic **bucket = &s->buckets[hash & (s->nbuckets - 1)];
+    t->next = *bucket;
+    *bucket = t;
+    s->count++;
+    atomic_fetch_add_explicit(&total_topics, 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return t;
+}
+
+struct topic *topic_ref(struct topic *t) {
+  atomic_fetch_add_explicit(&t->refcount, 1, memory_order_relaxed);
+  return t;
+}
+
+/*
+ * Drop a reference. References above one are dropped without the lock; the
+ * last one is only dropped under the shard lock, since topic_intern may be
+ * handing out a new reference to the same entry at that moment.
+ */
+void topic_release(struct topic *t) {
+  if (t == NULL) {
+    return;
+  }
+
+  unsigned refs = atomic_load_explicit(&t->refcount, memory_order_relaxed);
+  while (refs > 1) {
+    if (atomic_compare_exchange_weak_explicit(&t->refcount, &refs, refs - 1,
+                                              memory_order_release,
+                                              memory_order_relaxed)) {
+      return;
+    }
+  }
+
+  struct topic_shard *s = shard_of(t->hash);
+  pthread_mutex_lock(&s->lock);
+  if (atomic_fetch_sub_explicit(&t->refcount, 1, memory_order_acq_rel) != 1) {
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+  struct topic **link = &s->buckets[t->hash & (s->nbuckets - 1)];
+  while (*link != t) {
+    link = &(*link)->next;
+  }
+  *link = t->next;
+  s->count--;
+  pthread_mutex_unlock(&s->lock);
+
+  atomic_fetch_sub_explicit(&total_topics, 1, memory_order_relaxed);
+  free(t);
+}
+
+/*
+ * Level i of the topic (0 based), not NUL terminated.
+ */
+const char *topic_level(const struct topic *t, unsigned i, size_t *len) {
+  size_t start = t->levels[i];
+  size_t end = i + 1 < t->nlevels ? t->levels[i + 1] - 1 : t->len;
+  *len = end - start;
+  return t->name + start;
+}
+
+/*
+ * Whether a topic name matches a subscription filter, level by level.
+ * Wildcards at the first level never match topics starting with '$'.
+ */
+int topic_matches(const struct topic *filter, const struct topic *topic) {
+  if (filter == topic) {
+    return 1;
+  }
+  if (topic->len > 0 && topic->name[0] == '$' &&
+      (filter->name[0] == '+' || filter->name[0] == '#')) {
+    return 0;
+  }
+
+  for (unsigned i = 0; i < filter->nlevels; i++) {
+    size_t flen, tlen;
+    const char *f = topic_level(filter, i, &flen);
+    if (flen == 1 && f[0] == '#') {
+      return 1; // also matches the parent level itself
+    }
+    if (i >= topic->nlevels) {
+      return 0;
+    }
+    const char *t = topic_level(topic, i, &tlen);
+    if (flen == 1 && f[0] == '+') {
+      continue;
+    }
+    if (flen != tlen || memcmp(f, t, flen) != 0) {
+      return 0;
+    }
+  }
+  return filter->nlevels == topic->nlevels;
+}
+
+// Distinct topics currently interned
+size_t topic_count(void) {
+  return atomic_load_explicit(&total_topics, memory_order_relaxed);
+}
@@ -0,0 +1,42 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Canonical, refcounted copy of a topic name or filter.
+ *
+ * Every stage of the broker that keeps a topic (decoded PUBLISH, queued
+ * messages, subscriptions, retained messages) holds a reference to the one
+ * interned copy instead of its own string, so two handles name the same
+ * topic exactly when the pointers are equal.
+ *
+ * The hash and the start of every '/' separated level are computed once at
+ * intern time; matching walks levels by offset without re-tokenizing.
+ *
+ * +----------+------+-----+---------+-----------------+-------------+
+ * | refcount | hash | len | nlevels | levels[nlevels] | name + '\0' |
+ * +----------+------+-----+---------+-----------------+-------------+
+ */
+struct topic {
+  atomic_uint refcount;
+  uint32_t hash;
+  struct topic *next; // hash chain, guarded by the shard lock
+  const char *name;   // NUL terminated, points past levels
+  uint16_t len;
+  uint16_t nlevels;
+  uint16_t levels[]; // offset of each level in name
+};
+
+// Function prototypes
+struct topic *topic_intern(const char *name, size_t len);
+struct topic *topic_ref(struct topic *t);
+void topic_release(struct topic *t);
+const char *topic_level(const struct topic *t, unsigned i, size_t *len);
+uint32_t topic_hash(const char *name, size_t len);
+int topic_matches(const struct topic *filter, const struct topic *topic);
+size_t topic_count(void);
+
+#endif // TOPIC_H
@@ -0,0 +1,71 @@
+#include "worker.h"
+#include <stdio.h>
+
+int worker_init(struct worker *w, int id) {
+  w->id = id;
+  if (mpsc_queue_init(&w->inbox, WORKER_INBOX_SIZE) == -1) {
+    perror("worker inbox: ");
+    return -1;
+  }
+  return 0;
+}
+
+void worker_destroy(struct worker *w) { mpsc_queue_destroy(&w->inbox); }
+
+int worker_wake_fd(const struct worker *w) { return w->inbox.wake_fd; }
+
+/*
+ * Hand a message to the worker owning fd. The target gets its own reference,
+ * the caller's reference is untouched either way.
+ *
+ * Returns -1 when the target inbox is full.
+ */
+int worker_route(struct worker *target, struct mqtt_message *msg, int fd) {
+  mqtt_message_ref(msg);
+  if (mpsc_queue_push(&target->inbox, msg, fd) == -1) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Hand a fan-out job to the worker owning every subscriber in it. On success
+ * the target owns the job and a reference to msg; on -1 (inbox full) both
+ * stay with the caller.
+ */
+int worker_route_job(struct worker *target, struct mqtt_message *msg,
+                     struct fanout_job *job) {
+  mqtt_message_ref(msg);
+  if (mpsc_queue_push_job(&target->inbox, msg, job) == -1) {
+    mqtt_message_release(msg);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Called when the inbox wake fd polls readable. Deliveries are popped in
+ * batches of WORKER_DRAIN_BATCH; deliver() takes over each message
+ * reference, and the job of a fan-out delivery (see fanout_run).
+ *
+ * Returns 1 if the inbox still holds work after WORKER_DRAIN_ROUNDS
+ * batches, in which case the caller must poll with a zero timeout since
+ * producers will not signal again until the queue has been emptied.
+ */
+int worker_drain(struct worker *w, worker_deliver_fn deliver, void *arg) {
+  struct delivery batch[WORKER_DRAIN_BATCH];
+
+  mpsc_queue_clear_wakeup(&w->inbox);
+  for (int round = 0; round < WORKER_DRAIN_ROUNDS; round++) {
+    size_t n = mpsc_queue_pop_batch(&w->inbox, batch, WORKER_DRAIN_BATCH);
+    if (n == 0) {
+      break;
+    }
+    for (size_t i = 0; i < n; i++) {
+      deliver(w, &batch[i], arg);
+    }
+  }
+
+  return mpsc_queue_pending(&w->inbox);
+}
@@ -0,0 +1,40 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "message.h"
+#include "mpsc_queue.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#define WORKER_INBOX_SIZE 4096
+#define WORKER_DRAIN_BATCH 64
+// Batches drained per wakeup before the worker goes back to its own sockets
+#define WORKER_DRAIN_ROUNDS 16
+
+/*
+ * An I/O thread that owns a set of connections.
+ *
+ * A PUBLISH decoded on one worker reaches subscribers owned by another
+ * through that worker's inbox. The inbox wake fd goes into the owner's poll
+ * set next to its sockets; on wakeup it drains the inbox in batches and
+ * writes each delivery to the target connection.
+ */
+struct worker {
+  int id;
+  pthread_t thread;
+  struct mpsc_queue inbox;
+};
+
+typedef void (*worker_deliver_fn)(struct worker *self, struct delivery *d,
+                                  void *arg);
+
+// Function prototypes
+int worker_init(struct worker *w, int id);
+void worker_destroy(struct worker *w);
+int worker_wake_fd(const struct worker *w);
+int worker_route(struct worker *target, struct mqtt_message *msg, int fd);
+int worker_route_job(struct worker *target, struct mqtt_message *msg,
+                     struct fanout_job *job);
+int worker_drain(struct worker *w, worker_deliver_fn deliver, void *arg);
+
+#endif // WORKER_H
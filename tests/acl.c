@@ -0,0 +1,131 @@
+#include "minunit.h"
+#include "../src/acl.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct acl acl;
+static struct acl_session alice, bob, anon;
+
+static const char rules[] =
+    "# sensors publish under their own name, operators read them all\n"
+    "group operators alice\n"
+    "allow readwrite user:alice devices/%u/#\n"
+    "allow write anyone clients/%c/status\n"
+    "allow read group:operators devices/+/telemetry\n"
+    "deny read group:operators devices/secret/#\n"
+    "allow read user:alice devices/secret/key\n"
+    "allow read anyone public/#\n"
+    "deny read anyone public/private\n";
+
+void test_setup(void) {
+    acl_init(&acl, 0);
+    FILE *in = tmpfile();
+    fputs(rules, in);
+    rewind(in);
+    acl_load(&acl, in);
+    fclose(in);
+    acl_session_init(&alice, &acl, "alice", 5, "c1", 2);
+    acl_session_init(&bob, &acl, "bob", 3, "c2", 2);
+    acl_session_init(&anon, &acl, NULL, 0, "c3", 2);
+}
+
+void test_teardown(void) {
+    acl_session_destroy(&alice);
+    acl_session_destroy(&bob);
+    acl_session_destroy(&anon);
+    acl_destroy(&acl);
+}
+
+static int check(struct acl_session *s, const char *name,
+                 enum acl_access access) {
+    struct topic *t = topic_intern(name, strlen(name));
+    int allow = acl_check(s, t, access);
+    topic_release(t);
+    return allow;
+}
+
+MU_TEST(test_user_template) {
+    mu_check(check(&alice, "devices/alice/temp", ACL_WRITE));
+    mu_check(check(&alice, "devices/alice", ACL_READ));
+    mu_check(!check(&alice, "devices/bob/temp", ACL_WRITE));
+    mu_check(!check(&bob, "devices/bob/temp", ACL_WRITE));
+    mu_check(!check(&anon, "devices/alice/temp", ACL_WRITE));
+}
+
+MU_TEST(test_client_template) {
+    mu_check(check(&bob, "clients/c2/status", ACL_WRITE));
+    mu_check(!check(&bob, "clients/c1/status", ACL_WRITE));
+    mu_check(!check(&bob, "clients/c2/status", ACL_READ));
+}
+
+MU_TEST(test_precedence) {
+    // Group rules, deny beats allow
+    mu_check(check(&alice, "devices/x/telemetry", ACL_READ));
+    mu_check(!check(&alice, "devices/secret/telemetry", ACL_READ));
+    // A user rule beats the group deny
+    mu_check(check(&alice, "devices/secret/key", ACL_READ));
+    mu_check(!check(&bob, "devices/x/telemetry", ACL_READ));
+    // Anyone: deny beats allow, no match falls to the default
+    mu_check(check(&anon, "public/news", ACL_READ));
+    mu_check(!check(&anon, "public/private", ACL_READ));
+    mu_check(!check(&anon, "elsewhere", ACL_READ));
+}
+
+MU_TEST(test_subscription_filters) {
+    mu_check(check(&bob, "public/#", ACL_READ));
+    mu_check(check(&bob, "public/+", ACL_READ));
+    mu_check(check(&alice, "devices/+/telemetry", ACL_READ));
+    // Only a '#' pattern covers a '#' filter
+    mu_check(!check(&alice, "devices/#", ACL_READ));
+}
+
+MU_TEST(test_sys_topics_not_wildcarded) {
+    mu_assert_int_eq(0, acl_add_rule(&acl, ACL_ANYONE, NULL, ACL_READ, 1, "#"));
+    mu_check(check(&bob, "anything/at/all", ACL_READ));
+    mu_check(!check(&bob, "$SYS/broker/load", ACL_READ));
+}
+
+MU_TEST(test_cache_and_reload) {
+    struct topic *t = topic_intern("later/added", 11);
+    mu_check(!acl_check(&bob, t, ACL_WRITE));
+    mu_check(!acl_check(&bob, t, ACL_WRITE));
+    mu_check(alice.cache[t->hash & (ACL_CACHE_SIZE - 1)].topic != t);
+    mu_check(bob.cache[t->hash & (ACL_CACHE_SIZE - 1)].topic == t);
+
+    // A new rule invalidates every cached verdict
+    acl_add_rule(&acl, ACL_USER, "bob", ACL_WRITE, 1, "later/#");
+    mu_check(acl_check(&bob, t, ACL_WRITE));
+    mu_check(!acl_check(&bob, t, ACL_READ));
+    topic_release(t);
+}
+
+MU_TEST(test_rejects_bad_rules) {
+    mu_assert_int_eq(-1, acl_add_rule(&acl, ACL_ANYONE, NULL, ACL_READ, 1,
+                                      "a/#/b"));
+    mu_assert_int_eq(-1, acl_add_rule(&acl, ACL_ANYONE, NULL, ACL_READ, 1,
+                                      "a+/b"));
+    mu_assert_int_eq(-1, acl_add_rule(&acl, ACL_ANYONE, NULL, 0, 1, "a"));
+
+    FILE *in = tmpfile();
+    fputs("allow read anyone ok\nallow sometimes anyone bad\n", in);
+    rewind(in);
+    mu_assert_int_eq(2, acl_load(&acl, in));
+    fclose(in);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_user_template);
+    MU_RUN_TEST(test_client_template);
+    MU_RUN_TEST(test_precedence);
+    MU_RUN_TEST(test_subscription_filters);
+    MU_RUN_TEST(test_sys_topics_not_wildcarded);
+    MU_RUN_TEST(test_cache_and_reload);
+    MU_RUN_TEST(test_rejects_bad_rules);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,161 @@
+#include "minunit.h"
+#include "../src/auth.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// crypt("s3cret", "$6$rounds=20000$saltsalt$")
+#define ALICE_HASH                                                             \
+    "$6$rounds=20000$saltsalt$pMF8XNanZUWDFwyAFd9Z5MNJulMcFwXsDEn0wUIR8QnOA6V" \
+    "l3AW9Rk.YaUzO8GYQrF7d3SLfo.ZXttb747QuA1"
+
+static char path[64];
+static struct auth_file file;
+static struct auth_inbox inbox;
+static enum auth_verdict verdicts[8];
+static int sessions[8];
+static int received;
+
+void test_setup(void) {
+    snprintf(path, sizeof(path), "/tmp/auth_test_%d", (int)getpid());
+    FILE *out = fopen(path, "w");
+    fputs("# test users\nalice:" ALICE_HASH "\nbob:*\n", out);
+    fclose(out);
+    auth_file_load(&file, path);
+    auth_inbox_init(&inbox);
+    received = 0;
+}
+
+void test_teardown(void) {
+    auth_inbox_destroy(&inbox);
+    auth_file_destroy(&file);
+    unlink(path);
+}
+
+static void record(void *session, enum auth_verdict verdict, void *arg) {
+    sessions[received] = *(int *)session;
+    verdicts[received++] = verdict;
+}
+
+// Wait for n verdicts to come back through the inbox
+static void await(int n) {
+    struct pollfd pfd = {.fd = inbox.wake_fd, .events = POLLIN};
+    while (received < n && poll(&pfd, 1, 5000) == 1)
+        auth_inbox_drain(&inbox, record, NULL);
+}
+
+static int submit(struct auth_pool *pool, int *session, const char *user,
+                  const char *password) {
+    return auth_pool_submit(pool, &inbox, session, user, strlen(user),
+                            password, strlen(password));
+}
+
+MU_TEST(test_file_backend) {
+    mu_assert_int_eq(2, file.count);
+    mu_assert_int_eq(AUTH_ALLOW,
+                     auth_file_verify("alice", 5, "s3cret", 6, &file));
+    mu_assert_int_eq(AUTH_DENY,
+                     auth_file_verify("alice", 5, "s3cre", 5, &file));
+    mu_assert_int_eq(AUTH_DENY,
+                     auth_file_verify("carol", 5, "s3cret", 6, &file));
+    // A locked account's hash never matches
+    mu_check(auth_file_verify("bob", 3, "*", 1, &file) != AUTH_ALLOW);
+}
+
+MU_TEST(test_embedded_nul_denied) {
+    // crypt would only see "s3cret"
+    mu_assert_int_eq(AUTH_DENY,
+                     auth_file_verify("alice", 5, "s3cret\0junk", 11, &file));
+
+    struct auth_pool pool;
+    int session = 0;
+    auth_pool_init(&pool, 1, auth_file_verify, &file, 4, 60000);
+    mu_assert_int_eq(0, auth_pool_submit(&pool, &inbox, &session, "alice", 5,
+                                         "s3cret\0junk", 11));
+    await(1);
+    mu_assert_int_eq(AUTH_DENY, verdicts[0]);
+    // Nothing was cached, so the same credentials go to the pool again
+    mu_assert_int_eq(0, auth_pool_submit(&pool, &inbox, &session, "alice", 5,
+                                         "s3cret\0junk", 11));
+    await(2);
+    mu_assert_int_eq(AUTH_DENY, verdicts[1]);
+    auth_pool_destroy(&pool);
+}
+
+MU_TEST(test_verdicts_arrive_async) {
+    struct auth_pool pool;
+    int good = 1, bad = 2;
+    mu_assert_int_eq(0, auth_pool_init(&pool, 2, auth_file_verify, &file,
+                                       16, 60000));
+    mu_assert_int_eq(0, submit(&pool, &good, "alice", "s3cret"));
+    mu_assert_int_eq(0, submit(&pool, &bad, "alice", "wrong"));
+    await(2);
+    mu_assert_int_eq(2, received);
+    for (int i = 0; i < 2; i++) {
+        mu_assert_int_eq(sessions[i] == good ? AUTH_ALLOW : AUTH_DENY,
+                         verdicts[i]);
+    }
+
+    // Accepted credentials skip the pool, rejected ones don't
+    mu_assert_int_eq(1, submit(&pool, &good, "alice", "s3cret"));
+    mu_assert_int_eq(0, submit(&pool, &bad, "alice", "wrong"));
+    mu_assert_int_eq(0, submit(&pool, &bad, "alic", "es3cret"));
+    await(4);
+    auth_pool_destroy(&pool);
+}
+
+static enum auth_verdict allow_all(const char *username, size_t username_len,
+                                   const char *password, size_t password_len,
+                                   void *arg) {
+    return AUTH_ALLOW;
+}
+
+MU_TEST(test_cache_lru) {
+    struct auth_pool pool;
+    int session = 0;
+    auth_pool_init(&pool, 1, allow_all, NULL, 2, 60000);
+    submit(&pool, &session, "a", "pw");
+    submit(&pool, &session, "b", "pw");
+    await(2);
+    // Touch a so b is the least recently used when c arrives
+    mu_assert_int_eq(1, submit(&pool, &session, "a", "pw"));
+    submit(&pool, &session, "c", "pw");
+    await(3);
+    mu_assert_int_eq(2, pool.cache.count);
+    mu_assert_int_eq(1, submit(&pool, &session, "a", "pw"));
+    mu_assert_int_eq(1, submit(&pool, &session, "c", "pw"));
+    mu_assert_int_eq(0, submit(&pool, &session, "b", "pw"));
+    await(4);
+    auth_pool_destroy(&pool);
+}
+
+MU_TEST(test_cache_expires) {
+    struct auth_pool pool;
+    int session = 0;
+    auth_pool_init(&pool, 1, allow_all, NULL, 4, 1);
+    submit(&pool, &session, "a", "pw");
+    await(1);
+    nanosleep(&(struct timespec){0, 5000000}, NULL);
+    mu_assert_int_eq(0, submit(&pool, &session, "a", "pw"));
+    await(2);
+    mu_assert_int_eq(2, received);
+    auth_pool_destroy(&pool);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_file_backend);
+    MU_RUN_TEST(test_embedded_nul_denied);
+    MU_RUN_TEST(test_verdicts_arrive_async);
+    MU_RUN_TEST(test_cache_lru);
+    MU_RUN_TEST(test_cache_expires);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
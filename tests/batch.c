@@ -0,0 +1,115 @@
+#include "minunit.h"
+#include "../src/batch.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct seen {
+    int count;
+    char topics[4][32];
+    char payloads[4][16];
+    uint64_t timestamps[4];
+};
+
+static struct seen seen;
+static struct topic *envelope;
+
+void test_setup(void) {
+    memset(&seen, 0, sizeof(seen));
+    envelope = topic_intern("$batch/sensors/room1", 20);
+}
+
+void test_teardown(void) { topic_release(envelope); }
+
+static int collect(struct topic *topic, const void *payload, size_t len,
+                   uint64_t timestamp, void *arg) {
+    memcpy(seen.topics[seen.count], topic->name, topic->len);
+    memcpy(seen.payloads[seen.count], payload, len);
+    seen.timestamps[seen.count] = timestamp;
+    seen.count++;
+    return 0;
+}
+
+static void build(msgpack_sbuffer *out, int n) {
+    struct batch_builder b;
+    batch_init(&b);
+    batch_add(&b, "temp", 4, "21.5", 4, 1000);
+    if (n > 1)
+        batch_add(&b, "humidity", 8, "40", 2, 1001);
+    msgpack_sbuffer_init(out);
+    batch_finish(&b, out);
+    batch_destroy(&b);
+}
+
+MU_TEST(test_only_prefixed_topics) {
+    struct topic *plain = topic_intern("sensors/room1", 13);
+    mu_check(batch_is_envelope(envelope));
+    mu_check(!batch_is_envelope(plain));
+    topic_release(plain);
+}
+
+MU_TEST(test_unbatch) {
+    msgpack_sbuffer buf;
+    build(&buf, 2);
+    mu_assert_int_eq(2, batch_unpack(envelope, buf.data, buf.size, collect,
+                                     NULL));
+    mu_assert_string_eq("sensors/room1/temp", seen.topics[0]);
+    mu_assert_string_eq("21.5", seen.payloads[0]);
+    mu_assert_int_eq(1000, seen.timestamps[0]);
+    mu_assert_string_eq("sensors/room1/humidity", seen.topics[1]);
+    mu_assert_int_eq(1001, seen.timestamps[1]);
+    msgpack_sbuffer_destroy(&buf);
+}
+
+MU_TEST(test_malformed_delivers_nothing) {
+    msgpack_sbuffer buf;
+    build(&buf, 2);
+    // Cut off the second entry
+    mu_assert_int_eq(-1, batch_unpack(envelope, buf.data, buf.size - 3,
+                                      collect, NULL));
+    mu_assert_int_eq(0, seen.count);
+
+    // An entry that is not [suffix, payload, timestamp]
+    msgpack_sbuffer bad;
+    msgpack_packer pk;
+    msgpack_sbuffer_init(&bad);
+    msgpack_packer_init(&pk, &bad, msgpack_sbuffer_write);
+    msgpack_pack_array(&pk, 1);
+    msgpack_pack_array(&pk, 2);
+    msgpack_pack_str(&pk, 1);
+    msgpack_pack_str_body(&pk, "a", 1);
+    msgpack_pack_uint64(&pk, 5);
+    mu_assert_int_eq(-1, batch_unpack(envelope, bad.data, bad.size, collect,
+                                      NULL));
+    mu_assert_int_eq(0, seen.count);
+    msgpack_sbuffer_destroy(&bad);
+    msgpack_sbuffer_destroy(&buf);
+}
+
+MU_TEST(test_wildcard_suffix_skipped) {
+    struct batch_builder b;
+    msgpack_sbuffer buf;
+    batch_init(&b);
+    batch_add(&b, "#", 1, "x", 1, 1);
+    batch_add(&b, "ok", 2, "y", 1, 2);
+    msgpack_sbuffer_init(&buf);
+    batch_finish(&b, &buf);
+    mu_assert_int_eq(1, batch_unpack(envelope, buf.data, buf.size, collect,
+                                     NULL));
+    mu_assert_string_eq("sensors/room1/ok", seen.topics[0]);
+    batch_destroy(&b);
+    msgpack_sbuffer_destroy(&buf);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_only_prefixed_topics);
+    MU_RUN_TEST(test_unbatch);
+    MU_RUN_TEST(test_malformed_delivers_nothing);
+    MU_RUN_TEST(test_wildcard_suffix_skipped);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
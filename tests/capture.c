@@ -0,0 +1,124 @@
+#include "minunit.h"
+#include "../src/capture.h"
+#include "../src/mqtt.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path[64];
+
+void test_setup(void) {
+    snprintf(path, sizeof(path), "/tmp/capture_test.%d", (int)getpid());
+}
+
+void test_teardown(void) { unlink(path); }
+
+MU_TEST(test_roundtrip) {
+    struct capture *cap = capture_open(path);
+    mu_check(cap != NULL);
+    mu_assert_int_eq(0, capture_record(cap, CAP_OPEN, 5, NULL, 0));
+    mu_assert_int_eq(0, capture_record(cap, CAP_DATA, 5, "\x30\x03\x00\x01t", 5));
+    mu_assert_int_eq(0, capture_record(cap, CAP_CLOSE, 5, NULL, 0));
+    capture_close(cap);
+
+    struct capture_reader r;
+    struct capture_record rec;
+    const unsigned char *data;
+    mu_assert_int_eq(0, capture_reader_open(&r, path));
+
+    mu_assert_int_eq(1, capture_next(&r, &rec, &data));
+    mu_assert_int_eq(CAP_OPEN, capture_kind(&rec));
+    mu_assert_int_eq(5, rec.conn);
+    uint64_t opened = rec.ts_ns;
+
+    mu_assert_int_eq(1, capture_next(&r, &rec, &data));
+    mu_assert_int_eq(CAP_DATA, capture_kind(&rec));
+    mu_assert_int_eq(5, capture_len(&rec));
+    mu_check(memcmp(data, "\x30\x03\x00\x01t", 5) == 0);
+    mu_check(rec.ts_ns >= opened);
+
+    mu_assert_int_eq(1, capture_next(&r, &rec, &data));
+    mu_assert_int_eq(CAP_CLOSE, capture_kind(&rec));
+    mu_assert_int_eq(0, capture_next(&r, &rec, &data));
+    capture_reader_close(&r);
+}
+
+MU_TEST(test_disabled_capture_is_noop) {
+    mu_assert_int_eq(0, capture_record(NULL, CAP_DATA, 1, "x", 1));
+}
+
+MU_TEST(test_truncated_file) {
+    struct capture *cap = capture_open(path);
+    capture_record(cap, CAP_DATA, 1, "hello", 5);
+    capture_close(cap);
+    // Cut the file in the middle of the record's data
+    FILE *f = fopen(path, "r+b");
+    mu_check(ftruncate(fileno(f), 8 + sizeof(struct capture_record) + 2) == 0);
+    fclose(f);
+
+    struct capture_reader r;
+    struct capture_record rec;
+    const unsigned char *data;
+    mu_assert_int_eq(0, capture_reader_open(&r, path));
+    mu_assert_int_eq(-1, capture_next(&r, &rec, &data));
+    capture_reader_close(&r);
+}
+
+MU_TEST(test_rejects_other_files) {
+    FILE *f = fopen(path, "wb");
+    fputs("FREC....", f);
+    fclose(f);
+    struct capture_reader r;
+    mu_assert_int_eq(-1, capture_reader_open(&r, path));
+}
+
+/*
+ * Replay decodes captured records as it would live traffic. A CONNECT
+ * whose fields claim more than its remaining length must be refused
+ * without reading past the packet or leaking what it already copied.
+ */
+MU_TEST(test_replayed_connect_truncated) {
+    static const unsigned char records[][24] = {
+        // The protocol name runs past the remaining length
+        {0x10, 0x02, 0x00, 0x04},
+        // Client id and username fit, the password claims 16 bytes
+        {0x10, 20, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0xc2, 0x00, 0x3c,
+         0x00, 0x02, 'c', 'd', 0x00, 0x01, 'u', 0x00, 0x10, 'p'},
+    };
+    static const size_t lens[] = {4, 22};
+    struct capture *cap = capture_open(path);
+    for (int i = 0; i < 2; i++)
+        capture_record(cap, CAP_DATA, 1, records[i], lens[i]);
+    capture_close(cap);
+
+    struct capture_reader r;
+    struct capture_record rec;
+    const unsigned char *data;
+    mu_assert_int_eq(0, capture_reader_open(&r, path));
+    while (capture_next(&r, &rec, &data) == 1) {
+        // Exactly the record, so any over-read leaves the allocation
+        unsigned char *pkt = malloc(capture_len(&rec));
+        memcpy(pkt, data, capture_len(&rec));
+        union mqtt_packet p;
+        mu_assert_int_eq(-1, unpack_mqtt_packet(pkt, &p));
+        mu_check(p.connect.payload.client_id == NULL);
+        mu_check(p.connect.payload.username == NULL);
+        free(pkt);
+    }
+    capture_reader_close(&r);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_roundtrip);
+    MU_RUN_TEST(test_disabled_capture_is_noop);
+    MU_RUN_TEST(test_truncated_file);
+    MU_RUN_TEST(test_rejects_other_files);
+    MU_RUN_TEST(test_replayed_connect_truncated);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,248 @@
+#include "minunit.h"
+#include "../src/cluster.h"
+#include "../src/stats.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NODES 3
+
+static struct cluster nodes[NODES];
+static int received[NODES];
+static char last_topic[NODES][32];
+static char ports[NODES][8];
+
+static void deliver(struct mqtt_message *msg, void *arg) {
+    int n = (int *)arg - received;
+    received[n]++;
+    snprintf(last_topic[n], sizeof(last_topic[n]), "%s", msg->topic->name);
+}
+
+// Node i listens on an ephemeral port, node ids start at 1
+static void start(int i) {
+    cluster_init(&nodes[i], i + 1, "0", deliver, &received[i]);
+    snprintf(ports[i], sizeof(ports[i]), "%d", cluster_port(&nodes[i]));
+}
+
+void test_setup(void) {
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+        received[i] = 0;
+        last_topic[i][0] = '\0';
+    }
+}
+
+void test_teardown(void) {
+    for (int i = 0; i < NODES; i++) {
+        cluster_destroy(&nodes[i]);
+    }
+}
+
+// Run every node's loop until the links go quiet
+static void settle(void) {
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < NODES; i++) {
+            if (nodes[i].epfd != -1) {
+                cluster_poll(&nodes[i]);
+                cluster_flush(&nodes[i]);
+            }
+        }
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+}
+
+static void mesh(void) {
+    cluster_add_peer(&nodes[1], "127.0.0.1", ports[0]);
+    cluster_add_peer(&nodes[2], "127.0.0.1", ports[0]);
+    cluster_add_peer(&nodes[2], "127.0.0.1", ports[1]);
+    settle();
+}
+
+static int subscribe(int i, const char *filter, int delta) {
+    struct topic *t = topic_intern(filter, strlen(filter));
+    int changed = cluster_interest(&nodes[i], t, delta);
+    topic_release(t);
+    return changed;
+}
+
+// Forward a PUBLISH from node i, returns the peers it was queued for
+static size_t publish(int i, const char *topic) {
+    struct topic *t = topic_intern(topic, strlen(topic));
+    struct mqtt_message *msg = mqtt_message_publish(t, "1", 1, PUBLISH_BYTE, 0);
+    size_t n = cluster_forward(&nodes[i], msg);
+    mqtt_message_release(msg);
+    topic_release(t);
+    return n;
+}
+
+MU_TEST(test_mesh_links) {
+    mesh();
+    for (int i = 0; i < NODES; i++) {
+        mu_assert_int_eq(NODES - 1, cluster_linked(&nodes[i]));
+    }
+}
+
+MU_TEST(test_forward_only_to_interested) {
+    mesh();
+    subscribe(1, "sensors/+/temp", 1);
+    subscribe(2, "alerts/#", 1);
+    settle();
+
+    mu_assert_int_eq(1, publish(0, "sensors/7/temp"));
+    mu_assert_int_eq(0, publish(0, "sensors/7/hum"));
+    mu_assert_int_eq(0, publish(0, "$SYS/x"));
+    settle();
+    mu_assert_int_eq(0, received[0]);
+    mu_assert_int_eq(1, received[1]);
+    mu_assert_string_eq("sensors/7/temp", last_topic[1]);
+
+    mu_assert_int_eq(1, publish(1, "alerts/fire"));
+    mu_assert_int_eq(1, publish(2, "sensors/1/temp"));
+    settle();
+    mu_assert_int_eq(2, received[1]);
+    mu_assert_string_eq("sensors/1/temp", last_topic[1]);
+    mu_assert_int_eq(1, received[2]);
+    mu_assert_string_eq("alerts/fire", last_topic[2]);
+}
+
+MU_TEST(test_interest_is_counted) {
+    mesh();
+    mu_assert_int_eq(1, subscribe(1, "a/b", 1));
+    mu_assert_int_eq(0, subscribe(1, "a/b", 1));
+    settle();
+    mu_assert_int_eq(1, publish(0, "a/b"));
+
+    // Still one subscriber left
+    mu_assert_int_eq(0, subscribe(1, "a/b", -1));
+    settle();
+    mu_assert_int_eq(1, publish(0, "a/b"));
+    mu_assert_int_eq(1, subscribe(1, "a/b", -1));
+    mu_assert_int_eq(0, subscribe(1, "a/b", -1));
+    settle();
+    mu_assert_int_eq(0, publish(0, "a/b"));
+    mu_assert_int_eq(0, nodes[1].nfilters);
+}
+
+MU_TEST(test_new_link_gets_snapshot) {
+    for (int i = 0; i < 300; i++) {
+        char filter[32];
+        snprintf(filter, sizeof(filter), "fleet/%d/#", i);
+        subscribe(1, filter, 1);
+    }
+    // Added and removed before any link existed
+    subscribe(1, "gone", 1);
+    subscribe(1, "gone", -1);
+    cluster_add_peer(&nodes[1], "127.0.0.1", ports[0]);
+    settle();
+    mu_assert_int_eq(300, nodes[0].peers[0]->interest.nfilters);
+    mu_assert_int_eq(1, publish(0, "fleet/299/x"));
+    mu_assert_int_eq(0, publish(0, "gone"));
+}
+
+MU_TEST(test_crossed_dials_keep_one_link) {
+    cluster_add_peer(&nodes[0], "127.0.0.1", ports[1]);
+    cluster_add_peer(&nodes[1], "127.0.0.1", ports[0]);
+    subscribe(1, "t", 1);
+    settle();
+    mu_assert_int_eq(1, cluster_linked(&nodes[0]));
+    mu_assert_int_eq(1, cluster_linked(&nodes[1]));
+    mu_assert_int_eq(1, publish(0, "t"));
+    settle();
+    mu_assert_int_eq(1, received[1]);
+    // The kept link took over the routes, nothing redials
+    cluster_tick(&nodes[0], stats_now_ns() + 2 * CLUSTER_RETRY_NS);
+    cluster_tick(&nodes[1], stats_now_ns() + 2 * CLUSTER_RETRY_NS);
+    settle();
+    mu_assert_int_eq(1, nodes[0].npeers);
+    mu_assert_int_eq(1, nodes[1].npeers);
+}
+
+MU_TEST(test_redial_after_restart) {
+    cluster_add_peer(&nodes[1], "127.0.0.1", ports[0]);
+    subscribe(1, "t", 1);
+    settle();
+    mu_assert_int_eq(1, cluster_linked(&nodes[1]));
+
+    cluster_destroy(&nodes[0]);
+    settle();
+    mu_assert_int_eq(0, cluster_linked(&nodes[1]));
+    cluster_init(&nodes[0], 1, ports[0], deliver, &received[0]);
+    cluster_tick(&nodes[1], stats_now_ns() + 2 * CLUSTER_RETRY_NS);
+    settle();
+    mu_assert_int_eq(1, cluster_linked(&nodes[0]));
+    mu_assert_int_eq(1, publish(0, "t"));
+}
+
+MU_TEST(test_publish_before_hello_closes_link) {
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons(cluster_port(&nodes[0])),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    mu_check(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    const unsigned char publish_packet[] = {PUBLISH_BYTE, 4, 0, 1, 'x', '1'};
+    send(fd, publish_packet, sizeof(publish_packet), 0);
+    settle();
+    unsigned char buf[64];
+    ssize_t n;
+    // The hello arrives, then the node hangs up
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+    }
+    mu_assert_int_eq(0, n);
+    mu_assert_int_eq(0, received[0]);
+    mu_assert_int_eq(0, nodes[0].npeers);
+    close(fd);
+}
+
+MU_TEST(test_split_publish_forwarded_whole) {
+    mesh();
+    subscribe(1, "big/#", 1);
+    settle();
+
+    static char payload[400];
+    memset(payload, 'p', sizeof(payload));
+    struct topic *t = topic_intern("big/one", 7);
+    struct mqtt_message *whole =
+        mqtt_message_publish(t, payload, sizeof(payload), PUBLISH_BYTE, 0);
+    // Split the way the server reads it, 255 bytes at a time
+    struct mqtt_message *first = mqtt_message_new(whole->data, 255);
+    struct mqtt_message *rest =
+        mqtt_message_new(whole->data + 255, whole->len - 255);
+    mu_assert_int_eq(0, cluster_forward(&nodes[0], first));
+    mu_assert_int_eq(0, cluster_forward(&nodes[0], rest));
+
+    // Reassembled it goes out once, and the link stays in step
+    mu_assert_int_eq(1, cluster_forward(&nodes[0], whole));
+    mu_assert_int_eq(1, publish(0, "big/two"));
+    settle();
+    mu_assert_int_eq(2, received[1]);
+    mu_assert_string_eq("big/two", last_topic[1]);
+
+    mqtt_message_release(first);
+    mqtt_message_release(rest);
+    mqtt_message_release(whole);
+    topic_release(t);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_mesh_links);
+    MU_RUN_TEST(test_forward_only_to_interested);
+    MU_RUN_TEST(test_interest_is_counted);
+    MU_RUN_TEST(test_new_link_gets_snapshot);
+    MU_RUN_TEST(test_crossed_dials_keep_one_link);
+    MU_RUN_TEST(test_redial_after_restart);
+    MU_RUN_TEST(test_publish_before_hello_closes_link);
+    MU_RUN_TEST(test_split_publish_forwarded_whole);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
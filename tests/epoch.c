@@ -0,0 +1,106 @@
+#include "minunit.h"
+#include "../src/epoch.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct tracked {
+    struct epoch_entry retired;
+    int *freed;
+};
+
+static atomic_int in_section;
+static atomic_int leave;
+
+void test_setup(void) {
+    atomic_store(&in_section, 0);
+    atomic_store(&leave, 0);
+}
+
+void test_teardown(void) { epoch_synchronize(); }
+
+static void tracked_free(struct epoch_entry *e) {
+    struct tracked *t = (struct tracked *)e;
+    (*t->freed)++;
+    free(t);
+}
+
+static void retire(int *freed) {
+    struct tracked *t = malloc(sizeof(*t));
+    t->freed = freed;
+    epoch_retire(&t->retired, tracked_free);
+}
+
+// Holds a section open until told to leave
+static void *reader(void *arg) {
+    epoch_enter();
+    atomic_store(&in_section, 1);
+    while (!atomic_load(&leave))
+        ;
+    epoch_exit();
+    return NULL;
+}
+
+MU_TEST(test_freed_without_readers) {
+    int freed = 0;
+    retire(&freed);
+    epoch_synchronize();
+    mu_assert_int_eq(1, freed);
+}
+
+MU_TEST(test_reader_holds_back_reclamation) {
+    pthread_t t;
+    pthread_create(&t, NULL, reader, NULL);
+    while (!atomic_load(&in_section))
+        ;
+    int freed = 0;
+    for (int i = 0; i < 100; i++)
+        retire(&freed);
+    mu_assert_int_eq(0, freed);
+
+    atomic_store(&leave, 1);
+    pthread_join(t, NULL);
+    epoch_synchronize();
+    mu_assert_int_eq(100, freed);
+}
+
+// Leaves an inner section, still inside the outer one
+static void *nested_reader(void *arg) {
+    epoch_enter();
+    epoch_enter();
+    epoch_exit();
+    atomic_store(&in_section, 1);
+    while (!atomic_load(&leave))
+        ;
+    epoch_exit();
+    return NULL;
+}
+
+MU_TEST(test_sections_nest) {
+    pthread_t t;
+    pthread_create(&t, NULL, nested_reader, NULL);
+    while (!atomic_load(&in_section))
+        ;
+    int freed = 0;
+    for (int i = 0; i < 100; i++)
+        retire(&freed);
+    mu_assert_int_eq(0, freed);
+
+    atomic_store(&leave, 1);
+    pthread_join(t, NULL);
+    epoch_synchronize();
+    mu_assert_int_eq(100, freed);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_freed_without_readers);
+    MU_RUN_TEST(test_reader_holds_back_reclamation);
+    MU_RUN_TEST(test_sections_nest);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
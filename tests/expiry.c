@@ -0,0 +1,141 @@
+#include "minunit.h"
+#include "../src/expiry.h"
+#include "../src/retain.h"
+#include "../src/stats.h"
+#include <stdint.h>
+
+#define SEC 1000000000ULL
+
+static struct expiry_wheel wheel;
+static int fired[8];
+
+static void count_fired(void *key, uint64_t now_ns, void *arg) {
+    fired[(intptr_t)key]++;
+}
+
+void test_setup(void) {
+    expiry_init(&wheel, SEC, 100 * SEC, count_fired, NULL);
+    for (int i = 0; i < 8; i++)
+        fired[i] = 0;
+}
+
+void test_teardown(void) { expiry_destroy(&wheel); }
+
+MU_TEST(test_fires_after_tick_passes) {
+    expiry_add(&wheel, (void *)1, 102 * SEC + 1);
+    mu_assert_int_eq(0, expiry_advance(&wheel, 102 * SEC + 1));
+    mu_assert_int_eq(0, fired[1]);
+    // Coarse: the deadline's whole tick has to pass first
+    mu_assert_int_eq(1, expiry_advance(&wheel, 103 * SEC));
+    mu_assert_int_eq(1, fired[1]);
+    mu_assert_int_eq(0, wheel.count);
+}
+
+MU_TEST(test_fires_bucket_as_batch) {
+    for (intptr_t k = 0; k < 4; k++)
+        expiry_add(&wheel, (void *)k, 105 * SEC);
+    expiry_add(&wheel, (void *)5, 107 * SEC);
+    mu_assert_int_eq(4, expiry_advance(&wheel, 106 * SEC));
+    mu_assert_int_eq(1, fired[0]);
+    mu_assert_int_eq(1, fired[3]);
+    mu_assert_int_eq(0, fired[5]);
+    mu_assert_int_eq(1, wheel.count);
+    mu_check(expiry_next_ns(&wheel) == 107 * SEC);
+}
+
+MU_TEST(test_past_deadline_fires_next_advance) {
+    expiry_add(&wheel, (void *)2, 50 * SEC);
+    mu_assert_int_eq(1, expiry_advance(&wheel, 101 * SEC));
+    mu_assert_int_eq(1, fired[2]);
+}
+
+MU_TEST(test_far_deadline_survives_revolutions) {
+    // Shares a bucket with 101 s, several revolutions early
+    uint64_t far = (101 + 3 * EXPIRY_SLOTS) * SEC;
+    expiry_add(&wheel, (void *)3, far);
+    for (uint64_t t = 101; t < 101 + 3 * EXPIRY_SLOTS; t += 7)
+        expiry_advance(&wheel, t * SEC);
+    mu_assert_int_eq(0, fired[3]);
+    // A long idle gap only visits each bucket once
+    mu_assert_int_eq(1, expiry_advance(&wheel, far + 1000 * SEC));
+    mu_assert_int_eq(1, fired[3]);
+}
+
+static void rearm(void *key, uint64_t now_ns, void *arg) {
+    fired[(intptr_t)key]++;
+    if (fired[(intptr_t)key] < 3)
+        expiry_add(&wheel, key, now_ns + SEC);
+}
+
+MU_TEST(test_callback_may_rearm) {
+    wheel.fn = rearm;
+    expiry_add(&wheel, (void *)4, 101 * SEC);
+    for (uint64_t t = 101; t < 110; t++)
+        expiry_advance(&wheel, t * SEC);
+    mu_assert_int_eq(3, fired[4]);
+    mu_assert_int_eq(0, wheel.count);
+}
+
+static struct mqtt_message *expiring(struct topic *topic, uint64_t expires_ns) {
+    struct mqtt_message *msg = mqtt_message_publish(topic, "v", 1, 0x31, 0);
+    msg->expires_ns = expires_ns;
+    return msg;
+}
+
+MU_TEST(test_retained_message_expires) {
+    struct retain_store store;
+    retain_init(&store);
+    uint64_t now = stats_now_ns();
+    struct topic *gone = topic_intern("sensor/gone", 11);
+    struct topic *kept = topic_intern("sensor/kept", 11);
+    retain_set(&store, topic_ref(gone), expiring(gone, now + 10 * SEC));
+    retain_set(&store, topic_ref(kept), expiring(kept, 0));
+    // Replaced before its deadline, the stale key must not drop the new one
+    struct topic *renewed = topic_intern("sensor/renewed", 14);
+    retain_set(&store, topic_ref(renewed), expiring(renewed, now + 10 * SEC));
+    retain_set(&store, topic_ref(renewed), expiring(renewed, now + 30 * SEC));
+
+    mu_assert_int_eq(0, retain_expire(&store, now + 9 * SEC));
+    mu_assert_int_eq(3, store.count);
+    mu_assert_int_eq(1, retain_expire(&store, now + 11 * SEC));
+    mu_assert_int_eq(2, store.count);
+    mu_check(retain_get(&store, gone) == NULL);
+    struct mqtt_message *msg = retain_get(&store, renewed);
+    mu_check(msg != NULL);
+    mqtt_message_release(msg);
+
+    topic_release(gone);
+    topic_release(kept);
+    topic_release(renewed);
+    // Still holds a key for renewed
+    retain_destroy(&store);
+}
+
+MU_TEST(test_expired_retained_not_served) {
+    struct retain_store store;
+    retain_init(&store);
+    struct topic *topic = topic_intern("sensor/stale", 12);
+    // Past its deadline, though no bucket has fired yet
+    retain_set(&store, topic_ref(topic), expiring(topic, stats_now_ns() - 1));
+    mu_check(retain_get(&store, topic) == NULL);
+    mu_assert_int_eq(1, store.count);
+    topic_release(topic);
+    retain_destroy(&store);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_fires_after_tick_passes);
+    MU_RUN_TEST(test_fires_bucket_as_batch);
+    MU_RUN_TEST(test_past_deadline_fires_next_advance);
+    MU_RUN_TEST(test_far_deadline_survives_revolutions);
+    MU_RUN_TEST(test_callback_may_rearm);
+    MU_RUN_TEST(test_retained_message_expires);
+    MU_RUN_TEST(test_expired_retained_not_served);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
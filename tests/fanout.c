@@ -0,0 +1,224 @@
+#include "minunit.h"
+#include "../src/fanout.h"
+#include "../src/stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORKERS 4
+#define SUBSCRIBERS 10000
+
+static struct worker workers[WORKERS];
+static struct sub_index idx;
+static struct fanout fanout;
+static struct topic *topic;
+
+// Last message seen by every subscriber, and by which worker
+static struct mqtt_message *last_seen[SUBSCRIBERS + 1];
+static int served_by[SUBSCRIBERS + 1];
+static int out_of_order;
+static atomic_int delivered;
+
+static int owner_of(const struct subscriber *sub, void *arg) {
+    return (int)((uintptr_t)sub->client % WORKERS);
+}
+
+void test_setup(void) {
+    subs_init(&idx);
+    for (int w = 0; w < WORKERS; w++)
+        worker_init(&workers[w], w);
+    fanout_init(&fanout, workers, WORKERS, 64, owner_of, NULL);
+    topic = topic_intern("broadcast/all", 13);
+    for (uintptr_t c = 1; c <= SUBSCRIBERS; c++)
+        subs_add(&idx, topic, (void *)c, 0, 0);
+    memset(last_seen, 0, sizeof(last_seen));
+    memset(served_by, -1, sizeof(served_by));
+    out_of_order = 0;
+    atomic_store(&delivered, 0);
+}
+
+void test_teardown(void) {
+    fanout_destroy(&fanout);
+    for (int w = 0; w < WORKERS; w++)
+        worker_destroy(&workers[w]);
+    subs_destroy(&idx);
+    topic_release(topic);
+}
+
+static void record(struct worker *self, struct mqtt_message *msg,
+                   const struct subscriber *sub, void *arg) {
+    struct mqtt_message **order = arg;
+    uintptr_t c = (uintptr_t)sub->client;
+    // Messages are expected in the order of the array passed as arg
+    if (order != NULL) {
+        struct mqtt_message *expected =
+            last_seen[c] == NULL ? order[0] : order[1];
+        if (msg != expected)
+            out_of_order++;
+    }
+    last_seen[c] = msg;
+    served_by[c] = self->id;
+    atomic_fetch_add(&delivered, 1);
+}
+
+static void deliver(struct worker *self, struct delivery *d, void *arg) {
+    fanout_run(self, d, record, arg);
+}
+
+static void drain_all(void *arg) {
+    for (int w = 0; w < WORKERS; w++)
+        while (worker_drain(&workers[w], deliver, arg))
+            ;
+}
+
+MU_TEST(test_split_by_owner) {
+    struct mqtt_message *msg = mqtt_message_new(NULL, 0);
+    size_t dropped;
+    mu_assert_int_eq(SUBSCRIBERS,
+                     fanout_publish(&fanout, &idx, topic, msg, &dropped));
+    mu_assert_int_eq(0, dropped);
+    drain_all(NULL);
+
+    mu_assert_int_eq(SUBSCRIBERS, atomic_load(&delivered));
+    for (uintptr_t c = 1; c <= SUBSCRIBERS; c++) {
+        mu_check(last_seen[c] == msg);
+        mu_assert_int_eq(c % WORKERS, served_by[c]);
+    }
+    // Every job holds its own reference until it is run
+    mu_assert_int_eq(1, msg->refcount);
+    mqtt_message_release(msg);
+}
+
+MU_TEST(test_order_per_subscriber) {
+    struct mqtt_message *order[2] = {mqtt_message_new(NULL, 0),
+                                     mqtt_message_new(NULL, 0)};
+    fanout_publish(&fanout, &idx, topic, order[0], NULL);
+    fanout_publish(&fanout, &idx, topic, order[1], NULL);
+    drain_all(order);
+
+    mu_assert_int_eq(2 * SUBSCRIBERS, atomic_load(&delivered));
+    mu_assert_int_eq(0, out_of_order);
+    mqtt_message_release(order[0]);
+    mqtt_message_release(order[1]);
+}
+
+static int no_owner(const struct subscriber *sub, void *arg) { return -1; }
+
+static int owner_of_first(const struct subscriber *sub, void *arg) {
+    return 0;
+}
+
+MU_TEST(test_unowned_dropped) {
+    struct fanout lost;
+    fanout_init(&lost, workers, WORKERS, 0, no_owner, NULL);
+    struct mqtt_message *msg = mqtt_message_new(NULL, 0);
+    size_t dropped;
+    fanout_publish(&lost, &idx, topic, msg, &dropped);
+    mu_assert_int_eq(SUBSCRIBERS, dropped);
+    mu_check(!mpsc_queue_pending(&workers[0].inbox));
+    mqtt_message_release(msg);
+    fanout_destroy(&lost);
+}
+
+MU_TEST(test_prefilter_skips_unsubscribed) {
+    stats_init(1);
+    fanout.stats = stats_worker(0);
+    struct topic *other = topic_intern("broadcast/none", 14);
+    struct mqtt_message *msg = mqtt_message_new(NULL, 0);
+    size_t dropped = 1;
+    mu_assert_int_eq(0, fanout_publish(&fanout, &idx, other, msg, &dropped));
+    mu_assert_int_eq(0, dropped);
+    for (int w = 0; w < WORKERS; w++)
+        mu_check(!mpsc_queue_pending(&workers[w].inbox));
+    mu_assert_int_eq(1, msg->refcount);
+
+    fanout_publish(&fanout, &idx, topic, msg, NULL);
+    int64_t totals[STAT_COUNT];
+    stats_snapshot(totals);
+    mu_assert_int_eq(2, totals[STAT_PREFILTER_CHECKED]);
+    mu_assert_int_eq(1, totals[STAT_PREFILTER_REJECTED]);
+    drain_all(NULL);
+    mu_assert_int_eq(SUBSCRIBERS, atomic_load(&delivered));
+    mqtt_message_release(msg);
+    topic_release(other);
+}
+
+static void *drain_thread(void *arg) {
+    struct worker *w = arg;
+    while (atomic_load(&delivered) < SUBSCRIBERS)
+        worker_drain(w, deliver, NULL);
+    return NULL;
+}
+
+MU_TEST(test_workers_drain_in_parallel) {
+    pthread_t threads[WORKERS];
+    for (int w = 0; w < WORKERS; w++)
+        pthread_create(&threads[w], NULL, drain_thread, &workers[w]);
+
+    struct mqtt_message *msg = mqtt_message_new(NULL, 0);
+    fanout_publish(&fanout, &idx, topic, msg, NULL);
+    for (int w = 0; w < WORKERS; w++)
+        pthread_join(threads[w], NULL);
+
+    mu_assert_int_eq(SUBSCRIBERS, atomic_load(&delivered));
+    mu_assert_int_eq(1, msg->refcount);
+    mqtt_message_release(msg);
+}
+
+static struct outq queues[2];
+
+static void enqueue(struct worker *self, struct mqtt_message *msg,
+                    const struct subscriber *sub, void *arg) {
+    fanout_queue(&queues[(uintptr_t)sub->client - 1], sub, msg);
+}
+
+static void deliver_queued(struct worker *self, struct delivery *d,
+                           void *arg) {
+    fanout_run(self, d, enqueue, arg);
+}
+
+MU_TEST(test_conflating_subscriber_keeps_last) {
+    struct fanout one;
+    struct sub_index own;
+    fanout_init(&one, workers, 1, 0, owner_of_first, NULL);
+    subs_init(&own);
+    subs_add(&own, topic, (void *)1, 0, 0);
+    subs_add(&own, topic, (void *)2, 0, SUB_CONFLATE);
+    outq_init(&queues[0]);
+    outq_init(&queues[1]);
+
+    for (int i = 0; i < 3; i++) {
+        struct mqtt_message *msg =
+            mqtt_message_publish(topic, "v", 1, PUBLISH_BYTE, 0);
+        fanout_publish(&one, &own, topic, msg, NULL);
+        mqtt_message_release(msg);
+    }
+    while (worker_drain(&workers[0], deliver_queued, NULL))
+        ;
+    mu_assert_int_eq(3, queues[0].ring.count);
+    // Only the latest value waits for the conflating subscriber
+    mu_assert_int_eq(1, queues[1].ring.count);
+
+    outq_destroy(&queues[0]);
+    outq_destroy(&queues[1]);
+    subs_destroy(&own);
+    fanout_destroy(&one);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_split_by_owner);
+    MU_RUN_TEST(test_order_per_subscriber);
+    MU_RUN_TEST(test_unowned_dropped);
+    MU_RUN_TEST(test_prefilter_skips_unsubscribed);
+    MU_RUN_TEST(test_workers_drain_in_parallel);
+    MU_RUN_TEST(test_conflating_subscriber_keeps_last);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
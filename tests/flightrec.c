@@ -0,0 +1,99 @@
+#include "minunit.h"
+#include "../src/flightrec.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+void test_setup(void) {}
+
+void test_teardown(void) {}
+
+MU_TEST(test_event_compact) { mu_assert_int_eq(16, sizeof(struct fr_event)); }
+
+MU_TEST(test_unattached_thread_ignored) {
+    // Must not crash before flightrec_attach
+    flightrec_event(FR_TIMER, 1, 0, 0);
+    mu_check(flightrec_local == NULL);
+}
+
+MU_TEST(test_ring_wraps) {
+    mu_assert_int_eq(0, flightrec_attach(7));
+    for (uint32_t i = 0; i < FLIGHTREC_EVENTS + 10; i++) {
+        flightrec_event(FR_PUBLISH_ROUTED, i, 0, 3);
+    }
+    struct flightrec *fr = flightrec_local;
+    mu_assert_int_eq(FLIGHTREC_EVENTS + 10, fr->head);
+    // The oldest slots were overwritten by the newest events
+    mu_assert_int_eq(FLIGHTREC_EVENTS, fr->events[0].id);
+    mu_assert_int_eq(FLIGHTREC_EVENTS + 9, fr->events[9].id);
+    mu_assert_int_eq(10, fr->events[10].id);
+}
+
+MU_TEST(test_aux_saturates) {
+    // A fan-out to 500k subscribers must not wrap to a small count
+    flightrec_event(FR_PUBLISH_ROUTED, 1, 0, 500000);
+    struct flightrec *fr = flightrec_local;
+    mu_assert_int_eq(UINT16_MAX,
+                     fr->events[(fr->head - 1) & (FLIGHTREC_EVENTS - 1)].aux);
+}
+
+static void *other_thread(void *arg) {
+    flightrec_attach(8);
+    flightrec_event(FR_DISCONNECT, 42, FR_REASON_MEMORY, 0);
+    return NULL;
+}
+
+MU_TEST(test_dump_decodes_all_threads) {
+    pthread_t t;
+    pthread_create(&t, NULL, other_thread, NULL);
+    pthread_join(t, NULL);
+    flightrec_event(FR_TIMER, 0, FR_TIMER_EXPIRY, 3);
+    flightrec_event(FR_ACCEPT, 99, 0, 0);
+    flightrec_event(FR_CONNECT, 99, 0, 0);
+
+    FILE *dump = tmpfile();
+    mu_assert_int_eq(0, flightrec_dump_fd(fileno(dump)));
+    rewind(dump);
+
+    FILE *out = tmpfile();
+    mu_assert_int_eq(0, flightrec_decode(dump, out));
+    long text_len = ftell(out);
+    char *text = calloc(1, text_len + 1);
+    rewind(out);
+    mu_check(fread(text, 1, text_len, out) == (size_t)text_len);
+    fclose(out);
+    fclose(dump);
+
+    mu_check(strstr(text, "thread 8   disconnect       id 42") != NULL);
+    mu_check(strstr(text, "reason memory_limit") != NULL);
+    mu_check(strstr(text, "id 0      expiry aux 3") != NULL);
+    // Newest event last, at offset zero
+    mu_check(strstr(text, "accept") != NULL);
+    const char *last = strstr(text, " connect ");
+    mu_check(last != NULL && strchr(last, '\n')[1] == '\0');
+    free(text);
+}
+
+MU_TEST(test_decode_rejects_garbage) {
+    FILE *f = tmpfile();
+    fputs("not a dump", f);
+    rewind(f);
+    mu_assert_int_eq(-1, flightrec_decode(f, stdout));
+    fclose(f);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_event_compact);
+    MU_RUN_TEST(test_unattached_thread_ignored);
+    MU_RUN_TEST(test_ring_wraps);
+    MU_RUN_TEST(test_aux_saturates);
+    MU_RUN_TEST(test_dump_decodes_all_threads);
+    MU_RUN_TEST(test_decode_rejects_garbage);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,82 @@
+#include "minunit.h"
+#include "../src/histogram.h"
+#include <stdlib.h>
+
+static struct histogram hist;
+
+void test_setup(void) { hist_reset(&hist); }
+
+void test_teardown(void) {}
+
+MU_TEST(test_small_values_exact) {
+    for (uint64_t v = 0; v < HIST_SUB_BUCKETS; v++) {
+        mu_assert_int_eq(v, hist_bucket_value(hist_bucket(v)));
+    }
+}
+
+MU_TEST(test_bucket_error_bounded) {
+    uint64_t values[] = {17, 100, 1000, 123456, 987654321, 1ULL << 40,
+                         UINT64_MAX};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        uint64_t v = values[i];
+        uint64_t b = hist_bucket_value(hist_bucket(v));
+        uint64_t diff = b > v ? b - v : v - b;
+        mu_check(diff <= v / HIST_SUB_BUCKETS);
+        mu_check(hist_bucket(v) < HIST_BUCKETS);
+    }
+}
+
+MU_TEST(test_buckets_monotonic) {
+    unsigned last = 0;
+    for (uint64_t v = 1; v < (1ULL << 62); v = v * 3 / 2 + 1) {
+        unsigned b = hist_bucket(v);
+        mu_check(b >= last);
+        last = b;
+    }
+}
+
+MU_TEST(test_percentiles) {
+    // 1..1000 microseconds, uniformly
+    for (uint64_t us = 1; us <= 1000; us++) {
+        hist_record(&hist, us * 1000);
+    }
+    mu_assert_int_eq(1000, hist_count(&hist));
+
+    uint64_t p50 = hist_percentile(&hist, 50.0);
+    uint64_t p99 = hist_percentile(&hist, 99.0);
+    uint64_t p999 = hist_percentile(&hist, 99.9);
+    mu_check(p50 > 470000 && p50 < 530000);
+    mu_check(p99 > 930000 && p99 < 1050000);
+    mu_check(p999 >= p99);
+}
+
+MU_TEST(test_merge) {
+    struct histogram other;
+    hist_reset(&other);
+    hist_record(&hist, 10);
+    hist_record(&other, 10);
+    hist_record(&other, 5000);
+
+    hist_merge(&hist, &other);
+    mu_assert_int_eq(3, hist_count(&hist));
+    mu_assert_int_eq(10, hist_percentile(&hist, 50.0));
+    mu_check(hist_percentile(&hist, 100.0) > 4000);
+}
+
+MU_TEST(test_empty) { mu_assert_int_eq(0, hist_percentile(&hist, 99.0)); }
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_small_values_exact);
+    MU_RUN_TEST(test_bucket_error_bounded);
+    MU_RUN_TEST(test_buckets_monotonic);
+    MU_RUN_TEST(test_percentiles);
+    MU_RUN_TEST(test_merge);
+    MU_RUN_TEST(test_empty);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,119 @@
+#include "minunit.h"
+#include "../src/mpsc_queue.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PRODUCERS 4
+#define PER_PRODUCER 10000
+
+static struct mpsc_queue queue;
+
+void test_setup(void) { mpsc_queue_init(&queue, 8); }
+
+void test_teardown(void) { mpsc_queue_destroy(&queue); }
+
+static int wakeups_pending(void) {
+    uint64_t value = 0;
+    if (read(queue.wake_fd, &value, sizeof(value)) == -1)
+        return 0;
+    return (int)value;
+}
+
+MU_TEST(test_push_pop_order) {
+    for (int i = 0; i < 5; i++) {
+        mu_check(mpsc_queue_push(&queue, mqtt_message_new(NULL, 0), i) == 0);
+    }
+    struct delivery out[8];
+    size_t n = mpsc_queue_pop_batch(&queue, out, 8);
+    mu_assert_int_eq(5, n);
+    for (int i = 0; i < 5; i++) {
+        mu_assert_int_eq(i, out[i].fd);
+        mqtt_message_release(out[i].msg);
+    }
+    mu_check(!mpsc_queue_pending(&queue));
+}
+
+MU_TEST(test_full_queue) {
+    for (int i = 0; i < 8; i++) {
+        mu_check(mpsc_queue_push(&queue, NULL, i) == 0);
+    }
+    mu_check(mpsc_queue_push(&queue, NULL, 8) == -1);
+    struct delivery out[8];
+    mu_assert_int_eq(8, mpsc_queue_pop_batch(&queue, out, 8));
+    mu_check(mpsc_queue_push(&queue, NULL, 9) == 0);
+    mu_assert_int_eq(1, mpsc_queue_pop_batch(&queue, out, 8));
+}
+
+MU_TEST(test_wakeup_only_when_empty) {
+    mpsc_queue_push(&queue, NULL, 1);
+    mpsc_queue_push(&queue, NULL, 2);
+    mpsc_queue_push(&queue, NULL, 3);
+    mu_assert_int_eq(1, wakeups_pending());
+
+    struct delivery out[8];
+    mpsc_queue_pop_batch(&queue, out, 8);
+    mpsc_queue_push(&queue, NULL, 4);
+    mu_assert_int_eq(1, wakeups_pending());
+    mpsc_queue_pop_batch(&queue, out, 8);
+}
+
+static struct mpsc_queue big_queue;
+
+static void *producer(void *arg) {
+    int base = (int)(intptr_t)arg;
+    for (int i = 0; i < PER_PRODUCER; i++) {
+        while (mpsc_queue_push(&big_queue, NULL, base + i) == -1)
+            ;
+    }
+    return NULL;
+}
+
+MU_TEST(test_concurrent_producers) {
+    pthread_t threads[PRODUCERS];
+    int last[PRODUCERS];
+    int received = 0;
+    int in_order = 1;
+
+    mpsc_queue_init(&big_queue, 256);
+    for (int p = 0; p < PRODUCERS; p++) {
+        last[p] = -1;
+        pthread_create(&threads[p], NULL, producer,
+                       (void *)(intptr_t)(p * PER_PRODUCER));
+    }
+
+    struct delivery out[32];
+    while (received < PRODUCERS * PER_PRODUCER) {
+        size_t n = mpsc_queue_pop_batch(&big_queue, out, 32);
+        for (size_t i = 0; i < n; i++) {
+            int p = out[i].fd / PER_PRODUCER;
+            // Each producer's items must come out in the order it pushed them
+            if (out[i].fd <= last[p])
+                in_order = 0;
+            last[p] = out[i].fd;
+        }
+        received += n;
+    }
+
+    for (int p = 0; p < PRODUCERS; p++) {
+        pthread_join(threads[p], NULL);
+    }
+    mu_check(in_order);
+    mu_check(!mpsc_queue_pending(&big_queue));
+    mpsc_queue_destroy(&big_queue);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_push_pop_order);
+    MU_RUN_TEST(test_full_queue);
+    MU_RUN_TEST(test_wakeup_only_when_empty);
+    MU_RUN_TEST(test_concurrent_producers);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -2,6 +2,8 @@
 #include "minunit.h"
 #include "src/mqtt.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 size_t len = 18;
 
@@ -25,11 +27,126 @@ MU_TEST(test_same) {
 
 
 
+MU_TEST(test_frame_header_incomplete) {
+    unsigned char buf[] = {PUBLISH_BYTE, 0x80 | 0x10};
+    size_t header_len, remaining;
+    mu_check(mqtt_frame_header(buf, 1, &header_len, &remaining) ==
+             MQTT_FRAME_INCOMPLETE);
+    mu_check(mqtt_frame_header(buf, 2, &header_len, &remaining) ==
+             MQTT_FRAME_INCOMPLETE);
+}
+
+MU_TEST(test_frame_header_too_large) {
+    unsigned char buf[MQTT_MAX_FIXED_HEADER] = {PUBLISH_BYTE};
+    int n = mqtt_encode_length(buf + 1, 100000);
+    size_t header_len, remaining;
+
+    mqtt_set_max_packet_size(64 * 1024);
+    // Rejected from the fixed header alone, none of the body is needed
+    mu_check(mqtt_frame_header(buf, 1 + n, &header_len, &remaining) ==
+             MQTT_FRAME_TOO_LARGE);
+    mqtt_set_max_packet_size(0);
+    mu_check(mqtt_frame_header(buf, 1 + n, &header_len, &remaining) ==
+             MQTT_FRAME_OK);
+    mu_check(remaining == 100000);
+    mu_check(header_len == (size_t)(1 + n));
+}
+
+MU_TEST(test_frame_header_malformed) {
+    unsigned char buf[] = {PUBLISH_BYTE, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    size_t header_len, remaining;
+    mu_check(mqtt_frame_header(buf, sizeof(buf), &header_len, &remaining) ==
+             MQTT_FRAME_MALFORMED);
+}
+
+MU_TEST(test_unpack_publish_over_64k) {
+    size_t payloadlen = 100000;
+    size_t remaining = 2 + 1 + payloadlen;
+    unsigned char *buf = malloc(MQTT_MAX_FIXED_HEADER + remaining);
+    unsigned char *ptr = buf;
+    *ptr++ = PUBLISH_BYTE;
+    ptr += mqtt_encode_length(ptr, remaining);
+    mqtt_pack_string(&ptr, "t", 1);
+    memset(ptr, 'x', payloadlen);
+
+    union mqtt_header hdr = {.byte = PUBLISH_BYTE};
+    union mqtt_packet pkt;
+    unpack_mqtt_publish(buf + 1, &hdr, &pkt);
+    mu_check(pkt.publish.payloadlen == payloadlen);
+    mu_check(pkt.publish.payload[payloadlen - 1] == 'x');
+    mu_assert_string_eq("t", (char *)pkt.publish.topic);
+    topic_release(pkt.publish.interned);
+    free(pkt.publish.payload);
+    free(buf);
+}
+
+MU_TEST(test_unpack_publish_forged_topic_length) {
+    // Remaining length 4, but the topic claims 60000 bytes
+    unsigned char *buf = malloc(6);
+    memcpy(buf, (unsigned char[]){PUBLISH_BYTE, 4, 0xea, 0x60, 'a', 'b'}, 6);
+
+    union mqtt_header hdr = {.byte = PUBLISH_BYTE};
+    union mqtt_packet pkt;
+    mu_assert_int_eq(0, unpack_mqtt_publish(buf + 1, &hdr, &pkt));
+    mu_check(pkt.publish.interned == NULL);
+    free(buf);
+}
+
+MU_TEST(test_pack_connect_roundtrip) {
+    struct mqtt_connect c = {0};
+    c.bits.clean_session = 1;
+    c.bits.username = 1;
+    c.payload.keepalive = 60;
+    c.payload.client_id = (unsigned char *)"bench-1";
+    c.payload.username = (unsigned char *)"user";
+
+    unsigned char buf[64];
+    size_t len = pack_mqtt_connect(buf, &c);
+    mu_assert_int_eq(mqtt_connect_size(&c), len);
+
+    union mqtt_packet pkt;
+    mu_check(unpack_mqtt_packet(buf, &pkt) == 0);
+    mu_assert_int_eq(60, pkt.connect.payload.keepalive);
+    mu_assert_string_eq("bench-1", (char *)pkt.connect.payload.client_id);
+    mu_assert_string_eq("user", (char *)pkt.connect.payload.username);
+    free(pkt.connect.payload.client_id);
+    free(pkt.connect.payload.username);
+}
+
+MU_TEST(test_unpack_subscribe_tuples) {
+    struct mqtt_subscribe s = {.pkt_id = 7, .tuples_len = 2};
+    __typeof__(*s.tuples) tuples[2] = {
+        {3, (unsigned char *)"a/b", 1}, {5, (unsigned char *)"c/+/#", 2}};
+    s.tuples = tuples;
+    unsigned char buf[64];
+    pack_mqtt_subscribe(buf, &s);
+
+    union mqtt_packet pkt;
+    mu_check(unpack_mqtt_packet(buf, &pkt) == 0);
+    mu_assert_int_eq(7, pkt.subscribe.pkt_id);
+    mu_assert_int_eq(2, pkt.subscribe.tuples_len);
+    mu_assert_int_eq(5, pkt.subscribe.tuples[1].topic_len);
+    mu_check(memcmp(pkt.subscribe.tuples[1].topic, "c/+/#", 5) == 0);
+    mu_assert_int_eq(2, pkt.subscribe.tuples[1].qos);
+    free(pkt.subscribe.tuples);
+
+    // A filter running past the remaining length
+    buf[1] -= 1;
+    mu_check(unpack_mqtt_packet(buf, &pkt) == -1);
+}
+
 MU_TEST_SUITE(test_suite) {
 	MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
 	MU_RUN_TEST(test_check);
 	MU_RUN_TEST(test_same);
+	MU_RUN_TEST(test_frame_header_incomplete);
+	MU_RUN_TEST(test_frame_header_too_large);
+	MU_RUN_TEST(test_frame_header_malformed);
+	MU_RUN_TEST(test_unpack_publish_over_64k);
+	MU_RUN_TEST(test_unpack_publish_forged_topic_length);
+	MU_RUN_TEST(test_pack_connect_roundtrip);
+	MU_RUN_TEST(test_unpack_subscribe_tuples);
 
 }
 
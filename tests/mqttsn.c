@@ -0,0 +1,326 @@
+#include "minunit.h"
+#include "../src/mqttsn.h"
+#include "../src/stats.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static struct sn_gateway gw;
+static int sensor;
+static struct mqtt_message *routed[8];
+static int nrouted;
+
+static int interested; // filters with SN subscribers
+static int loop_back;  // route back into the gateway, as pollserver does
+
+static void route(struct mqtt_message *msg, void *arg) {
+    routed[nrouted++] = mqtt_message_ref(msg);
+    if (loop_back) {
+        mqttsn_deliver(&gw, msg);
+    }
+}
+
+static void count_interest(struct topic *filter, int delta, void *arg) {
+    interested += delta;
+}
+
+void test_setup(void) {
+    int fd = mqttsn_listen("0");
+    mqttsn_init(&gw, fd, route, NULL);
+    mqttsn_predefine(&gw, 7, "meters/power");
+    gw.interest = count_interest;
+    interested = 0;
+    loop_back = 0;
+
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *)&addr, &len);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sensor = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(sensor, (struct sockaddr *)&addr, sizeof(addr));
+    nrouted = 0;
+}
+
+void test_teardown(void) {
+    for (int i = 0; i < nrouted; i++) {
+        mqtt_message_release(routed[i]);
+    }
+    close(sensor);
+    mqttsn_destroy(&gw);
+}
+
+static void sn_send(enum sn_type type, const void *body, size_t len) {
+    unsigned char buf[256];
+    buf[0] = len + 2;
+    buf[1] = type;
+    if (len > 0) {
+        memcpy(buf + 2, body, len);
+    }
+    send(sensor, buf, len + 2, 0);
+}
+
+// Next datagram from the gateway, its type in buf[1]
+static int sn_recv(unsigned char *buf, size_t len) {
+    struct pollfd pfd = {.fd = sensor, .events = POLLIN};
+    if (poll(&pfd, 1, 1000) != 1) {
+        return -1;
+    }
+    return recv(sensor, buf, len, 0);
+}
+
+// Handle what was sent so far, however the kernel split it into batches
+static int gateway_poll(int expected) {
+    int handled = 0;
+    for (int round = 0; round < 100 && handled < expected; round++) {
+        handled += mqttsn_poll(&gw);
+        if (handled < expected) {
+            nanosleep(&(struct timespec){0, 1000000}, NULL);
+        }
+    }
+    return handled;
+}
+
+static void connect_sensor(void) {
+    const unsigned char body[] = {0x04, 0x01, 0x00, 0x3c, 's', '1'};
+    sn_send(SN_CONNECT, body, sizeof(body));
+    gateway_poll(1);
+    unsigned char buf[16];
+    sn_recv(buf, sizeof(buf));
+}
+
+MU_TEST(test_register_and_publish) {
+    connect_sensor();
+    mu_assert_int_eq(1, gw.nclients);
+
+    const unsigned char reg[] = {0, 0, 0, 1, 's', '/', 't'};
+    sn_send(SN_REGISTER, reg, sizeof(reg));
+    gateway_poll(1);
+    unsigned char buf[64];
+    mu_assert_int_eq(7, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_REGACK, buf[1]);
+    mu_assert_int_eq(1, buf[3]); // topic id
+    mu_assert_int_eq(SN_ACCEPTED, buf[6]);
+
+    const unsigned char pub[] = {SN_FLAG_QOS1, 0, 1, 0, 9, '2', '1'};
+    sn_send(SN_PUBLISH, pub, sizeof(pub));
+    gateway_poll(1);
+    mu_assert_int_eq(1, nrouted);
+    mu_assert_string_eq("s/t", routed[0]->topic->name);
+    mu_assert_int_eq(PUBLISH_BYTE, routed[0]->data[0]);
+    mu_check(memcmp(routed[0]->data + routed[0]->len - 2, "21", 2) == 0);
+    mu_assert_int_eq(7, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_PUBACK, buf[1]);
+    mu_assert_int_eq(9, buf[5]); // message id
+    mu_assert_int_eq(SN_ACCEPTED, buf[6]);
+
+    // An id the client never registered
+    const unsigned char bad[] = {SN_FLAG_QOS1, 0, 2, 0, 10, 'x'};
+    sn_send(SN_PUBLISH, bad, sizeof(bad));
+    gateway_poll(1);
+    mu_assert_int_eq(1, nrouted);
+    sn_recv(buf, sizeof(buf));
+    mu_assert_int_eq(SN_REJECTED_TOPIC_ID, buf[6]);
+}
+
+MU_TEST(test_qos_minus_one_needs_no_connection) {
+    const unsigned char predefined[] = {SN_FLAG_QOS_MINUS1 | SN_TOPIC_PREDEFINED,
+                                        0, 7, 0, 0, '5'};
+    const unsigned char short_name[] = {SN_FLAG_QOS_MINUS1 | SN_TOPIC_SHORT,
+                                        'a', 'b', 0, 0, '6'};
+    const unsigned char by_id[] = {SN_FLAG_QOS_MINUS1, 0, 1, 0, 0, '7'};
+    const unsigned char qos0[] = {SN_TOPIC_PREDEFINED, 0, 7, 0, 0, '8'};
+    sn_send(SN_PUBLISH, predefined, sizeof(predefined));
+    sn_send(SN_PUBLISH, short_name, sizeof(short_name));
+    sn_send(SN_PUBLISH, by_id, sizeof(by_id));
+    sn_send(SN_PUBLISH, qos0, sizeof(qos0));
+    gateway_poll(4);
+    mu_assert_int_eq(2, nrouted);
+    mu_assert_string_eq("meters/power", routed[0]->topic->name);
+    mu_assert_string_eq("ab", routed[1]->topic->name);
+    mu_assert_int_eq(2, gw.dropped);
+    mu_assert_int_eq(0, gw.nclients);
+}
+
+MU_TEST(test_wildcard_delivery_registers_first) {
+    connect_sensor();
+    const unsigned char sub[] = {0, 0, 3, 's', '/', '#'};
+    sn_send(SN_SUBSCRIBE, sub, sizeof(sub));
+    gateway_poll(1);
+    unsigned char buf[64];
+    mu_assert_int_eq(8, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_SUBACK, buf[1]);
+    mu_assert_int_eq(0, buf[4]); // no id for a wildcard
+    mu_assert_int_eq(SN_ACCEPTED, buf[7]);
+    mu_assert_int_eq(1, interested);
+
+    struct topic *t = topic_intern("s/hum", 5);
+    struct mqtt_message *msg = mqtt_message_publish(t, "40", 2, PUBLISH_BYTE, 0);
+    for (int i = 0; i < 2; i++) {
+        mqttsn_deliver(&gw, msg);
+    }
+    mqttsn_flush(&gw);
+    mu_assert_int_eq(11, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_REGISTER, buf[1]);
+    mu_assert_int_eq(1, buf[3]);
+    mu_check(memcmp(buf + 6, "s/hum", 5) == 0);
+    for (int i = 0; i < 2; i++) {
+        mu_assert_int_eq(9, sn_recv(buf, sizeof(buf)));
+        mu_assert_int_eq(SN_PUBLISH, buf[1]);
+        mu_assert_int_eq(SN_TOPIC_NORMAL, buf[2]);
+        mu_assert_int_eq(1, buf[4]);
+        mu_check(memcmp(buf + 7, "40", 2) == 0);
+    }
+    mqtt_message_release(msg);
+    topic_release(t);
+
+    // Unsubscribed, nothing more is delivered
+    sn_send(SN_UNSUBSCRIBE, sub, sizeof(sub));
+    gateway_poll(1);
+    mu_assert_int_eq(4, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_UNSUBACK, buf[1]);
+    mu_assert_int_eq(0, gw.subs.nsubs);
+    mu_assert_int_eq(0, interested);
+}
+
+MU_TEST(test_named_subscription_gets_id) {
+    connect_sensor();
+    const unsigned char sub[] = {0, 0, 4, 'c', 'm', 'd'};
+    sn_send(SN_SUBSCRIBE, sub, sizeof(sub));
+    gateway_poll(1);
+    unsigned char buf[64];
+    sn_recv(buf, sizeof(buf));
+    mu_assert_int_eq(1, buf[4]);
+
+    struct topic *t = topic_intern("cmd", 3);
+    struct mqtt_message *msg = mqtt_message_publish(t, "go", 2, PUBLISH_BYTE, 0);
+    mqttsn_deliver(&gw, msg);
+    mqttsn_flush(&gw);
+    mu_assert_int_eq(9, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_PUBLISH, buf[1]);
+    mu_assert_int_eq(1, buf[4]);
+    mqtt_message_release(msg);
+    topic_release(t);
+}
+
+MU_TEST(test_payload_ends_with_frame) {
+    connect_sensor();
+    const unsigned char sub[] = {0, 0, 4, 'c', 'm', 'd'};
+    sn_send(SN_SUBSCRIBE, sub, sizeof(sub));
+    gateway_poll(1);
+    unsigned char buf[64];
+    sn_recv(buf, sizeof(buf));
+
+    struct topic *t = topic_intern("cmd", 3);
+    struct mqtt_message *one = mqtt_message_publish(t, "go", 2, PUBLISH_BYTE, 0);
+    // A read cut short, then two packets in one read
+    struct mqtt_message *cut = mqtt_message_new(one->data, one->len - 1);
+    struct mqtt_message *two = mqtt_message_new(NULL, one->len * 2);
+    memcpy(two->data, one->data, one->len);
+    memcpy(two->data + one->len, one->data, one->len);
+    mqttsn_deliver(&gw, cut);
+    mqttsn_deliver(&gw, two);
+    mqttsn_flush(&gw);
+
+    mu_assert_int_eq(9, sn_recv(buf, sizeof(buf)));
+    mu_check(memcmp(buf + 7, "go", 2) == 0);
+    mu_assert_int_eq(-1, recv(sensor, buf, sizeof(buf), MSG_DONTWAIT));
+    mqtt_message_release(one);
+    mqtt_message_release(cut);
+    mqtt_message_release(two);
+    topic_release(t);
+}
+
+MU_TEST(test_sensor_to_sensor) {
+    // The subscriber is a second sensor on its own socket
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(gw.fd, (struct sockaddr *)&addr, &len);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int publisher = sensor;
+    sensor = socket(AF_INET, SOCK_DGRAM, 0);
+    connect(sensor, (struct sockaddr *)&addr, sizeof(addr));
+    connect_sensor();
+    const unsigned char sub[] = {0, 0, 4, 'c', 'm', 'd'};
+    sn_send(SN_SUBSCRIBE, sub, sizeof(sub));
+    gateway_poll(1);
+    unsigned char buf[64];
+    sn_recv(buf, sizeof(buf));
+    int subscriber = sensor;
+
+    sensor = publisher;
+    connect_sensor();
+    const unsigned char reg[] = {0, 0, 0, 1, 'c', 'm', 'd'};
+    sn_send(SN_REGISTER, reg, sizeof(reg));
+    gateway_poll(1);
+    sn_recv(buf, sizeof(buf));
+    loop_back = 1;
+    const unsigned char pub[] = {0, 0, buf[3], 0, 0, 'h', 'i'};
+    sn_send(SN_PUBLISH, pub, sizeof(pub));
+    gateway_poll(1);
+
+    sensor = subscriber;
+    mu_assert_int_eq(9, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(SN_PUBLISH, buf[1]);
+    mu_check(memcmp(buf + 7, "hi", 2) == 0);
+    close(subscriber);
+    sensor = publisher;
+}
+
+MU_TEST(test_batches) {
+    for (int i = 0; i < 3 * SN_BATCH; i++) {
+        sn_send(SN_PINGREQ, NULL, 0);
+    }
+    mu_assert_int_eq(3 * SN_BATCH, gateway_poll(3 * SN_BATCH));
+    unsigned char buf[16];
+    for (int i = 0; i < 3 * SN_BATCH; i++) {
+        mu_assert_int_eq(2, sn_recv(buf, sizeof(buf)));
+        mu_assert_int_eq(SN_PINGRESP, buf[1]);
+    }
+}
+
+MU_TEST(test_disconnect_and_expiry) {
+    connect_sensor();
+    unsigned char buf[16];
+    sn_send(SN_DISCONNECT, NULL, 0);
+    gateway_poll(1);
+    mu_assert_int_eq(2, sn_recv(buf, sizeof(buf)));
+    mu_assert_int_eq(0, gw.nclients);
+
+    connect_sensor();
+    mu_assert_int_eq(0, mqttsn_expire(&gw, stats_now_ns()));
+    // 60 s keep alive, gone after 90 s of silence
+    mu_assert_int_eq(1, mqttsn_expire(&gw, stats_now_ns() + 91000000000ULL));
+    mu_assert_int_eq(0, gw.nclients);
+}
+
+MU_TEST(test_malformed) {
+    unsigned char wrong_length[] = {9, SN_PINGREQ};
+    send(sensor, wrong_length, sizeof(wrong_length), 0);
+    unsigned char short_connect[] = {4, SN_CONNECT, 0, 1};
+    send(sensor, short_connect, sizeof(short_connect), 0);
+    gateway_poll(2);
+    mu_assert_int_eq(2, gw.dropped);
+    mu_assert_int_eq(0, gw.nclients);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_register_and_publish);
+    MU_RUN_TEST(test_qos_minus_one_needs_no_connection);
+    MU_RUN_TEST(test_wildcard_delivery_registers_first);
+    MU_RUN_TEST(test_named_subscription_gets_id);
+    MU_RUN_TEST(test_payload_ends_with_frame);
+    MU_RUN_TEST(test_sensor_to_sensor);
+    MU_RUN_TEST(test_batches);
+    MU_RUN_TEST(test_disconnect_and_expiry);
+    MU_RUN_TEST(test_malformed);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
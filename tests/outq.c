@@ -0,0 +1,346 @@
+#include "minunit.h"
+#include "../src/mqtt.h"
+#include "../src/outq.h"
+#include "../src/stats.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static struct outq queue;
+static struct mem_account account;
+static int fds[2];
+
+void test_setup(void) {
+    outq_init(&queue);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+}
+
+void test_teardown(void) {
+    struct mem_limits unlimited = {0, 0, MEM_DROP_OLDEST_QOS0};
+    memacct_configure(&unlimited);
+    outq_destroy(&queue);
+    memacct_release(&account);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static struct mqtt_message *text_message(const char *text) {
+    return mqtt_message_new((const unsigned char *)text, strlen(text));
+}
+
+MU_TEST(test_flush_coalesces_in_order) {
+    stats_init(1);
+    queue.stats = stats_worker(0);
+    outq_push(&queue, text_message("one,"));
+    outq_push(&queue, text_message("two,"));
+    outq_push(&queue, text_message("three"));
+    mu_assert_int_eq(13, queue.bytes);
+
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    mu_check(outq_empty(&queue));
+    mu_assert_int_eq(0, queue.bytes);
+
+    char buf[32] = {0};
+    mu_assert_int_eq(13, read(fds[1], buf, sizeof(buf) - 1));
+    mu_assert_string_eq("one,two,three", buf);
+
+    int64_t totals[STAT_COUNT];
+    stats_snapshot(totals);
+    mu_assert_int_eq(13, totals[STAT_BYTES_OUT]);
+}
+
+MU_TEST(test_shared_message_survives_flush) {
+    struct mqtt_message *msg = text_message("shared");
+    outq_push(&queue, mqtt_message_ref(msg));
+    outq_flush(&queue, fds[0]);
+    // The queue dropped its reference, ours is still valid
+    mu_assert_int_eq(1, msg->refcount);
+    mqtt_message_release(msg);
+}
+
+MU_TEST(test_full_socket_keeps_remainder) {
+    static unsigned char big[64 * 1024];
+    int pushed = 0;
+    for (int i = 0; i < 16; i++) {
+        outq_push(&queue, mqtt_message_new(big, sizeof(big)));
+        pushed += sizeof(big);
+    }
+
+    int total = 0;
+    int status;
+    while ((status = outq_flush(&queue, fds[0])) == 1) {
+        char sink[64 * 1024];
+        ssize_t n = read(fds[1], sink, sizeof(sink));
+        if (n > 0)
+            total += n;
+    }
+    mu_assert_int_eq(0, status);
+
+    char sink[64 * 1024];
+    ssize_t n;
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    while ((n = read(fds[1], sink, sizeof(sink))) > 0)
+        total += n;
+    mu_assert_int_eq(pushed, total);
+}
+
+/* A 10 byte packet whose first byte carries the given header */
+static struct mqtt_message *packet(unsigned char first_byte) {
+    unsigned char data[10] = {first_byte};
+    return mqtt_message_new(data, sizeof(data));
+}
+
+MU_TEST(test_limit_drops_oldest_qos0) {
+    struct mem_limits limits = {30, 0, MEM_DROP_OLDEST_QOS0};
+    memacct_configure(&limits);
+    queue.acct = &account;
+
+    outq_push(&queue, packet(PUBLISH_BYTE));
+    outq_push(&queue, packet(PUBLISH_BYTE | 0x02)); // QoS 1, never evicted
+    outq_push(&queue, packet(PUBLISH_BYTE));
+    mu_assert_int_eq(30, account.total);
+
+    struct mem_stats before, after;
+    memacct_snapshot(&before);
+    mu_assert_int_eq(0, outq_push(&queue, packet(PUBACK_BYTE)));
+    memacct_snapshot(&after);
+
+    mu_assert_int_eq(1, after.evicted - before.evicted);
+    mu_assert_int_eq(30, account.total);
+    mu_assert_int_eq(3, queue.ring.count);
+    // The oldest QoS 0 went, the QoS 1 is now at the front
+    mu_assert_int_eq(PUBLISH_BYTE | 0x02, queue.ring.entries[queue.ring.head].msg->data[0]);
+}
+
+MU_TEST(test_limit_rejects_and_disconnects) {
+    struct mem_limits limits = {20, 0, MEM_DISCONNECT};
+    memacct_configure(&limits);
+    queue.acct = &account;
+
+    outq_push(&queue, packet(PUBLISH_BYTE));
+    outq_push(&queue, packet(PUBLISH_BYTE));
+    struct mqtt_message *msg = packet(PUBLISH_BYTE);
+    mu_assert_int_eq(-1, outq_push(&queue, msg));
+    mqtt_message_release(msg);
+    mu_check(account.disconnect);
+
+    // Writing the queue returns the bytes to the budget
+    outq_flush(&queue, fds[0]);
+    mu_assert_int_eq(0, account.total);
+}
+
+static struct mqtt_message *reading(const char *topic, const char *value) {
+    struct topic *t = topic_intern(topic, strlen(topic));
+    struct mqtt_message *msg =
+        mqtt_message_publish(t, value, strlen(value), PUBLISH_BYTE, 0);
+    topic_release(t);
+    return msg;
+}
+
+MU_TEST(test_conflated_keeps_last_value_per_topic) {
+    mu_assert_int_eq(0, outq_push_conflated(&queue, reading("a", "1")));
+    mu_assert_int_eq(0, outq_push_conflated(&queue, reading("b", "1")));
+    mu_assert_int_eq(1, outq_push_conflated(&queue, reading("a", "2")));
+    mu_assert_int_eq(1, outq_push_conflated(&queue, reading("a", "3")));
+    mu_assert_int_eq(2, queue.ring.count);
+
+    // a keeps its place in the queue with the newest value
+    struct mqtt_message *front = queue.ring.entries[queue.ring.head].msg;
+    mu_check(front->data[front->len - 1] == '3');
+    mu_assert_int_eq(front->len * 2, queue.bytes);
+
+    // Once written, the next value is queued again
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    mu_assert_int_eq(0, outq_push_conflated(&queue, reading("a", "4")));
+    mu_assert_int_eq(1, queue.ring.count);
+}
+
+MU_TEST(test_conflated_never_replaces_partial_write) {
+    mu_assert_int_eq(0, outq_push_conflated(&queue, reading("a", "1")));
+    queue.ring.entries[queue.ring.head].offset = 1;
+    mu_assert_int_eq(0, outq_push_conflated(&queue, reading("a", "2")));
+    mu_assert_int_eq(2, queue.ring.count);
+}
+
+MU_TEST(test_conflated_many_topics) {
+    char name[16];
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 500; i++) {
+            snprintf(name, sizeof(name), "t/%d", i);
+            outq_push_conflated(&queue, reading(name, "v"));
+        }
+    }
+    mu_assert_int_eq(500, queue.ring.count);
+}
+
+static const unsigned char puback[] = {PUBACK_BYTE, 0x02, 0x00, 0x01};
+
+static struct mqtt_message *ack(void) {
+    return mqtt_message_new(puback, sizeof(puback));
+}
+
+MU_TEST(test_control_jumps_data) {
+    outq_push(&queue, text_message("one,"));
+    outq_push(&queue, text_message("two"));
+    mu_assert_int_eq(0, outq_push_control(&queue, ack()));
+    mu_assert_int_eq(11, queue.bytes);
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    mu_check(outq_empty(&queue));
+
+    unsigned char buf[16] = {0};
+    mu_assert_int_eq(11, read(fds[1], buf, sizeof(buf)));
+    mu_check(memcmp(buf, puback, sizeof(puback)) == 0);
+    mu_check(memcmp(buf + sizeof(puback), "one,two", 7) == 0);
+}
+
+MU_TEST(test_control_waits_for_packet_boundary) {
+    static unsigned char big[64 * 1024];
+    for (int i = 0; i < 8; i++) {
+        outq_push(&queue, mqtt_message_new(big, sizeof(big)));
+    }
+    // Fill the socket so the first packet is cut mid-way
+    mu_assert_int_eq(1, outq_flush(&queue, fds[0]));
+    outq_push_control(&queue, ack());
+
+    static unsigned char sink[16 * 64 * 1024];
+    size_t total = 0;
+    int status;
+    do {
+        status = outq_flush(&queue, fds[0]);
+        ssize_t n = read(fds[1], sink + total, sizeof(sink) - total);
+        if (n > 0)
+            total += n;
+    } while (status == 1 || total < 8 * sizeof(big) + sizeof(puback));
+    mu_assert_int_eq(8 * sizeof(big) + sizeof(puback), total);
+
+    // The ack sits between two whole packets, well before the last one
+    size_t at = 0;
+    while (at < total && sink[at] == 0)
+        at++;
+    mu_check(at > 0 && at < 7 * sizeof(big));
+    mu_assert_int_eq(0, at % sizeof(big));
+    mu_check(memcmp(sink + at, puback, sizeof(puback)) == 0);
+}
+
+MU_TEST(test_control_never_splits_stream) {
+    int owner;
+    outq_stream_begin(&queue, &owner);
+    outq_stream_push(&queue, &owner, text_message("hea"));
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    outq_push_control(&queue, ack());
+    // The rest of the packet hasn't arrived, the ack has to wait
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    mu_check(!outq_empty(&queue));
+
+    outq_stream_push(&queue, &owner, text_message("d,"));
+    outq_stream_end(&queue, &owner);
+    outq_push(&queue, text_message("tail"));
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+
+    unsigned char buf[32] = {0};
+    mu_assert_int_eq(13, read(fds[1], buf, sizeof(buf)));
+    mu_check(memcmp(buf, "head,", 5) == 0);
+    mu_check(memcmp(buf + 5, puback, sizeof(puback)) == 0);
+    mu_check(memcmp(buf + 9, "tail", 4) == 0);
+}
+
+MU_TEST(test_peek_and_advance) {
+    outq_push(&queue, text_message("one,"));
+    outq_push(&queue, text_message("two"));
+    outq_push_control(&queue, ack());
+
+    unsigned char buf[16] = {0};
+    mu_assert_int_eq(6, outq_peek(&queue, buf, 6));
+    mu_check(memcmp(buf, puback, sizeof(puback)) == 0);
+    mu_check(memcmp(buf + sizeof(puback), "on", 2) == 0);
+    outq_advance(&queue, 6);
+    mu_assert_int_eq(5, queue.bytes);
+
+    mu_assert_int_eq(5, outq_peek(&queue, buf, sizeof(buf)));
+    mu_check(memcmp(buf, "e,two", 5) == 0);
+    outq_advance(&queue, 5);
+    mu_check(outq_empty(&queue));
+    mu_assert_int_eq(0, outq_peek(&queue, buf, sizeof(buf)));
+}
+
+static void expire_queue(void *key, uint64_t now_ns, void *arg) {
+    outq_expire(key, now_ns);
+}
+
+MU_TEST(test_expired_messages_dropped_unsent) {
+    struct expiry_wheel wheel;
+    expiry_init(&wheel, 1000, 0, expire_queue, NULL);
+    queue.expiry = &wheel;
+    queue.expiry_key = &queue;
+
+    struct mqtt_message *msg = text_message("old,");
+    msg->expires_ns = 5000;
+    outq_push(&queue, msg);
+    outq_push(&queue, text_message("kept,"));
+    msg = text_message("later");
+    msg->expires_ns = 9000;
+    outq_push(&queue, msg);
+    // Only the earliest deadline is on the wheel
+    mu_assert_int_eq(1, wheel.count);
+
+    expiry_advance(&wheel, 6000);
+    mu_assert_int_eq(2, queue.ring.count);
+    mu_assert_int_eq(10, queue.bytes);
+    // and the queue went back on for the next one
+    mu_assert_int_eq(1, wheel.count);
+    expiry_advance(&wheel, 9000);
+    mu_assert_int_eq(1, queue.ring.count);
+    mu_assert_int_eq(0, wheel.count);
+
+    outq_flush(&queue, fds[0]);
+    char buf[16] = {0};
+    mu_assert_int_eq(5, read(fds[1], buf, sizeof(buf) - 1));
+    mu_assert_string_eq("kept,", buf);
+    expiry_destroy(&wheel);
+}
+
+MU_TEST(test_flush_skips_expired_before_wheel_fires) {
+    struct expiry_wheel wheel;
+    uint64_t now_ns = stats_now_ns();
+    expiry_init(&wheel, 1000000000ULL, now_ns, expire_queue, NULL);
+    queue.expiry = &wheel;
+    queue.expiry_key = &queue;
+
+    struct mqtt_message *msg = text_message("stale,");
+    msg->expires_ns = now_ns - 1;
+    outq_push(&queue, msg);
+    outq_push(&queue, text_message("fresh"));
+    // The wheel has not reached the deadline's tick yet
+    mu_assert_int_eq(0, outq_flush(&queue, fds[0]));
+    char buf[16] = {0};
+    mu_assert_int_eq(5, read(fds[1], buf, sizeof(buf) - 1));
+    mu_assert_string_eq("fresh", buf);
+    mu_assert_int_eq(0, queue.bytes);
+    expiry_destroy(&wheel);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_flush_coalesces_in_order);
+    MU_RUN_TEST(test_shared_message_survives_flush);
+    MU_RUN_TEST(test_full_socket_keeps_remainder);
+    MU_RUN_TEST(test_limit_drops_oldest_qos0);
+    MU_RUN_TEST(test_limit_rejects_and_disconnects);
+    MU_RUN_TEST(test_conflated_keeps_last_value_per_topic);
+    MU_RUN_TEST(test_conflated_never_replaces_partial_write);
+    MU_RUN_TEST(test_conflated_many_topics);
+    MU_RUN_TEST(test_control_jumps_data);
+    MU_RUN_TEST(test_control_waits_for_packet_boundary);
+    MU_RUN_TEST(test_control_never_splits_stream);
+    MU_RUN_TEST(test_peek_and_advance);
+    MU_RUN_TEST(test_expired_messages_dropped_unsent);
+    MU_RUN_TEST(test_flush_skips_expired_before_wheel_fires);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,189 @@
+#include "minunit.h"
+#include "../src/mqtt.h"
+#include "../src/shm.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RING 4096
+
+static char path[64];
+static int listener;
+static struct shm_conn *broker, *client;
+
+static void *accept_one(void *arg) {
+    int sock = accept(listener, NULL, NULL);
+    broker = shm_conn_new(sock, RING);
+    return NULL;
+}
+
+void test_setup(void) {
+    snprintf(path, sizeof(path), "/tmp/shm_test_%d.sock", (int)getpid());
+    listener = shm_listen(path);
+    pthread_t t;
+    pthread_create(&t, NULL, accept_one, NULL);
+    client = shm_connect(path);
+    pthread_join(t, NULL);
+}
+
+void test_teardown(void) {
+    if (broker != NULL) {
+        close(broker->sock);
+        shm_conn_free(broker);
+    }
+    if (client != NULL) {
+        close(client->sock);
+        shm_conn_free(client);
+    }
+    close(listener);
+    unlink(path);
+}
+
+// The doorbell rang on the side owning sock
+static int rang(int sock) {
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+MU_TEST(test_handshake) {
+    mu_check(broker != NULL);
+    mu_check(client != NULL);
+    mu_assert_int_eq(RING, client->in.size);
+    mu_check(!shm_readable(broker));
+    char buf[8];
+    mu_assert_int_eq(-1, shm_read(broker, buf, sizeof(buf)));
+    mu_assert_int_eq(EAGAIN, errno);
+}
+
+MU_TEST(test_frames_cross_the_wrap) {
+    static unsigned char sent[3000], got[3000];
+    for (int round = 0; round < 5; round++) {
+        memset(sent, 'a' + round, sizeof(sent));
+        mu_assert_int_eq(sizeof(sent), shm_write(client, sent, sizeof(sent)));
+        // One read, even when the bytes wrap around the end of the ring
+        mu_assert_int_eq(sizeof(got), shm_read(broker, got, sizeof(got)));
+        mu_check(memcmp(sent, got, sizeof(got)) == 0);
+    }
+    mu_assert_int_eq(15000, client->out.pos);
+}
+
+MU_TEST(test_doorbell_only_when_parked) {
+    shm_write(client, "x", 1);
+    mu_check(!rang(broker->sock));
+    char c;
+    mu_assert_int_eq(1, shm_read(broker, &c, 1));
+
+    mu_assert_int_eq(1, shm_park(broker));
+    shm_write(client, "y", 1);
+    mu_check(rang(broker->sock));
+    shm_doorbell(broker);
+    mu_check(!rang(broker->sock));
+    // Parking with input waiting doesn't sleep
+    mu_assert_int_eq(0, shm_park(broker));
+    mu_assert_int_eq(1, shm_read(broker, &c, 1));
+    mu_assert_int_eq('y', c);
+}
+
+MU_TEST(test_full_ring_wakes_writer) {
+    static unsigned char big[RING + 100];
+    memset(big, 7, sizeof(big));
+    mu_assert_int_eq(RING, shm_write(client, big, sizeof(big)));
+    mu_assert_int_eq(0, shm_write(client, big, 1));
+    mu_check(!rang(client->sock));
+    unsigned char buf[100];
+    mu_assert_int_eq(100, shm_read(broker, buf, sizeof(buf)));
+    mu_check(rang(client->sock));
+    mu_assert_int_eq(1, shm_wait(client, 0));
+    mu_assert_int_eq(100, shm_write(client, big, 100));
+}
+
+MU_TEST(test_queue_flushes_mqtt_frames) {
+    struct outq q;
+    outq_init(&q);
+    struct topic *t = topic_intern("sensors/1", 9);
+    for (int i = 0; i < 3; i++) {
+        outq_push(&q, mqtt_message_publish(t, "21.5", 4, PUBLISH_BYTE, 0));
+    }
+    topic_release(t);
+    mu_assert_int_eq(0, shm_flush(broker, &q));
+    mu_check(outq_empty(&q));
+
+    unsigned char buf[256];
+    ssize_t n = shm_read(client, buf, sizeof(buf));
+    mu_assert_int_eq(3 * 17, n);
+    const unsigned char *at = buf;
+    for (int i = 0; i < 3; i++) {
+        size_t header_len, remaining;
+        mu_check(mqtt_frame_header(at, buf + n - at, &header_len,
+                                   &remaining) == MQTT_FRAME_OK);
+        const unsigned char *name;
+        uint16_t len;
+        mu_assert_int_eq(0, mqtt_peek_publish_topic(
+                                at, header_len + remaining, &name, &len));
+        mu_check(len == 9 && memcmp(name, "sensors/1", 9) == 0);
+        at += header_len + remaining;
+    }
+    outq_destroy(&q);
+}
+
+MU_TEST(test_full_ring_keeps_queue) {
+    struct outq q;
+    outq_init(&q);
+    static unsigned char chunk[1000];
+    for (int i = 0; i < 6; i++) {
+        outq_push(&q, mqtt_message_new(chunk, sizeof(chunk)));
+    }
+    mu_assert_int_eq(1, shm_flush(broker, &q));
+    mu_assert_int_eq(6000 - RING, q.bytes);
+    static unsigned char got[6000];
+    mu_assert_int_eq(RING, shm_read(client, got, sizeof(got)));
+    mu_check(rang(broker->sock));
+    mu_assert_int_eq(0, shm_flush(broker, &q));
+    mu_check(outq_empty(&q));
+    outq_destroy(&q);
+}
+
+MU_TEST(test_hang_up) {
+    shm_write(client, "bye", 3);
+    close(client->sock);
+    shm_conn_free(client);
+    client = NULL;
+
+    mu_check(rang(broker->sock));
+    shm_doorbell(broker);
+    char buf[8];
+    mu_assert_int_eq(3, shm_read(broker, buf, sizeof(buf)));
+    mu_assert_int_eq(0, shm_read(broker, buf, sizeof(buf)));
+    mu_assert_int_eq(-1, shm_write(broker, "x", 1));
+}
+
+MU_TEST(test_rejects_impossible_positions) {
+    atomic_store(&client->out.hdr->tail, 1 << 20);
+    char buf[8];
+    mu_assert_int_eq(-1, shm_read(broker, buf, sizeof(buf)));
+    mu_assert_int_eq(EPROTO, errno);
+    atomic_store(&client->in.hdr->head, 12345);
+    mu_assert_int_eq(-1, shm_write(broker, "x", 1));
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_handshake);
+    MU_RUN_TEST(test_frames_cross_the_wrap);
+    MU_RUN_TEST(test_doorbell_only_when_parked);
+    MU_RUN_TEST(test_full_ring_wakes_writer);
+    MU_RUN_TEST(test_queue_flushes_mqtt_frames);
+    MU_RUN_TEST(test_full_ring_keeps_queue);
+    MU_RUN_TEST(test_hang_up);
+    MU_RUN_TEST(test_rejects_impossible_positions);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
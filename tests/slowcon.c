@@ -0,0 +1,104 @@
+#include "minunit.h"
+#include "../src/slowcon.h"
+#include <stdlib.h>
+
+#define MS 1000000ULL
+
+static struct slow_consumer sc;
+static struct slow_policy policy = {1000, 500 * MS, SLOW_CONFLATE};
+
+void test_setup(void) { slow_init(&sc, 1); }
+
+void test_teardown(void) {}
+
+MU_TEST(test_engage_after_grace) {
+    mu_assert_int_eq(SLOW_OK, slow_update(&sc, &policy, 2000, 0, 1, 1));
+    mu_assert_int_eq(SLOW_OK,
+                     slow_update(&sc, &policy, 2000, 0, 1, 1 + 499 * MS));
+    mu_assert_int_eq(SLOW_ENGAGE,
+                     slow_update(&sc, &policy, 2000, 0, 1, 1 + 500 * MS));
+    // Engaged once, not on every update
+    mu_assert_int_eq(SLOW_OK,
+                     slow_update(&sc, &policy, 2000, 0, 1, 1 + 600 * MS));
+    mu_check(sc.flagged);
+}
+
+MU_TEST(test_dip_restarts_grace) {
+    slow_update(&sc, &policy, 2000, 0, 1, 1);
+    slow_update(&sc, &policy, 900, 0, 1, 1 + 400 * MS);
+    mu_assert_int_eq(SLOW_OK,
+                     slow_update(&sc, &policy, 2000, 0, 1, 1 + 600 * MS));
+    mu_assert_int_eq(SLOW_ENGAGE,
+                     slow_update(&sc, &policy, 2000, 0, 1, 1 + 1100 * MS));
+}
+
+MU_TEST(test_release_below_low_watermark) {
+    slow_update(&sc, &policy, 2000, 0, 1, 1);
+    slow_update(&sc, &policy, 2000, 0, 1, 1 + 500 * MS);
+    // Under the high watermark but above half of it: still slow
+    mu_assert_int_eq(SLOW_OK,
+                     slow_update(&sc, &policy, 800, 0, 1, 1 + 600 * MS));
+    mu_assert_int_eq(SLOW_RELEASE,
+                     slow_update(&sc, &policy, 500, 0, 0, 1 + 700 * MS));
+    mu_check(!sc.flagged);
+}
+
+MU_TEST(test_drain_rate) {
+    slow_update(&sc, &policy, 0, 4000, 0, 1 + 500 * MS);
+    slow_update(&sc, &policy, 0, 4000, 0, 1 + 1000 * MS);
+    // 8000 bytes in the first second, averaged with no history
+    mu_assert_int_eq(4000, sc.drain_rate);
+    slow_update(&sc, &policy, 0, 8000, 0, 1 + 2000 * MS);
+    mu_assert_int_eq(6000, sc.drain_rate);
+}
+
+MU_TEST(test_backpressure_time) {
+    slow_update(&sc, &policy, 10, 0, 1, 1 + 100 * MS);
+    slow_update(&sc, &policy, 10, 0, 1, 1 + 200 * MS);
+    slow_update(&sc, &policy, 0, 10, 0, 1 + 350 * MS);
+    mu_assert_int_eq(250 * MS, sc.blocked_ns);
+    mu_assert_int_eq(0, sc.blocked_since_ns);
+}
+
+MU_TEST(test_disabled) {
+    struct slow_policy off = {0, 0, SLOW_DISCONNECT};
+    mu_assert_int_eq(SLOW_OK, slow_update(&sc, &off, 1 << 30, 0, 1, 1));
+    mu_assert_int_eq(SLOW_OK,
+                     slow_update(&sc, &off, 1 << 30, 0, 1, 1 + 5000 * MS));
+}
+
+MU_TEST(test_parse_action) {
+    enum slow_action action;
+    mu_assert_int_eq(0, slow_parse_action("drop", &action));
+    mu_assert_int_eq(SLOW_DROP_QOS0, action);
+    mu_assert_int_eq(0, slow_parse_action("disconnect", &action));
+    mu_assert_int_eq(SLOW_DISCONNECT, action);
+    mu_assert_int_eq(-1, slow_parse_action("ignore", &action));
+}
+
+MU_TEST(test_deadline_for_idle_loop) {
+    mu_check(slow_deadline_ns(&sc, &policy) == 0);
+    slow_update(&sc, &policy, 2000, 0, 1, 1);
+    // The poll timeout has to wake the loop when the grace period ends
+    mu_check(slow_deadline_ns(&sc, &policy) == 1 + 500 * MS);
+    slow_update(&sc, &policy, 2000, 0, 1, 1 + 500 * MS);
+    mu_check(slow_deadline_ns(&sc, &policy) == 0);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_engage_after_grace);
+    MU_RUN_TEST(test_dip_restarts_grace);
+    MU_RUN_TEST(test_release_below_low_watermark);
+    MU_RUN_TEST(test_drain_rate);
+    MU_RUN_TEST(test_backpressure_time);
+    MU_RUN_TEST(test_deadline_for_idle_loop);
+    MU_RUN_TEST(test_disabled);
+    MU_RUN_TEST(test_parse_action);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
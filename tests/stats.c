@@ -0,0 +1,93 @@
+#include "minunit.h"
+#include "../src/stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+static struct retain_store store;
+static int delivered;
+
+void test_setup(void) {
+    retain_init(&store);
+    delivered = 0;
+}
+
+void test_teardown(void) { retain_destroy(&store); }
+
+static void count_delivery(struct mqtt_message *msg, void *arg) {
+    delivered++;
+}
+
+MU_TEST(test_counters_padded_apart) {
+    mu_check(sizeof(struct worker_stats) % STATS_CACHE_LINE == 0);
+}
+
+MU_TEST(test_snapshot_sums_workers) {
+    stats_init(3);
+    stats_add(stats_worker(0), STAT_CLIENTS_CONNECTED, 2);
+    stats_add(stats_worker(1), STAT_CLIENTS_CONNECTED, 5);
+    // Connected on worker 0, disconnected after moving to worker 2
+    stats_add(stats_worker(2), STAT_CLIENTS_CONNECTED, -1);
+    stats_add(stats_worker(1), STAT_MSGS_IN, 40);
+
+    int64_t totals[STAT_COUNT];
+    stats_snapshot(totals);
+    mu_assert_int_eq(6, totals[STAT_CLIENTS_CONNECTED]);
+    mu_assert_int_eq(40, totals[STAT_MSGS_IN]);
+}
+
+MU_TEST(test_publish_sys_retains_values) {
+    stats_init(1);
+    stats_add(stats_worker(0), STAT_MSGS_OUT, 1234);
+    mu_assert_int_eq(0, stats_publish_sys(&store, count_delivery, NULL));
+    mu_check(delivered >= STAT_COUNT);
+
+    const char *name = "$SYS/broker/messages/sent";
+    struct topic *t = topic_intern(name, strlen(name));
+    struct mqtt_message *msg = retain_get(&store, t);
+    mu_check(msg != NULL);
+
+    union mqtt_packet pkt;
+    mu_check(unpack_mqtt_packet(msg->data, &pkt) == 0);
+    mu_check(pkt.publish.header.bits.retain == 1);
+    mu_assert_string_eq("1234", (char *)pkt.publish.payload);
+
+    topic_release(pkt.publish.interned);
+    free(pkt.publish.payload);
+    mqtt_message_release(msg);
+    topic_release(t);
+}
+
+MU_TEST(test_latency_merged_across_workers) {
+    stats_init(2);
+    stats_latency(stats_worker(0), LAT_WRITE, 1000, 2000);
+    stats_latency(stats_worker(1), LAT_WRITE, 1000, 3000);
+    // Unstamped messages are not recorded
+    stats_latency(stats_worker(1), LAT_WRITE, 0, 3000);
+
+    struct histogram merged;
+    stats_latency_snapshot(LAT_WRITE, &merged);
+    mu_assert_int_eq(2, hist_count(&merged));
+    mu_check(hist_percentile(&merged, 100.0) >= 1900);
+
+    mu_assert_int_eq(0, stats_publish_sys(&store, NULL, NULL));
+    const char *name = "$SYS/broker/latency/write/p99";
+    struct topic *t = topic_intern(name, strlen(name));
+    struct mqtt_message *msg = retain_get(&store, t);
+    mu_check(msg != NULL);
+    mqtt_message_release(msg);
+    topic_release(t);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_counters_padded_apart);
+    MU_RUN_TEST(test_snapshot_sums_workers);
+    MU_RUN_TEST(test_publish_sys_retains_values);
+    MU_RUN_TEST(test_latency_merged_across_workers);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
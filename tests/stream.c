@@ -0,0 +1,148 @@
+#include "minunit.h"
+#include "../src/stream.h"
+#include <string.h>
+
+static struct outq first;
+static struct outq second;
+static int cuts;
+static const union mqtt_header qos0 = {.byte = PUBLISH_BYTE};
+
+void test_setup(void) {
+    outq_init(&first);
+    outq_init(&second);
+    cuts = 0;
+}
+
+void test_teardown(void) {
+    outq_destroy(&first);
+    outq_destroy(&second);
+    memacct_configure(&(struct mem_limits){0, 0, MEM_DROP_OLDEST_QOS0});
+}
+
+static void count_cut(struct outq *q, void *arg) { cuts++; }
+
+/* Concatenate everything ready to be written on q */
+static size_t collect(struct outq *q, char *out) {
+    size_t len = 0;
+    for (size_t i = 0; i < q->ring.count; i++) {
+        struct outq_entry *e =
+            &q->ring.entries[(q->ring.head + i) & (q->ring.capacity - 1)];
+        memcpy(out + len, e->msg->data, e->msg->len);
+        len += e->msg->len;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+MU_TEST(test_chunks_are_cut_through) {
+    struct publish_stream s;
+    struct outq *targets[] = {&first};
+    publish_stream_begin(&s, qos0, 10, targets, 1, count_cut, NULL);
+
+    mu_assert_int_eq(4, publish_stream_feed(&s, (const unsigned char *)"abcd", 4));
+    // Forwarded before the rest of the packet has arrived
+    mu_assert_int_eq(1, first.ring.count);
+
+    // A message routed meanwhile must not land inside the stream
+    outq_push(&first, mqtt_message_new((const unsigned char *)"XY", 2));
+    mu_assert_int_eq(1, first.ring.count);
+
+    // Only the rest of the packet is consumed
+    mu_assert_int_eq(6, publish_stream_feed(&s, (const unsigned char *)"efghijNEXT", 10));
+    mu_check(publish_stream_done(&s));
+
+    char buf[64];
+    collect(&first, buf);
+    mu_assert_string_eq("abcdefghijXY", buf);
+    mu_assert_int_eq(12, first.bytes);
+}
+
+MU_TEST(test_busy_connection_gets_whole_copy) {
+    struct publish_stream a, b;
+    struct outq *targets[] = {&first, &second};
+    struct outq *only_second[] = {&second};
+
+    publish_stream_begin(&a, qos0, 4, only_second, 1, count_cut, NULL);
+    publish_stream_begin(&b, qos0, 6, targets, 2, count_cut, NULL);
+
+    publish_stream_feed(&a, (const unsigned char *)"12", 2);
+    publish_stream_feed(&b, (const unsigned char *)"abc", 3);
+    publish_stream_feed(&b, (const unsigned char *)"def", 3);
+    publish_stream_feed(&a, (const unsigned char *)"34", 2);
+
+    char buf[64];
+    collect(&first, buf);
+    mu_assert_string_eq("abcdef", buf);
+    collect(&second, buf);
+    mu_assert_string_eq("1234abcdef", buf);
+}
+
+MU_TEST(test_abort_cuts_partial_subscribers) {
+    struct publish_stream a, b;
+    struct outq *only_first[] = {&first};
+    struct outq *targets[] = {&first, &second};
+
+    publish_stream_begin(&a, qos0, 4, only_first, 1, count_cut, NULL);
+    publish_stream_begin(&b, qos0, 8, targets, 2, count_cut, NULL);
+    publish_stream_feed(&b, (const unsigned char *)"abc", 3);
+    publish_stream_abort(&b);
+
+    // second saw a partial packet, first was only buffering a copy
+    mu_assert_int_eq(1, cuts);
+    mu_check(first.stream_owner == &a);
+    mu_check(second.stream_owner == NULL);
+    publish_stream_abort(&a);
+    mu_assert_int_eq(2, cuts);
+}
+
+MU_TEST(test_qos1_is_not_streamed) {
+    struct publish_stream s;
+    struct outq *targets[] = {&first};
+    union mqtt_header qos1 = {.byte = PUBLISH_BYTE | 0x02};
+    mu_assert_int_eq(-1, publish_stream_begin(&s, qos1, 10, targets, 1,
+                                              count_cut, NULL));
+    mu_check(first.stream_owner == NULL);
+}
+
+MU_TEST(test_busy_copy_charged_to_session) {
+    struct publish_stream a, b;
+    static struct mem_account first_mem, second_mem;
+    struct outq *only_second[] = {&second};
+    struct outq *targets[] = {&first, &second};
+    first.acct = &first_mem;
+    second.acct = &second_mem;
+    memacct_configure(&(struct mem_limits){100, 0, MEM_REJECT});
+
+    publish_stream_begin(&a, qos0, 4, only_second, 1, count_cut, NULL);
+    publish_stream_begin(&b, qos0, 60, targets, 2, count_cut, NULL);
+    // Held for second until a is done, the bytes are already charged
+    mu_assert_int_eq(60, second_mem.total);
+
+    // Over the limit, the next busy copy is refused instead of allocated
+    struct publish_stream c;
+    struct outq *again[] = {&second};
+    publish_stream_begin(&c, qos0, 60, again, 1, count_cut, NULL);
+    mu_check(c.targets[0].q == NULL);
+    publish_stream_abort(&c);
+
+    publish_stream_abort(&b);
+    mu_assert_int_eq(0, second_mem.total);
+    publish_stream_abort(&a);
+    memacct_release(&first_mem);
+    memacct_release(&second_mem);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_chunks_are_cut_through);
+    MU_RUN_TEST(test_busy_connection_gets_whole_copy);
+    MU_RUN_TEST(test_abort_cuts_partial_subscribers);
+    MU_RUN_TEST(test_qos1_is_not_streamed);
+    MU_RUN_TEST(test_busy_copy_charged_to_session);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
@@ -0,0 +1,355 @@
+#include "minunit.h"
+#include "../src/retain.h"
+#include "../src/subs.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+static struct sub_index index;
+static int clients[4];
+static int hits[4];
+
+void test_setup(void) {
+    subs_init(&index);
+    memset(hits, 0, sizeof(hits));
+}
+
+void test_teardown(void) { subs_destroy(&index); }
+
+static struct topic *intern(const char *name) {
+    return topic_intern(name, strlen(name));
+}
+
+static void subscribe(const char *filter, int client, uint8_t qos) {
+    struct topic *f = intern(filter);
+    subs_add(&index, f, &clients[client], qos, 0);
+    topic_release(f);
+}
+
+static void count_hit(const struct subscriber *sub, const struct topic *filter,
+                      void *arg) {
+    hits[(int *)sub->client - clients]++;
+}
+
+static size_t publish(const char *name) {
+    struct topic *t = intern(name);
+    size_t n = subs_match(&index, t, count_hit, NULL);
+    topic_release(t);
+    return n;
+}
+
+MU_TEST(test_literal_and_wildcards) {
+    subscribe("home/kitchen/temp", 0, 0);
+    subscribe("home/+/temp", 1, 1);
+    subscribe("home/#", 2, 2);
+    subscribe("office/#", 3, 0);
+
+    mu_assert_int_eq(3, publish("home/kitchen/temp"));
+    mu_assert_int_eq(2, publish("home/garage/temp"));
+    mu_assert_int_eq(1, publish("home"));
+    mu_assert_int_eq(0, publish("garden/temp"));
+    mu_assert_int_eq(1, hits[0]);
+    mu_assert_int_eq(2, hits[1]);
+    mu_assert_int_eq(3, hits[2]);
+    mu_assert_int_eq(0, hits[3]);
+}
+
+MU_TEST(test_resubscribe_replaces) {
+    subscribe("a/b", 0, 0);
+    subscribe("a/b", 0, 2);
+    mu_assert_int_eq(1, index.nsubs);
+    mu_assert_int_eq(1, publish("a/b"));
+}
+
+MU_TEST(test_remove) {
+    struct topic *f = intern("a/+");
+    subs_add(&index, f, &clients[0], 0, 0);
+    subs_add(&index, f, &clients[1], 0, 0);
+    mu_assert_int_eq(0, subs_remove(&index, f, &clients[0]));
+    mu_assert_int_eq(-1, subs_remove(&index, f, &clients[0]));
+    mu_assert_int_eq(1, publish("a/x"));
+    mu_assert_int_eq(1, hits[1]);
+    subs_remove(&index, f, &clients[1]);
+    mu_assert_int_eq(0, index.nfilters);
+    topic_release(f);
+}
+
+MU_TEST(test_sys_topics_skip_root_wildcards) {
+    subscribe("#", 0, 0);
+    subscribe("+/broker/uptime", 1, 0);
+    subscribe("$SYS/#", 2, 0);
+    mu_assert_int_eq(1, publish("$SYS/broker/uptime"));
+    mu_assert_int_eq(1, hits[2]);
+}
+
+static int may_match(const char *name) {
+    struct topic *t = intern(name);
+    int possible = subs_may_match(&index, t);
+    topic_release(t);
+    return possible;
+}
+
+MU_TEST(test_prefilter_rejects_unsubscribed) {
+    mu_check(!may_match("a"));
+    subscribe("fleet/7/+/temp", 0, 0);
+    subscribe("home/#", 1, 0);
+    subscribe("plant/line/3", 2, 0);
+
+    mu_check(may_match("fleet/7/pump/temp"));
+    mu_check(may_match("home"));
+    mu_check(may_match("home/kitchen"));
+    mu_check(may_match("plant/line/3"));
+    mu_check(!may_match("fleet/8/pump/temp"));
+    mu_check(!may_match("garden/temp"));
+    mu_check(!may_match("plant"));
+
+    // A root wildcard lets everything through, except '$' topics
+    subscribe("+/status", 3, 0);
+    mu_check(may_match("garden/temp"));
+    mu_check(!may_match("$SYS/broker/uptime"));
+}
+
+MU_TEST(test_prefilter_follows_removals) {
+    struct topic *f = intern("dev/1/#");
+    subs_add(&index, f, &clients[0], 0, 0);
+    subs_add(&index, f, &clients[1], 0, 0);
+    subs_remove(&index, f, &clients[0]);
+    mu_check(may_match("dev/1/x"));
+    subs_remove(&index, f, &clients[1]);
+    mu_check(!may_match("dev/1/x"));
+    mu_assert_int_eq(0, index.prefilter.lengths[2]);
+    topic_release(f);
+}
+
+MU_TEST(test_prefilter_grows_without_false_negatives) {
+    static char name[64];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "site/%d/+/%d", i, i % 7);
+        subscribe(name, 0, 0);
+    }
+    mu_check(index.prefilter.bloom->mask + 1 >= 5000 * SUB_PREFILTER_RATIO);
+    int passed = 0;
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "site/%d/x/%d", i, i % 7);
+        mu_check(may_match(name));
+        snprintf(name, sizeof(name), "other/%d/x", i);
+        passed += may_match(name);
+    }
+    // About 3% get through to the trie walk, which then finds nothing
+    mu_check(passed < 5000 / 10);
+}
+
+static void count_none(const struct subscriber *sub,
+                       const struct topic *filter, void *arg) {}
+
+MU_TEST(test_batch_applies_in_order) {
+    subscribe("a/b", 0, 0);
+    struct topic *ab = intern("a/b");
+    struct topic *cd = intern("c/+");
+    unsigned char rcs[3] = {0xff, 0xff, 0xff};
+    struct sub_batch batch;
+    subs_batch_init(&batch);
+    // One SUBSCRIBE of three filters, another client leaving a/b after
+    subs_batch_add(&batch, ab, &clients[1], 1, 0, &rcs[0]);
+    subs_batch_add(&batch, cd, &clients[1], 2, 0, &rcs[1]);
+    subs_batch_add(&batch, ab, &clients[0], 2, 0, &rcs[2]);
+    subs_batch_remove(&batch, ab, &clients[0]);
+    subs_batch_remove(&batch, cd, &clients[2]);
+    mu_assert_int_eq(0, subs_apply(&index, &batch));
+    mu_assert_int_eq(0, batch.nops);
+    mu_assert_int_eq(1, rcs[0]);
+    mu_assert_int_eq(2, rcs[1]);
+    mu_assert_int_eq(2, rcs[2]);
+    mu_assert_int_eq(2, index.nsubs);
+    mu_assert_int_eq(2, index.nfilters);
+    mu_assert_int_eq(1, publish("a/b"));
+    mu_assert_int_eq(1, publish("c/d"));
+    mu_assert_int_eq(2, hits[1]);
+
+    // The last subscriber of a filter leaving takes it out of the prefilter
+    subs_batch_remove(&batch, ab, &clients[1]);
+    subs_batch_add(&batch, cd, &clients[3], 0, 0, NULL);
+    subs_apply(&index, &batch);
+    mu_assert_int_eq(1, index.nfilters);
+    mu_check(!may_match("a/b"));
+    mu_check(may_match("c/x"));
+    subs_batch_destroy(&batch);
+    topic_release(ab);
+    topic_release(cd);
+}
+
+MU_TEST(test_batch_reconnect_storm) {
+    enum { CLIENTS = 3000, FILTERS = 20 };
+    static unsigned char rcs[CLIENTS][FILTERS];
+    struct topic *filters[FILTERS];
+    char name[32];
+    for (int f = 0; f < FILTERS; f++) {
+        snprintf(name, sizeof(name), "fleet/%d/#", f);
+        filters[f] = intern(name);
+    }
+    struct sub_batch batch;
+    subs_batch_init(&batch);
+    // Every client resubscribes twice, as after a reconnect racing a retry
+    for (int round = 0; round < 2; round++) {
+        for (uintptr_t c = 1; c <= CLIENTS; c++)
+            for (int f = 0; f < FILTERS; f++)
+                subs_batch_add(&batch, filters[f], (void *)c, 1, 0,
+                               &rcs[c - 1][f]);
+        mu_assert_int_eq(0, subs_apply(&index, &batch));
+    }
+    mu_assert_int_eq(CLIENTS * FILTERS, index.nsubs);
+    mu_assert_int_eq(FILTERS, index.nfilters);
+    mu_assert_int_eq(1, rcs[CLIENTS - 1][FILTERS - 1]);
+
+    // Half of them go away again
+    for (uintptr_t c = 2; c <= CLIENTS; c += 2)
+        for (int f = 0; f < FILTERS; f++)
+            subs_batch_remove(&batch, filters[f], (void *)c);
+    subs_apply(&index, &batch);
+    mu_assert_int_eq(CLIENTS * FILTERS / 2, index.nsubs);
+    struct topic *t = intern("fleet/3/x");
+    mu_assert_int_eq(CLIENTS / 2, subs_match(&index, t, count_none, NULL));
+    topic_release(t);
+    for (uintptr_t c = 1; c <= CLIENTS; c += 2)
+        mu_assert_int_eq(0, subs_remove(&index, filters[0], (void *)c));
+
+    subs_batch_destroy(&batch);
+    for (int f = 0; f < FILTERS; f++)
+        topic_release(filters[f]);
+}
+
+#define READERS 3
+
+static atomic_int stop_readers;
+static atomic_int missed;
+
+static void count_stable(const struct subscriber *sub,
+                         const struct topic *filter, void *arg) {
+    if (sub->client == &clients[0])
+        (*(int *)arg)++;
+}
+
+// Match continuously, the subscription of clients[0] must always be seen
+static void *match_loop(void *arg) {
+    struct topic *t = intern("live/a/b");
+    while (!atomic_load(&stop_readers)) {
+        int stable = 0;
+        subs_match(&index, t, count_stable, &stable);
+        if (stable != 1 || !subs_may_match(&index, t))
+            atomic_fetch_add(&missed, 1);
+    }
+    topic_release(t);
+    return NULL;
+}
+
+MU_TEST(test_match_while_subscribing) {
+    enum { ROUNDS = 20, CLIENTS = 500 };
+    subscribe("live/a/b", 0, 0);
+    atomic_store(&stop_readers, 0);
+    atomic_store(&missed, 0);
+    pthread_t readers[READERS];
+    for (int r = 0; r < READERS; r++)
+        pthread_create(&readers[r], NULL, match_loop, NULL);
+
+    struct topic *shared = intern("live/+/b");
+    struct sub_batch batch;
+    subs_batch_init(&batch);
+    char name[32];
+    for (int round = 0; round < ROUNDS; round++) {
+        // New literal children next to the ones readers walk through
+        for (uintptr_t c = 1; c <= CLIENTS; c++) {
+            snprintf(name, sizeof(name), "live/%d/%d", round, (int)c);
+            struct topic *own = intern(name);
+            subs_batch_add(&batch, own, (void *)c, 0, 0, NULL);
+            subs_batch_add(&batch, shared, (void *)c, 0, 0, NULL);
+            topic_release(own);
+        }
+        subs_apply(&index, &batch);
+        subs_add(&index, shared, &clients[1], 1, 0);
+        for (uintptr_t c = 1; c <= CLIENTS; c++)
+            subs_batch_remove(&batch, shared, (void *)c);
+        subs_apply(&index, &batch);
+        subs_remove(&index, shared, &clients[1]);
+    }
+    atomic_store(&stop_readers, 1);
+    for (int r = 0; r < READERS; r++)
+        pthread_join(readers[r], NULL);
+
+    mu_assert_int_eq(0, atomic_load(&missed));
+    mu_assert_int_eq(1 + ROUNDS * CLIENTS, index.nsubs);
+    subs_batch_destroy(&batch);
+    topic_release(shared);
+}
+
+static void count_retained(struct topic *topic, struct mqtt_message *msg,
+                           void *arg) {
+    (*(int *)arg)++;
+}
+
+MU_TEST(test_retained_by_handle) {
+    struct retain_store store;
+    retain_init(&store);
+
+    for (int i = 0; i < 200; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "r/%d", i);
+        retain_set(&store, intern(name), mqtt_message_new(NULL, 0));
+    }
+    mu_assert_int_eq(200, store.count);
+
+    struct topic *t = intern("r/7");
+    struct mqtt_message *msg = retain_get(&store, t);
+    mu_check(msg != NULL);
+    mqtt_message_release(msg);
+
+    // A NULL message clears the topic
+    retain_set(&store, topic_ref(t), NULL);
+    mu_check(retain_get(&store, t) == NULL);
+    mu_assert_int_eq(199, store.count);
+
+    struct topic *f = intern("r/+");
+    int matched = 0;
+    retain_match(&store, f, count_retained, &matched);
+    mu_assert_int_eq(199, matched);
+
+    topic_release(f);
+    topic_release(t);
+    retain_destroy(&store);
+}
+
+MU_TEST(test_conflate_option_prefix) {
+    size_t len = strlen("$conflate/fleet/+/pos");
+    uint8_t flags;
+    const char *filter =
+        subs_filter_options("$conflate/fleet/+/pos", &len, &flags);
+    mu_assert_int_eq(SUB_CONFLATE, flags);
+    mu_assert_int_eq(strlen("fleet/+/pos"), len);
+    mu_check(memcmp(filter, "fleet/+/pos", len) == 0);
+
+    len = strlen("$SYS/broker/#");
+    filter = subs_filter_options("$SYS/broker/#", &len, &flags);
+    mu_assert_int_eq(0, flags);
+    mu_assert_int_eq(strlen("$SYS/broker/#"), len);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_literal_and_wildcards);
+    MU_RUN_TEST(test_resubscribe_replaces);
+    MU_RUN_TEST(test_remove);
+    MU_RUN_TEST(test_sys_topics_skip_root_wildcards);
+    MU_RUN_TEST(test_prefilter_rejects_unsubscribed);
+    MU_RUN_TEST(test_prefilter_follows_removals);
+    MU_RUN_TEST(test_prefilter_grows_without_false_negatives);
+    MU_RUN_TEST(test_batch_applies_in_order);
+    MU_RUN_TEST(test_batch_reconnect_storm);
+    MU_RUN_TEST(test_match_while_subscribing);
+    MU_RUN_TEST(test_retained_by_handle);
+    MU_RUN_TEST(test_conflate_option_prefix);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
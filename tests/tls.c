@@ -0,0 +1,284 @@
+#include "minunit.h"
+#include "../src/tls.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static char cert_path[64], key_path[64];
+static struct tls_server srv;
+static SSL_CTX *client_ctx;
+static int fds[2];
+
+// Self-signed certificate for localhost, written next to its key
+static void make_certificate(void) {
+    EVP_PKEY *pkey = EVP_EC_gen("P-256");
+    X509 *x = X509_new();
+    X509_set_version(x, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+    X509_set_pubkey(x, pkey);
+    X509_NAME *name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    X509_sign(x, pkey, EVP_sha256());
+
+    FILE *out = fopen(cert_path, "w");
+    PEM_write_X509(out, x);
+    fclose(out);
+    out = fopen(key_path, "w");
+    PEM_write_PrivateKey(out, pkey, NULL, NULL, 0, NULL, NULL);
+    fclose(out);
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+}
+
+void test_setup(void) {
+    snprintf(cert_path, sizeof(cert_path), "/tmp/tls_test_%d.crt",
+             (int)getpid());
+    snprintf(key_path, sizeof(key_path), "/tmp/tls_test_%d.key",
+             (int)getpid());
+    make_certificate();
+    tls_server_init(&srv, cert_path, key_path, 1);
+    client_ctx = SSL_CTX_new(TLS_client_method());
+}
+
+void test_teardown(void) {
+    SSL_CTX_free(client_ctx);
+    tls_server_destroy(&srv);
+    unlink(cert_path);
+    unlink(key_path);
+}
+
+static void connect_pair(void) {
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+}
+
+static void close_pair(void) {
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static SSL *new_client(SSL_SESSION *resume) {
+    SSL *client = SSL_new(client_ctx);
+    SSL_set_fd(client, fds[1]);
+    SSL_set_connect_state(client);
+    if (resume != NULL) {
+        SSL_set_session(client, resume);
+    }
+    return client;
+}
+
+static int blocked(SSL *ssl, int ret) {
+    int err = SSL_get_error(ssl, ret);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+}
+
+// Drive both ends in turn until the handshake completes on both
+static int handshake(struct tls_conn *server, SSL *client) {
+    for (int round = 0; round < 100; round++) {
+        int s = tls_handshake(server);
+        int c = SSL_do_handshake(client);
+        if (s == -1 || (c != 1 && !blocked(client, c))) {
+            return -1;
+        }
+        if (s == 0 && c == 1) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Read exactly len bytes on the client, flushing the server meanwhile
+static int client_read(SSL *client, struct tls_conn *server, struct outq *q,
+                       unsigned char *buf, size_t len) {
+    size_t got = 0;
+    for (int round = 0; got < len && round < 100000; round++) {
+        if (q != NULL && tls_flush(server, q) == -1) {
+            return -1;
+        }
+        int n = SSL_read(client, buf + got, len - got);
+        if (n > 0) {
+            got += n;
+        } else if (!blocked(client, n)) {
+            return -1;
+        }
+    }
+    return got == len ? 0 : -1;
+}
+
+static struct mqtt_message *text(const char *s) {
+    return mqtt_message_new((const unsigned char *)s, strlen(s));
+}
+
+MU_TEST(test_queue_round_trip) {
+    connect_pair();
+    struct tls_conn *server = tls_conn_new(&srv, fds[0]);
+    SSL *client = new_client(NULL);
+    mu_assert_int_eq(0, handshake(server, client));
+    mu_check(!tls_resumed(server));
+
+    struct outq q;
+    outq_init(&q);
+    outq_push(&q, text("one "));
+    outq_push(&q, text("two "));
+    outq_push(&q, text("three"));
+    mu_assert_int_eq(0, tls_flush(server, &q));
+    mu_check(outq_empty(&q));
+    unsigned char buf[32] = {0};
+    mu_assert_int_eq(0, client_read(client, server, NULL, buf, 13));
+    mu_assert_string_eq("one two three", (char *)buf);
+
+    // Decrypted bytes left in a record still have to be read
+    SSL_write(client, "0123456789", 10);
+    char in[4];
+    mu_assert_int_eq(4, tls_read(server, in, sizeof(in)));
+    mu_check(tls_read_pending(server));
+    mu_assert_int_eq(4, tls_read(server, in, sizeof(in)));
+    mu_assert_int_eq(2, tls_read(server, in, sizeof(in)));
+    mu_check(!tls_read_pending(server));
+    mu_assert_int_eq(-1, tls_read(server, in, sizeof(in)));
+    mu_assert_int_eq(EAGAIN, errno);
+
+    SSL_shutdown(client);
+    mu_assert_int_eq(0, tls_read(server, in, sizeof(in)));
+    outq_destroy(&q);
+    SSL_free(client);
+    tls_conn_free(server);
+    close_pair();
+}
+
+MU_TEST(test_partial_writes_keep_order) {
+    connect_pair();
+    int small = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    struct tls_conn *server = tls_conn_new(&srv, fds[0]);
+    SSL *client = new_client(NULL);
+    mu_assert_int_eq(0, handshake(server, client));
+
+    struct outq q;
+    outq_init(&q);
+    static unsigned char sent[200000], got[200000];
+    for (size_t i = 0; i < sizeof(sent); i++) {
+        sent[i] = i * 7 + (i >> 8);
+    }
+    for (size_t off = 0; off < sizeof(sent); off += 1000) {
+        outq_push(&q, mqtt_message_new(sent + off, 1000));
+    }
+    mu_assert_int_eq(1, tls_flush(server, &q));
+    mu_check(server->want_write);
+    mu_assert_int_eq(0, client_read(client, server, &q, got, sizeof(got)));
+    mu_check(memcmp(sent, got, sizeof(sent)) == 0);
+    mu_check(outq_empty(&q));
+    mu_assert_int_eq(0, server->pending);
+
+    outq_destroy(&q);
+    SSL_free(client);
+    tls_conn_free(server);
+    close_pair();
+}
+
+/*
+ * Connect, read one message so the client takes in the session tickets,
+ * and return the session to resume with.
+ */
+static SSL_SESSION *first_connection(void) {
+    connect_pair();
+    struct tls_conn *server = tls_conn_new(&srv, fds[0]);
+    SSL *client = new_client(NULL);
+    SSL_SESSION *session = NULL;
+    struct outq q;
+    outq_init(&q);
+    outq_push(&q, text("hi"));
+    unsigned char buf[2];
+    if (handshake(server, client) == 0 && !tls_resumed(server) &&
+        client_read(client, server, &q, buf, sizeof(buf)) == 0) {
+        session = SSL_get1_session(client);
+    }
+    SSL_shutdown(client);
+    tls_read(server, buf, sizeof(buf));
+    outq_destroy(&q);
+    SSL_free(client);
+    tls_conn_free(server);
+    close_pair();
+    return session;
+}
+
+static int resumes(SSL_SESSION *session) {
+    connect_pair();
+    struct tls_conn *server = tls_conn_new(&srv, fds[0]);
+    SSL *client = new_client(session);
+    int resumed = handshake(server, client) == 0 && tls_resumed(server) &&
+                  SSL_session_reused(client);
+    SSL_free(client);
+    tls_conn_free(server);
+    close_pair();
+    return resumed;
+}
+
+MU_TEST(test_ticket_resumption) {
+    SSL_SESSION *session = first_connection();
+    mu_check(session != NULL);
+    mu_check(SSL_SESSION_is_resumable(session));
+    mu_check(resumes(session));
+    SSL_SESSION_free(session);
+}
+
+MU_TEST(test_session_cache_resumption) {
+    // TLS 1.2 without tickets resumes by session id from the server cache
+    SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(client_ctx, SSL_OP_NO_TICKET);
+    SSL_SESSION *session = first_connection();
+    mu_check(session != NULL);
+    mu_check(SSL_SESSION_get_id(session, NULL) != NULL);
+    mu_check(resumes(session));
+    mu_check(SSL_CTX_sess_hits(srv.ctx) >= 1);
+    SSL_SESSION_free(session);
+}
+
+MU_TEST(test_rejects_garbage) {
+    connect_pair();
+    struct tls_conn *server = tls_conn_new(&srv, fds[0]);
+    mu_assert_int_eq(1, tls_handshake(server));
+    write(fds[1], "CONNECT please\r\n\r\n", 18);
+    mu_assert_int_eq(-1, tls_handshake(server));
+    struct outq q;
+    outq_init(&q);
+    outq_push(&q, text("never"));
+    mu_assert_int_eq(-1, tls_flush(server, &q));
+    outq_destroy(&q);
+    tls_conn_free(server);
+    close_pair();
+}
+
+MU_TEST(test_bad_key_file) {
+    struct tls_server other;
+    mu_assert_int_eq(-1, tls_server_init(&other, cert_path, cert_path, 0));
+    mu_assert_int_eq(-1, tls_server_init(&other, "/nonexistent", key_path, 0));
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_queue_round_trip);
+    MU_RUN_TEST(test_partial_writes_keep_order);
+    MU_RUN_TEST(test_ticket_resumption);
+    MU_RUN_TEST(test_session_cache_resumption);
+    MU_RUN_TEST(test_rejects_garbage);
+    MU_RUN_TEST(test_bad_key_file);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}
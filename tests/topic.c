@@ -0,0 +1,98 @@
+#include "minunit.h"
+#include "../src/topic.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 4
+#define TOPICS 1000
+
+void test_setup(void) { /* Nothing */ }
+
+void test_teardown(void) { /* Nothing */ }
+
+static struct topic *intern(const char *name) {
+    return topic_intern(name, strlen(name));
+}
+
+MU_TEST(test_intern_returns_same_handle) {
+    size_t before = topic_count();
+    struct topic *a = intern("sensors/kitchen/temp");
+    struct topic *b = intern("sensors/kitchen/temp");
+    struct topic *c = intern("sensors/kitchen/humidity");
+    mu_check(a == b);
+    mu_check(a != c);
+    mu_assert_int_eq(before + 2, topic_count());
+    mu_assert_string_eq("sensors/kitchen/temp", a->name);
+
+    topic_release(a);
+    topic_release(b);
+    topic_release(c);
+    mu_assert_int_eq(before, topic_count());
+}
+
+MU_TEST(test_level_offsets) {
+    struct topic *t = intern("a/bc//d");
+    size_t len;
+    mu_assert_int_eq(4, t->nlevels);
+    mu_check(strncmp(topic_level(t, 1, &len), "bc", len) == 0 && len == 2);
+    topic_level(t, 2, &len);
+    mu_assert_int_eq(0, len);
+    mu_check(strncmp(topic_level(t, 3, &len), "d", len) == 0 && len == 1);
+    topic_release(t);
+}
+
+static int matches(const char *filter, const char *name) {
+    struct topic *f = intern(filter);
+    struct topic *t = intern(name);
+    int result = topic_matches(f, t);
+    topic_release(f);
+    topic_release(t);
+    return result;
+}
+
+MU_TEST(test_matches) {
+    mu_check(matches("sport/#", "sport"));
+    mu_check(matches("sport/#", "sport/tennis/player1"));
+    mu_check(matches("sport/+/player1", "sport/tennis/player1"));
+    mu_check(!matches("sport/+", "sport/tennis/player1"));
+    mu_check(matches("+/+", "/finance"));
+    mu_check(!matches("#", "$SYS/broker/uptime"));
+    mu_check(matches("$SYS/#", "$SYS/broker/uptime"));
+}
+
+static void *intern_many(void *arg) {
+    char name[32];
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < TOPICS; i++) {
+            snprintf(name, sizeof(name), "devices/%d/state", i);
+            struct topic *t = intern(name);
+            topic_release(t);
+        }
+    }
+    return NULL;
+}
+
+MU_TEST(test_concurrent_intern_release) {
+    size_t before = topic_count();
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, intern_many, NULL);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+    mu_assert_int_eq(before, topic_count());
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
+    MU_RUN_TEST(test_intern_returns_same_handle);
+    MU_RUN_TEST(test_level_offsets);
+    MU_RUN_TEST(test_matches);
+    MU_RUN_TEST(test_concurrent_intern_release);
+}
+
+int main(int argc, char *argv[]) {
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return MU_EXIT_CODE;
+}